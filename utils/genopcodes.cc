@@ -32,9 +32,11 @@ main(int argc, char **argv)
   printf("#define littype_WORD %d\n", LIT_WORD);
   printf("#define littype_CHAR %d\n", LIT_CHAR);
   printf("#define littype_FLOAT %d\n", LIT_FLOAT);
+  printf("#define littype_DOUBLE %d\n", LIT_DOUBLE);
   printf("#define littype_STRING %d\n", LIT_STRING);
   printf("#define littype_CLOSURE %d\n", LIT_CLOSURE);
   printf("#define littype_INFO %d\n", LIT_INFO);
+  printf("#define littype_CFUNC %d\n", LIT_CFUNC);
   printf("\n");
 
   // Closure types
@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Measures the speedup of the parallel garbage collector on the
+# allocation-heavy benchmarks.  Runs each benchmark with an increasing
+# number of GC threads and reports the GC time and the total runtime.
+#
+# Usage: utils/rungcbenchmarks.sh [THREAD_COUNTS]
+#
+# THREAD_COUNTS defaults to "1 2 4 8".
+#
+# The programs must have been built (make test-files).  Boyer and
+# Lambda are not part of the build and hence not listed.  For a
+# synthetic heap that needs no Haskell compiler, see GCBench in
+# vm/microbench.cc.
+
+THREADS=${1:-"1 2 4 8"}
+
+BENCHMARKS="Bench.Nofib.Spectral.Constraints
+Bench.Nofib.Spectral.Circsim"
+
+for bench in ${BENCHMARKS}; do
+    echo "=== ${bench}"
+    for n in ${THREADS}; do
+        printf "  --gc-threads=%-3s" "${n}"
+        ./lcvm -e bench ${bench} --stack=10m --gc-threads=${n} \
+            --print-stats 2>/dev/null \
+            | grep -E '^ +(GC|Runtime) ' | tr -s ' ' | tr '\n' ' '
+        echo
+    done
+done
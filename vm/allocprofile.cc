@@ -0,0 +1,145 @@
+#include "allocprofile.hh"
+#include "integer.hh"
+#include "jit.hh"
+
+#include <algorithm>
+#include <vector>
+
+_START_LAMBDACHINE_NAMESPACE
+
+typedef struct {
+  const InfoTable *fun;
+  const BcIns *pc;
+  uint64_t allocs;
+  uint64_t bytes;
+  uint64_t jitBytes;
+} MergedSite;
+
+static bool moreBytes(const MergedSite &a, const MergedSite &b) {
+  return a.bytes > b.bytes;
+}
+
+static void formatCount(char *res, uint64_t n) {
+  char digits[24];
+  int len = sprintf(digits, "%" FMT_Word64, n);
+  for (int i = 0; i < len; ++i) {
+    *res++ = digits[i];
+    if ((len - i - 1) % 3 == 0 && i != len - 1)
+      *res++ = ',';
+  }
+  *res = '\0';
+}
+
+static void printSiteName(FILE *out, const InfoTable *fun, const BcIns *pc) {
+  if (pc == NULL) {
+    fprintf(out, "(unknown)");
+    return;
+  }
+  fprintf(out, "%s", fun != NULL ? fun->name() : "?");
+  if (fun != NULL && fun->hasCode()) {
+    const Code *code = static_cast<const CodeInfoTable *>(fun)->code();
+    if (pc >= code->code && pc < code->code + code->sizecode)
+      fprintf(out, "+%d", (int)(pc - code->code));
+  }
+  fprintf(out, " %s", pc->name());
+}
+
+void AllocProfile::merge(const AllocProfile &other) {
+  for (SiteMap::const_iterator it = other.sites_.begin();
+       it != other.sites_.end(); ++it) {
+    AllocSite &s = sites_[it->first];
+    s.fun = it->second.fun;
+    s.pc = it->second.pc;
+    s.allocs += it->second.allocs;
+    s.bytes += it->second.bytes;
+  }
+}
+
+void countTraceAlloc(AllocSite *site, Closure *cl) {
+  if (isSmallInteger(cl))
+    return;
+  Word bytes;
+  if (cl->info()->type() == ARRAY)
+    bytes = ArrayClosure::allocBytes(((ArrayClosure *)cl)->ptrs_);
+  else if (cl->info() == MiscClosures::stg_BIGPOS_info ||
+           cl->info() == MiscClosures::stg_BIGNEG_info)
+    bytes = integerAllocBytes(cl);
+  else
+    bytes = sizeof(ByteArrayClosure) +
+      roundUpBytesToWords(((ByteArrayClosure *)cl)->bytes_) * sizeof(Word);
+  LC_STAT_INC(site->allocs);
+  LC_STAT_ADD(site->bytes, bytes);
+}
+
+void AllocProfile::print(FILE *out, size_t maxSites) const {
+  std::vector<MergedSite> sites;
+  HASH_NAMESPACE::HASH_MAP_CLASS<Word, size_t> index;
+
+  for (SiteMap::const_iterator it = sites_.begin(); it != sites_.end(); ++it) {
+    MergedSite s = { it->second.fun, it->second.pc,
+                     it->second.allocs, it->second.bytes, 0 };
+    index[it->first] = sites.size();
+    sites.push_back(s);
+  }
+
+  for (TraceId t = 0; t < Jit::numFragments(); ++t) {
+    Fragment *F = Jit::traceById(t);
+    for (u4 e = 0; e < F->numAllocSites(); ++e) {
+      const AllocSite &as = F->allocSite(e);
+      if (as.allocs == 0)
+        continue;
+      uint64_t bytes = as.allocs * F->allocSiteWords(e) * sizeof(Word);
+      Word key = (Word)as.pc;
+      if (index.find(key) == index.end()) {
+        MergedSite s = { as.fun, as.pc, 0, 0, 0 };
+        index[key] = sites.size();
+        sites.push_back(s);
+      }
+      MergedSite &s = sites[index[key]];
+      s.allocs += as.allocs;
+      s.bytes += bytes;
+      s.jitBytes += bytes;
+    }
+    for (u4 c = 0; c < F->numAllocCalls(); ++c) {
+      const AllocSite &as = F->allocCall(c);
+      if (as.allocs == 0)
+        continue;
+      Word key = (Word)as.pc;
+      if (index.find(key) == index.end()) {
+        MergedSite s = { as.fun, as.pc, 0, 0, 0 };
+        index[key] = sites.size();
+        sites.push_back(s);
+      }
+      MergedSite &s = sites[index[key]];
+      s.allocs += as.allocs;
+      s.bytes += as.bytes;
+      s.jitBytes += as.bytes;
+    }
+  }
+
+  uint64_t total = 0;
+  for (size_t i = 0; i < sites.size(); ++i)
+    total += sites[i].bytes;
+
+  std::sort(sites.begin(), sites.end(), moreBytes);
+
+  fprintf(out, "  Allocation sites by bytes allocated (top %d of %d):\n"
+          "  %20s %6s %6s %20s  site\n",
+          (int)std::min(maxSites, sites.size()), (int)sites.size(),
+          "bytes", "%total", "%JIT", "allocations");
+  char bytesbuf[32], allocsbuf[32];
+  for (size_t i = 0; i < sites.size() && i < maxSites; ++i) {
+    const MergedSite &s = sites[i];
+    formatCount(bytesbuf, s.bytes);
+    formatCount(allocsbuf, s.allocs);
+    fprintf(out, "  %20s %5.1f%% %5.1f%% %20s  ", bytesbuf,
+            total ? (double)s.bytes * 100 / total : 0.0,
+            s.bytes ? (double)s.jitBytes * 100 / s.bytes : 0.0,
+            allocsbuf);
+    printSiteName(out, s.fun, s.pc);
+    fprintf(out, "\n");
+  }
+  fprintf(out, "\n");
+}
+
+_END_LAMBDACHINE_NAMESPACE
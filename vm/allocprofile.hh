@@ -0,0 +1,60 @@
+#ifndef _ALLOCPROFILE_H_
+#define _ALLOCPROFILE_H_
+
+#include "common.hh"
+#include "objects.hh"
+
+#include <stdio.h>
+
+#include HASH_MAP_H
+
+_START_LAMBDACHINE_NAMESPACE
+
+// An allocation site is the bytecode instruction that performs the
+// allocation, together with the info table of the closure whose code
+// contains it.
+typedef struct {
+  const InfoTable *fun;
+  const BcIns *pc;
+  uint64_t allocs;
+  uint64_t bytes;
+} AllocSite;
+
+// Allocation counts of the interpreter, keyed by the PC of the
+// allocating instruction.  Each capability has its own profile; use
+// merge() to combine them.  Allocations performed by traces are
+// counted inside each Fragment, per heap entry and per allocating
+// helper call, and merged with these by print().
+class AllocProfile {
+public:
+  inline void count(const InfoTable *fun, const BcIns *pc, Word bytes) {
+    AllocSite &s = sites_[(Word)pc];
+    s.fun = fun;
+    s.pc = pc;
+    ++s.allocs;
+    s.bytes += bytes;
+  }
+
+  // Add the counts of another profile to this one.
+  void merge(const AllocProfile &other);
+
+  inline size_t numSites() const { return sites_.size(); }
+
+  // Print the top maxSites allocation sites by number of bytes
+  // allocated.  Includes allocations from all traces.
+  void print(FILE *out, size_t maxSites) const;
+
+private:
+  typedef HASH_NAMESPACE::HASH_MAP_CLASS<Word, AllocSite> SiteMap;
+  SiteMap sites_;
+};
+
+// Called by traces after a helper (e.g., newByteArray) allocated
+// `cl'.  Traces are shared by all capabilities, so the counts are
+// updated atomically.  Small Integer boxes are heap entries of the
+// trace and counted there.
+void countTraceAlloc(AllocSite *site, Closure *cl);
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _ALLOCPROFILE_H_ */
@@ -40,18 +40,10 @@ heapCheckFail(ExitState *s)
   return ok;
 }
 
-extern "C" void LC_USED
-handleStackOverflow(void) {
-  fprintf(stderr, "Stack overflow (in JIT)\n");
-  fflush(stderr);
-  abort();
-}
-
 #define ASM_ENTER NAME_PREFIX "asmEnter"
 #define ASM_EXIT  NAME_PREFIX "asmExit"
 #define ASM_TRACE NAME_PREFIX "asmTrace"
 #define ASM_HEAP_OVERFLOW NAME_PREFIX "asmHeapOverflow"
-#define ASM_STACK_OVERFLOW NAME_PREFIX "asmStackOverflow"
 
 #define SAVE_SIZE (80 + 256 * sizeof(Word))
 
@@ -191,12 +183,8 @@ asmExitIsImplementedInAssembly() {
     "sub   $128, %%rsp\n\t"  /* make room for them on the stack */
     "sub   $128, %%rbp\n\t"  /* skip past the int regs */
 
-    /* For now, we don't actually save the xmm registers because
-     * we don't support floating point operations. We still need to
-     * make space for them on the stack so that the ExitState data
-     * structure is properly constructed. The ExitState has room for
-     * the xmm regs, but all the xmm reg data will be invalid. */
-#if 0
+    /* We only save the low 8 bytes of each register.  Those hold the
+     * Double# or Float# values allocated by the trace compiler. */
     "movsd %%xmm15, -8(%%rbp)\n\t"
     "movsd %%xmm14, -16(%%rbp)\n\t"
     "movsd %%xmm13, -24(%%rbp)\n\t"
@@ -213,7 +201,6 @@ asmExitIsImplementedInAssembly() {
     "movsd %%xmm2,  -112(%%rbp)\n\t"
     "movsd %%xmm1,  -120(%%rbp)\n\t"
     "movsd %%xmm0,  -128(%%rbp)\n\t"
-#endif
 
     /* call the generic restore routine exitTrace(ExitNo n, ExitState *s)
      * rdi = ExitNo
@@ -280,15 +267,43 @@ asmTraceIsImplementedInAssembly(void) {
     /* Make room for xmm registers.  We only save the lower 8 bytes of
        the 16 byte registers, so we only need 16 * 8 = 128 bytes */
     "subq $128, %%rsp\n\t"
-
-#if 0
-    // TODO: Actually write XMM registers here.
-#endif
+    "movsd %%xmm0, 0(%%rsp)\n\t"
+    "movsd %%xmm1, 8(%%rsp)\n\t"
+    "movsd %%xmm2, 16(%%rsp)\n\t"
+    "movsd %%xmm3, 24(%%rsp)\n\t"
+    "movsd %%xmm4, 32(%%rsp)\n\t"
+    "movsd %%xmm5, 40(%%rsp)\n\t"
+    "movsd %%xmm6, 48(%%rsp)\n\t"
+    "movsd %%xmm7, 56(%%rsp)\n\t"
+    "movsd %%xmm8, 64(%%rsp)\n\t"
+    "movsd %%xmm9, 72(%%rsp)\n\t"
+    "movsd %%xmm10, 80(%%rsp)\n\t"
+    "movsd %%xmm11, 88(%%rsp)\n\t"
+    "movsd %%xmm12, 96(%%rsp)\n\t"
+    "movsd %%xmm13, 104(%%rsp)\n\t"
+    "movsd %%xmm14, 112(%%rsp)\n\t"
+    "movsd %%xmm15, 120(%%rsp)\n\t"
 
     /* The stack is 16-byte aligned. */
     "movq %%rsp, %%rdi\n\t"  // Pointer to exit state as 1st argument
     "call " NAME_PREFIX "debugTrace\n\t"
 
+    "movsd 0(%%rsp), %%xmm0\n\t"
+    "movsd 8(%%rsp), %%xmm1\n\t"
+    "movsd 16(%%rsp), %%xmm2\n\t"
+    "movsd 24(%%rsp), %%xmm3\n\t"
+    "movsd 32(%%rsp), %%xmm4\n\t"
+    "movsd 40(%%rsp), %%xmm5\n\t"
+    "movsd 48(%%rsp), %%xmm6\n\t"
+    "movsd 56(%%rsp), %%xmm7\n\t"
+    "movsd 64(%%rsp), %%xmm8\n\t"
+    "movsd 72(%%rsp), %%xmm9\n\t"
+    "movsd 80(%%rsp), %%xmm10\n\t"
+    "movsd 88(%%rsp), %%xmm11\n\t"
+    "movsd 96(%%rsp), %%xmm12\n\t"
+    "movsd 104(%%rsp), %%xmm13\n\t"
+    "movsd 112(%%rsp), %%xmm14\n\t"
+    "movsd 120(%%rsp), %%xmm15\n\t"
     "addq $128, %%rsp\n\t"  /* deallocate space for xmm registers */
 
     /* r12-r15 are guarenteed to be the same. r14 contains the return
@@ -361,7 +376,23 @@ asmHeapBufOverflowDummy(void) {
     "sub   $128, %%rsp\n\t"  /* make room for them on the stack */
     "sub   $128, %%rbp\n\t"  /* skip past the int regs */
 
-    /* TODO: Are XMM registers caller-save? */
+    /* XMM registers are caller-save. */
+    "movsd %%xmm0, 0(%%rsp)\n\t"
+    "movsd %%xmm1, 8(%%rsp)\n\t"
+    "movsd %%xmm2, 16(%%rsp)\n\t"
+    "movsd %%xmm3, 24(%%rsp)\n\t"
+    "movsd %%xmm4, 32(%%rsp)\n\t"
+    "movsd %%xmm5, 40(%%rsp)\n\t"
+    "movsd %%xmm6, 48(%%rsp)\n\t"
+    "movsd %%xmm7, 56(%%rsp)\n\t"
+    "movsd %%xmm8, 64(%%rsp)\n\t"
+    "movsd %%xmm9, 72(%%rsp)\n\t"
+    "movsd %%xmm10, 80(%%rsp)\n\t"
+    "movsd %%xmm11, 88(%%rsp)\n\t"
+    "movsd %%xmm12, 96(%%rsp)\n\t"
+    "movsd %%xmm13, 104(%%rsp)\n\t"
+    "movsd %%xmm14, 112(%%rsp)\n\t"
+    "movsd %%xmm15, 120(%%rsp)\n\t"
 
     /* call heap overflow handler: rdi = ExitState*  */
     "movq %%rsp, %%rdi\n\t"
@@ -371,6 +402,22 @@ asmHeapBufOverflowDummy(void) {
     "jnz .L1\n\t"
 
     /* Common case: we jump back to the trace code. */
+    "movsd 0(%%rsp), %%xmm0\n\t"
+    "movsd 8(%%rsp), %%xmm1\n\t"
+    "movsd 16(%%rsp), %%xmm2\n\t"
+    "movsd 24(%%rsp), %%xmm3\n\t"
+    "movsd 32(%%rsp), %%xmm4\n\t"
+    "movsd 40(%%rsp), %%xmm5\n\t"
+    "movsd 48(%%rsp), %%xmm6\n\t"
+    "movsd 56(%%rsp), %%xmm7\n\t"
+    "movsd 64(%%rsp), %%xmm8\n\t"
+    "movsd 72(%%rsp), %%xmm9\n\t"
+    "movsd 80(%%rsp), %%xmm10\n\t"
+    "movsd 88(%%rsp), %%xmm11\n\t"
+    "movsd 96(%%rsp), %%xmm12\n\t"
+    "movsd 104(%%rsp), %%xmm13\n\t"
+    "movsd 112(%%rsp), %%xmm14\n\t"
+    "movsd 120(%%rsp), %%xmm15\n\t"
     "addq   $128, %%rsp\n\t"   /* deallocate XMM registers */
 
     "movq   0(%%rsp), %%rax\n\t"
@@ -393,7 +440,7 @@ asmHeapBufOverflowDummy(void) {
     /* Uncommon case: we need to do GC and fall back to the
        interpreter. */
 
-    /* TODO: Save XMM registers. */
+    /* XMM registers have already been saved above. */
 
     /* Save r13-r15 and get exit number. */
     /* [rsp + 0] = xmm15; [rsp + 32 * 8] = trace rsp;
@@ -441,30 +488,4 @@ asmHeapBufOverflowDummy(void) {
     : : "i"(SAVE_SIZE + 256));
 }
 
-static void LC_USED
-asmStackOverflowIsImplementedInAssembly(void) {
-  asm volatile(
-    ".globl " ASM_STACK_OVERFLOW "\n"
-    ASM_STACK_OVERFLOW ":\n\t"
-
-    "leaq %c0(%%rsp), %%rax\n\t"
-    /* restore callee saved registers */
-    "movq -8(%%rax),%%rbx\n\t"
-    "movq -16(%%rax),%%r12\n\t"
-    "movq -24(%%rax),%%r13\n\t"
-    "movq -32(%%rax),%%r14\n\t"
-    "movq -40(%%rax),%%r15\n\t"
-
-    /* deallocate the stack used */
-    "addq %0, %%rsp\n\t"
-
-    "call " NAME_PREFIX "handleStackOverflow\n\t"
-
-    /* return to original caller */
-    "pop %%rbp\n\t"
-    "ret\n\t"
-
-    : : "i"(SAVE_SIZE));
-}
-
 _END_LAMBDACHINE_NAMESPACE
@@ -43,9 +43,9 @@ static void ra_dprintf(Assembler *as, const char *fmt, ...)
     p += e-fmt;
     if (e[1] == 'r') {
       Reg r = va_arg(argp, Reg) & RID_MASK;
-      if (r <= RID_MAX) {
+      if (r < RID_MAX) {
         const char *q;
-        for (q = regNames64[r]; *q; q++)
+        for (q = regName(r); *q; q++)
           *p++ = *q >= 'A' && *q <= 'Z' ? *q + 0x20 : *q;
       } else {
         *p++ = '?';
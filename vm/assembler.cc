@@ -1,10 +1,14 @@
 #include "assembler.hh"
 #include "jit.hh"
 #include "ir-inl.hh"
+#include "memorymanager.hh"
+#include "utils.hh"
+#include "ffi.hh"
 
 #include <iostream>
 #include <fstream>
 #include <string.h>
+#include <cpuid.h>
 
 #define MCLIM_REDZONE 64
 
@@ -22,8 +26,7 @@ void RegSet::debugPrint(ostream &out) {
     char sep = '{';
     do {
       Reg r = work.pickBot();
-      const char *rname = r < RID_MAX_GPR ? regNames64[r] : fpRegNames[r - RID_MIN_FPR];
-      out << sep << rname;
+      out << sep << regName(r);
       sep = ',';
       work.clear(r);
     } while (!work.isEmpty());
@@ -65,6 +68,22 @@ Assembler::Assembler(Jit *J) {
   mctop = mcend = mcp = mclim = NULL;
   ir_ = NULL;
   buf_ = NULL;
+  cpuFeatures_ = detectCpuFeatures();
+}
+
+uint32_t Assembler::detectCpuFeatures() {
+  unsigned int eax, ebx, ecx, edx;
+  uint32_t features = 0;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 23)))
+    features |= CPU_POPCNT;
+  if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 5)))
+    features |= CPU_LZCNT;
+  if (__get_cpuid_max(0, NULL) >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (ebx & (1 << 3)) features |= CPU_BMI1;
+    if (ebx & (1 << 8)) features |= CPU_BMI2;
+  }
+  return features;
 }
 
 Assembler::~Assembler() {
@@ -82,7 +101,7 @@ void Assembler::setupMachineCode(MachineCode *mcode) {
 }
 
 void Assembler::setupRegAlloc() {
-  freeset_ = kGPR;
+  freeset_ = kAllocRegs;
   modset_ = RegSet();
   //  weakset_ =
   phiset_ = RegSet();
@@ -262,6 +281,14 @@ void Assembler::emit_mrm(x86Op xo, Reg rr, Reg rb) {
   mcp = emit_opm(xo, mode, rr, rb, p, 0);
 }
 
+// op r, [rip + (addr - end of instruction)]
+void Assembler::emit_rma(x86Op xo, Reg rr, const void *addr) {
+  MCode *p = mcp;
+  *(int32_t *)(p - 4) = jmprel(p, (MCode *)addr);
+  p -= 4;
+  mcp = emit_opm(xo, XM_OFS0, rr, RID_EBP, p, 0);
+}
+
 /* op r, i */
 void Assembler::emit_gri(x86Group xg, Reg rb, int32_t i) {
   MCode *p = mcp;
@@ -428,7 +455,7 @@ Reg Assembler::restoreReg(IRRef ref) {
 }
 
 #define MINCOST(name) \
-  if (kGPR.test(RID_##name) && /* constant-foldable */ \
+  if (kAllocRegs.test(RID_##name) && /* constant-foldable */ \
       LC_LIKELY(allow.test(RID_##name)) && \
       cost_[RID_##name].raw() < cost.raw())     \
     cost = cost_[RID_##name];
@@ -437,20 +464,19 @@ Reg Assembler::evictReg(RegSet allow) {
   IRRef ref;
   RegCost cost = kMaxCost;
   LC_ASSERT(!allow.isEmpty());
-  if (allow.raw() < (1 << RID_MAX_GPR)) {
-    // Unrolled linear search for register with smallest cost.
+  // Unrolled linear search for register with smallest cost.
+  if (!allow.intersect(kGPR).isEmpty()) {
     GPRDEF(MINCOST);
-  } else {
-    cerr << "Trying to evict FP regs. (allow="
-         << hex << allow.raw() << ", max_gpr=" << RID_MAX_GPR << ')' << endl;
-    exit(13);
+  }
+  if (!allow.intersect(kFPR).isEmpty()) {
+    FPRDEF(MINCOST);
   }
   ref = cost.ref();
   return restoreReg(ref);
 }
 
 void Assembler::evictConstants() {
-  RegSet work = freeset_.complement().intersect(kGPR);
+  RegSet work = freeset_.complement().intersect(kAllocRegs);
   while (!work.isEmpty()) {
     Reg r = work.pickBot();
     IRRef ref = cost_[r].ref();
@@ -472,7 +498,10 @@ Reg Assembler::rematConstant(IRRef ref) {
 
   if (ins->opcode() == IR::kKINT || ins->opcode() == IR::kKWORD) {
     uint64_t k = buf_->literalValue(ref);
-    loadi_u64(r, k);
+    if (kFPR.test(r))
+      loadFPConstant(r, k);
+    else
+      loadi_u64(r, k);
   } else {
     LC_ASSERT(ins->opcode() == IR::kKBASEO);
     int32_t ofs = ins->i32() * 8;  // TODO: Hardcoded word width.
@@ -525,7 +554,7 @@ Reg Assembler::allocScratchReg(RegSet allow) {
 
 void Assembler::evictSet(RegSet drop) {
   RegSet work;
-  work = drop.intersect(freeset_.complement()).intersect(kGPR);
+  work = drop.intersect(freeset_.complement()).intersect(kAllocRegs);
   while (!work.isEmpty()) {
     Reg r = work.pickBot();
     restoreReg(cost_[r].ref());
@@ -555,8 +584,7 @@ void Assembler::allocLeft(Reg dest, IRRef lref) {
     if (!hasHint(left))
       setHint(ins, dest);  // Propagate register hint.
 
-    LC_ASSERT(dest < RID_MAX_GPR); // FIXME: FP support.
-    left = allocRef(lref, kGPR);
+    left = allocRef(lref, kFPR.test(dest) ? kFPR : kGPR);
   }
   if (dest != left) {
     // TODO: Special PHI stuff here?
@@ -619,7 +647,19 @@ bool Assembler::is32BitLiteral(IRRef ref, int32_t *k) {
   return false;
 }
 
-void Assembler::intArith(IR *ins, x86Arith xa) {
+// Checked arithmetic (ADDOV, etc.) tests the overflow flag directly
+// after the instruction:
+//
+//     add dest, right
+//     jo ->exit
+//
+// Similarly, ADDCU reads the carry flag:
+//
+//     add dest, right
+//     setc dest8
+//     movzx dest, dest8
+//
+void Assembler::intArith(IR *ins, x86Arith xa, int setcc) {
   RegSet allow = kGPR;
   int32_t k = 0;
   IRRef lref = ins->op1();
@@ -631,6 +671,15 @@ void Assembler::intArith(IR *ins, x86Arith xa) {
   }
   Reg dest = destReg(ins, allow);
 
+  if (ins->isGuard()) {
+    guardcc(CC_O);
+  } else if (setcc >= 0) {
+    // The REX prefix selects SIL/DIL rather than DH/BH.
+    emit_rr(XO_MOVZXb, dest | FORCE_REX, dest);
+    emit_rr((x86Op)(XO_SETCC + ((uint32_t)setcc << 24)),
+            (Reg)FORCE_REX, dest);
+  }
+
   if (!isReg(right) && !is32BitLiteral(rref, &k)) {
     allow.clear(dest);
     right = fuseLoad(rref, allow);
@@ -764,6 +813,368 @@ void Assembler::divmod(IR *ins, DivModOp op, bool useSigned) {
   allocLeft(RID_EAX, ins->op1());
 }
 
+// The high word of an unsigned multiplication.  MUL leaves the full
+// product in rdx:rax:
+//
+//     rax <- left
+//     mul right            ; right is anything but rdx,rax
+//     mov dest, rdx
+//
+void Assembler::mulHigh(IR *ins) {
+  RegSet allow = kGPR.exclude(RID_EAX).exclude(RID_EDX);
+
+  evictSet(RegSet::fromReg(RID_EAX));
+
+  Reg dest = destReg(ins, allow.include(RID_EDX));
+  if (dest != RID_EDX) {
+    evictSet(RegSet::fromReg(RID_EDX));
+    move(dest, RID_EDX);
+  }
+
+  Reg right = alloc1(ins->op2(), allow);
+  LC_ASSERT(right != RID_EAX && right != RID_EDX);
+
+  emit_rr(XO_GROUP3, XOg_MUL | REX_64, right);
+  allocLeft(RID_EAX, ins->op1());
+}
+
+// --- Calls to C helpers -------------------------------------------
+//
+// Helpers are called using the System V AMD64 calling convention.
+// All values held in caller-saved registers are evicted, i.e., they
+// are reloaded after the call.  RID_BASE and RID_HP are callee-saved.
+// The stack pointer is 16-byte aligned inside a trace (see asmEnter).
+
+static const Reg kArgRegs[] = {
+  RID_EDI, RID_ESI, RID_EDX, RID_ECX, RID_R8D, RID_R9D
+};
+
+static const RegSet kCallerSaved =
+  RegSet::fromReg(RID_EAX).include(RID_ECX).include(RID_EDX)
+  .include(RID_ESI).include(RID_EDI).include(RID_R8D).include(RID_R9D)
+  .include(RID_R10D).include(RID_R11D).setunion(kFPR);
+
+void Assembler::callHelper(IR *ins) {
+  const CCallInfo &ci = ircall_info[ins->op2()];
+  IRRef args[countof(kArgRegs)];
+  LC_ASSERT(ci.nargs > 0 && ci.nargs <= countof(kArgRegs));
+
+  // The arguments are a left-nested tree of CARGs.
+  IRRef ref = ins->op1();
+  for (int i = ci.nargs - 1; i > 0; --i) {
+    IR *carg = ir(ref);
+    LC_ASSERT(carg->opcode() == IR::kCARG);
+    args[i] = carg->op2();
+    ref = carg->op1();
+  }
+  args[0] = ref;
+  callC(ins, ci.func, ci.nargs, args, false);
+}
+
+// Call `func' with the given arguments.  The result is the result of
+// instruction `ins'.  As in the System V ABI, integer and floating
+// point arguments are passed in the next free register of their
+// class.  If `varargs' is set, %al holds the number of floating point
+// arguments, as required by C functions with variable arguments.
+//
+// Only the caller-saved registers that are in use across the call are
+// saved (evicted) and reloaded afterwards.
+void Assembler::callC(IR *ins, const void *func, int nargs,
+                      const IRRef *args, bool varargs) {
+  //     <set up arguments>
+  //     mov eax, #fpargs       ; if varargs
+  //     call helper            ; or: mov r11, helper; call r11
+  //     mov dest, rax              ; unless the result is void
+  //     <reload evicted registers>
+  if (ins->type() != IRT_VOID) {
+    bool isFloat = isFloatType(ins->type());
+    Reg ret = isFloat ? RID_FPRET : RID_RET;
+    if (!hasHint(ins->reg()))
+      setHint(ins, ret);
+    Reg dest = destReg(ins, isFloat ? kFPR : kGPR);
+    evictSet(kCallerSaved);
+    if (dest != ret)
+      move(dest, ret);
+  } else {
+    evictSet(kCallerSaved);
+  }
+  callArgs(func, nargs, args, varargs);
+}
+
+// Emit the call to `func' and the code that sets up its arguments.
+// The caller must have evicted the caller-saved registers.
+void Assembler::callArgs(const void *func, int nargs, const IRRef *args,
+                         bool varargs) {
+  MCode *target = (MCode *)func;
+  MCode *p = mcp;
+  ptrdiff_t delta = target - p;
+  if (delta == (int32_t)delta) {
+    *(int32_t *)(p - 4) = (int32_t)delta;
+    p[-5] = XI_CALL;
+    mcp = p - 5;
+  } else {
+    p[-1] = MODRM(XM_REG, 2, RID_R11D);  // FF /2 = call r/m64
+    p[-2] = 0xff;
+    p[-3] = 0x41;  // REX.B
+    mcp = p - 3;
+    loadi_u64(RID_R11D, (uint64_t)target);
+  }
+
+  Reg regs[countof(kArgRegs)];
+  int ngpr = 0, nfpr = 0;
+  for (int i = 0; i < nargs; ++i) {
+    if (isFloatType(ir(args[i])->type()))
+      regs[i] = (Reg)(RID_MIN_FPR + nfpr++);
+    else
+      regs[i] = kArgRegs[ngpr++];
+  }
+  LC_ASSERT(ngpr <= (int)countof(kArgRegs) && nfpr <= 8);
+  if (varargs)
+    loadi_u32(RID_EAX, nfpr);
+
+  // The argument registers are free at this point.  Arguments that
+  // are not in a register yet are computed directly into their
+  // argument register.
+  for (int i = 0; i < nargs; ++i) {
+    Reg r = regs[i];
+    IRRef aref = args[i];
+    if (!isReg(ir(aref)->reg()) && !irref_islit(aref))
+      allocRef(aref, RegSet::fromReg(r));
+    else
+      allocLeft(r, aref);
+  }
+}
+
+// Foreign function call (see ffi.hh):
+//
+//     CCALL (CARG (CARG func arg1) arg2) sig
+//
+// The function is a literal, so the call is direct.
+void Assembler::foreignCall(IR *ins) {
+  IRRef args[kFfiMaxArgs];
+  int nargs = 0;
+  IRRef ref = ins->op1();
+  while (ir(ref)->opcode() == IR::kCARG) {
+    LC_ASSERT(nargs < kFfiMaxArgs);
+    args[nargs++] = ir(ref)->op2();
+    ref = ir(ref)->op1();
+  }
+  for (int i = 0, j = nargs - 1; i < j; ++i, --j) {
+    IRRef tmp = args[i];
+    args[i] = args[j];
+    args[j] = tmp;
+  }
+  LC_ASSERT(irref_islit(ref));
+  callC(ins, (const void *)buf_->literalValue(ref), nargs, args, true);
+}
+
+// --- Bit operations ----------------------------------------------
+//
+// POPCNT, LZCNT, TZCNT, PDEP and PEXT are not available on all
+// x86-64 CPUs.  Without LZCNT and TZCNT we use BSR and BSF, which
+// leave the destination undefined if the source is zero:
+//
+//     mov tmp, 127             mov tmp, 64
+//     bsr dest, src            bsf dest, src
+//     cmovz dest, tmp          cmovz dest, tmp
+//     xor dest, 63
+//
+// (127 ^ 63 == 64, and b ^ 63 == 63 - b for 0 <= b < 64.)  POPCNT,
+// PDEP and PEXT fall back to calling the C implementation.
+
+void Assembler::bitCount(IR *ins) {
+  IRRef lref = ins->op1();
+  uint32_t need = 0;
+  x86Op xo = XO_POPCNT;
+  switch (ins->opcode()) {
+  case IR::kPOPCNT:
+    need = CPU_POPCNT;
+    break;
+  case IR::kCLZ:
+    need = CPU_LZCNT;
+    xo = XO_LZCNT;
+    break;
+  case IR::kCTZ:
+    need = CPU_BMI1;
+    xo = XO_TZCNT;
+    break;
+  default:
+    LC_ASSERT(0);
+  }
+
+  if (!(cpuFeatures_ & need) && ins->opcode() == IR::kPOPCNT) {
+    callC(ins, (const void *)&wordPopCount, 1, &lref, false);
+    return;
+  }
+
+  Reg dest = destReg(ins, kGPR);
+  Reg src = alloc1(lref, kGPR);
+  if (cpuFeatures_ & need) {
+    emit_rr(xo, dest | REX_64, src);
+    return;
+  }
+
+  bool isClz = ins->opcode() == IR::kCLZ;
+  Reg tmp = allocScratchReg(kGPR.exclude(dest).exclude(src));
+  if (isClz)
+    emit_gri(XG_ARITHi(XOg_XOR), dest | REX_64, 63);
+  emit_rr((x86Op)(XO_CMOV + ((uint32_t)CC_E << 24)), dest | REX_64, tmp);
+  emit_rr(isClz ? XO_BSR : XO_BSF, dest | REX_64, src);
+  loadi_u32(tmp, isClz ? 127 : 64);
+}
+
+void Assembler::byteSwap(IR *ins) {
+  Reg dest = destReg(ins, kGPR);
+  mcp = emit_op((x86Op)(XO_BSWAP + ((dest & 7) << 24)),
+                (Reg)REX_64, dest, (Reg)0, mcp, 1);
+  allocLeft(dest, ins->op1());
+}
+
+// PDEP and PEXT only exist in a VEX-encoded form:
+//
+//     C4 [R X B 00010] [W vvvv L pp] F5 /r
+//
+// with W = 1, L = 0, vvvv = the (inverted) source register, and the
+// mask in ModRM.rm.  pp selects the instruction: F2 (3) is PDEP, F3
+// (2) is PEXT.
+void Assembler::bitDepositExtract(IR *ins) {
+  bool isPdep = ins->opcode() == IR::kPDEP;
+  if (!(cpuFeatures_ & CPU_BMI2)) {
+    IRRef args[2] = { ins->op1(), ins->op2() };
+    callC(ins, isPdep ? (const void *)&wordPdep : (const void *)&wordPext,
+          2, args, false);
+    return;
+  }
+
+  Reg dest = destReg(ins, kGPR);
+  Reg src = alloc1(ins->op1(), kGPR);
+  Reg mask = alloc1(ins->op2(), kGPR.exclude(src));
+  MCode *p = mcp;
+  p[-1] = MODRM(XM_REG, dest, mask);
+  p[-2] = 0xf5;
+  p[-3] = (MCode)(0x80 | ((~src & 15) << 3) | (isPdep ? 3 : 2));
+  p[-4] = (MCode)((dest & 8 ? 0 : 0x80) | 0x40 | (mask & 8 ? 0 : 0x20) | 0x02);
+  p[-5] = 0xc4;
+  mcp = p - 5;
+}
+
+// --- Floating point ----------------------------------------------
+
+static const uint64_t kSignMaskF64 = (uint64_t)1 << 63;
+static const uint64_t kSignMaskF32 = (uint64_t)1 << 31;
+//
+// Double# and Float# values are kept in the low bits of XMM
+// registers.  We maintain the invariant that the upper 32 bits of the
+// low quadword of a Float# register are zero, so that spilling or
+// saving it with a full MOVSD writes the same bit pattern as the
+// interpreter.
+
+void Assembler::fpArith(IR *ins, x86Op xo) {
+  IRRef lref = ins->op1(), rref = ins->op2();
+  Reg dest = destReg(ins, kFPR);
+  Reg right = alloc1(rref, kFPR.exclude(dest));
+  emit_mrm(xo, dest, right);
+  allocLeft(dest, lref);
+}
+
+// Flip the sign bit:
+//
+//     movsd tmp, [sign mask]
+//     xorps dest, tmp
+//
+// XORPS with a memory operand would require a 16 byte aligned
+// constant, so we load the mask into a register first.
+void Assembler::fpNeg(IR *ins) {
+  Reg dest = destReg(ins, kFPR);
+  Reg tmp = allocScratchReg(kFPR.exclude(dest));
+  emit_rr(XO_XORPS, dest, tmp);
+  loadFPConstant(tmp, ins->type() == IRT_F64
+                 ? kSignMaskF64 : kSignMaskF32);
+  allocLeft(dest, ins->op1());
+}
+
+// UCOMISD sets the flags like an unsigned integer comparison and
+// additionally sets PF (and ZF and CF) if either operand is NaN.  LT
+// and LE are turned into GT and GE by swapping the operands so that
+// we only have to test CF and ZF.  For EQ we need two guards that
+// share the exit stub:
+//
+//     ucomisd left, right
+//     jp   ->exit
+//     jne  ->exit
+//
+// NE is the other way round:
+//
+//     ucomisd left, right
+//     jp   1f
+//     je   ->exit
+//  1:
+//
+void Assembler::fpCompare(IR *ins) {
+  x86Op xo = ins->type() == IRT_F64 ? XO_UCOMISD : XO_UCOMISS;
+  IRRef lref = ins->op1(), rref = ins->op2();
+  IR::Opcode op = (IR::Opcode)ins->opcode();
+  if (op == IR::kLT || op == IR::kLE) {
+    IRRef tmp = lref;
+    lref = rref;
+    rref = tmp;
+  }
+  Reg left = alloc1(lref, kFPR);
+  Reg right = alloc1(rref, kFPR);
+  switch (op) {
+  case IR::kLT: case IR::kGT:
+    guardcc(CC_BE);
+    break;
+  case IR::kLE: case IR::kGE:
+    guardcc(CC_B);
+    break;
+  case IR::kEQ:
+    guardcc(CC_NE);
+    guardcc(CC_P);
+    break;
+  case IR::kNE: {
+    guardcc(CC_E);
+    MCode *p = mcp;
+    p[-1] = 6;  // Skip over the JE.
+    p[-2] = (MCode)(XI_JCCs + (CC_P & 15));
+    mcp = p - 2;
+    break;
+  }
+  default:
+    LC_ASSERT(0 && "Not a comparison");
+  }
+  emit_mrm(xo, left, right);
+}
+
+// The source type is stored in op2.  A conversion from float to
+// integer truncates towards zero.
+void Assembler::conv(IR *ins) {
+  IRType srcty = (IRType)ins->op2();
+  IRType dstty = ins->type();
+  if (isFloatType(dstty)) {
+    Reg dest = destReg(ins, kFPR);
+    // CVT* only write the low 32 or 64 bits of the destination.
+    // Clear the rest first to maintain the Float# invariant and to
+    // break the dependency on the previous contents of dest.
+    if (isFloatType(srcty)) {
+      LC_ASSERT(srcty != dstty);
+      Reg left = alloc1(ins->op1(), kFPR.exclude(dest));
+      emit_mrm(dstty == IRT_F64 ? XO_CVTSS2SD : XO_CVTSD2SS, dest, left);
+    } else {
+      Reg left = alloc1(ins->op1(), kGPR);
+      emit_mrm(dstty == IRT_F64 ? XO_CVTSI2SD : XO_CVTSI2SS,
+               dest | REX_64, left | REX_64);
+    }
+    emit_rr(XO_XORPS, dest, dest);
+  } else {
+    LC_ASSERT(isFloatType(srcty));
+    Reg dest = destReg(ins, kGPR);
+    Reg left = alloc1(ins->op1(), kFPR);
+    emit_mrm(srcty == IRT_F64 ? XO_CVTTSD2SI : XO_CVTTSS2SI,
+             dest | REX_64, left);
+  }
+}
+
 bool Assembler::mergeWithParent() {
   // 1. Construct parallel assignment data.
   uint32_t p;
@@ -915,7 +1326,59 @@ MCode *emitSetTraceId(MCode *p, TraceId traceId) {
   return p;
 }
 
+// Floating point literals cannot be encoded as immediates.  They are
+// stored in a small constant pool at the very top of the trace's code
+// area and loaded using RIP-relative addressing.
+void Assembler::setupConstantPool() {
+  uint64_t consts[256];
+  uint32_t n = 0;
+  bool needMasks = false;
+
+  for (IRRef ref = buf_->bufmin_; ref < REF_BIAS; ++ref) {
+    IR *ins = ir(ref);
+    if ((ins->opcode() == IR::kKINT || ins->opcode() == IR::kKWORD) &&
+        isFloatType(ins->type())) {
+      if (n >= countof(consts) - 2) {
+        cerr << "NYI: Too many floating point constants." << endl;
+        exit(EXIT_FAILURE);
+      }
+      consts[n++] = buf_->literalValue(ref);
+    }
+  }
+  for (IRRef ref = stopins_; ref < nins_; ++ref) {
+    IR *ins = ir(ref);
+    if (ins->opcode() == IR::kNEG && isFloatType(ins->type()))
+      needMasks = true;
+  }
+  if (needMasks) {
+    consts[n++] = kSignMaskF64;
+    consts[n++] = kSignMaskF32;
+  }
+
+  kpoolSize_ = n;
+  mctop -= n * sizeof(uint64_t);
+  kpool_ = mctop;
+  for (uint32_t i = 0; i < n; ++i)
+    ((uint64_t *)kpool_)[i] = consts[i];
+}
+
+MCode *Assembler::fpConstant(uint64_t k) {
+  uint64_t *pool = (uint64_t *)kpool_;
+  for (uint32_t i = 0; i < kpoolSize_; ++i) {
+    if (pool[i] == k)
+      return (MCode *)&pool[i];
+  }
+  LC_ASSERT(0 && "Constant not in constant pool");
+  return NULL;
+}
+
+void Assembler::loadFPConstant(Reg dst, uint64_t k) {
+  emit_rma(XO_MOVSD, dst, fpConstant(k));
+}
+
 void Assembler::prepareTail(IRBuffer *buf, IRRef saveref) {
+  setupConstantPool();
+
   if (jit()->getOption(Jit::kOptFastHeapCheckFail) &&
       numHeapChecks_ > 0) {
     mctop -= QUICK_HEAP_CHECK_FAIL_SIZE;
@@ -972,6 +1435,9 @@ void Assembler::assemble(IRBuffer *buf, MachineCode *mcode) {
 
   prepareTail(buf, saveref);
 
+  if (jit()->getOption(Jit::kOptAllocProfile))
+    jit()->initAllocCounters();
+
 #ifdef LC_TRACE_STATS
   if (jit()->stats_ != NULL)
     incrementCounter(&jit()->stats_[0]);
@@ -1052,8 +1518,9 @@ void Assembler::assemble(IRBuffer *buf, MachineCode *mcode) {
 
   buf->setRegsAllocated();
   // TODO: Save to trace fragment
-  LC_ASSERT_MSG(freeset_.raw() == kGPR.raw(),
-                "free = %x, gpr = %x\n", freeset_.raw(), kGPR.raw());
+  LC_ASSERT_MSG(freeset_.raw() == kAllocRegs.raw(),
+                "free = %x, allocatable = %x\n", freeset_.raw(),
+                kAllocRegs.raw());
   mcode->commit(mcp);
 
   RA_DBG_FLUSH();
@@ -1077,7 +1544,7 @@ Assembler::incrementCounter(uint64_t *counterAddr)
 void Assembler::emitSLOAD(IR *ins) {
   int32_t ofs = 8 * (int16_t)ins->op1();
   Reg base = RID_BASE;
-  RegSet allow = kGPR;
+  RegSet allow = regClass(ins->type());
   Reg dst = destReg(ins, allow);
   load_u64(dst, base, ofs);
 }
@@ -1141,7 +1608,15 @@ void Assembler::patchGuard(Fragment *F, ExitNo exitno, MCode *target) {
   if (p[0] == (MCode)0x0f) {  // Patch conditional branch.
     LC_ASSERT(p[1] >= (MCode)XI_JCCn);
     LC_ASSERT(p[1] <= (MCode)(XI_JCCn + 15));
+    MCode *exitstub = p + 6 + *(int32_t *)(p + 2);
     *(int32_t *)(p + 2) = jmprel(p + 6, target);
+    // Floating point equality uses two branches to the same exit.
+    MCode *q = p + 6;
+    if (q[0] == (MCode)0x0f && q[1] >= (MCode)XI_JCCn &&
+        q[1] <= (MCode)(XI_JCCn + 15) &&
+        q + 6 + *(int32_t *)(q + 2) == exitstub) {
+      *(int32_t *)(q + 2) = jmprel(q + 6, target);
+    }
   } else {  // Patch unconditional branch (e.g., fall-through)
     LC_ASSERT(p[0] == (MCode)XI_JMP);
     *(int32_t *)(p + 1) = jmprel(p + 5, target);
@@ -1184,7 +1659,7 @@ void Assembler::fieldLoad(IR *ins) {
   IR *frefins = ir(fref);
   IRRef base = frefins->op1();
   int fieldid = frefins->op2();
-  Reg dst = destReg(ins, kGPR);
+  Reg dst = destReg(ins, regClass(ins->type()));
   Reg basereg = alloc1(base, kGPR);
   load_u64(dst, basereg, sizeof(Word) * fieldid);
 }
@@ -1268,6 +1743,9 @@ void Assembler::insNew(IR *ins) {
   }
   // Write info table.
   memstore(RID_HP, sizeof(Word) * ofs, ins->op1(), kGPR);
+
+  if (jit()->allocCounters_ != NULL)
+    incrementCounter(&jit()->allocCounters_[eid].allocs);
 }
 
 void Assembler::insUpdate(IR *ins) {
@@ -1276,21 +1754,252 @@ void Assembler::insUpdate(IR *ins) {
   memstore(oldptr, 0, REF_IND, kGPR.exclude(oldptr));
 }
 
+void Assembler::fieldStore(IR *ins) {
+  IR *fref = ir(ins->op1());
+  LC_ASSERT(fref->opcode() == IR::kFREF);
+  Reg basereg = alloc1(fref->op1(), kGPR);
+  memstore(basereg, sizeof(Word) * fref->op2(), ins->op2(),
+           kGPR.exclude(basereg));
+}
+
+// The index of an array access, if it is a small enough literal to be
+// folded into the offset.
+bool Assembler::literalArrayIndex(IRRef ref, int32_t *k) {
+  return is32BitLiteral(ref, k) && *k >= 0 && *k < (1 << 24);
+}
+
+// Splits the index of an array access into a register part and a
+// constant added to the displacement.  Returns 0 if the index is a
+// literal.
+IRRef Assembler::arrayIndex(IRRef ref, int size, int32_t *ofs) {
+  int32_t k;
+  if (literalArrayIndex(ref, &k)) {
+    *ofs += k * size;
+    return 0;
+  }
+  IR *ins = ir(ref);
+  if (ins->opcode() == IR::kADD && is32BitLiteral(ins->op2(), &k) &&
+      k > -(1 << 24) && k < (1 << 24)) {
+    *ofs += k * size;
+    return ins->op1();
+  }
+  return ref;
+}
+
+static x86Mode arrayIndexScale(int size) {
+  switch (size) {
+  case 1: return XM_SCALE1;
+  case 2: return XM_SCALE2;
+  case 4: return XM_SCALE4;
+  default: return XM_SCALE8;
+  }
+}
+
+// Byte array elements are zero-extended.  A 32 bit move clears the
+// upper half of the register.
+void Assembler::arrayLoad(IR *ins) {
+  IR *aref = ir(ins->op1());
+  LC_ASSERT(aref->opcode() == IR::kAREF);
+  int size = arrayElementSize(ins->type());
+  int32_t ofs = ins->type() == IRT_CLOS
+    ? ARRAY_PAYLOAD_OFFSET : BYTEARRAY_PAYLOAD_OFFSET;
+  IRRef idxref = arrayIndex(aref->op2(), size, &ofs);
+  Reg dst = destReg(ins, kGPR);
+  Reg arr = alloc1(aref->op1(), kGPR);
+  x86Op xo = size == 1 ? XO_MOVZXb : (size == 2 ? XO_MOVZXw : XO_MOV);
+  Reg rr = size == 8 ? (Reg)(dst | REX_64) : dst;
+  if (idxref == 0) {
+    emit_rmro(xo, rr, arr | REX_64, ofs);
+  } else {
+    Reg idx = alloc1(idxref, kGPR.exclude(arr));
+    emit_rmrxo(xo, rr, arr | REX_64, idx | REX_64, arrayIndexScale(size),
+               ofs);
+  }
+}
+
+// Byte array stores need no write barrier.
+void Assembler::byteArrayStore(IR *ins) {
+  IR *aref = ir(ins->op1());
+  int size = arrayElementSize(ins->type());
+  int32_t ofs = BYTEARRAY_PAYLOAD_OFFSET;
+  IRRef idxref = arrayIndex(aref->op2(), size, &ofs);
+  Reg arr = alloc1(aref->op1(), kGPR);
+  Reg val = alloc1(ins->op2(), kGPR.exclude(arr));
+  x86Op xo;
+  Reg rr;
+  switch (size) {
+  case 1: xo = XO_MOVtob; rr = (Reg)(val | FORCE_REX); break;
+  case 2: xo = XO_MOVtow; rr = val; break;
+  case 4: xo = XO_MOVto; rr = val; break;
+  default: xo = XO_MOVto; rr = (Reg)(val | REX_64); break;
+  }
+  if (idxref == 0) {
+    emit_rmro(xo, rr, arr | REX_64, ofs);
+  } else {
+    Reg idx = alloc1(idxref, kGPR.exclude(arr).exclude(val));
+    emit_rmrxo(xo, rr, arr | REX_64, idx | REX_64, arrayIndexScale(size),
+               ofs);
+  }
+}
+
+// Store the element and mark its card (see ArrayClosure).  The card
+// table follows the payload:
+//
+//     mov [arr + idx * 8 + payload], val
+//     mov t1, [arr + ptrs]
+//     lea t1, [arr + t1 * 8]
+//     mov t2, idx
+//     shr t2, kArrayCardBits
+//     mov byte [t1 + t2 + payload], 1
+//
+// For a literal index the card offset is a constant:
+//
+//     mov [arr + payload + k * 8], val
+//     mov t1, [arr + ptrs]
+//     mov byte [arr + t1 * 8 + payload + (k >> kArrayCardBits)], 1
+//
+void Assembler::arrayStore(IR *ins) {
+  IR *aref = ir(ins->op1());
+  LC_ASSERT(aref->opcode() == IR::kAREF);
+  if (ins->type() != IRT_CLOS) {
+    byteArrayStore(ins);
+    return;
+  }
+  int32_t k;
+  Reg arr = alloc1(aref->op1(), kGPR);
+  Reg val = alloc1(ins->op2(), kGPR.exclude(arr));
+  RegSet avail = kGPR.exclude(arr).exclude(val);
+  if (literalArrayIndex(aref->op2(), &k)) {
+    Reg t1 = allocScratchReg(avail);
+    emit_i8(1);
+    emit_rmrxo(XO_MOVmib, (Reg)0, arr | REX_64, t1 | REX_64, XM_SCALE8,
+               ARRAY_PAYLOAD_OFFSET + (k >> kArrayCardBits));
+    emit_rmro(XO_MOV, t1 | REX_64, arr | REX_64, ARRAY_PTRS_OFFSET);
+    emit_rmro(XO_MOVto, val | REX_64, arr | REX_64,
+              ARRAY_PAYLOAD_OFFSET + k * sizeof(Word));
+  } else {
+    Reg idx = alloc1(aref->op2(), avail);
+    avail = avail.exclude(idx);
+    Reg t1 = allocScratchReg(avail);
+    Reg t2 = allocScratchReg(avail.exclude(t1));
+    emit_i8(1);
+    emit_rmrxo(XO_MOVmib, (Reg)0, t1 | REX_64, t2 | REX_64, XM_SCALE1,
+               ARRAY_PAYLOAD_OFFSET);
+    emit_shifti(XOg_SHR | REX_64, t2, kArrayCardBits);
+    emit_rr(XO_MOV, t2 | REX_64, idx | REX_64);
+    emit_rmrxo(XO_LEA, t1 | REX_64, arr | REX_64, t1 | REX_64, XM_SCALE8, 0);
+    emit_rmro(XO_MOV, t1 | REX_64, arr | REX_64, ARRAY_PTRS_OFFSET);
+    emit_rmrxo(XO_MOVto, val | REX_64, arr | REX_64, idx | REX_64,
+               XM_SCALE8, ARRAY_PAYLOAD_OFFSET);
+  }
+}
+
+void Assembler::writeBarrier(IR *ins) {
+  // If the object lives in a block of the old generation, add it to
+  // the remembered set.  The block descriptor is found in the header
+  // of the region containing the object:
+  //
+  //     mov  t1, obj
+  //     and  t1, ~RegionMask         ; t1 = region
+  //     mov  t2, obj
+  //     shr  t2, BlockSizeLog2
+  //     and  t2, BlocksPerRegion - 1  ; t2 = block index
+  //     imul t2, t2, sizeof(Block)
+  //     test dword [t1 + t2 + blockFlagsOffset], Block::kOld
+  //     jz   >1
+  //     <set up arguments>
+  //     call rememberFromTrace
+  //   1:
+  //     <reload evicted registers>
+  //
+  // The reloads are on both paths, so the caller-saved registers are
+  // free whether or not the call is made.
+  IRRef args[2] = { ins->op2(), ins->op1() };
+  evictSet(kCallerSaved);
+  MCode *done = mcp;
+  callArgs(ircall_info[IRCALL_rememberFromTrace].func, 2, args, false);
+
+  Reg closreg = alloc1(ins->op1(), kGPR);
+  Reg t1 = allocScratchReg(kGPR.exclude(closreg));
+  Reg t2 = allocScratchReg(kGPR.exclude(closreg).exclude(t1));
+
+  MCode *p = mcp;
+  ptrdiff_t delta = done - p;
+  if (delta == (int8_t)delta) {
+    p[-1] = (MCode)delta;
+    p[-2] = (MCode)(XI_JCCs + (CC_E & 15));
+    mcp = p - 2;
+  } else {
+    *(int32_t *)(p - 4) = (int32_t)delta;
+    p[-5] = (MCode)(XI_JCCn + (CC_E & 15));
+    p[-6] = 0x0f;
+    mcp = p - 6;
+  }
+
+  emit_i32(Block::kOld);
+  mrm_.base = t1;
+  mrm_.idx = t2;
+  mrm_.scale = XM_SCALE1;
+  mrm_.ofs = (int32_t)Region::blockFlagsOffset();
+  emit_mrm(XO_GROUP3, (Reg)XOg_TEST, RID_MRM);
+
+  emit_i8((int8_t)sizeof(Block));
+  emit_rr(XO_IMULi8, t2 | REX_64, t2 | REX_64);
+  emit_gri(XG_ARITHi(XOg_AND), t2 | REX_64, Region::kBlocksPerRegion - 1);
+  emit_shifti(XOg_SHR | REX_64, t2, Block::kBlockSizeLog2);
+  emit_rr(XO_MOV, t2 | REX_64, closreg | REX_64);
+
+  emit_gri(XG_ARITHi(XOg_AND), t1 | REX_64, (int32_t)~Region::kRegionMask);
+  emit_rr(XO_MOV, t1 | REX_64, closreg | REX_64);
+}
+
+void Assembler::safepoint(IR *ins) {
+  // Exit the trace if a capability waits for all others to stop (see
+  // MemoryManager::safepointRequested):
+  //
+  //     mov  t, &safepointRequests
+  //     cmp  dword [t], 0
+  //     jne  _exit<N>
+  //
+  Reg t = allocScratchReg(kGPR);
+
+  guardcc(CC_NE);
+
+  mrm_.base = t;
+  mrm_.ofs = 0;
+  mrm_.idx = RID_NONE;
+  emit_gmrmi(XG_ARITHi(XOg_CMP), RID_MRM, 0);
+  loadi_u64(t, (uint64_t)MemoryManager::safepointRequestFlag());
+}
+
 void Assembler::emit(IR *ins) {
   switch (ins->opcode()) {
   case IR::kSLOAD:
     emitSLOAD(ins);
     break;
   case IR::kADD:
-    intArith(ins, XOg_ADD);
+    if (isFloatType(ins->type()))
+      fpArith(ins, ins->type() == IRT_F64 ? XO_ADDSD : XO_ADDSS);
+    else
+      intArith(ins, XOg_ADD);
     break;
   case IR::kSUB:
-    intArith(ins, XOg_SUB);
+    if (isFloatType(ins->type()))
+      fpArith(ins, ins->type() == IRT_F64 ? XO_SUBSD : XO_SUBSS);
+    else
+      intArith(ins, XOg_SUB);
     break;
   case IR::kMUL:
-    intArith(ins, XOg_X_IMUL);
+    if (isFloatType(ins->type()))
+      fpArith(ins, ins->type() == IRT_F64 ? XO_MULSD : XO_MULSS);
+    else
+      intArith(ins, XOg_X_IMUL);
     break;
   case IR::kDIV:
+    if (isFloatType(ins->type())) {
+      fpArith(ins, ins->type() == IRT_F64 ? XO_DIVSD : XO_DIVSS);
+      break;
+    }
     LC_ASSERT(isIntegerType(ins->type()));
     divmod(ins, DIVMOD_DIV, isSigned(ins->type()));
     break;
@@ -1299,13 +2008,56 @@ void Assembler::emit(IR *ins) {
     divmod(ins, DIVMOD_MOD, isSigned(ins->type()));
     break;
   case IR::kNEG:
+    if (isFloatType(ins->type())) {
+      fpNeg(ins);
+      break;
+    }
     LC_ASSERT(isIntegerType(ins->type()));
     intNegNot(ins, XOg_NEG);
     break;
+  case IR::kADDOV:
+    intArith(ins, XOg_ADD);
+    break;
+  case IR::kSUBOV:
+    intArith(ins, XOg_SUB);
+    break;
+  case IR::kMULOV:
+    intArith(ins, XOg_X_IMUL);
+    break;
+  case IR::kADDCU:
+    intArith(ins, XOg_ADD, CC_C);
+    break;
+  case IR::kMULHU:
+    mulHigh(ins);
+    break;
+  case IR::kCONV:
+    conv(ins);
+    break;
+  case IR::kCARG:
+    // Handled by CALLN.
+    break;
+  case IR::kCALLN:
+    callHelper(ins);
+    break;
+  case IR::kCCALL:
+    foreignCall(ins);
+    break;
   case IR::kBNOT:
     LC_ASSERT(isIntegerType(ins->type()));
     intNegNot(ins, XOg_NOT);
     break;
+  case IR::kPOPCNT:
+  case IR::kCLZ:
+  case IR::kCTZ:
+    bitCount(ins);
+    break;
+  case IR::kBSWAP:
+    byteSwap(ins);
+    break;
+  case IR::kPDEP:
+  case IR::kPEXT:
+    bitDepositExtract(ins);
+    break;
   case IR::kBAND:
     intArith(ins, XOg_AND);
     break;
@@ -1324,6 +2076,10 @@ void Assembler::emit(IR *ins) {
   case IR::kGT:
   case IR::kEQ:
   case IR::kNE: {
+    if (isFloatType(ins->type())) {
+      fpCompare(ins);
+      break;
+    }
     int idx = (int)ins->opcode() - (int)IR::kLT;
     LC_ASSERT(idx >= 0 && idx < countof(asm_compmap));
     LC_ASSERT(buf_->snap(snapno_).ref() == curins_);
@@ -1361,9 +2117,27 @@ void Assembler::emit(IR *ins) {
   case IR::kUPDATE:
     insUpdate(ins);
     break;
+  case IR::kWBAR:
+    writeBarrier(ins);
+    break;
+  case IR::kSAFEPOINT:
+    safepoint(ins);
+    break;
   case IR::kPLOAD:
     insPLOAD(ins);
     break;
+  case IR::kFSTORE:
+    fieldStore(ins);
+    break;
+  case IR::kAREF:
+    // Always fused into its use sites.
+    break;
+  case IR::kALOAD:
+    arrayLoad(ins);
+    break;
+  case IR::kASTORE:
+    arrayStore(ins);
+    break;
   case IR::kBSHL: bitshift(ins, XOg_SHL); break;
   case IR::kBSHR: bitshift(ins, XOg_SHR); break;
   case IR::kBSAR: bitshift(ins, XOg_SAR); break;
@@ -1378,7 +2152,7 @@ void Assembler::emit(IR *ins) {
 void Assembler::snapshotAlloc1(IRRef ref) {
   IR *ins = ir(ref);
   if (!ins->hasRegOrSpill()) {
-    RegSet allow = kGPR;
+    RegSet allow = regClass(ins->type());
     if (!freeset_.intersect(allow).isEmpty()) {
       allocRef(ref, allow);
       RA_DBGX((this, "snapreg   $f $r", ref, ins->reg()));
@@ -1406,9 +2180,14 @@ void Assembler::adjustBase(int32_t relbase) {
   emit_gri(XG_ARITHi(XOg_ADD), RID_BASE | REX_64, relbase * sizeof(Word));
 }
 
+// If the stack limit has been reached, leave the trace via the exit
+// of the current SAVE snapshot.  The interpreter then moves the
+// current frame into a new stack chunk before it re-enters the trace.
+// Unlike a guard, this exit is never patched to a side trace, so we
+// don't set the snapshot's mcode_.
 void Assembler::stackCheck(void) {
   MCode *p = mcp;
-  *(int32_t *)(p - 4) = jmprel(p, (MCode *)(void *)asmStackOverflow);
+  *(int32_t *)(p - 4) = jmprel(p, exitstubAddr(snapno_));
   p[-5] = (MCode)(XI_JCCn + (CC_A & 15));
   p[-6] = 0x0f;
   mcp = p - 6;
@@ -1429,7 +2208,7 @@ void Assembler::save(IR *ins) {
   // Adjust base pointer if necessary.
   if (relbase != 0) {
     if (relbase > 0) {
-      // TODO: Stack check (done after adjusting BASE)
+      // Stack check (done after adjusting BASE)
       stackCheck();
     }
     adjustBase(relbase);
@@ -1471,6 +2250,8 @@ void Assembler::memstore(Reg base, int32_t ofs, IRRef ref, RegSet allow) {
   if (irref_islit(ref) && is32BitLiteral(ref, &k)) {
     storei_u64(base, ofs, k);
   } else {
+    if (isFloatType(ir(ref)->type()))
+      allow = kFPR;
     Reg r = alloc1(ref, allow);
     store_u64(base, ofs, r);
   }
@@ -1504,7 +2285,7 @@ bool conflicts(RegSpill candidate, RegSpill src) {
 #define SAVE_HP_OFFS  SPILL_SP_OFFS
 
 static inline Reg
-getTemp(Assembler *as, ParAssign *assign)
+getTemp(Assembler *as, ParAssign *assign, RegSet allow)
 {
   if (assign->tmpsInUse >= 1) {
     cerr << "More than one temporary required for parallel assignment.\n";
@@ -1512,8 +2293,11 @@ getTemp(Assembler *as, ParAssign *assign)
   }
 
   Reg r;
-  if (as->hasFreeReg()) {
-    r = as->allocScratchReg(kGPR);
+  if (as->hasFreeReg(allow)) {
+    r = as->allocScratchReg(allow);
+  } else if (allow.intersect(kGPR).isEmpty()) {
+    cerr << "NYI: No free FP register for parallel assignment.\n";
+    exit(EXIT_FAILURE);
   } else {
     // Use heap pointer.  Free it up if necessary.
     if (!assign->usingHp) {
@@ -1619,8 +2403,8 @@ debugPrintSingleParallelAssign(ostream &out, RegSpill dst, RegSpill src)
       << '.' << (uint32_t)dst.spill
       << ":" << (uint32_t)src.reg
       << '.' << (uint32_t)src.spill << "] ";
-  const char *dreg = isReg(dst.reg) ? regNames64[dst.reg] : " - ";
-  const char *sreg = isReg(src.reg) ? regNames64[src.reg] : " - ";
+  const char *dreg = isReg(dst.reg) ? regName(dst.reg) : " - ";
+  const char *sreg = isReg(src.reg) ? regName(src.reg) : " - ";
   out << "   " << dreg;
   if (hasSpill(dst)) out << '[' << (uint32_t)dst.spill << ']';
   out << " <- " << sreg;
@@ -1676,9 +2460,11 @@ Assembler::moveOne(uint32_t i, ParAssign *assign, int level) {
                                                      assign->source[j]); });
           // We found a cyclic dependency.  Use a temporary register
           // to break the cycle.
-          Reg tmp = getTemp(this, assign);
+          Reg tmp = getTemp(this, assign,
+                            kFPR.test(assign->source[j].reg) ||
+                            kFPR.test(assign->dest[j].reg) ? kFPR : kGPR);
           releaseTemp(assign, tmp); // TODO: explain this.
-          DBG_MOVEONE(level, { cerr << "-temp=" << regNames64[tmp] << endl; });
+          DBG_MOVEONE(level, { cerr << "-temp=" << regName(tmp) << endl; });
           dst = assign->dest[j];
           if (isReg(dst.reg))
             move(dst.reg, tmp);
@@ -46,6 +46,10 @@ extern const char *regNames32[RID_NUM_GPR];
 extern const char *regNames64[RID_NUM_GPR];
 extern const char *fpRegNames[RID_NUM_FPR];
 
+inline const char *regName(uint32_t r) {
+  return r < RID_MAX_GPR ? regNames64[r] : fpRegNames[r - RID_MIN_FPR];
+}
+
 inline int32_t sps_scale(int ofs) { return 8 * ofs; }
 
 /// Register allocation cost is used when deciding which register to spill.
@@ -164,6 +168,18 @@ static const RegSet kGPR =
   RegSet::range(RID_MIN_GPR, RID_MAX_GPR).exclude(RID_ESP)
   .exclude(RID_BASE).exclude(RID_HP);
 
+// The SSE registers.  Double# and Float# values live in the low
+// 64/32 bits of an XMM register.
+static const RegSet kFPR = RegSet::range(RID_MIN_FPR, RID_MAX_FPR);
+
+// All registers available to the register allocator.
+static const RegSet kAllocRegs = kGPR.setunion(kFPR);
+
+/// The register class for a value of the given type.
+inline RegSet regClass(IRType ty) {
+  return isFloatType(ty) ? kFPR : kGPR;
+}
+
 LC_STATIC_ASSERT(sizeof(RegSet) == sizeof(uint32_t));
 
 class SpillSet {
@@ -310,7 +326,13 @@ typedef enum {
   XO_MOVSXw =   XO_0f(bf),
   XO_MOVSXd =   XO_(63),
   XO_BSWAP =    XO_0f(c8),
+  XO_BSF =      XO_0f(bc),
+  XO_BSR =      XO_0f(bd),
+  XO_POPCNT =   XO_f30f(b8),
+  XO_TZCNT =    XO_f30f(bc),
+  XO_LZCNT =    XO_f30f(bd),
   XO_CMOV =     XO_0f(40),
+  XO_SETCC =    XO_0f(90),
 
   XO_MOVSD =    XO_f20f(10),
   XO_MOVSDto =  XO_f20f(11),
@@ -338,6 +360,10 @@ typedef enum {
   XO_CVTSS2SD = XO_f30f(5a),
   XO_CVTSD2SS = XO_f20f(5a),
   XO_ADDSS =    XO_f30f(58),
+  XO_SUBSS =    XO_f30f(5c),
+  XO_MULSS =    XO_f30f(59),
+  XO_DIVSS =    XO_f30f(5e),
+  XO_UCOMISS =  XO_0f(2e),
   XO_MOVD =     XO_660f(6e),
   XO_MOVDto =   XO_660f(7e),
 
@@ -428,11 +454,28 @@ typedef struct {
   uint8_t usingHp;
 } ParAssign;
 
+// Optional instruction set extensions used by the code generator.
+enum {
+  CPU_POPCNT = 1 << 0,
+  CPU_LZCNT  = 1 << 1,
+  CPU_BMI1   = 1 << 2,  // TZCNT
+  CPU_BMI2   = 1 << 3   // PDEP, PEXT
+};
+
 class Assembler {
 public:
   Assembler(Jit *);
   ~Assembler();
 
+  /// Queries CPUID for the CPU_* features.
+  static uint32_t detectCpuFeatures();
+
+  /// The features are detected at startup.  Instructions that the
+  /// CPU does not support are replaced by a fallback sequence or a
+  /// call to a C helper.
+  inline uint32_t cpuFeatures() const { return cpuFeatures_; }
+  inline void setCpuFeatures(uint32_t f) { cpuFeatures_ = f; }
+
   void move(Reg dst, Reg src);
   void loadi_u32(Reg dst, uint32_t i);
   void loadi_i32(Reg dst, int32_t i);
@@ -487,6 +530,9 @@ public:
   Reg allocScratchReg(RegSet allow);
 
   inline bool hasFreeReg() const { return !freeset_.isEmpty(); }
+  inline bool hasFreeReg(RegSet allow) const {
+    return !freeset_.intersect(allow).isEmpty();
+  }
 
   void snapshotAlloc1(IRRef ref);
   void snapshotAlloc(Snapshot &snap, SnapshotData *snapmap);
@@ -521,7 +567,11 @@ public:
   void setupRegAlloc();
 
   bool is32BitLiteral(IRRef ref, int32_t *k);
-  void intArith(IR *ins, x86Arith xa);
+  bool literalArrayIndex(IRRef ref, int32_t *k);
+  IRRef arrayIndex(IRRef ref, int size, int32_t *ofs);
+  // If `setcc' is a condition code, the result is the value of that
+  // flag after the operation (0 or 1).
+  void intArith(IR *ins, x86Arith xa, int setcc = -1);
   void intNegNot(IR *ins, x86Group3 xg);
   void bitshift(IR *ins, x86Shift xs);
 
@@ -531,14 +581,36 @@ public:
     DIVMOD_MOD = 1,
   };
   void divmod(IR *ins, DivModOp op, bool useSigned);
+  void mulHigh(IR *ins);
+  void callHelper(IR *ins);
+  void callC(IR *ins, const void *func, int nargs, const IRRef *args,
+             bool varargs);
+  void callArgs(const void *func, int nargs, const IRRef *args,
+                bool varargs);
+  void foreignCall(IR *ins);
+
+  void bitCount(IR *ins);
+  void byteSwap(IR *ins);
+  void bitDepositExtract(IR *ins);
+
+  void fpArith(IR *ins, x86Op xo);
+  void fpNeg(IR *ins);
+  void fpCompare(IR *ins);
+  void conv(IR *ins);
 
   /// Generate code for the given instruction.
   void itblGuard(IR *ins, bool inverted);
   void fieldLoad(IR *ins);
+  void fieldStore(IR *ins);
+  void arrayLoad(IR *ins);
+  void arrayStore(IR *ins);
+  void byteArrayStore(IR *ins);
   inline void adjustHeapPointer(int32_t bytes);
   void heapCheck(IR *ins);
   void insNew(IR *ins);
   void insUpdate(IR *ins);
+  void writeBarrier(IR *ins);
+  void safepoint(IR *ins);
   void emit(IR *ins);
   void save(IR *ins);
   void memstore(Reg base, int32_t ofs, IRRef ref, RegSet allow);
@@ -565,6 +637,10 @@ public:
 private:
   inline int32_t spillOffset(uint8_t spillSlot) const;
 
+  void setupConstantPool();
+  MCode *fpConstant(uint64_t k);
+  void loadFPConstant(Reg dst, uint64_t k);
+
   MCode *generateExitstubGroup(ExitNo group, MachineCode *);
   void setupExitStubs(ExitNo nexits, MachineCode *mcode);
   MCode *exitstubAddr(ExitNo);
@@ -654,6 +730,8 @@ private:
   }
 
   void emit_mrm(x86Op xo, Reg rr, Reg rb);
+  // op r, [rip + (addr - next instruction)]
+  void emit_rma(x86Op xo, Reg rr, const void *addr);
   void emit_gri(x86Group xg, Reg rb, int32_t i);
   void emit_gmrmi(x86Group xg, Reg rb, int32_t i);
 
@@ -665,9 +743,15 @@ private:
   MCode *mctop; // Top of generated MCode
 
   MCode *mcQuickHeapCheck_;
+
+  // Floating point constants and sign masks are loaded from a pool
+  // placed right above the trace's code.
+  MCode *kpool_;
+  uint32_t kpoolSize_;  // Number of 8-byte entries.
   uint32_t numHeapChecks_;
 
   Jit *jit_;
+  uint32_t cpuFeatures_;
   IR *ir_;
   IRBuffer *buf_;
   IRRef nins_;
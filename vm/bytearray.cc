@@ -0,0 +1,216 @@
+#include "bytearray.hh"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+_START_LAMBDACHINE_NAMESPACE
+
+static inline u1 *bytes(Closure *arr, Word offset) {
+  return (u1 *)((ByteArrayClosure *)arr)->payload_ + offset;
+}
+
+void copyByteArray(Closure *src, Word srcOffset, Closure *dst,
+                   Word dstOffset, Word n) {
+  LC_ASSERT(srcOffset + n <= ((ByteArrayClosure *)src)->bytes_);
+  LC_ASSERT(dstOffset + n <= ((ByteArrayClosure *)dst)->bytes_);
+  memmove(bytes(dst, dstOffset), bytes(src, srcOffset), n);
+}
+
+void setByteArray(Closure *arr, Word offset, Word n, Word value) {
+  LC_ASSERT(offset + n <= ((ByteArrayClosure *)arr)->bytes_);
+  memset(bytes(arr, offset), (u1)value, n);
+}
+
+// --- Kernels ---------------------------------------------------------
+//
+// compareBytes returns -1, 0, or 1.  findByte returns a pointer to the
+// first occurrence of c, or NULL.  The vector kernels handle the tail
+// that does not fill a whole vector with the scalar kernel.
+
+static WordInt compareBytesScalar(const u1 *p, const u1 *q, Word n) {
+  for (Word i = 0; i < n; ++i) {
+    if (p[i] != q[i])
+      return p[i] < q[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+static const u1 *findByteScalar(const u1 *p, Word n, u1 c) {
+  for (Word i = 0; i < n; ++i) {
+    if (p[i] == c)
+      return p + i;
+  }
+  return NULL;
+}
+
+#if defined(__x86_64__)
+
+static WordInt compareBytesSSE2(const u1 *p, const u1 *q, Word n) {
+  Word i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(q + i));
+    unsigned int diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+    if (diff != 0) {
+      i += __builtin_ctz(diff);
+      return p[i] < q[i] ? -1 : 1;
+    }
+  }
+  return compareBytesScalar(p + i, q + i, n - i);
+}
+
+static const u1 *findByteSSE2(const u1 *p, Word n, u1 c) {
+  __m128i needle = _mm_set1_epi8((char)c);
+  Word i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+    unsigned int match = _mm_movemask_epi8(_mm_cmpeq_epi8(x, needle));
+    if (match != 0)
+      return p + i + __builtin_ctz(match);
+  }
+  return findByteScalar(p + i, n - i, c);
+}
+
+__attribute__((target("avx2")))
+static WordInt compareBytesAVX2(const u1 *p, const u1 *q, Word n) {
+  Word i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(q + i));
+    unsigned int diff = ~(unsigned int)_mm256_movemask_epi8(
+                                          _mm256_cmpeq_epi8(x, y));
+    if (diff != 0) {
+      i += __builtin_ctz(diff);
+      return p[i] < q[i] ? -1 : 1;
+    }
+  }
+  return compareBytesSSE2(p + i, q + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static const u1 *findByteAVX2(const u1 *p, Word n, u1 c) {
+  __m256i needle = _mm256_set1_epi8((char)c);
+  Word i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+    unsigned int match =
+      (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, needle));
+    if (match != 0)
+      return p + i + __builtin_ctz(match);
+  }
+  return findByteSSE2(p + i, n - i, c);
+}
+
+int detectByteArrayKernels() {
+  unsigned int eax, ebx, ecx, edx;
+  // AVX2 also needs the OS to save the YMM registers (OSXSAVE and
+  // XCR0 bits 1 and 2).
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+      (ecx & (1 << 27)) && (ecx & (1 << 28)) &&
+      __get_cpuid_max(0, NULL) >= 7) {
+    unsigned int xcr0lo, xcr0hi;
+    __asm__("xgetbv" : "=a"(xcr0lo), "=d"(xcr0hi) : "c"(0));
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if ((xcr0lo & 6) == 6 && (ebx & (1 << 5)))
+      return BYTEARRAY_KERNELS_AVX2;
+  }
+  // SSE2 is part of x86-64.
+  return BYTEARRAY_KERNELS_SSE2;
+}
+
+#else
+
+int detectByteArrayKernels() {
+  return BYTEARRAY_KERNELS_SCALAR;
+}
+
+#endif
+
+typedef WordInt (*CompareBytesFn)(const u1 *, const u1 *, Word);
+typedef const u1 *(*FindByteFn)(const u1 *, Word, u1);
+
+static WordInt compareBytesInit(const u1 *p, const u1 *q, Word n);
+static const u1 *findByteInit(const u1 *p, Word n, u1 c);
+
+// The kernels are selected on first use.  Traces on several
+// capabilities may get there at the same time, so the selection runs
+// only once.  The function pointers are only ever replaced by
+// equivalent kernels, so readers need no ordering.
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+static int kernels = -1;
+static CompareBytesFn compareBytes = compareBytesInit;
+static FindByteFn findByte = findByteInit;
+
+static void selectKernels(int k);
+
+static void initKernels() {
+  selectKernels(detectByteArrayKernels());
+}
+
+int byteArrayKernels() {
+  pthread_once(&kernelsOnce, initKernels);
+  return kernels;
+}
+
+void setByteArrayKernels(int k) {
+  LC_ASSERT(k <= detectByteArrayKernels());
+  pthread_once(&kernelsOnce, initKernels);
+  selectKernels(k);
+}
+
+static void selectKernels(int k) {
+  CompareBytesFn compare;
+  FindByteFn find;
+  switch (k) {
+#if defined(__x86_64__)
+  case BYTEARRAY_KERNELS_AVX2:
+    compare = compareBytesAVX2;
+    find = findByteAVX2;
+    break;
+  case BYTEARRAY_KERNELS_SSE2:
+    compare = compareBytesSSE2;
+    find = findByteSSE2;
+    break;
+#endif
+  default:
+    compare = compareBytesScalar;
+    find = findByteScalar;
+    break;
+  }
+  kernels = k;
+  __atomic_store_n(&compareBytes, compare, __ATOMIC_RELAXED);
+  __atomic_store_n(&findByte, find, __ATOMIC_RELAXED);
+}
+
+static WordInt compareBytesInit(const u1 *p, const u1 *q, Word n) {
+  byteArrayKernels();
+  return __atomic_load_n(&compareBytes, __ATOMIC_RELAXED)(p, q, n);
+}
+
+static const u1 *findByteInit(const u1 *p, Word n, u1 c) {
+  byteArrayKernels();
+  return __atomic_load_n(&findByte, __ATOMIC_RELAXED)(p, n, c);
+}
+
+WordInt compareByteArrays(Closure *arr1, Word offset1, Closure *arr2,
+                          Word offset2, Word n) {
+  LC_ASSERT(offset1 + n <= ((ByteArrayClosure *)arr1)->bytes_);
+  LC_ASSERT(offset2 + n <= ((ByteArrayClosure *)arr2)->bytes_);
+  return __atomic_load_n(&compareBytes, __ATOMIC_RELAXED)(
+      bytes(arr1, offset1), bytes(arr2, offset2), n);
+}
+
+WordInt findByteArray(Closure *arr, Word offset, Word n, Word value) {
+  LC_ASSERT(offset + n <= ((ByteArrayClosure *)arr)->bytes_);
+  const u1 *start = bytes(arr, 0);
+  const u1 *p = __atomic_load_n(&findByte, __ATOMIC_RELAXED)(
+      start + offset, n, (u1)value);
+  return p != NULL ? (WordInt)(p - start) : -1;
+}
+
+_END_LAMBDACHINE_NAMESPACE
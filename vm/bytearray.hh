@@ -0,0 +1,54 @@
+#ifndef _BYTEARRAY_H_
+#define _BYTEARRAY_H_
+
+#include "common.hh"
+#include "objects.hh"
+
+_START_LAMBDACHINE_NAMESPACE
+
+// --- Bulk byte array operations -------------------------------------
+//
+// The COPYBYTEA, SETBYTEA, CMPBYTEA and FINDBYTEA bytecodes work on
+// whole ranges of a ByteArrayClosure.  The helpers below implement
+// them for the interpreter and are called directly from traces (see
+// IRCALLDEF).  Offsets and lengths are in bytes.  Like GETA/SETA the
+// caller must make sure that all ranges are within bounds.
+//
+// Copying and filling use memmove and memset, whose C library
+// versions already pick SSE2/AVX2 code at load time.  Comparison and
+// search use the vector kernels in bytearray.cc, which are selected
+// with CPUID on first use.
+
+// Copy [srcOffset, srcOffset + n) of `src' to `dst'.  The ranges may
+// overlap.
+void copyByteArray(Closure *src, Word srcOffset, Closure *dst,
+                   Word dstOffset, Word n);
+
+// Set [offset, offset + n) to the low byte of `value'.
+void setByteArray(Closure *arr, Word offset, Word n, Word value);
+
+// Lexicographic unsigned comparison.  Returns -1, 0, or 1.
+WordInt compareByteArrays(Closure *arr1, Word offset1, Closure *arr2,
+                          Word offset2, Word n);
+
+// The index (relative to the start of the array) of the first
+// occurrence of the low byte of `value' in [offset, offset + n), or -1.
+WordInt findByteArray(Closure *arr, Word offset, Word n, Word value);
+
+enum {
+  BYTEARRAY_KERNELS_SCALAR,
+  BYTEARRAY_KERNELS_SSE2,
+  BYTEARRAY_KERNELS_AVX2
+};
+
+// The best kernels supported by the CPU.
+int detectByteArrayKernels();
+
+// The kernels used by the helpers above.  Can be overridden, e.g., to
+// test the fallbacks, but not beyond what the CPU supports.
+int byteArrayKernels();
+void setByteArrayKernels(int kernels);
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _BYTEARRAY_H_ */
@@ -213,6 +213,32 @@ const BcIns *BcIns::debugPrint(ostream &out, const BcIns *ins,
       printInlineBitmaps(out, ins - 1);
     }
     break;
+    case kCCALL:
+    case kCCALLS: {
+      u4 info = ins->raw();
+      ++ins;
+      const u1 *arg = (const u1 *)ins;
+      ins += BC_ROUND(i.c());
+      out << i.name() << "\tr" << (int)i.a() << " = ";
+      if (code != NULL)
+        code->printLiteral(out, info & 0xffff);
+      else
+        out << "#" << (info & 0xffff);
+      char comma = '(';
+      for (u4 j = 0; j < i.c(); j++) {
+        out << comma << 'r' << (int)arg[j];
+        comma = ',';
+      }
+      if (i.c() == 0) out << '(';
+      out << ") sig " << hex << (info >> 16) << dec;
+      if (i.opcode() == kCCALLS) {
+        ++ins;
+        printInlineBitmaps(out, ins - 1);
+      } else {
+        out << endl;
+      }
+    }
+    break;
     case kCALLT: {
       u4 bitmask = *(u4 *)ins;
       ++ins;
@@ -227,7 +253,64 @@ const BcIns *BcIns::debugPrint(ostream &out, const BcIns *ins,
       out << ')' << endl;
     }
     break;
+    case kADDZ:
+    case kSUBZ:
+    case kMULZ:
+    case kQUOTZ:
+    case kREMZ:
+    case kSHLZ:
+    case kSHRZ:
+      out << i.name() << "\tr" << (int)i.a() << ", r" << (int)i.b()
+          << ", r" << (int)i.c();
+      ++ins;  // skip bitmap
+      printInlineBitmaps(out, ins - 1);
+      break;
+    case kI2Z:
+    case kFORK:
+    case kCATCH:
+    case kTAKEMVAR:
+    case kPUTMVAR:
+      out << i.name() << "\tr" << (int)i.a() << ", r" << (int)i.d();
+      ++ins;  // skip bitmap
+      printInlineBitmaps(out, ins - 1);
+      break;
+    case kHWRITEBA: {
+      const u1 *arg = (const u1 *)ins;
+      ++ins;
+      out << i.name() << "\tr" << (int)i.a() << ", r" << (int)i.b()
+          << ", r" << (int)i.c() << ", r" << (int)arg[0]
+          << ", r" << (int)arg[1] << endl;
+    }
+    break;
+    case kCOPYARR:
+    case kCOPYBYTEA:
+    case kSETBYTEA:
+    case kCMPBYTEA:
+    case kFINDBYTEA: {
+      // Operands after rC are in the next word.
+      int nargs = i.opcode() == kSETBYTEA ? 1 :
+        (i.opcode() == kCMPBYTEA ? 3 : 2);
+      const u1 *arg = (const u1 *)ins;
+      ++ins;
+      out << i.name() << "\tr" << (int)i.a() << ", r" << (int)i.b()
+          << ", r" << (int)i.c();
+      for (int n = 0; n < nargs; ++n)
+        out << ", r" << (int)arg[n];
+      out << endl;
+    }
+    break;
+    case kNEWMVAR:
+      out << i.name() << "\tr" << (int)i.a();
+      ++ins;
+      printInlineBitmaps(out, ins - 1);
+      break;
+    case kYIELD:
+      out << i.name();
+      ++ins;
+      printInlineBitmaps(out, ins - 1);
+      break;
     case kFUNCPAP:
+    case kUNDERFLOW:
     case kSTOP:
       out << i.name() << endl;
       break;
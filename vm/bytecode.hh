@@ -19,6 +19,19 @@ _START_LAMBDACHINE_NAMESPACE
   _(ISGEU,   RRJ) \
   _(ISLEU,   RRJ) \
   _(ISGTU,   RRJ) \
+  /* Floating point comparisons (Double#, then Float#), order significant */ \
+  _(ISLTD,   RRJ) \
+  _(ISGED,   RRJ) \
+  _(ISLED,   RRJ) \
+  _(ISGTD,   RRJ) \
+  _(ISEQD,   RRJ) \
+  _(ISNED,   RRJ) \
+  _(ISLTF,   RRJ) \
+  _(ISGEF,   RRJ) \
+  _(ISLEF,   RRJ) \
+  _(ISGTF,   RRJ) \
+  _(ISEQF,   RRJ) \
+  _(ISNEF,   RRJ) \
   /* Unary ops */ \
   _(NEG,     RR) \
   /* Updates */ \
@@ -36,6 +49,13 @@ _START_LAMBDACHINE_NAMESPACE
   _(MULRR,   RRR) \
   _(DIVRR,   RRR) \
   _(REMRR,   RRR) \
+  /* Overflow checks.  The result of the operation itself is */ \
+  /* computed by ADDRR, SUBRR, or MULRR. */ \
+  _(ADDOV,   RRR) /* rA = 1 if rB + rC overflows (signed), else 0 */ \
+  _(SUBOV,   RRR) /* rA = 1 if rB - rC overflows (signed), else 0 */ \
+  _(MULOV,   RRR) /* rA = 1 if rB * rC overflows (signed), else 0 */ \
+  _(ADDCU,   RRR) /* rA = carry of rB + rC (unsigned) */ \
+  _(MULHU,   RRR) /* rA = high word of rB * rC (unsigned) */ \
   /* Comparisons ops producing an integer */ \
   _(CMPLT,   RRR) \
   _(CMPGE,   RRR) \
@@ -57,6 +77,30 @@ _START_LAMBDACHINE_NAMESPACE
   _(BSAR,    RRR) \
   _(BROL,    RRR) \
   _(BROR,    RRR) \
+  _(POPCNT,  RR) /* rA = number of set bits in rD */ \
+  _(CLZ,     RR) /* rA = leading zero bits of rD (64 if rD == 0) */ \
+  _(CTZ,     RR) /* rA = trailing zero bits of rD (64 if rD == 0) */ \
+  _(BSWAP,   RR) /* rA = rD with the byte order reversed */ \
+  _(PDEP,    RRR) /* rA = deposit low bits of rB at mask rC */ \
+  _(PEXT,    RRR) /* rA = extract bits of rB at mask rC */ \
+  /* Floating point arithmetic (Double#, then Float#) */ \
+  _(ADDD,    RRR) \
+  _(SUBD,    RRR) \
+  _(MULD,    RRR) \
+  _(DIVD,    RRR) \
+  _(NEGD,    RR) \
+  _(ADDF,    RRR) \
+  _(SUBF,    RRR) \
+  _(MULF,    RRR) \
+  _(DIVF,    RRR) \
+  _(NEGF,    RR) \
+  /* Conversions.  Float to integer truncates towards zero. */ \
+  _(I2D,     RR) \
+  _(D2I,     RR) \
+  _(I2F,     RR) \
+  _(F2I,     RR) \
+  _(F2D,     RR) \
+  _(D2F,     RR) \
   /* Primops */ \
   _(PTROFSC, RRR) /* indexCharOffAddr# :: Addr# -> Int# -> Char# */ \
   _(GETTAG,  RR) /* dataToTag# :: a -> Int# */ \
@@ -79,6 +123,7 @@ _START_LAMBDACHINE_NAMESPACE
   _(CASE_S,  ___) \
   /* Exception stuff */ \
   _(RAISE,   R) \
+  _(CATCH,   ___) /* run the IO action in rA with handler rD */ \
   /* Arrays */ \
   _(NEWBYTEA, RRN) \
   _(GETA1, RRR) /* u1 x = arr[offs] */ \
@@ -89,6 +134,47 @@ _START_LAMBDACHINE_NAMESPACE
   _(SETA2, RRR) /* arr[offs] = (u2)x */ \
   _(SETA4, RRR) /* arr[offs] = (u4)x */ \
   _(SETA8, RRR) /* arr[offs] = (u8)x */ \
+  /* Boxed arrays (see ArrayClosure).  NEWARR does not trigger a GC. */ \
+  _(NEWARR,  RRR) /* rA = new mutable array of rB elements, all rC */ \
+  _(READARR, RRR) /* rA = rB[rC] */ \
+  _(WRITEARR, RRR) /* rB[rC] = rA */ \
+  _(SIZEARR, RR)  /* rA = number of elements of rD */ \
+  _(FREEZEARR, RR) /* rA = rD, made immutable in place */ \
+  _(THAWARR, RR)  /* rA = rD, made mutable in place */ \
+  _(COPYARR, ___) /* copy rE elements from rA[rB] to rC[rD]; */ \
+                  /* rD and rE are in the next word */ \
+  /* Bulk byte array operations (see bytearray.hh).  Operands */ \
+  /* after rC are in the next word. */ \
+  _(COPYBYTEA, ___) /* copy rE bytes from rA[rB] to rC[rD] */ \
+  _(SETBYTEA, ___) /* set rC bytes of rA from rB on to rD */ \
+  _(CMPBYTEA, ___) /* rA = compare rF bytes of rB[rC] and rD[rE] */ \
+  _(FINDBYTEA, ___) /* rA = index of byte rE in rD bytes of rB[rC], or -1 */ \
+  /* Integer primops, see integer.hh.  The allocating ones are */ \
+  /* followed by a live-outs bitmap. */ \
+  _(ADDZ,    ___) /* rA = rB + rC */ \
+  _(SUBZ,    ___) /* rA = rB - rC */ \
+  _(MULZ,    ___) /* rA = rB * rC */ \
+  _(QUOTZ,   ___) /* rA = rB `quot` rC */ \
+  _(REMZ,    ___) /* rA = rB `rem` rC */ \
+  _(SHLZ,    ___) /* rA = rB `shiftL` rC  (rC :: Int#) */ \
+  _(SHRZ,    ___) /* rA = rB `shiftR` rC  (rC :: Int#) */ \
+  _(I2Z,     ___) /* rA = toInteger rD  (rD :: Int#) */ \
+  _(CMPZ,    RRR) /* rA = compare rB rC  (-1, 0, 1 :: Int#) */ \
+  _(Z2I,     RR)  /* rA = fromInteger rD :: Int# */ \
+  /* Foreign function calls, see ffi.hh.  CCALLS is followed by a */ \
+  /* live-outs bitmap. */ \
+  _(CCALL,   ___) /* rA = unsafe call of a C function */ \
+  _(CCALLS,  ___) /* rA = safe call of a C function */ \
+  /* Buffered output, see io.hh.  rA = 0, or -1 on error. */ \
+  _(HOPEN,   RRR) /* rA = new handle for file rB (C string), mode rC */ \
+  _(HCLOSE,  RR)  /* close handle rD */ \
+  _(HFLUSH,  RR)  /* flush handle rD */ \
+  _(HPUTC,   RRR) /* write Char rC to handle rB */ \
+  _(HPUTS,   RRR) /* write C string rC to handle rB */ \
+  _(HWRITEBA, ___) /* write rE bytes of rC[rD] to handle rB; */ \
+                   /* rD and rE are in the next word */ \
+  _(MAPFILE, RRR) /* rB = read-only byte array mapping file rC */ \
+                  /* (C string); empty on error */ \
   /* Function headers */ \
   _(FUNC,    R) \
   _(IFUNC,   R) \
@@ -96,6 +182,15 @@ _START_LAMBDACHINE_NAMESPACE
   _(FUNCPAP, ___) \
   _(JRET,    RN) \
   _(IRET,    RN) \
+  /* Threads */ \
+  _(FORK,    ___) /* fork the IO action in rD, result ThreadId in rA */ \
+  _(YIELD,   ___) \
+  _(NEWMVAR, ___) /* rA = new empty MVar */ \
+  _(TAKEMVAR, ___) /* rA = takeMVar rD */ \
+  _(PUTMVAR, ___) /* putMVar rA rD */ \
+  /* Parallelism */ \
+  _(SPARK,   R) /* par#: evaluate rA in parallel, maybe */ \
+  _(UNDERFLOW, ___) \
   _(SYNC, ___) \
   _(STOP, ___)
 
@@ -190,6 +285,14 @@ class BcIns {
     return BcIns(n);
   }
 
+  /**
+   * The second word of CCALL and CCALLS.  See ffi.hh.
+   */
+  static inline BcIns foreignCallInfo(uint16_t litid, uint16_t sig) {
+    return BcIns(static_cast<uint32_t>(litid) |
+                 (static_cast<uint32_t>(sig) << 16));
+  }
+
   static inline BcIns args(uint8_t arg1, uint8_t arg2, uint8_t arg3,
                            uint8_t arg4) {
     LC_ASSERT(arch::kEndianness == arch::ENDIAN_LITTLE);
@@ -3,10 +3,18 @@
 #include "thread.hh"
 #include "objects.hh"
 #include "miscclosures.hh"
+#include "integer.hh"
+#include "bytearray.hh"
+#include "ffi.hh"
 #include "time.hh"
+#include "utils.hh"
+#include "io.hh"
+#include "loader.hh"
 
 #include <iomanip>
+#include <algorithm>
 #include <string.h>
+#include <sched.h>
 
 _START_LAMBDACHINE_NAMESPACE
 
@@ -25,21 +33,149 @@ using namespace std;
 static BcIns reload_state_code[1] = { BcIns::ad(BcIns::kSYNC, 0, 0) };
 
 Capability::Capability(MemoryManager *mm)
-  : mm_(mm), currentThread_(NULL),
-    static_roots_(NULL),
+  : mm_(mm), currentThread_(NULL), mainThread_(NULL),
+    sparks_(kSparkPoolSizeLog2),
     reload_state_pc_(&reload_state_code[0]),
     counters_(HOT_THRESHOLD), // TODO: initialise from Options
-    flags_() {
+    recordingStart_(0), flags_(), nursery_(NULL), topOfStackMask_(MemoryManager::kNoMask),
+    attached_(0), prevCurrent_(NULL) {
+  memset(&sparkStats_, 0, sizeof(sparkStats_));
   interpMsg(kModeInit);
+  mm_->registerCapability(this);
 }
 
 Capability::~Capability() {
+  LC_ASSERT(attached_ == 0);
+  mm_->unregisterCapability(this);
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->destroy();
+    delete threads_[i];
+  }
+}
+
+static __thread Capability *current_capability = NULL;
+
+Capability *Capability::current() {
+  return current_capability;
+}
+
+void Capability::attach() {
+  if (attached_++ == 0) {
+    mm_->attachCapability();
+    prevCurrent_ = current_capability;
+    current_capability = this;
+  }
 }
 
+void Capability::detach() {
+  LC_ASSERT(attached_ > 0);
+  if (--attached_ == 0) {
+    mm_->detachCapability();
+    current_capability = prevCurrent_;
+  }
+}
+
+// Runs T until it stops.  Other threads are run whenever T yields or
+// blocks.  Threads that are still runnable when T stops are resumed
+// by the next call to run().
 bool Capability::run(Thread *T) {
   LC_ASSERT(T != NULL);
+  LC_ASSERT(mainThread_ == NULL);
+  attach();
+  currentThread_ = T;
+  mainThread_ = T;
+  threads_.push_back(T);
+  bool ok = interpMsg(kModeRun) == kInterpOk;
+  threads_.erase(std::find(threads_.begin(), threads_.end(), T));
+  mainThread_ = NULL;
   currentThread_ = T;
-  return interpMsg(kModeRun) == kInterpOk;
+  detach();
+  return ok;
+}
+
+Thread *Capability::forkThread(Closure *action) {
+  Thread *parent = currentThread_;
+  Thread *T = Thread::createForkedThread(this, parent->chunkWords_, action);
+  T->setMaxStackSize(parent->maxStackSize());
+  threads_.push_back(T);
+  runQueue_.push_back(T);
+  return T;
+}
+
+void Capability::blockOn(MVarClosure *mvar, Thread *T) {
+  T->link_ = NULL;
+  if (mvar->tail_ != NULL)
+    mvar->tail_->link_ = T;
+  else
+    mvar->head_ = T;
+  mvar->tail_ = T;
+}
+
+// Move all threads blocked on the MVar to the run queue.  Each of
+// them retries its MVar operation when it runs next, and blocks again
+// if the MVar is (again) in the wrong state.  Waking only the first
+// thread is not enough, because the queue may contain both takers and
+// putters.
+void Capability::wakeUp(MVarClosure *mvar) {
+  Thread *T = mvar->head_;
+  while (T != NULL) {
+    Thread *next = T->link_;
+    T->link_ = NULL;
+    runQueue_.push_back(T);
+    T = next;
+  }
+  mvar->head_ = NULL;
+  mvar->tail_ = NULL;
+}
+
+void Capability::finishThread(Thread *T) {
+  LC_ASSERT(T != mainThread_);
+  threads_.erase(std::find(threads_.begin(), threads_.end(), T));
+  T->destroy();
+  delete T;
+}
+
+// Called by a thread that found a blackhole and has nothing else to
+// do.  Detaches the capability for a moment so that a GC requested by
+// the owner of the blackhole can proceed.  The caller must have synced
+// its state.
+void Capability::waitForBlackhole() {
+  LC_ASSERT(attached_ > 0);
+  mm_->detachCapability();
+  sched_yield();
+  mm_->attachCapability();
+}
+
+// Pop frames off the stack of T, starting with the frame at `base',
+// until `base' is the innermost catch frame.  Thunks under evaluation
+// are overwritten to raise the exception again.  Returns false and
+// leaves `base' at the bottom frame if there is no catch frame.  See
+// "Exceptions" in capability.hh.
+bool Capability::unwindStack(Thread *T, Word *&base, Closure *exception) {
+  for (;;) {
+    Closure *node = (Closure *)base[-1];
+    if (node == MiscClosures::stg_CATCH_closure_addr)
+      return true;
+    if (node == MiscClosures::stg_STOP_closure_addr ||
+        node == MiscClosures::stg_FORK_closure_addr ||
+        base < T->stack_ + FRAME_SIZE || base[-3] == 0)
+      return false;
+    if (node == MiscClosures::stg_UPD_closure_addr) {
+      Closure *updatee = untag(base[0]);
+      ClosureType type = updatee->info()->type();
+      if (type == THUNK || type == BLACKHOLE) {
+        // Other capabilities may be waiting for the blackhole, so
+        // the info table must be written last.
+        updatee->setPayload(0, (Word)exception);
+        __atomic_store_n(&updatee->header_.info_, MiscClosures::stg_RAISE_info,
+                         __ATOMIC_RELEASE);
+        mm_->writeBarrier(updatee);
+      }
+    } else if (node == MiscClosures::stg_UNDERFLOW_closure_addr) {
+      T->popStackChunk();
+    }
+    base = (Word *)base[-3];
+  }
 }
 
 bool Capability::eval(Thread *T, Closure *cl) {
@@ -78,15 +214,29 @@ Capability::interpBranch(BcIns *srcPc, BcIns *dstPc,
       Fragment *F = jit_.traceAt(dstPc);
       if (F != NULL) {
 
+        // Don't enter traces while another capability waits for us
+        // to stop.  The next call is a safepoint.
+        if (LC_UNLIKELY(MemoryManager::safepointRequested()))
+          return dstPc;
+
+        // Traces check the stack limit only at the end of the loop.
+        // Make sure it has enough room until then.  After a return
+        // the results are still above T->top_, so we can only move
+        // the current frame at a call.
+        if (LC_UNLIKELY(base > T->traceStackLimit()) &&
+            (branchType != kCall ||
+             !growStack(T, base, T->top(), Thread::kTraceStackReserve)))
+          return dstPc;
+
         // Enter the trace.
         if (DEBUG_COMPONENTS & DEBUG_TRACE_RECORDER) {
           cerr << COL_YELLOW << "TRACE: " << dstPc << COL_RESET << endl;
         }
 
         T->sync(dstPc, base);
-        ++switch_interp_to_asm;
+        LC_STAT_INC(switch_interp_to_asm);
         asmEnter(F->traceId(), T, (Word *)heap, (Word*)heaplim,
-                 T->stackLimit() - 200, F->entry());
+                 T->traceStackLimit(), F->entry());
         heap = (char *)traceExitHp_;
         heaplim = (char *)traceExitHpLim_;
 
@@ -106,7 +256,8 @@ Capability::interpBranch(BcIns *srcPc, BcIns *dstPc,
         return pc;
 
       } else if (counters_.tick(dstPc) &&
-                 dstPc != MiscClosures::stg_UPD_return_pc) {
+                 dstPc != MiscClosures::stg_UPD_return_pc &&
+                 dstPc != MiscClosures::stg_UNDERFLOW_return_pc) {
         currentThread_->sync(dstPc, base);
 
         if (DEBUG_COMPONENTS & DEBUG_TRACE_RECORDER) {
@@ -136,23 +287,22 @@ Capability::interpBranch(BcIns *srcPc, BcIns *dstPc,
 }
 
 Time record_time = 0;
-Time recording_start = 0;
 uint64_t recordings_started = 0;
 uint64_t switch_interp_to_asm = 0;
 
 void Capability::setState(int state) {
   switch (state) {
   case STATE_INTERP:
-    if (recording_start != 0) {
-      record_time += getProcessElapsedTime() - recording_start;
-      recording_start = 0;
+    if (recordingStart_ != 0) {
+      LC_STAT_ADD(record_time, getProcessElapsedTime() - recordingStart_);
+      recordingStart_ = 0;
     }
     dispatch_ = dispatch_normal_;
     flags_.clear(kRecording);
     break;
   case STATE_RECORD:
-    ++recordings_started;
-    recording_start = getProcessElapsedTime();
+    LC_STAT_INC(recordings_started);
+    recordingStart_ = getProcessElapsedTime();
     dispatch_ = dispatch_record_;
     flags_.set(kRecording);
     break;
@@ -167,6 +317,8 @@ void Capability::finishRecording() {
   setState(STATE_INTERP);
 }
 
+static const u4 kStackHeadroom = FRAME_SIZE + 1;
+
 static inline
 bool stackOverflow(Thread *T, Word *top, u4 increment) {
   // The implementation of EVAL currently needs to simulate a return
@@ -174,8 +326,28 @@ bool stackOverflow(Thread *T, Word *top, u4 increment) {
   // the returned function (i.e., the frame is now unused), we need to
   // make sure this stack space is valid even if we did not just
   // return from a function.
-  u4 headroom = FRAME_SIZE + 1;
-  return T->stackLimit() < (top + increment + headroom);
+  return T->stackLimit() < (top + increment + kStackHeadroom);
+}
+
+// The end of the current frame, which contains at least `nargs'
+// arguments.
+static inline
+Word *frameTop(Thread *T, Word *base, u4 nargs) {
+  Word *top = base + nargs;
+  return T->top() > top ? T->top() : top;
+}
+
+// Move the current frame, which extends from base[-3] up to
+// `frametop', into a new stack chunk with room for `increment' more
+// words.  Returns false if the stack has reached its maximum size.
+bool Capability::growStack(Thread *T, Word *&base, Word *frametop,
+                           u4 increment) {
+  if (!T->growStack(&base, &frametop, increment + kStackHeadroom))
+    return false;
+  T->top_ = frametop;
+  // The recorder tracks frames by their absolute addresses.
+  if (isRecording()) jit_.requestAbort();
+  return true;
 }
 
 // NOTE: Does not check for stack overflow.
@@ -190,6 +362,21 @@ void pushFrame(Word **top, Word **base, BcIns *ret, Closure *clos,
   *top = *base + framesize;
 }
 
+// Blackhole a thunk (see "Blackholing" in objects.hh).  Returns false
+// if another thread is evaluating it, or has just updated it.
+static inline
+bool claimThunk(Closure *node, CodeInfoTable *info) {
+  if (info->type() == BLACKHOLE)
+    return false;
+  if (info->type() != THUNK || info->blackholeInfo() == NULL)
+    return true;
+  return node->tryClaim(info, info->blackholeInfo());
+}
+
+Word claimThunkFromTrace(Closure *node, InfoTable *info) {
+  return claimThunk(node, static_cast<CodeInfoTable *>(info));
+}
+
 extern Word *traceDebugLastHp;
 
 static const int kStackFrameWords = 3;
@@ -226,9 +413,10 @@ Capability::InterpExitCode Capability::interpMsg(InterpMode mode) {
   Word *base;
   BcIns *pc;
   u4 opA, opB, opC, opcode;
+  u4 nresults = 0;  // number of return results, used by UNDERFLOW
   char *heap;
   char *heaplim;
-  mm_->getBumpAllocatorBounds(&heap, &heaplim);
+  mm_->getBumpAllocatorBounds(nursery_, &heap, &heaplim);
   // Technically, we only need a pointer to the literals.  But having
   // a pointer to the whole code segment can be useful for debugging.
   const Code *code = NULL;
@@ -384,6 +572,90 @@ op_ISNE:
     pc += (pc - 1)->j();
   DISPATCH_NEXT;
 
+op_ISLTD:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2d(base[opA]) < lc_w2d(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISGED:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2d(base[opA]) >= lc_w2d(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISLED:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2d(base[opA]) <= lc_w2d(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISGTD:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2d(base[opA]) > lc_w2d(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISEQD:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2d(base[opA]) == lc_w2d(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISNED:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2d(base[opA]) != lc_w2d(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISLTF:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2f(base[opA]) < lc_w2f(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISGEF:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2f(base[opA]) >= lc_w2f(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISLEF:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2f(base[opA]) <= lc_w2f(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISGTF:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2f(base[opA]) > lc_w2f(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISEQF:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2f(base[opA]) == lc_w2f(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
+op_ISNEF:
+  DECODE_AD;
+  ++pc;
+  if (lc_w2f(base[opA]) != lc_w2f(base[opC]))
+    pc += (pc - 1)->j();
+  DISPATCH_NEXT;
+
 op_NEG:
   DECODE_AD;
   base[opA] = -(WordInt)base[opC];
@@ -405,7 +677,7 @@ op_LOADF:
   // C = field offset, 1-based indexed!  TODO: fix this
   {
     DECODE_BC;
-    Closure *cl = (Closure *)base[opB];
+    Closure *cl = untag(base[opB]);
     base[opA] = cl->payload(opC - 1);
     DISPATCH_NEXT;
   }
@@ -448,6 +720,37 @@ op_REMRR:
   base[opA] = (WordInt)base[opB] % (WordInt)base[opC];
   DISPATCH_NEXT;
 
+op_ADDOV: {
+    DECODE_BC;
+    WordInt r;
+    base[opA] = addOverflows(base[opB], base[opC], &r) ? 1 : 0;
+    DISPATCH_NEXT;
+  }
+
+op_SUBOV: {
+    DECODE_BC;
+    WordInt r;
+    base[opA] = subOverflows(base[opB], base[opC], &r) ? 1 : 0;
+    DISPATCH_NEXT;
+  }
+
+op_MULOV: {
+    DECODE_BC;
+    WordInt r;
+    base[opA] = mulOverflows(base[opB], base[opC], &r) ? 1 : 0;
+    DISPATCH_NEXT;
+  }
+
+op_ADDCU:
+  DECODE_BC;
+  base[opA] = (Word)base[opB] + (Word)base[opC] < (Word)base[opB] ? 1 : 0;
+  DISPATCH_NEXT;
+
+op_MULHU:
+  DECODE_BC;
+  base[opA] = mulHighWord(base[opB], base[opC]);
+  DISPATCH_NEXT;
+
 op_CMPLT:
   DECODE_BC;
   base[opA] = (WordInt)base[opB] < (WordInt)base[opC] ? 1 : 0;
@@ -549,6 +852,116 @@ op_BROR: {
     DISPATCH_NEXT;
   }
 
+op_POPCNT:
+  DECODE_AD;
+  base[opA] = wordPopCount(base[opC]);
+  DISPATCH_NEXT;
+
+op_CLZ:
+  DECODE_AD;
+  base[opA] = wordClz(base[opC]);
+  DISPATCH_NEXT;
+
+op_CTZ:
+  DECODE_AD;
+  base[opA] = wordCtz(base[opC]);
+  DISPATCH_NEXT;
+
+op_BSWAP:
+  DECODE_AD;
+  base[opA] = wordByteSwap(base[opC]);
+  DISPATCH_NEXT;
+
+op_PDEP:
+  DECODE_BC;
+  base[opA] = wordPdep(base[opB], base[opC]);
+  DISPATCH_NEXT;
+
+op_PEXT:
+  DECODE_BC;
+  base[opA] = wordPext(base[opB], base[opC]);
+  DISPATCH_NEXT;
+
+op_ADDD:
+  DECODE_BC;
+  base[opA] = lc_d2w(lc_w2d(base[opB]) + lc_w2d(base[opC]));
+  DISPATCH_NEXT;
+
+op_SUBD:
+  DECODE_BC;
+  base[opA] = lc_d2w(lc_w2d(base[opB]) - lc_w2d(base[opC]));
+  DISPATCH_NEXT;
+
+op_MULD:
+  DECODE_BC;
+  base[opA] = lc_d2w(lc_w2d(base[opB]) * lc_w2d(base[opC]));
+  DISPATCH_NEXT;
+
+op_DIVD:
+  DECODE_BC;
+  base[opA] = lc_d2w(lc_w2d(base[opB]) / lc_w2d(base[opC]));
+  DISPATCH_NEXT;
+
+op_NEGD:
+  DECODE_AD;
+  base[opA] = lc_d2w(-lc_w2d(base[opC]));
+  DISPATCH_NEXT;
+
+op_ADDF:
+  DECODE_BC;
+  base[opA] = lc_f2w(lc_w2f(base[opB]) + lc_w2f(base[opC]));
+  DISPATCH_NEXT;
+
+op_SUBF:
+  DECODE_BC;
+  base[opA] = lc_f2w(lc_w2f(base[opB]) - lc_w2f(base[opC]));
+  DISPATCH_NEXT;
+
+op_MULF:
+  DECODE_BC;
+  base[opA] = lc_f2w(lc_w2f(base[opB]) * lc_w2f(base[opC]));
+  DISPATCH_NEXT;
+
+op_DIVF:
+  DECODE_BC;
+  base[opA] = lc_f2w(lc_w2f(base[opB]) / lc_w2f(base[opC]));
+  DISPATCH_NEXT;
+
+op_NEGF:
+  DECODE_AD;
+  base[opA] = lc_f2w(-lc_w2f(base[opC]));
+  DISPATCH_NEXT;
+
+op_I2D:
+  DECODE_AD;
+  base[opA] = lc_d2w((double)(WordInt)base[opC]);
+  DISPATCH_NEXT;
+
+op_D2I:
+  DECODE_AD;
+  base[opA] = (Word)(WordInt)lc_w2d(base[opC]);
+  DISPATCH_NEXT;
+
+op_I2F:
+  DECODE_AD;
+  base[opA] = lc_f2w((float)(WordInt)base[opC]);
+  DISPATCH_NEXT;
+
+op_F2I:
+  DECODE_AD;
+  base[opA] = (Word)(WordInt)lc_w2f(base[opC]);
+  DISPATCH_NEXT;
+
+op_F2D:
+  DECODE_AD;
+  base[opA] = lc_d2w((double)lc_w2f(base[opC]));
+  DISPATCH_NEXT;
+
+op_D2F:
+  DECODE_AD;
+  base[opA] = lc_f2w((float)lc_w2d(base[opC]));
+  DISPATCH_NEXT;
+
 op_PTROFSC:
   DECODE_BC;
   base[opA] = ((char*)base[opB])[(WordInt)base[opC]];
@@ -561,6 +974,13 @@ op_PTROFSC:
     goto heapOverflow; \
   }
 
+  // Must be used after the allocation succeeded (a failed heap check
+  // retries the instruction) and before pc is moved past the
+  // instruction's arguments.
+# define COUNT_ALLOC(bytes) \
+  if (LC_UNLIKELY(flags_.get(kProfileAlloc))) \
+    allocProfile_.count(((Closure *)base[-1])->info(), pc - 1, (bytes))
+
 op_ALLOC1:
   // A = target
   // B = itbl
@@ -569,6 +989,7 @@ op_ALLOC1:
     DECODE_BC;
     Closure *cl = (Closure *)heap;
     BUMP_HEAP(1);
+    COUNT_ALLOC(2 * sizeof(Word));
     ++pc;
     cl->setInfo((InfoTable *)base[opB]);
     cl->setPayload(0, base[opC]);
@@ -587,6 +1008,7 @@ op_ALLOC:
     const u1 *arg = (const u1 *)pc;
 
     BUMP_HEAP(opC);
+    COUNT_ALLOC((1 + opC) * sizeof(Word));
     cl->setInfo((InfoTable *)base[opB]);
     for (u4 i = 0; i < opC; ++i) {
       // cerr << "payload[" << i << "]=base[" << (int)*arg << "] ("
@@ -616,6 +1038,7 @@ op_ALLOCAP:
 
     Closure *cl = (Closure *)heap;
     BUMP_HEAP(nargs + 1);
+    COUNT_ALLOC((2 + nargs) * sizeof(Word));
     cl->setInfo(MiscClosures::getApInfo(nargs, pointerMask));
     for (u4 i = 0; i < nargs + 1; ++i, ++args) {
       cl->setPayload(i, base[*args]);
@@ -637,9 +1060,42 @@ heapOverflow:
   T->sync(pc, base);
   DLOG("Heap Block Overflow: %p of %p\n", heap, heaplim);
   mm_->bumpAllocatorFull(&heap, &heaplim, this);
+  // A heap check is also our preemption point.  The allocation is
+  // retried when the thread runs next.
+  if (!runQueue_.empty()) {
+    runQueue_.push_back(T);
+    goto schedule;
+  }
   // re-dispatch last instruction
   DISPATCH_NEXT;
 
+schedule:
+  // Switch to the next runnable thread.  The old thread must have
+  // been synced and put into the run queue or an MVar queue, or have
+  // finished.
+  if (isRecording()) jit_.requestAbort();
+  if (runQueue_.empty()) {
+    mm_->sync(nursery_, heap, heaplim);
+    cerr << "\nERROR: thread blocked indefinitely in an MVar operation\n";
+    return kInterpDeadlock;
+  }
+  currentThread_ = runQueue_.front();
+  runQueue_.pop_front();
+  LOAD_STATE_FROM_CAP;
+  if (isEnabledBytecodeTracing())
+    dispatch = dispatch_debug;
+  if (T->blackhole_ != NULL) {
+    // Retry the EVAL that found the blackhole.
+    base[pc->a()] = (Word)T->blackhole_;
+    T->blackhole_ = NULL;
+  }
+  // A thread that yielded (or has just been forked) continues after
+  // the YIELD.  All other threads retry their last instruction.
+  if (pc->opcode() == BcIns::kYIELD)
+    pc += 2;
+  code = ((CodeInfoTable *)((Closure *)base[-1])->info())->code();
+  DISPATCH_NEXT;
+
 op_JMP:
   // Offsets are relative to the current PC which points to the
   // following instruction.  Hence, "JMP 0" is a no-op, "JMP -1" is an
@@ -657,29 +1113,61 @@ op_EVAL:
   //  +-----------+-----------+
   //
   {
-    Closure *tnode = (Closure *)base[opA];
+    // A tagged pointer is known to point to a constructor.
+    if (ptrTag(base[opA]) != 0) {
+      T->top_[FRAME_SIZE] = base[opA];
+      ++pc;  // skip live-out info
+      DISPATCH_NEXT;
+    }
+
+    Closure *tnode = untag(base[opA]);
 
     LC_ASSERT(tnode != NULL);
     LC_ASSERT(mm_->looksLikeClosure(tnode));
 
     while (tnode->isIndirection()) {
-      tnode = (Closure *)tnode->payload(0);
+      tnode = untag(tnode->payload(0));
     }
 
     LC_ASSERT(tnode->info() != MiscClosures::stg_IND_info);
 
     if (tnode->isHNF()) {
-      T->top_[FRAME_SIZE] = (Word)tnode;
+      T->top_[FRAME_SIZE] = tagPointer(tnode);
       ++pc;  // skip live-out info
       DISPATCH_NEXT;
     } else {
       CodeInfoTable *info = static_cast<CodeInfoTable *>(tnode->info());
+
+      if (LC_UNLIKELY(mm_->isShared()) && !claimThunk(tnode, info)) {
+        // Another thread is evaluating the thunk.  Wait until it has
+        // been updated, then retry.  The thunk may not be live after
+        // the EVAL, so the GC finds it via T->blackhole_.
+        T->sync(pc - 1, base);
+        T->blackhole_ = tnode;
+        if (isRecording()) jit_.requestAbort();
+        mm_->sync(nursery_, heap, heaplim);
+        waitForBlackhole();
+        mm_->getBumpAllocatorBounds(nursery_, &heap, &heaplim);
+        if (!runQueue_.empty()) {
+          runQueue_.push_back(T);
+          goto schedule;
+        }
+        base[opA] = (Word)T->blackhole_;
+        T->blackhole_ = NULL;
+        --pc;
+        DISPATCH_NEXT;
+      }
+
       u4 framesize = info->code()->framesize;
       Word *top = T->top();
 
       if (stackOverflow(T, top, kStackFrameWords + kUpdateFrameWords
-                        + framesize))
-        goto stack_overflow;
+                        + framesize)) {
+        if (!growStack(T, base, top, kStackFrameWords + kUpdateFrameWords
+                       + framesize))
+          goto stack_overflow;
+        top = T->top();
+      }
 
       Word *top_orig = top;
 
@@ -692,7 +1180,7 @@ op_EVAL:
       LC_ASSERT(base == top_orig + kStackFrameWords + kUpdateFrameWords);
       LC_ASSERT(top == base + framesize);
       T->top_ = top;
-      code = info->code();
+      code = Loader::entryCode(info);
 
       opC = 0;                  // No arguments.
       BRANCH_TO(code->code, kCall);
@@ -710,12 +1198,15 @@ op_LOADK: {
 op_RET1:
   DECODE_AD;
   base[0] = base[opA];
+  nresults = 1;
+  goto do_return;
 
 op_RETN:
   // Arguments are already in place.  We only add some sanity checks
   // here.
   DECODE_AD;
   LC_ASSERT(&base[opA] <= T->top_);
+  nresults = opA;
 
 do_return: {
     T->top_ = base - 3;
@@ -735,27 +1226,63 @@ do_return: {
 
 op_IRET:
   base[0] = base[opA];
+  nresults = 1;
   goto do_return;
 
+op_UNDERFLOW: {
+    // We returned to the underflow frame at the bottom of the current
+    // stack chunk.  Copy the results to the frame of the real caller
+    // and return to it.  See "Stack Chunks" in thread.hh.
+    Word *callerTop = (Word *)base[0];
+    for (u4 i = 0; i < nresults; ++i)
+      callerTop[FRAME_SIZE + i] = T->top_[FRAME_SIZE + i];
+    T->popStackChunk();
+    T->top_ = callerTop;
+    BcIns *dst_pc = (BcIns *)base[-2];
+    base = (Word *)base[-3];
+    {
+      Closure *node = (Closure *)base[-1];
+      LC_ASSERT(mm_->looksLikeClosure(node));
+      CodeInfoTable *info = static_cast<CodeInfoTable *>(node->info());
+      code = info->code();
+      LC_ASSERT(code->code < dst_pc && dst_pc < code->code + code->sizecode);
+    }
+    opC = dst_pc->d();
+    BRANCH_TO(dst_pc, kReturn);
+  }
+
 op_UPDATE: {
-    Closure *oldnode = (Closure *)base[opA];
+    Closure *oldnode = untag(base[opA]);
     Closure *newnode = (Closure *)base[opC];
     InfoTable *info = oldnode->info();
     LC_ASSERT(oldnode != NULL && mm_->looksLikeClosure(oldnode));
-    LC_ASSERT(newnode != NULL && mm_->looksLikeClosure(newnode));
-
-    LC_ASSERT(!oldnode->isHNF());
+    LC_ASSERT(newnode != NULL && mm_->looksLikeClosure(untag(newnode)));
+
+    // Two threads can only both evaluate the same node if it was
+    // never claimed: while blackholing is off (a single capability,
+    // whose green threads may still interleave), for CAFs, or if the
+    // first evaluation started before blackholing was switched on.
+    // A thread that loses a claim race waits instead (see op_EVAL).
+    // If the other thread updated the node first, it is an
+    // indirection, or, if the GC has already removed the indirection,
+    // a value.  Keep the first result.
+    if (LC_UNLIKELY(oldnode->isHNF() || oldnode->isIndirection())) {
+      DISPATCH_NEXT;
+    }
 
     // cerr << "UPDATING: " << oldnode << " (" << oldnode->info()->name() << ") with "
     //      << newnode << " (" << newnode->info()->name() << ")\n";
 
-    oldnode->setInfo(MiscClosures::stg_IND_info);
     oldnode->setPayload(0, (Word)newnode);
-
     if (info->type() == CAF) {
-      oldnode->setPayload(1, (Word)static_roots_);
-      static_roots_ = oldnode;
+      oldnode->setPayload(1, (Word)info);
+      static_roots_.push_back(oldnode);
     }
+    // Another capability may be looking at the node, so the info
+    // table must be written last.
+    __atomic_store_n(&oldnode->header_.info_, MiscClosures::stg_IND_info,
+                     __ATOMIC_RELEASE);
+    mm_->writeBarrier(oldnode);
 
     DISPATCH_NEXT;
   }
@@ -784,7 +1311,7 @@ op_CALL: {
     top = T->top();
 
     while (fnode->isIndirection()) {
-      fnode = (Closure *)fnode->payload(0);
+      fnode = untag(fnode->payload(0));
     }
 
     LC_ASSERT(fnode != NULL);
@@ -793,14 +1320,18 @@ op_CALL: {
     LC_ASSERT(fnode->info()->type() == FUN ||
               fnode->info()->type() == CAF ||
               fnode->info()->type() == THUNK ||
+              fnode->info()->type() == BLACKHOLE ||
               fnode->info()->type() == PAP);
 
     CodeInfoTable *info = (CodeInfoTable *)fnode->info();
 
     DLOG("   ENTER: %s\n", info->name());
 
-    if (stackOverflow(T, top, kStackFrameWords + nargs))
-      goto stack_overflow;
+    if (stackOverflow(T, top, kStackFrameWords + nargs)) {
+      if (!growStack(T, base, top, kStackFrameWords + nargs))
+        goto stack_overflow;
+      top = T->top();
+    }
 
     // Each additional argument requires 1 byte, we pad to multiples
     // of an instruction.  The liveness mask follows.
@@ -843,12 +1374,13 @@ op_CALLT: {
     LC_ASSERT(callargs <= BcIns::kMaxCallArgs);
 
     while (fnode->isIndirection()) {
-      fnode = (Closure *)fnode->payload(0);
+      fnode = untag(fnode->payload(0));
     }
 
     LC_ASSERT(fnode->info()->type() == FUN ||
               fnode->info()->type() == CAF ||
               fnode->info()->type() == THUNK ||
+              fnode->info()->type() == BLACKHOLE ||
               fnode->info()->type() == PAP);
 
     // TODO: Remove indirections or make them callable, same for
@@ -859,7 +1391,8 @@ op_CALLT: {
     DLOG("   ENTER: %s\n", info->name());
 
     if (stackOverflow(T, base, nargs)) {
-      goto stack_overflow;
+      if (!growStack(T, base, frameTop(T, base, nargs), nargs))
+        goto stack_overflow;
     }
 
     // Arguments are already in place.  Just dispatch to target.
@@ -906,7 +1439,8 @@ op_CASE:
   //
   {
     const BcIns *this_pc = pc - 1;
-    Closure *cl = (Closure *)base[opA];
+    Word clp = base[opA];
+    Closure *cl = untag(clp);
     u2 num_cases = opC;
     u2 *table = (u2 *)pc;
     pc += (num_cases + 1) >> 1;
@@ -914,7 +1448,7 @@ op_CASE:
     LC_ASSERT(mm_->looksLikeClosure(cl));
     LC_ASSERT(cl->info()->type() == CONSTR);
 
-    u2 tag = cl->tag() - 1;  // tags start at 1
+    u2 tag = constructorTag(clp) - 1;  // tags start at 1
 
     if (!(tag < num_cases)) {
       cerr << "tag = " << tag << ", num_cases = " << num_cases << endl;
@@ -942,6 +1476,14 @@ op_SYNC:
   DISPATCH_NEXT;
 
 op_JFUNC: {
+    // See interpBranch.  If the stack cannot grow, or another
+    // capability waits for us to stop, we just run the function in
+    // the interpreter.
+    if (LC_UNLIKELY(MemoryManager::safepointRequested()) ||
+        (LC_UNLIKELY(base > T->traceStackLimit()) &&
+         !growStack(T, base, T->top(), Thread::kTraceStackReserve))) {
+      DISPATCH_NEXT;
+    }
     Fragment *F = jit_.lookupFragment(pc - 1);
     T->sync(pc - 1, base);
     //    traceDebugLastHp = (Word *)heap;
@@ -949,10 +1491,10 @@ op_JFUNC: {
     cerr << "Entering trace " << F->traceId() << endl;
 #endif
     LC_ASSERT(F->startPc() == pc - 1);
-    ++switch_interp_to_asm;
+    LC_STAT_INC(switch_interp_to_asm);
     asmEnter(F->traceId(), T,
              (Word *)heap, (Word *)heaplim,
-             T->stackLimit() - 200, F->entry());
+             T->traceStackLimit(), F->entry());
     heap = (char *)traceExitHp_;
     heaplim = (char *)traceExitHpLim_;
 
@@ -968,10 +1510,53 @@ op_JFUNC: {
     DISPATCH_NEXT;
   }
 
- op_RAISE:
-  {
-    fprintf(stderr, "Exception raised. BAD!\n");
-    exit(3);
+op_RAISE: {
+    // A = the exception.
+    Closure *exception = (Closure *)base[opA];
+    if (LC_UNLIKELY(!unwindStack(T, base, exception))) {
+      T->sync(pc - 1, base);
+      cerr << "Uncaught exception: ";
+      printClosure(cerr, untag(exception), true);
+      cerr << endl;
+      if (T != mainThread_) {
+        finishThread(T);
+        goto schedule;
+      }
+      mm_->sync(nursery_, heap, heaplim);
+      return kInterpUncaughtException;
+    }
+    // Call the handler in place of the catch frame.
+    base[2] = base[0];
+    base[0] = (Word)exception;
+    base[1] = 0;  // State# token
+    T->top_ = base + MiscClosures::CATCH_frame_size;
+    code = static_cast<CodeInfoTable *>
+      (MiscClosures::stg_CATCH_closure_addr->info())->code();
+    pc = MiscClosures::stg_CATCH_handler_pc;
+    DISPATCH_NEXT;
+  }
+
+op_CATCH: {
+    // A = the IO action, D = the handler.  Followed by live-outs
+    // bitmap.
+    const u4 framesize = MiscClosures::CATCH_frame_size;
+    Word *top = T->top();
+    if (stackOverflow(T, top, kStackFrameWords + framesize)) {
+      if (!growStack(T, base, top, kStackFrameWords + framesize))
+        goto stack_overflow;
+      top = T->top();
+    }
+    Word action = base[opA];
+    Word handler = base[opC];
+    pushFrame(&top, &base, pc + 1,  // skip live-out info
+              MiscClosures::stg_CATCH_closure_addr, framesize);
+    base[0] = handler;
+    base[1] = action;
+    base[2] = 0;  // State# token
+    T->top_ = top;
+    code = static_cast<CodeInfoTable *>
+      (MiscClosures::stg_CATCH_closure_addr->info())->code();
+    BRANCH_TO(code->code, kCall);
   }
 
 op_LOADBH:
@@ -984,7 +1569,7 @@ op_LOADBH:
 op_INITF:
   {
     DECODE_BC;
-    Closure *cl = (Closure *)base[opA];
+    Closure *cl = untag(base[opA]);
     cl->setPayload(opC - 1, base[opB]);
     DISPATCH_NEXT;
   }
@@ -992,8 +1577,7 @@ op_INITF:
 op_GETTAG:
   {
     DECODE_AD;
-    Closure *cl = (Closure *)base[opC];
-    base[opA] = cl->tag() - 1;
+    base[opA] = constructorTag(base[opC]) - 1;
     DISPATCH_NEXT;
   }
 
@@ -1016,8 +1600,7 @@ op_CASE_S:
   {
     // Sparse CASE.
     DECODE_AD;
-    Closure *cl = (Closure *)base[opA];
-    uint32_t tag = cl->tag();
+    uint32_t tag = constructorTag(base[opA]);
     uint32_t num_cases = opC;
     uint32_t minMax = ((uint32_t *)pc)[0];
     uint32_t min_tag = minMax & 0xffff;
@@ -1063,10 +1646,8 @@ op_CASE_S:
     // Word flags = opC;
     Word payloadSizeWords = roundUpBytesToWords(payloadSizeBytes);
 
-    ByteArrayClosure *cl = (ByteArrayClosure*)mm_->allocLarge
-      (sizeof(ByteArrayClosure) + payloadSizeWords * sizeof(Word));
-    cl->header_.info_ = MiscClosures::stg_BYTEARR_info;
-    cl->bytes_ = payloadSizeBytes;
+    ByteArrayClosure *cl = mm_->allocByteArray(payloadSizeBytes);
+    COUNT_ALLOC(sizeof(ByteArrayClosure) + payloadSizeWords * sizeof(Word));
 
     base[opA] = (Word)cl;
     DISPATCH_NEXT;
@@ -1110,23 +1691,438 @@ op_CASE_S:
 
 #undef SETA
 
+ op_NEWARR:
+  // rA = result
+  // rB = number of elements
+  // rC = initial value of all elements
+  {
+    DECODE_BC;
+    Word ptrs = base[opB];
+    ArrayClosure *arr = mm_->allocArray(ptrs, (Closure *)base[opC]);
+    COUNT_ALLOC(ArrayClosure::allocBytes(ptrs));
+    base[opA] = (Word)arr;
+    DISPATCH_NEXT;
+  }
+
+ op_READARR:
+  {
+    DECODE_BC;
+    ArrayClosure *arr = (ArrayClosure *)base[opB];
+    Word i = base[opC];
+    LC_ASSERT(arr && arr->info()->type() == ARRAY);
+    LC_ASSERT(i < arr->ptrs_);
+    base[opA] = (Word)arr->payload_[i];
+    DISPATCH_NEXT;
+  }
+
+ op_WRITEARR:
+  {
+    DECODE_BC;
+    ArrayClosure *arr = (ArrayClosure *)base[opB];
+    Word i = base[opC];
+    LC_ASSERT(arr && arr->info() == MiscClosures::stg_MUT_ARR_info);
+    LC_ASSERT(i < arr->ptrs_);
+    arr->payload_[i] = (Closure *)base[opA];
+    MemoryManager::arrayWriteBarrier(arr, i);
+    DISPATCH_NEXT;
+  }
+
+ op_SIZEARR:
+  {
+    DECODE_AD;
+    base[opA] = ((ArrayClosure *)base[opC])->ptrs_;
+    DISPATCH_NEXT;
+  }
+
+ op_FREEZEARR:
+  // The array may still point into the young generation, so its
+  // cards are left alone.
+  {
+    DECODE_AD;
+    ArrayClosure *arr = (ArrayClosure *)base[opC];
+    arr->header_.info_ = MiscClosures::stg_ARR_info;
+    base[opA] = (Word)arr;
+    DISPATCH_NEXT;
+  }
+
+ op_THAWARR:
+  {
+    DECODE_AD;
+    ArrayClosure *arr = (ArrayClosure *)base[opC];
+    arr->header_.info_ = MiscClosures::stg_MUT_ARR_info;
+    base[opA] = (Word)arr;
+    DISPATCH_NEXT;
+  }
+
+ op_COPYARR:
+  // A = source array, B = source offset, C = destination array
+  // next word: destination offset, number of elements
+  {
+    DECODE_BC;
+    const u1 *arg = (const u1 *)pc;
+    ++pc;
+    copyArray((Closure *)base[opA], base[opB], (Closure *)base[opC],
+              base[arg[0]], base[arg[1]]);
+    DISPATCH_NEXT;
+  }
+
+op_COPYBYTEA:
+  // A = source array, B = source offset, C = destination array
+  // next word: destination offset, number of bytes
+  {
+    DECODE_BC;
+    const u1 *arg = (const u1 *)pc;
+    ++pc;
+    copyByteArray((Closure *)base[opA], base[opB], (Closure *)base[opC],
+                  base[arg[0]], base[arg[1]]);
+    DISPATCH_NEXT;
+  }
+
+op_SETBYTEA:
+  // A = array, B = offset, C = number of bytes
+  // next word: value
+  {
+    DECODE_BC;
+    const u1 *arg = (const u1 *)pc;
+    ++pc;
+    setByteArray((Closure *)base[opA], base[opB], base[opC], base[arg[0]]);
+    DISPATCH_NEXT;
+  }
+
+op_CMPBYTEA:
+  // A = result, B = first array, C = first offset
+  // next word: second array, second offset, number of bytes
+  {
+    DECODE_BC;
+    const u1 *arg = (const u1 *)pc;
+    ++pc;
+    base[opA] = (Word)compareByteArrays((Closure *)base[opB], base[opC],
+                                        (Closure *)base[arg[0]],
+                                        base[arg[1]], base[arg[2]]);
+    DISPATCH_NEXT;
+  }
+
+op_FINDBYTEA:
+  // A = result, B = array, C = offset
+  // next word: number of bytes, byte to find
+  {
+    DECODE_BC;
+    const u1 *arg = (const u1 *)pc;
+    ++pc;
+    base[opA] = (Word)findByteArray((Closure *)base[opB], base[opC],
+                                    base[arg[0]], base[arg[1]]);
+    DISPATCH_NEXT;
+  }
+
+  // Integer primops.  The result box is allocated up front, so that a
+  // small result never needs more than the heap check.  If the result
+  // turns out to be big, the box is given back.
+#define INTEGER_OP(name, smallop, helper) \
+  op_##name: { \
+    DECODE_BC; \
+    Closure *box = (Closure *)heap; \
+    BUMP_HEAP(1); \
+    Closure *x = untag(base[opB]); \
+    Closure *y = untag(base[opC]); \
+    Closure *res; \
+    WordInt k; \
+    if (isSmallInteger(x) && isSmallInteger(y) && \
+        !smallop(smallIntegerValue(x), smallIntegerValue(y), &k)) { \
+      res = setSmallInteger(box, k); \
+    } else { \
+      res = helper(mm_, x, y, box); \
+      if (res != box) heap -= 2 * sizeof(Word); \
+    } \
+    COUNT_ALLOC(integerAllocBytes(res)); \
+    base[opA] = (Word)res; \
+    ++pc; \
+    DISPATCH_NEXT; \
+  }
+
+  INTEGER_OP(ADDZ, addOverflows, integerAdd)
+  INTEGER_OP(SUBZ, subOverflows, integerSub)
+  INTEGER_OP(MULZ, mulOverflows, integerMul)
+  INTEGER_OP(QUOTZ, quotOverflows, integerQuot)
+  INTEGER_OP(REMZ, remOverflows, integerRem)
+
+#undef INTEGER_OP
+
+op_SHLZ: {
+    DECODE_BC;
+    Closure *box = (Closure *)heap;
+    BUMP_HEAP(1);
+    Closure *x = untag(base[opB]);
+    WordInt n = (WordInt)base[opC];
+    Closure *res;
+    WordInt k;
+    if (isSmallInteger(x) && !shlOverflows(smallIntegerValue(x), n, &k)) {
+      res = setSmallInteger(box, k);
+    } else {
+      res = integerShl(mm_, x, n, box);
+      if (res != box) heap -= 2 * sizeof(Word);
+    }
+    COUNT_ALLOC(integerAllocBytes(res));
+    base[opA] = (Word)res;
+    ++pc;
+    DISPATCH_NEXT;
+  }
+
+op_SHRZ: {
+    DECODE_BC;
+    Closure *box = (Closure *)heap;
+    BUMP_HEAP(1);
+    Closure *x = untag(base[opB]);
+    WordInt n = (WordInt)base[opC];
+    Closure *res;
+    if (isSmallInteger(x)) {
+      res = setSmallInteger(box, shrSmallInteger(smallIntegerValue(x), n));
+    } else {
+      res = integerShr(mm_, x, n, box);
+      if (res != box) heap -= 2 * sizeof(Word);
+    }
+    COUNT_ALLOC(integerAllocBytes(res));
+    base[opA] = (Word)res;
+    ++pc;
+    DISPATCH_NEXT;
+  }
+
+op_I2Z: {
+    // A = result, D = Int#.  Followed by live-outs bitmap.
+    Closure *box = (Closure *)heap;
+    BUMP_HEAP(1);
+    COUNT_ALLOC(2 * sizeof(Word));
+    base[opA] = (Word)setSmallInteger(box, (WordInt)base[opC]);
+    ++pc;
+    DISPATCH_NEXT;
+  }
+
+op_CMPZ: {
+    DECODE_BC;
+    Closure *x = untag(base[opB]);
+    Closure *y = untag(base[opC]);
+    if (isSmallInteger(x) && isSmallInteger(y))
+      base[opA] = (Word)compareSmallIntegers(smallIntegerValue(x),
+                                             smallIntegerValue(y));
+    else
+      base[opA] = (Word)integerCompare(x, y);
+    DISPATCH_NEXT;
+  }
+
+op_Z2I: {
+    DECODE_AD;
+    Closure *x = untag(base[opC]);
+    if (isSmallInteger(x))
+      base[opA] = (Word)smallIntegerValue(x);
+    else
+      base[opA] = (Word)integerToInt(x);
+    DISPATCH_NEXT;
+  }
+
+op_HOPEN:
+  // A = result, B = path, C = mode
+  DECODE_BC;
+  base[opA] = (Word)HandleTable::open((const char *)base[opB], base[opC]);
+  DISPATCH_NEXT;
+
+op_HCLOSE:
+  DECODE_AD;
+  base[opA] = HandleTable::close(base[opC]) ? 0 : (Word)-1;
+  DISPATCH_NEXT;
+
+op_HFLUSH: {
+    DECODE_AD;
+    Handle *hd = HandleTable::get(base[opC]);
+    base[opA] = hd != NULL && hd->flush() ? 0 : (Word)-1;
+    DISPATCH_NEXT;
+  }
+
+op_HPUTC: {
+    DECODE_BC;
+    Handle *hd = HandleTable::get(base[opB]);
+    base[opA] = hd != NULL && hd->putChar((u4)base[opC]) ? 0 : (Word)-1;
+    DISPATCH_NEXT;
+  }
+
+op_HPUTS: {
+    DECODE_BC;
+    Handle *hd = HandleTable::get(base[opB]);
+    const char *str = (const char *)base[opC];
+    base[opA] = hd != NULL && hd->write(str, strlen(str)) ? 0 : (Word)-1;
+    DISPATCH_NEXT;
+  }
+
+op_HWRITEBA:
+  // A = result, B = handle, C = array
+  // next word: offset, number of bytes
+  {
+    DECODE_BC;
+    const u1 *arg = (const u1 *)pc;
+    ++pc;
+    Handle *hd = HandleTable::get(base[opB]);
+    ByteArrayClosure *arr = (ByteArrayClosure *)base[opC];
+    Word ofs = base[arg[0]], n = base[arg[1]];
+    LC_ASSERT(ofs + n <= arr->bytes_);
+    base[opA] = hd != NULL && hd->write((const u1 *)arr->payload_ + ofs, n)
+      ? 0 : (Word)-1;
+    DISPATCH_NEXT;
+  }
+
+op_MAPFILE: {
+    // A = result, B = array, C = path
+    DECODE_BC;
+    ByteArrayClosure *arr = mm_->mapFile((const char *)base[opC]);
+    base[opA] = arr != NULL ? 0 : (Word)-1;
+    if (arr == NULL)
+      arr = mm_->allocByteArray(0);
+    base[opB] = (Word)arr;
+    DISPATCH_NEXT;
+  }
+
+op_CCALL:
+op_CCALLS:
+  // A = result, C = number of arguments
+  // next word: literal id of the function, signature
+  // followed by the argument registers (and live-outs bitmap)
+  {
+    DECODE_BC;
+    u4 info = pc->raw();
+    u2 lit_id = info & 0xffff;
+    u2 sig = info >> 16;
+    LC_ASSERT(lit_id < code->sizelits);
+    LC_ASSERT(code->littypes[lit_id] == LIT_CFUNC);
+    const void *func = (const void *)code->lits[lit_id];
+    const u1 *arg = (const u1 *)(pc + 1);
+    Word args[kFfiMaxArgs];
+    LC_ASSERT(opC <= kFfiMaxArgs);
+    for (u4 i = 0; i < opC; ++i)
+      args[i] = base[arg[i]];
+    Word result;
+    // While recording, a safe call is made like an unsafe one (as in
+    // the trace), because the recorder doesn't expect objects to move.
+    if (opcode == BcIns::kCCALLS && !isRecording()) {
+      T->sync(pc - 1, base);
+      mm_->sync(nursery_, heap, heaplim);
+      mm_->detachCapability();
+      result = ffiCall(func, sig, opC, args);
+      mm_->attachCapability();
+      mm_->getBumpAllocatorBounds(nursery_, &heap, &heaplim);
+    } else {
+      result = ffiCall(func, sig, opC, args);
+    }
+    if (ffiResultType(sig) != FFI_VOID)
+      base[opA] = result;
+    pc += 1 + BC_ROUND(opC) + (opcode == BcIns::kCCALLS ? 1 : 0);
+    DISPATCH_NEXT;
+  }
+
 op_KINT:
 op_NEW_INT:
 op_JRET:
   cerr << "\nERROR: Unimplemented instruction: " << (pc - 1)->name() << endl;
   // not_yet_implemented:
   T->sync(pc, base);
-  mm_->sync(heap, heaplim);
+  mm_->sync(nursery_, heap, heaplim);
   return kInterpUnimplemented;
 
+op_FORK: {
+    // A = result (a ThreadId), D = the IO action to run.
+    // Followed by live-outs bitmap.
+    Closure *tid = (Closure *)heap;
+    BUMP_HEAP(1);
+    COUNT_ALLOC(2 * sizeof(Word));
+    Thread *child = forkThread(untag(base[opC]));
+    tid->setInfo(MiscClosures::stg_THREADID_info);
+    tid->setPayload(0, child->id());
+    base[opA] = (Word)tid;
+    ++pc;
+    DISPATCH_NEXT;
+  }
+
+op_YIELD:
+  // Followed by live-outs bitmap.
+  if (runQueue_.empty()) {
+    ++pc;
+    DISPATCH_NEXT;
+  }
+  T->sync(pc - 1, base);
+  runQueue_.push_back(T);
+  goto schedule;
+
+op_NEWMVAR: {
+    // A = result.  Followed by live-outs bitmap.
+    MVarClosure *mvar = (MVarClosure *)heap;
+    BUMP_HEAP(wordsof(MVarClosure) - 1);
+    COUNT_ALLOC(sizeof(MVarClosure));
+    mvar->init(MiscClosures::stg_MVAR_info,
+               MiscClosures::stg_NO_VALUE_closure_addr);
+    base[opA] = (Word)mvar;
+    ++pc;
+    DISPATCH_NEXT;
+  }
+
+  // An MVar operation that blocks is retried when the thread is woken
+  // up.  Its bitmap must therefore include its operands.
+op_TAKEMVAR: {
+    // A = result, D = MVar.  Followed by live-outs bitmap.
+    MVarClosure *mvar = (MVarClosure *)untag(base[opC]);
+    LC_ASSERT(mvar->info()->type() == MVAR);
+    if (mvar->value_ == MiscClosures::stg_NO_VALUE_closure_addr) {
+      T->sync(pc - 1, base);
+      blockOn(mvar, T);
+      goto schedule;
+    }
+    base[opA] = (Word)mvar->value_;
+    mvar->value_ = MiscClosures::stg_NO_VALUE_closure_addr;
+    wakeUp(mvar);
+    ++pc;
+    DISPATCH_NEXT;
+  }
+
+op_PUTMVAR: {
+    // A = MVar, D = value.  Followed by live-outs bitmap.
+    MVarClosure *mvar = (MVarClosure *)untag(base[opA]);
+    LC_ASSERT(mvar->info()->type() == MVAR);
+    if (mvar->value_ != MiscClosures::stg_NO_VALUE_closure_addr) {
+      T->sync(pc - 1, base);
+      blockOn(mvar, T);
+      goto schedule;
+    }
+    mvar->value_ = (Closure *)base[opC];
+    mm_->writeBarrier((Closure *)mvar);
+    wakeUp(mvar);
+    ++pc;
+    DISPATCH_NEXT;
+  }
+
+op_SPARK: {
+    // A = closure to evaluate in parallel.
+    Word p = base[opA];
+    Closure *cl = untag(p);
+    if (ptrTag(p) == 0 && cl->info()->type() == THUNK) {
+      if (sparks_.push(cl))
+        ++sparkStats_.created;
+      else
+        ++sparkStats_.overflowed;
+    } else {
+      ++sparkStats_.dud;
+    }
+    DISPATCH_NEXT;
+  }
+
 op_STOP:
   T->sync(pc, base);
-  mm_->sync(heap, heaplim);
+  if (T != mainThread_) {
+    // A forked thread has finished.
+    finishThread(T);
+    goto schedule;
+  }
+  mm_->sync(nursery_, heap, heaplim);
+  HandleTable::flushAll();
   return kInterpOk;
 
 stack_overflow:
   T->sync(pc, base);
-  mm_->sync(heap, heaplim);
+  mm_->sync(nursery_, heap, heaplim);
   cerr << "\nERROR: Stack overflow.\n";
   return kInterpStackOverflow;
 
@@ -1174,7 +2170,8 @@ generic_apply: {
 
       u4 framesize = papArgs + given_args;
       if (stackOverflow(T, base, framesize)) {
-        goto stack_overflow;
+        if (!growStack(T, base, frameTop(T, base, given_args), framesize))
+          goto stack_overflow;
       }
       T->top_ = base + framesize;
 
@@ -1197,7 +2194,8 @@ generic_apply: {
       goto generic_apply_retry;
     }
     case THUNK:
-    case CAF: {
+    case CAF:
+    case BLACKHOLE: {
       //  1. Turn all current arguments into APK.
       BcIns *apk_return_addr = NULL;
       Closure *apk_closure = NULL;
@@ -1205,15 +2203,30 @@ generic_apply: {
                               given_args, pointer_mask);
       uint32_t apk_framesize = MiscClosures::apContFrameSize(given_args);
       base[-1] = (Word)apk_closure;
-      Word *top = &base[apk_framesize];
       const CodeInfoTable *info = (CodeInfoTable *)fnode->info();
-      code = info->code();
+      code = Loader::entryCode(info);
 
-      if (stackOverflow(T, base, apk_framesize + kStackFrameWords +
-                        kUpdateFrameWords + kStackFrameWords +
-                        code->framesize))
+      u4 needed = apk_framesize + kStackFrameWords + kUpdateFrameWords +
+        kStackFrameWords + code->framesize;
+      if (stackOverflow(T, base, needed) &&
+          !growStack(T, base, frameTop(T, base, given_args), needed))
         goto stack_overflow;
 
+      Word *top = &base[apk_framesize];
+
+      if (LC_UNLIKELY(mm_->isShared()) &&
+          (info->type() == BLACKHOLE ||
+           (info->type() == THUNK && info->blackholeInfo() != NULL))) {
+        // The thunk must be blackholed.  Let EVAL deal with that.
+        pushFrame(&top, &base, apk_return_addr,
+                  MiscClosures::stg_EVAL_closure_addr, 1);
+        base[0] = (Word)fnode;
+        T->top_ = top;
+        code = ((CodeInfoTable *)MiscClosures::stg_EVAL_closure_addr->info())
+          ->code();
+        BRANCH_TO(code->code, kCall);
+      }
+
       pushFrame(&top, &base, apk_return_addr,
                 MiscClosures::stg_UPD_closure_addr, 2);
       // 2. Setup update frame.
@@ -1229,7 +2242,7 @@ generic_apply: {
     case FUN: {
       const CodeInfoTable *info = (CodeInfoTable *)fnode->info();
       uint32_t arity = info->code()->arity;
-      code = info->code();
+      code = Loader::entryCode(info);
 
       if (LC_UNLIKELY(arity < given_args)) {
 
@@ -1250,7 +2263,9 @@ generic_apply: {
         //
         u4 extra_args = given_args - arity;
         u4 apk_frame_size = MiscClosures::apContFrameSize(extra_args) + 3;
-        if (stackOverflow(T, base, apk_frame_size + given_args))
+        if (stackOverflow(T, base, apk_frame_size + given_args) &&
+            !growStack(T, base, frameTop(T, base, given_args),
+                       apk_frame_size + given_args))
           goto stack_overflow;
 
         // We could do some clever swapping scheme here, but it
@@ -1285,9 +2300,9 @@ generic_apply: {
           // top of stack pointer mask, though, so the GC really only
           // needs the correct base pointer.
           T->sync(pc, base);
-          mm_->setTopOfStackMask(pointer_mask);
+          topOfStackMask_ = pointer_mask;
           mm_->bumpAllocatorFull(&heap, &heaplim, this);
-          mm_->setTopOfStackMask(MemoryManager::kNoMask);  // Reset mask.
+          topOfStackMask_ = MemoryManager::kNoMask;  // Reset mask.
 
           // Try again.
           pap = (PapClosure *)heap;
@@ -1301,10 +2316,24 @@ generic_apply: {
         }
 
         base[0] = (Word)pap;
+        nresults = 1;
         goto do_return;
       }
 
+      if (stackOverflow(T, base, code->framesize) &&
+          !growStack(T, base, frameTop(T, base, given_args),
+                     code->framesize))
+        goto stack_overflow;
       T->top_ = base + code->framesize;
+      if (LC_UNLIKELY(MemoryManager::safepointRequested())) {
+        // Another capability waits for us to stop.  Calls are our
+        // safepoints, because every loop contains one.
+        if (isRecording()) jit_.requestAbort();
+        T->sync(pc, base);
+        topOfStackMask_ = pointer_mask;
+        mm_->safepoint(this, &heap, &heaplim);
+        topOfStackMask_ = MemoryManager::kNoMask;
+      }
       BRANCH_TO(code->code, kCall);
     }
     default:
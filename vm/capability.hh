@@ -5,6 +5,11 @@
 #include "vm.hh"
 #include "memorymanager.hh"
 #include "jit.hh"
+#include "allocprofile.hh"
+#include "wsdeque.hh"
+
+#include <vector>
+#include <deque>
 
 _START_LAMBDACHINE_NAMESPACE
 
@@ -22,16 +27,113 @@ public:
   inline Thread *currentThread() { return currentThread_; }
 
   inline void enableBytecodeTracing() { flags_.set(kTraceBytecode); }
+  inline void disableBytecodeTracing() { flags_.clear(kTraceBytecode); }
   inline bool isEnabledBytecodeTracing() const {
     return flags_.get(kTraceBytecode);
   }
   inline void enableDecodeClosures() { flags_.set(kDecodeClosures); }
 
+  // Count allocations per allocation site, both in the interpreter
+  // and in traces compiled from now on.
+  inline void enableAllocProfiling() {
+    flags_.set(kProfileAlloc);
+    jit_.setOption(Jit::kOptAllocProfile, true);
+  }
+  inline bool isEnabledAllocProfiling() const {
+    return flags_.get(kProfileAlloc);
+  }
+  inline const AllocProfile &allocProfile() const { return allocProfile_; }
+
+  // --- Threads ---
+  //
+  // A capability runs any number of lightweight threads.  Threads that
+  // are ready to run wait in the run queue, threads blocked on an MVar
+  // wait in the MVar's queue.  Context switches only happen in the
+  // interpreter: when the current heap block is full (the allocation
+  // is retried when the thread is resumed), at YIELD, and when a
+  // thread blocks on an MVar (the MVar operation is retried).  At each
+  // of these points the live registers of the thread are described by
+  // the instruction's bitmap, so the GC can treat the stacks of all
+  // threads as roots.
+
+  // Create a new thread that runs the IO action and add it to the run
+  // queue.
+  Thread *forkThread(Closure *action);
+  // All threads of this capability, including blocked threads.
+  inline const std::vector<Thread *> &threads() const { return threads_; }
+  inline size_t runQueueLength() const { return runQueue_.size(); }
+
+  // --- Exceptions ---
+  //
+  // CATCH pushes a catch frame (node stg_CATCH, see miscclosures.hh)
+  // that calls the IO action and returns its result.  On the normal
+  // path a catch frame is just another stack frame.  RAISE unwinds
+  // the stack up to the innermost catch frame and tail-calls its
+  // handler with the exception.  Each update frame on the way
+  // overwrites its thunk with a stg_RAISE thunk that raises the same
+  // exception again when it is evaluated.  CAFs are left alone, so
+  // they simply get re-evaluated.  An exception without a catch frame
+  // ends the thread (and run() returns false for the main thread).
+  // Traces stop at a RAISE and leave the unwinding to the
+  // interpreter.
+
+  // --- Capabilities ---
+  //
+  // Several capabilities may share a MemoryManager (and thus the
+  // heap, the loaded code and the compiled traces), each driven by its
+  // own OS thread.  A capability must only ever be used by one OS
+  // thread at a time.  Each capability has its own threads, run
+  // queue, nursery block, hot counters and trace recorder.  Threads
+  // and MVars cannot (yet) be shared between capabilities.  Thunks are
+  // blackholed while they are evaluated (see "Blackholing" in
+  // objects.hh), so capabilities may share unevaluated thunks.
+  //
+  // run() attaches the capability to the heap while it executes
+  // Haskell code.  Heap objects may be moved by a GC of another
+  // capability at any time the capability is not attached.  To look
+  // at results after run() returns (e.g., to print them), wrap both
+  // the run() and the inspection in attach()/detach().  Calls may be
+  // nested.
+  void attach();
+  void detach();
+  inline bool isAttached() const { return attached_ > 0; }
+  // The capability attached on the calling OS thread, or NULL.
+  static Capability *current();
+  // True if EVAL must blackhole thunks, i.e., other capabilities may
+  // enter the same thunks.
+  inline bool isBlackholing() const { return mm_->isShared(); }
+  inline MemoryManager *memoryManager() const { return mm_; }
+
+  // --- Sparks ---
+  //
+  // SPARK pushes a thunk onto the spark pool of the capability that
+  // executes it.  Spark workers (see sparks.hh) take sparks from the
+  // pools of all capabilities and evaluate them.  A spark is only a
+  // hint: it is dropped if the pool is full, and it fizzles if its
+  // thunk is evaluated (or being evaluated) by the time a worker or
+  // the GC looks at it.
+  typedef struct {
+    uint64_t created;     // pushed onto the pool
+    uint64_t dud;         // not a thunk when sparked
+    uint64_t overflowed;  // dropped because the pool was full
+    uint64_t converted;   // evaluated by a spark worker
+    uint64_t fizzled;     // evaluated by someone else first
+  } SparkStats;
+
+  // Take a spark from this capability's pool.  Only the capability's
+  // own OS thread may call this.
+  inline bool popSpark(Closure **spark) { return sparks_.pop(spark); }
+  inline long sparkPoolSize() const { return sparks_.size(); }
+  inline SparkStats &sparkStats() { return sparkStats_; }
+
   inline bool run() { return run(currentThread_); }
   // Eval given closure using current thread.
   bool eval(Thread *, Closure *);
   bool run(Thread *);
-  inline Closure *staticRoots() const { return static_roots_; }
+  // CAFs that have been updated with their value.  Each CAF's
+  // original info table is saved in its second payload word, so that
+  // the GC can revert CAFs that are no longer reachable.
+  inline std::vector<Closure *> &staticRoots() { return static_roots_; }
   inline bool isRecording() const {
     return flags_.get(kRecording);
   }
@@ -61,7 +163,9 @@ private:
     kInterpOk = 0,
     kInterpOutOfSteps,
     kInterpStackOverflow,
-    kInterpUnimplemented
+    kInterpUnimplemented,
+    kInterpDeadlock,
+    kInterpUncaughtException
   } InterpExitCode;
 
   typedef void *AsmFunction;
@@ -77,11 +181,23 @@ private:
                              const AsmFunction *dispatch_debug,
                              const Code *&code);
   BcIns *interpBranch(BcIns *srcPc, BcIns *dst_pc, Word *base, BranchType);
+  bool growStack(Thread *T, Word *&base, Word *frametop, u4 increment);
   void finishRecording();
+  void blockOn(MVarClosure *mvar, Thread *T);
+  void wakeUp(MVarClosure *mvar);
+  void finishThread(Thread *T);
+  void waitForBlackhole();
+  bool unwindStack(Thread *T, Word *&base, Closure *exception);
 
   MemoryManager *mm_;
   Thread *currentThread_;
-  Closure *static_roots_;
+  Thread *mainThread_;
+  std::deque<Thread *> runQueue_;
+  std::vector<Thread *> threads_;
+  std::vector<Closure *> static_roots_;
+  static const u4 kSparkPoolSizeLog2 = 12;
+  WSDeque<Closure *> sparks_;
+  SparkStats sparkStats_;
 
   const AsmFunction *dispatch_;
 
@@ -93,25 +209,40 @@ private:
 
   HotCounters counters_;
   Jit jit_;
+  Time recordingStart_;  // 0 unless recording
 
   static const int kTraceBytecode = 0;
   static const int kRecording     = 1;
   static const int kDecodeClosures = 2;
+  static const int kProfileAlloc = 3;
   Flags32 flags_;
+  AllocProfile allocProfile_;
 
   Word *traceExitHp_;
   Word *traceExitHpLim_;
 
+  Block *nursery_;  // Owned by the MemoryManager.
+  // Pointer mask of the top stack frame, for the GC.  kNoMask
+  // means the bitmap of the current instruction describes it.
+  u4 topOfStackMask_;
+  u4 attached_;
+  Capability *prevCurrent_;  // Restored by detach().
+
   friend class Fragment;
   friend class BranchTargetBuffer;  // For resetting hot counters.
+  friend class MemoryManager;
 };
 
 inline int
 Capability::heapCheckFailQuick(char **heap, char **hplim)
 {
-  return mm_->bumpAllocatorFullNoGC(heap, hplim);
+  return mm_->bumpAllocatorFullNoGC(this, heap, hplim);
 }
 
+// Called from traces (see IRCALLDEF) before they enter a thunk whose
+// info table is `info'.  Returns 0 if another thread has claimed it.
+Word claimThunkFromTrace(Closure *node, InfoTable *info);
+
 extern uint64_t recordings_started;
 extern uint64_t switch_interp_to_asm;
 
@@ -227,6 +227,12 @@ from separately compiled modules.
 #define LC_LIKELY(x)    __builtin_expect(!!(x), 1)
 #define LC_UNLIKELY(x)  __builtin_expect(!!(x), 0)
 
+// Update a statistics counter.  The counters are global, so several
+// capabilities may update them at the same time.
+#define LC_STAT_ADD(counter, n) \
+  ((void)__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED))
+#define LC_STAT_INC(counter)  LC_STAT_ADD(counter, 1)
+
 #else
 
 #error "Unknown compiler.  Don't know how to define LC_FASTCALL et al."
@@ -317,6 +323,25 @@ static LC_AINLINE uint32_t lc_bswap(uint32_t x)
   uint32_t r; __asm__("bswap %0" : "=r" (r) : "0" (x)); return r;
 }
 
+/* Floating point values live in stack slots as their bit patterns.
+   A Float# occupies the low 32 bits of the slot, the rest is zero. */
+static LC_AINLINE double lc_w2d(uint64_t w)
+{
+  union { uint64_t w; double d; } u; u.w = w; return u.d;
+}
+static LC_AINLINE uint64_t lc_d2w(double d)
+{
+  union { uint64_t w; double d; } u; u.d = d; return u.w;
+}
+static LC_AINLINE float lc_w2f(uint64_t w)
+{
+  union { uint32_t w; float f; } u; u.w = (uint32_t)w; return u.f;
+}
+static LC_AINLINE uint64_t lc_f2w(float f)
+{
+  union { uint32_t w; float f; } u; u.f = f; return (uint64_t)u.w;
+}
+
 // For abstracting flags.
 class Flags32 {
 public:
@@ -363,6 +388,9 @@ typedef Word BloomFilter;
   _(RECORD_CALL_PAP, "Recording of a call of a PAP.") \
   _(RECORD_CALL_THUNK, "Recording of call of a thunk/CAF.") \
   _(RECORD_CALL_IND, "Recording of call of an indirection.") \
+  _(RECORD_BLACKHOLE, "Recording of thunk entry with blackholing.") \
+  _(RECORD_FP_BITCAST, "Recording of FP operation on a non-FP value.") \
+  _(RECORD_OVERFLOW, "Recording of checked arithmetic that overflows.") \
   _(RECORD_LINK_FALLTHROUGH, "link fall-through trace to newly-generated trace.")
 
 enum {
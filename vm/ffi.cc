@@ -0,0 +1,80 @@
+#include "ffi.hh"
+#include "loader.hh"
+
+#include <dlfcn.h>
+
+_START_LAMBDACHINE_NAMESPACE
+
+// The interpreter calls foreign functions through one of three
+// trampolines, one per result register.  Each passes six integer and
+// six floating point arguments.  The x86-64 System V ABI assigns
+// integer and floating point arguments to their registers in order,
+// independently of each other, so this is correct for every signature
+// of up to six arguments; the callee ignores the registers it doesn't
+// use.  The trampolines are varargs functions, which makes the caller
+// set %al to the number of vector registers, so varargs C functions
+// (e.g., printf) can be called, too.
+//
+// A float argument is passed in the lower half of its double
+// register, so it is enough to reinterpret the argument's bits.
+
+typedef Word (*WordTrampoline)(Word, Word, Word, Word, Word, Word, ...);
+typedef double (*DoubleTrampoline)(Word, Word, Word, Word, Word, Word, ...);
+typedef float (*FloatTrampoline)(Word, Word, Word, Word, Word, Word, ...);
+
+Word ffiCall(const void *func, u2 sig, int nargs, const Word *args) {
+  LC_ASSERT(nargs <= kFfiMaxArgs);
+  Word w[kFfiMaxArgs] = { 0, 0, 0, 0, 0, 0 };
+  double d[kFfiMaxArgs] = { 0, 0, 0, 0, 0, 0 };
+  int nw = 0, nd = 0;
+  for (int i = 0; i < nargs; ++i) {
+    if (isFloatFfiType(ffiArgType(sig, i)))
+      d[nd++] = lc_w2d(args[i]);
+    else
+      w[nw++] = args[i];
+  }
+
+  switch (ffiResultType(sig)) {
+  case FFI_DOUBLE:
+    return lc_d2w(((DoubleTrampoline)func)(w[0], w[1], w[2], w[3], w[4], w[5],
+                                           d[0], d[1], d[2], d[3], d[4], d[5]));
+  case FFI_FLOAT:
+    return lc_f2w(((FloatTrampoline)func)(w[0], w[1], w[2], w[3], w[4], w[5],
+                                          d[0], d[1], d[2], d[3], d[4], d[5]));
+  case FFI_WORD:
+    return ((WordTrampoline)func)(w[0], w[1], w[2], w[3], w[4], w[5],
+                                  d[0], d[1], d[2], d[3], d[4], d[5]);
+  default:
+    ((WordTrampoline)func)(w[0], w[1], w[2], w[3], w[4], w[5],
+                           d[0], d[1], d[2], d[3], d[4], d[5]);
+    return 0;
+  }
+}
+
+static STRING_MAP(const void *) foreignFunctions;
+
+void registerForeignFunction(const char *name, const void *func) {
+  foreignFunctions[name] = func;
+}
+
+const void *lookupForeignFunction(const char *name) {
+  STRING_MAP(const void *)::const_iterator it = foreignFunctions.find(name);
+  if (it != foreignFunctions.end())
+    return it->second;
+  return dlsym(RTLD_DEFAULT, name);
+}
+
+const char *foreignFunctionName(const void *func) {
+  for (STRING_MAP(const void *)::const_iterator it = foreignFunctions.begin();
+       it != foreignFunctions.end(); ++it) {
+    if (it->second == func)
+      return it->first;
+  }
+  Dl_info info;
+  if (dladdr(func, &info) != 0 && info.dli_sname != NULL &&
+      info.dli_saddr == func)
+    return info.dli_sname;
+  return NULL;
+}
+
+_END_LAMBDACHINE_NAMESPACE
@@ -0,0 +1,89 @@
+#ifndef _FFI_H_
+#define _FFI_H_
+
+#include "common.hh"
+
+_START_LAMBDACHINE_NAMESPACE
+
+// --- Foreign function calls ----------------------------------------
+//
+// CCALL and CCALLS call a C function whose address is a LIT_CFUNC
+// literal.  The loader resolves the literal by name, first in the
+// table of functions registered with registerForeignFunction, then
+// among the symbols of the program and its shared libraries (dlsym).
+//
+//     +-----+-----+-----+-----+
+//     |  -  |nargs|  A  | OPC |  rA = result
+//     +-----+-----+-----+-----+
+//     | signature |  lit id   |
+//     +-----------+-----------+
+//     | arg | arg | ... |     |  BC_ROUND(nargs) words
+//     +-----+-----+-----+-----+
+//     |  live-outs bitmap     |  CCALLS only
+//     +-----------------------+
+//
+// The signature describes the result and argument types, two bits
+// each (see FfiType), with the result in the lowest bits.  Integers
+// of any size and pointers are passed as FFI_WORD.  Calls take at
+// most kFfiMaxArgs arguments, so all arguments are passed in
+// registers.
+//
+// CCALL is an unsafe call: the capability stays attached, so other
+// capabilities cannot collect garbage until the call returns.  CCALLS
+// is a safe call: it detaches the capability for the duration of the
+// call.  Use it for calls that may block.  Since the heap may change
+// under its feet, a safe call must not be passed pointers to heap
+// objects other than large objects (e.g., byte arrays), which are
+// never moved.  Neither kind of call may call back into Haskell.
+
+typedef enum {
+  FFI_VOID = 0,    // Only valid as a result type.
+  FFI_WORD = 1,
+  FFI_DOUBLE = 2,
+  FFI_FLOAT = 3
+} FfiType;
+
+static const int kFfiMaxArgs = 6;
+
+inline u2 ffiSignature(FfiType result, int nargs, const FfiType *args) {
+  LC_ASSERT(nargs <= kFfiMaxArgs);
+  u2 sig = (u2)result;
+  for (int i = 0; i < nargs; ++i) {
+    LC_ASSERT(args[i] != FFI_VOID);
+    sig |= (u2)args[i] << (2 + 2 * i);
+  }
+  return sig;
+}
+
+inline FfiType ffiResultType(u2 sig) {
+  return (FfiType)(sig & 3);
+}
+
+inline FfiType ffiArgType(u2 sig, int i) {
+  return (FfiType)((sig >> (2 + 2 * i)) & 3);
+}
+
+inline bool isFloatFfiType(FfiType ty) {
+  return ty == FFI_DOUBLE || ty == FFI_FLOAT;
+}
+
+// Call `func' with the given arguments.  Floating point arguments and
+// results are passed in the lower bits of their word (see lc_d2w and
+// lc_f2w).  The result is 0 for FFI_VOID.
+Word ffiCall(const void *func, u2 sig, int nargs, const Word *args);
+
+// Make a C function available to LIT_CFUNC literals, e.g., one that
+// is linked into the VM but not exported.  Takes precedence over
+// symbols found with dlsym.
+void registerForeignFunction(const char *name, const void *func);
+
+// The address of the named C function, or NULL if it is unknown.
+const void *lookupForeignFunction(const char *name);
+
+// The name under which lookupForeignFunction finds `func', or NULL if
+// it has none.  Used to save images (see image.hh).
+const char *foreignFunctionName(const void *func);
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _FFI_H_ */
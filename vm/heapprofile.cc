@@ -0,0 +1,69 @@
+#include "heapprofile.hh"
+
+_START_LAMBDACHINE_NAMESPACE
+
+HeapProfiler::HeapProfiler()
+  : out_(NULL), gcInterval_(0), timeInterval_(0), start_(0),
+    lastCensus_(0), lastCensusGC_(0), samples_(0) {
+}
+
+HeapProfiler::~HeapProfiler() {
+  if (out_ != NULL)
+    fclose(out_);
+}
+
+bool HeapProfiler::open(const char *filename, u4 gcInterval,
+                        Time timeInterval) {
+  out_ = fopen(filename, "w");
+  if (out_ == NULL)
+    return false;
+  gcInterval_ = gcInterval;
+  timeInterval_ = timeInterval;
+  start_ = getProcessElapsedTime();
+  lastCensus_ = start_;
+  fprintf(out_, "sample,seconds,type,name,objects,bytes\n");
+  return true;
+}
+
+bool HeapProfiler::censusDue(uint64_t gcNumber, Time now) const {
+  if (gcInterval_ == 0 && timeInterval_ == 0)
+    return true;
+  if (gcInterval_ != 0 && gcNumber - lastCensusGC_ >= gcInterval_)
+    return true;
+  if (timeInterval_ != 0 && now - lastCensus_ >= timeInterval_)
+    return true;
+  return false;
+}
+
+static void writeQuoted(FILE *out, const char *str) {
+  fputc('"', out);
+  for (const char *p = str; *p != '\0'; ++p) {
+    if (*p == '"')
+      fputc('"', out);
+    fputc(*p, out);
+  }
+  fputc('"', out);
+}
+
+void HeapProfiler::writeSample(uint64_t gcNumber, Time now,
+                               const CensusTable &census) {
+  double seconds = (double)(now - start_) / TIME_RESOLUTION;
+  CensusTable::const_iterator it;
+  for (it = census.begin(); it != census.end(); ++it) {
+    const InfoTable *info = (const InfoTable *)it->first;
+    fprintf(out_, "%u,%.3f,%s,", samples_, seconds,
+            closureTypeName(info->type()));
+    writeQuoted(out_, info->name());
+    fprintf(out_, ",%" FMT_Word64 ",%" FMT_Word64 "\n",
+            it->second.objects, it->second.bytes);
+  }
+  // An empty census still produces a sample.
+  if (census.empty())
+    fprintf(out_, "%u,%.3f,,\"\",0,0\n", samples_, seconds);
+  fflush(out_);
+  ++samples_;
+  lastCensus_ = now;
+  lastCensusGC_ = gcNumber;
+}
+
+_END_LAMBDACHINE_NAMESPACE
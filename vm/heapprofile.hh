@@ -0,0 +1,65 @@
+#ifndef _HEAPPROFILE_H_
+#define _HEAPPROFILE_H_
+
+#include "common.hh"
+#include "objects.hh"
+#include "time.hh"
+
+#include <stdio.h>
+
+#include HASH_MAP_H
+
+_START_LAMBDACHINE_NAMESPACE
+
+// Number of live objects and bytes per info table.
+typedef struct {
+  uint64_t objects;
+  uint64_t bytes;
+} CensusEntry;
+
+typedef HASH_NAMESPACE::HASH_MAP_CLASS<Word, CensusEntry> CensusTable;
+
+inline void addToCensus(CensusTable &census, InfoTable *info, u4 words) {
+  CensusEntry &e = census[(Word)info];
+  ++e.objects;
+  e.bytes += words * sizeof(Word);
+}
+
+// A heap profile is a sequence of censuses of the live heap.  A
+// census is taken during a GC, if at least the given number of GCs
+// or the given amount of time has passed since the last census.
+//
+// The profile is written as CSV, one line per info table per census:
+//
+//     sample,seconds,type,name,objects,bytes
+//
+// The name is always quoted.  See hpview.cc for a viewer.
+class HeapProfiler {
+public:
+  HeapProfiler();
+  ~HeapProfiler();
+
+  // Returns false if the file could not be opened.  Either interval
+  // may be zero.  If both are zero, a census is taken at every GC.
+  bool open(const char *filename, u4 gcInterval, Time timeInterval);
+
+  bool censusDue(uint64_t gcNumber, Time now) const;
+
+  // Write one sample.  Also takes care of resetting the interval.
+  void writeSample(uint64_t gcNumber, Time now, const CensusTable &census);
+
+  inline u4 samples() const { return samples_; }
+
+private:
+  FILE *out_;
+  u4 gcInterval_;
+  Time timeInterval_;
+  Time start_;
+  Time lastCensus_;
+  uint64_t lastCensusGC_;
+  u4 samples_;
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _HEAPPROFILE_H_ */
@@ -0,0 +1,215 @@
+// Renders a heap profile written by lcvm --heap-profile.
+//
+// Prints the largest contributors to the heap (by peak residency)
+// and a stacked bar chart of the heap over time, one line per
+// census.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+using namespace std;
+
+struct Sample {
+  double seconds;
+  uint64_t total;
+  map<string, uint64_t> bytes;
+};
+
+struct Contributor {
+  string key;
+  uint64_t peak;
+  uint64_t objects;  // at the peak
+};
+
+static bool byPeak(const Contributor &a, const Contributor &b) {
+  return a.peak > b.peak;
+}
+
+// Split a CSV line.  Fields may be quoted; quotes inside quoted
+// fields are doubled.
+static vector<string> splitCSV(const string &line) {
+  vector<string> fields;
+  string field;
+  bool quoted = false;
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (quoted) {
+      if (c == '"') {
+        if (i + 1 < line.size() && line[i + 1] == '"') {
+          field += '"';
+          ++i;
+        } else {
+          quoted = false;
+        }
+      } else {
+        field += c;
+      }
+    } else if (c == '"') {
+      quoted = true;
+    } else if (c == ',') {
+      fields.push_back(field);
+      field.clear();
+    } else {
+      field += c;
+    }
+  }
+  fields.push_back(field);
+  return fields;
+}
+
+static string withThousands(uint64_t n) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu", (unsigned long long)n);
+  string digits(buf), result;
+  int count = 0;
+  for (int i = (int)digits.size() - 1; i >= 0; --i) {
+    result.insert(result.begin(), digits[i]);
+    if (++count % 3 == 0 && i > 0)
+      result.insert(result.begin(), ',');
+  }
+  return result;
+}
+
+static void usage(const char *prog) {
+  cerr << "Usage: " << prog << " [--by-type] [--top=N] [--width=N] FILE"
+       << endl
+       << "  --by-type   Group by closure type instead of info table."
+       << endl
+       << "  --top=N     Show the N largest contributors (default: 8)."
+       << endl
+       << "  --width=N   Width of the chart (default: 60)." << endl;
+}
+
+int main(int argc, char *argv[]) {
+  bool byType = false;
+  size_t top = 8;
+  size_t width = 60;
+  const char *filename = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--by-type")) {
+      byType = true;
+    } else if (!strncmp(argv[i], "--top=", 6)) {
+      top = atoi(argv[i] + 6);
+    } else if (!strncmp(argv[i], "--width=", 8)) {
+      width = atoi(argv[i] + 8);
+    } else if (argv[i][0] == '-' || filename != NULL) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      filename = argv[i];
+    }
+  }
+  if (filename == NULL || top < 1 || top > 26 || width < 10) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  ifstream in(filename);
+  if (!in) {
+    cerr << "Could not open " << filename << endl;
+    return 1;
+  }
+
+  vector<Sample> samples;
+  map<string, Contributor> contributors;
+  map<string, uint64_t> objects;  // of the current sample
+  string line;
+  long current = -1;
+  getline(in, line);  // header
+  while (getline(in, line)) {
+    vector<string> f = splitCSV(line);
+    if (f.size() != 6) {
+      cerr << "Ignoring malformed line: " << line << endl;
+      continue;
+    }
+    long sample = atol(f[0].c_str());
+    if (sample != current) {
+      samples.push_back(Sample());
+      samples.back().seconds = atof(f[1].c_str());
+      samples.back().total = 0;
+      current = sample;
+      objects.clear();
+    }
+    if (f[2].empty())
+      continue;  // empty census
+    const string &key = byType ? f[2] : f[3];
+    uint64_t nobjs = strtoull(f[4].c_str(), NULL, 10);
+    uint64_t nbytes = strtoull(f[5].c_str(), NULL, 10);
+    Sample &s = samples.back();
+    s.bytes[key] += nbytes;
+    s.total += nbytes;
+    objects[key] += nobjs;
+    Contributor &c = contributors[key];
+    c.key = key;
+    if (s.bytes[key] > c.peak) {
+      c.peak = s.bytes[key];
+      c.objects = objects[key];
+    }
+  }
+
+  if (samples.empty()) {
+    cout << filename << ": no samples." << endl;
+    return 0;
+  }
+
+  vector<Contributor> sorted;
+  for (map<string, Contributor>::iterator it = contributors.begin();
+       it != contributors.end(); ++it) {
+    sorted.push_back(it->second);
+  }
+  sort(sorted.begin(), sorted.end(), byPeak);
+  if (sorted.size() > top)
+    sorted.resize(top);
+
+  uint64_t peak = 0;
+  double peakTime = 0;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    if (samples[i].total > peak) {
+      peak = samples[i].total;
+      peakTime = samples[i].seconds;
+    }
+  }
+
+  printf("Heap profile %s: %d samples, %.3fs - %.3fs, "
+         "peak %s bytes at %.3fs\n\n",
+         filename, (int)samples.size(), samples.front().seconds,
+         samples.back().seconds, withThousands(peak).c_str(), peakTime);
+
+  printf("Largest %s by peak residency:\n",
+         byType ? "closure types" : "info tables");
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    printf("  %c  %15s bytes %12s objects  %s\n", (char)('A' + i),
+           withThousands(sorted[i].peak).c_str(),
+           withThousands(sorted[i].objects).c_str(),
+           sorted[i].key.c_str());
+  }
+  printf("  .  everything else\n\n");
+
+  printf("%9s %15s  |\n", "seconds", "bytes");
+  for (size_t i = 0; i < samples.size(); ++i) {
+    Sample &s = samples[i];
+    string bar;
+    uint64_t shown = 0;
+    for (size_t j = 0; j < sorted.size(); ++j) {
+      uint64_t b = s.bytes[sorted[j].key];
+      shown += b;
+      size_t len = peak ? (size_t)(b * width / peak) : 0;
+      bar.append(len, (char)('A' + j));
+    }
+    size_t rest = peak ? (size_t)((s.total - shown) * width / peak) : 0;
+    bar.append(rest, '.');
+    printf("%9.3f %15s  |%s\n", s.seconds,
+           withThousands(s.total).c_str(), bar.c_str());
+  }
+  return 0;
+}
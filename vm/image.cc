@@ -0,0 +1,635 @@
+#include "image.hh"
+#include "ffi.hh"
+#include "miscclosures.hh"
+#include "time.hh"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_START_LAMBDACHINE_NAMESPACE
+
+using namespace std;
+
+typedef struct {
+  char magic[4];
+  u4 version;
+  u4 numBlocks;
+  u4 numRoots;
+  u4 numForeign;
+  u4 numRelocs;
+} ImageHeader;
+
+static const char kImageMagic[4] = { 'L', 'C', 'I', 'M' };
+// Also encodes the word size.
+static const u4 kImageVersion = 1 + (sizeof(Word) << 16);
+
+static const u4 kNoBlock = ~0;
+// The value of a root that is NULL.  0 is a valid pointer.
+static const Word kNullRoot = ~(Word)0;
+
+typedef enum {
+  kRootModule,
+  kRootInfoTable,
+  kRootClosure,
+  kRootMisc,       // index into miscRoots
+  kRootApCont,     // index = apContIndex, value = closure
+  kRootApReturn,   // index = apContIndex, value = return address
+  kRootApInfo      // index = apContIndex
+} RootKind;
+
+typedef enum { kMiscClosure, kMiscInfo, kMiscPc } MiscKind;
+
+typedef struct {
+  void *addr;
+  MiscKind kind;
+} MiscRoot;
+
+#define MISC_ROOT(name, kind) { (void *)&MiscClosures::name, kind }
+
+static const MiscRoot miscRoots[] = {
+  MISC_ROOT(stg_UPD_closure_addr, kMiscClosure),
+  MISC_ROOT(stg_BLACKHOLE_closure_addr, kMiscClosure),
+  MISC_ROOT(stg_UNDERFLOW_closure_addr, kMiscClosure),
+  MISC_ROOT(stg_STOP_closure_addr, kMiscClosure),
+  MISC_ROOT(stg_FORK_closure_addr, kMiscClosure),
+  MISC_ROOT(stg_EVAL_closure_addr, kMiscClosure),
+  MISC_ROOT(stg_CATCH_closure_addr, kMiscClosure),
+  MISC_ROOT(stg_NO_VALUE_closure_addr, kMiscClosure),
+  MISC_ROOT(stg_UPD_return_pc, kMiscPc),
+  MISC_ROOT(stg_UNDERFLOW_return_pc, kMiscPc),
+  MISC_ROOT(stg_CATCH_handler_pc, kMiscPc),
+  MISC_ROOT(stg_RAISE_info, kMiscInfo),
+  MISC_ROOT(stg_MVAR_info, kMiscInfo),
+  MISC_ROOT(stg_THREADID_info, kMiscInfo),
+  MISC_ROOT(stg_IND_info, kMiscInfo),
+  MISC_ROOT(stg_PAP_info, kMiscInfo),
+  MISC_ROOT(stg_BYTEARR_info, kMiscInfo),
+  MISC_ROOT(stg_MUT_ARR_info, kMiscInfo),
+  MISC_ROOT(stg_ARR_info, kMiscInfo),
+  MISC_ROOT(stg_SMALLINT_info, kMiscInfo),
+  MISC_ROOT(stg_BIGPOS_info, kMiscInfo),
+  MISC_ROOT(stg_BIGNEG_info, kMiscInfo)
+};
+
+#undef MISC_ROOT
+
+static inline Word encodePointer(u4 block, Word offset) {
+  return ((Word)block << Block::kBlockSizeLog2) | offset;
+}
+
+Image::Image()
+  : copyBlock_(kNoBlock), current_(NULL), failed_(false) {
+}
+
+// --- Saving ------------------------------------------------------------
+
+bool Image::save(const char *filename, MemoryManager *mm, Loader *loader) {
+  // An image contains all code, whether the program needs it or not.
+  loader->loadAllCode();
+  Image img;
+  img.addBlocks(mm->info_tables_);
+  img.addBlocks(mm->static_closures_);
+  img.addBlocks(mm->bytecode_);
+  img.addBlocks(mm->strings_);
+  img.addRoots(loader);
+  img.visitAll();
+  if (img.failed_)
+    return false;
+  return img.write(filename);
+}
+
+void Image::addBlocks(Block *b) {
+  for ( ; b != NULL; b = b->link_) {
+    size_t bytes = b->free() - b->start();
+    if (bytes == 0)
+      continue;
+    ImageBlock ib = { (u4)b->contents(), (u4)bytes };
+    sections_[b->start()] = blocks_.size();
+    blocks_.push_back(ib);
+    data_.push_back(vector<char>(b->start(), b->free()));
+  }
+}
+
+// Encode a pointer into one of the copied blocks.  Tagged pointers
+// keep their tag in the offset.
+bool Image::encode(const void *p, Word *out) const {
+  const char *q = (const char *)p;
+  map<const char *, u4>::const_iterator it = sections_.upper_bound(q);
+  if (it == sections_.begin())
+    return false;
+  --it;
+  u4 block = it->second;
+  if (q >= it->first + blocks_[block].bytes)
+    return false;
+  *out = encodePointer(block, q - it->first);
+  return true;
+}
+
+void Image::error(const char *what, const void *p) {
+  if (!failed_)
+    fprintf(stderr, "ERROR: Cannot save image: %s (%p) in %s\n",
+            what, p, current_ != NULL ? current_ : "roots");
+  failed_ = true;
+}
+
+// Write the encoded value of a field into the copy of its block and
+// record its location.
+void Image::setField(void *field, Word value) {
+  Word loc;
+  if (!encode(field, &loc)) {
+    error("object outside of the static data", field);
+    return;
+  }
+  u4 block = loc >> Block::kBlockSizeLog2;
+  Word offset = loc & Block::kBlockMask;
+  memcpy(&data_[block][offset], &value, sizeof(Word));
+  relocs_.push_back((u4)loc);
+}
+
+void Image::pointerField(void *field) {
+  Word p = *(Word *)field;
+  Word value;
+  if (p == 0)
+    return;
+  if (!encode((const void *)p, &value)) {
+    error("pointer outside of the static data", (const void *)p);
+    return;
+  }
+  setField(field, value);
+}
+
+void Image::stringField(const char **field) {
+  if (*field != NULL)
+    setField(field, encodeString(*field));
+}
+
+void Image::foreignField(Word *field) {
+  const char *name = foreignFunctionName((const void *)*field);
+  Word loc;
+  if (name == NULL) {
+    error("unknown foreign function", (const void *)*field);
+    return;
+  }
+  if (!encode(field, &loc)) {
+    error("object outside of the static data", field);
+    return;
+  }
+  Word null = 0;
+  memcpy(&data_[loc >> Block::kBlockSizeLog2][loc & Block::kBlockMask],
+         &null, sizeof(Word));
+  ImageForeign f = { (u4)loc, (u4)encodeString(name) };
+  foreign_.push_back(f);
+}
+
+// Strings outside of the string blocks are copied into additional
+// string blocks.
+Word Image::encodeString(const char *str) {
+  Word value;
+  if (encode(str, &value))
+    return value;
+  HASH_NAMESPACE::HASH_MAP_CLASS<const void *, Word>::iterator it =
+    copied_.find(str);
+  if (it != copied_.end())
+    return it->second;
+
+  size_t len = strlen(str) + 1;
+  if (len > Block::kBlockSize) {
+    error("string too long", str);
+    return 0;
+  }
+  if (copyBlock_ == kNoBlock ||
+      blocks_[copyBlock_].bytes + len > Block::kBlockSize) {
+    ImageBlock ib = { (u4)Block::kStrings, 0 };
+    copyBlock_ = blocks_.size();
+    blocks_.push_back(ib);
+    data_.push_back(vector<char>());
+  }
+  vector<char> &data = data_[copyBlock_];
+  value = encodePointer(copyBlock_, data.size());
+  data.insert(data.end(), str, str + len);
+  blocks_[copyBlock_].bytes = data.size();
+  copied_[str] = value;
+  return value;
+}
+
+Word Image::rootValue(const void *p) {
+  Word value = kNullRoot;
+  if (p != NULL && !encode(p, &value))
+    error("root outside of the static data", p);
+  return value;
+}
+
+void Image::addRoot(u4 kind, u4 index, Word name, Word value) {
+  ImageRoot r = { kind, index, name, value };
+  roots_.push_back(r);
+}
+
+void Image::addRoots(Loader *loader) {
+  // Lookups with operator[] may have added NULL entries.  The keys
+  // of the module table belong to the callers of loadModule, so we
+  // use the module names instead.
+  for (STRING_MAP(Module *)::iterator it = loader->loadedModules_.begin();
+       it != loader->loadedModules_.end(); ++it) {
+    if (it->second != NULL)
+      addRoot(kRootModule, 0, encodeString(it->second->name()), kNullRoot);
+  }
+  for (STRING_MAP(InfoTable *)::iterator it = loader->infoTables_.begin();
+       it != loader->infoTables_.end(); ++it) {
+    if (it->second == NULL)
+      continue;
+    addInfoTable(it->second);
+    addRoot(kRootInfoTable, 0, encodeString(it->first),
+            rootValue(it->second));
+  }
+  for (STRING_MAP(Closure *)::iterator it = loader->closures_.begin();
+       it != loader->closures_.end(); ++it) {
+    if (it->second == NULL)
+      continue;
+    addClosure(it->second);
+    addRoot(kRootClosure, 0, encodeString(it->first),
+            rootValue(it->second));
+  }
+
+  for (u4 i = 0; i < countof(miscRoots); ++i) {
+    void *p = *(void **)miscRoots[i].addr;
+    if (miscRoots[i].kind == kMiscClosure)
+      addClosure((Closure *)p);
+    else if (miscRoots[i].kind == kMiscInfo)
+      addInfoTable((InfoTable *)p);
+    addRoot(kRootMisc, i, 0, rootValue(p));
+  }
+
+  u4 numSmall =
+    MiscClosures::apContIndex(MiscClosures::kMaxSmallArity + 1, 0);
+  for (u4 i = 0; i < numSmall; ++i) {
+    MiscClosures::ApContInfo *k = &MiscClosures::smallApConts[i];
+    addClosure(k->closure);
+    addRoot(kRootApCont, i, 0, rootValue(k->closure));
+    addRoot(kRootApReturn, i, 0, rootValue(k->returnAddr));
+    addInfoTable(MiscClosures::smallApInfos[i]);
+    addRoot(kRootApInfo, i, 0, rootValue(MiscClosures::smallApInfos[i]));
+  }
+  for (Image::ApContMap::iterator it = MiscClosures::otherApConts->begin();
+       it != MiscClosures::otherApConts->end(); ++it) {
+    addClosure(it->second.closure);
+    addRoot(kRootApCont, it->first, 0, rootValue(it->second.closure));
+    addRoot(kRootApReturn, it->first, 0, rootValue(it->second.returnAddr));
+  }
+  for (APMAP::iterator it = MiscClosures::otherApInfos->begin();
+       it != MiscClosures::otherApInfos->end(); ++it) {
+    if (it->second == NULL)
+      continue;
+    addInfoTable(it->second);
+    addRoot(kRootApInfo, it->first, 0, rootValue(it->second));
+  }
+}
+
+void Image::addInfoTable(InfoTable *info) {
+  if (info != NULL && seen_.insert(info).second)
+    infoWork_.push_back(info);
+}
+
+void Image::addClosure(Closure *cl) {
+  if (cl != NULL && seen_.insert(cl).second)
+    closureWork_.push_back(cl);
+}
+
+// Static data can be deeply nested (e.g., long lists), so we use
+// explicit work lists instead of recursion.
+void Image::visitAll() {
+  while (!infoWork_.empty() || !closureWork_.empty()) {
+    if (!infoWork_.empty()) {
+      InfoTable *info = infoWork_.back();
+      infoWork_.pop_back();
+      visitInfoTable(info);
+    } else {
+      Closure *cl = closureWork_.back();
+      closureWork_.pop_back();
+      visitClosure(cl);
+    }
+  }
+}
+
+void Image::visitInfoTable(InfoTable *info) {
+  current_ = info->name();
+  stringField(&info->name_);
+  switch (info->type()) {
+  case FUN:
+  case THUNK:
+  case CAF:
+  case AP_CONT:
+  case UPDATE_FRAME:
+  case PAP:
+  case BLACKHOLE: {
+    CodeInfoTable *cinfo = static_cast<CodeInfoTable *>(info);
+    Code *code = &cinfo->code_;
+    pointerField(&code->lits);
+    pointerField(&code->littypes);
+    pointerField(&code->code);
+    for (u4 i = 0; i < code->sizelits; ++i)
+      visitLiteral(code->littypes[i], &code->lits[i]);
+    if (info->type() == THUNK || info->type() == BLACKHOLE) {
+      pointerField(&cinfo->blackholeInfo_);
+      addInfoTable(cinfo->blackholeInfo_);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void Image::visitLiteral(u1 littype, Word *lit) {
+  switch (littype) {
+  case LIT_STRING:
+    stringField((const char **)lit);
+    break;
+  case LIT_CLOSURE:
+    pointerField(lit);
+    addClosure(untag(*lit));
+    break;
+  case LIT_INFO:
+    pointerField(lit);
+    addInfoTable((InfoTable *)*lit);
+    break;
+  case LIT_PC:
+    pointerField(lit);
+    break;
+  case LIT_CFUNC:
+    foreignField(lit);
+    break;
+  default:
+    break;
+  }
+}
+
+void Image::visitClosure(Closure *cl) {
+  InfoTable *info = cl->info();
+  current_ = info != NULL ? info->name() : NULL;
+  pointerField(&cl->header_.info_);
+  if (info == NULL)
+    return;
+  addInfoTable(info);
+
+  // Static functions have no free variables and the payload of a CAF
+  // holds no pointers until it has been evaluated.
+  u4 size = 0;
+  u4 bitmap = 0;
+  if (info->type() == CONSTR) {
+    size = info->size();
+    bitmap = info->layout().bitmap;
+  } else if (info->type() == CAF) {
+    size = 2;
+  }
+  for (u4 i = 0; i < size; ++i, bitmap >>= 1) {
+    Word value;
+    if (bitmap & 1) {
+      pointerField(&cl->payload_[i]);
+      addClosure(untag(cl->payload_[i]));
+    } else if (cl->payload_[i] != 0 &&
+               encode((const void *)cl->payload_[i], &value)) {
+      setField(&cl->payload_[i], value);
+    }
+  }
+}
+
+static bool writeAll(FILE *out, const void *data, size_t bytes) {
+  return bytes == 0 || fwrite(data, bytes, 1, out) == 1;
+}
+
+bool Image::write(const char *filename) {
+  // Every object is visited once, so there should be no duplicates.
+  // Sorting makes loading touch the blocks in order.
+  sort(relocs_.begin(), relocs_.end());
+  relocs_.erase(unique(relocs_.begin(), relocs_.end()), relocs_.end());
+
+  if (blocks_.size() >= (1UL << (32 - Block::kBlockSizeLog2))) {
+    fprintf(stderr, "ERROR: Cannot save image: too much static data\n");
+    return false;
+  }
+
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "ERROR: Could not open file %s\n", filename);
+    return false;
+  }
+
+  ImageHeader hdr;
+  memcpy(hdr.magic, kImageMagic, sizeof(hdr.magic));
+  hdr.version = kImageVersion;
+  hdr.numBlocks = blocks_.size();
+  hdr.numRoots = roots_.size();
+  hdr.numForeign = foreign_.size();
+  hdr.numRelocs = relocs_.size();
+
+  static const char padding[sizeof(Word)] = { 0 };
+  size_t header = sizeof(hdr) + blocks_.size() * sizeof(ImageBlock) +
+    roots_.size() * sizeof(ImageRoot) +
+    foreign_.size() * sizeof(ImageForeign) + relocs_.size() * sizeof(u4);
+  bool ok =
+    writeAll(out, &hdr, sizeof(hdr)) &&
+    writeAll(out, blocks_.data(), blocks_.size() * sizeof(ImageBlock)) &&
+    writeAll(out, roots_.data(), roots_.size() * sizeof(ImageRoot)) &&
+    writeAll(out, foreign_.data(), foreign_.size() * sizeof(ImageForeign)) &&
+    writeAll(out, relocs_.data(), relocs_.size() * sizeof(u4)) &&
+    writeAll(out, padding, roundUpBytesToWords(header) * sizeof(Word) - header);
+  for (size_t i = 0; ok && i < data_.size(); ++i) {
+    size_t bytes = data_[i].size();
+    ok = writeAll(out, data_[i].data(), bytes) &&
+      writeAll(out, padding, roundUpBytesToWords(bytes) * sizeof(Word) - bytes);
+  }
+  if (fclose(out) != 0)
+    ok = false;
+  if (!ok)
+    fprintf(stderr, "ERROR: Could not write image %s\n", filename);
+  return ok;
+}
+
+// --- Loading -----------------------------------------------------------
+
+bool Image::load(const char *filename, MemoryManager *mm, Loader *loader) {
+  Time starttime = getProcessElapsedTime();
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "ERROR: Could not open file %s\n", filename);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  void *p = st.st_size > 0
+    ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Could not map file %s\n", filename);
+    return false;
+  }
+  bool ok = load(filename, (const char *)p, st.st_size, mm, loader);
+  munmap(p, st.st_size);
+  LC_STAT_ADD(loader_time, getProcessElapsedTime() - starttime);
+  return ok;
+}
+
+static bool corrupt(const char *filename) {
+  fprintf(stderr, "ERROR: Corrupt image file %s\n", filename);
+  return false;
+}
+
+bool Image::load(const char *filename, const char *data, size_t size,
+                 MemoryManager *mm, Loader *loader) {
+  const ImageHeader *hdr = (const ImageHeader *)data;
+  if (size < sizeof(ImageHeader) ||
+      memcmp(hdr->magic, kImageMagic, sizeof(kImageMagic)) != 0 ||
+      hdr->version != kImageVersion) {
+    fprintf(stderr, "ERROR: %s is not an image of this VM\n", filename);
+    return false;
+  }
+  if (!loader->loadedModules_.empty()) {
+    fprintf(stderr, "ERROR: Images must be loaded before any module\n");
+    return false;
+  }
+
+  uint64_t header = sizeof(ImageHeader) +
+    (uint64_t)hdr->numBlocks * sizeof(ImageBlock) +
+    (uint64_t)hdr->numRoots * sizeof(ImageRoot) +
+    (uint64_t)hdr->numForeign * sizeof(ImageForeign) +
+    (uint64_t)hdr->numRelocs * sizeof(u4);
+  if (header > size)
+    return corrupt(filename);
+  const ImageBlock *blocks = (const ImageBlock *)(hdr + 1);
+  const ImageRoot *roots = (const ImageRoot *)(blocks + hdr->numBlocks);
+  const ImageForeign *foreign = (const ImageForeign *)(roots + hdr->numRoots);
+  const u4 *relocs = (const u4 *)(foreign + hdr->numForeign);
+
+  // 1. Copy each section block into a fresh block.
+  vector<Block *> loaded(hdr->numBlocks);
+  uint64_t offset = roundUpBytesToWords(header) * sizeof(Word);
+  for (u4 i = 0; i < hdr->numBlocks; ++i) {
+    u4 contents = blocks[i].contents;
+    u4 bytes = blocks[i].bytes;
+    if ((contents != Block::kInfoTables &&
+         contents != Block::kStaticClosures &&
+         contents != Block::kBytecode && contents != Block::kStrings) ||
+        bytes > Block::kBlockSize || offset + bytes > size)
+      return corrupt(filename);
+    Block *b = mm->grabStaticBlock((Block::Flags)contents);
+    memcpy(b->start(), data + offset, bytes);
+    b->free_ = b->start() + bytes;
+    loaded[i] = b;
+    offset += roundUpBytesToWords(bytes) * sizeof(Word);
+  }
+
+  // 2. Relocate.
+#define DECODE(value, out) \
+  do { \
+    Word _block = (value) >> Block::kBlockSizeLog2; \
+    Word _offset = (value) & Block::kBlockMask; \
+    if (_block >= hdr->numBlocks || _offset >= blocks[_block].bytes) \
+      return corrupt(filename); \
+    (out) = loaded[_block]->start() + _offset; \
+  } while (0)
+
+  for (u4 i = 0; i < hdr->numRelocs; ++i) {
+    char *field;
+    DECODE(relocs[i], field);
+    if (field + sizeof(Word) > loaded[relocs[i] >> Block::kBlockSizeLog2]->free())
+      return corrupt(filename);
+    Word value;
+    char *p;
+    memcpy(&value, field, sizeof(Word));
+    DECODE(value, p);
+    memcpy(field, &p, sizeof(Word));
+  }
+
+  for (u4 i = 0; i < hdr->numForeign; ++i) {
+    char *field, *name;
+    DECODE(foreign[i].location, field);
+    DECODE(foreign[i].name, name);
+    const void *func = lookupForeignFunction(name);
+    if (func == NULL) {
+      fprintf(stderr, "ERROR: Unknown foreign function %s in image %s\n",
+              name, filename);
+      return false;
+    }
+    memcpy(field, &func, sizeof(Word));
+  }
+
+  for (u4 i = 0; i < hdr->numBlocks; ++i) {
+    if (loaded[i]->contents() == Block::kInfoTables) {
+      bool ok = mm->markBlockReadOnly(loaded[i]);
+      LC_ASSERT(ok && "Failed to mark block R/O");
+      UNUSED(ok);
+    }
+  }
+
+  // 3. Restore the loader's symbol tables and the MiscClosures.  The
+  // MiscClosures built by the loader's constructor become garbage.
+  // They are small, so we don't bother to free them.
+  MiscClosures::reset();
+  u4 numSmall =
+    MiscClosures::apContIndex(MiscClosures::kMaxSmallArity + 1, 0);
+  MiscClosures::smallApConts = new MiscClosures::ApContInfo[numSmall];
+  MiscClosures::smallApInfos = new InfoTable*[numSmall];
+  memset(MiscClosures::smallApConts, 0,
+         numSmall * sizeof(MiscClosures::ApContInfo));
+  memset(MiscClosures::smallApInfos, 0, numSmall * sizeof(InfoTable *));
+  MiscClosures::otherApConts = new ApContMap(20);
+  MiscClosures::otherApInfos = new APMAP(10);
+  MiscClosures::allocMM = mm;
+
+  for (u4 i = 0; i < hdr->numRoots; ++i) {
+    const ImageRoot *r = &roots[i];
+    char *name = NULL, *value = NULL;
+    if (r->kind <= kRootClosure)
+      DECODE(r->name, name);
+    if (r->value != kNullRoot)
+      DECODE(r->value, value);
+    switch (r->kind) {
+    case kRootModule: {
+      Module *mdl = new Module();
+      mdl->name_ = name;
+      loader->loadedModules_[name] = mdl;
+      break;
+    }
+    case kRootInfoTable:
+      loader->infoTables_[name] = (InfoTable *)value;
+      break;
+    case kRootClosure:
+      loader->closures_[name] = (Closure *)value;
+      break;
+    case kRootMisc:
+      if (r->index >= countof(miscRoots))
+        return corrupt(filename);
+      *(void **)miscRoots[r->index].addr = value;
+      break;
+    case kRootApCont:
+      if (r->index < numSmall)
+        MiscClosures::smallApConts[r->index].closure = (Closure *)value;
+      else
+        (*MiscClosures::otherApConts)[r->index].closure = (Closure *)value;
+      break;
+    case kRootApReturn:
+      if (r->index < numSmall)
+        MiscClosures::smallApConts[r->index].returnAddr = (BcIns *)value;
+      else
+        (*MiscClosures::otherApConts)[r->index].returnAddr = (BcIns *)value;
+      break;
+    case kRootApInfo:
+      if (r->index < numSmall)
+        MiscClosures::smallApInfos[r->index] = (InfoTable *)value;
+      else
+        (*MiscClosures::otherApInfos)[r->index] = (InfoTable *)value;
+      break;
+    default:
+      return corrupt(filename);
+    }
+  }
+#undef DECODE
+  return true;
+}
+
+_END_LAMBDACHINE_NAMESPACE
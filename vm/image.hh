@@ -0,0 +1,138 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include "common.hh"
+#include "memorymanager.hh"
+#include "loader.hh"
+#include "miscclosures.hh"
+
+#include <map>
+#include <vector>
+
+#include HASH_MAP_H
+#include HASH_SET_H
+
+_START_LAMBDACHINE_NAMESPACE
+
+// --- Images ----------------------------------------------------------
+//
+// An image is a snapshot of everything the loader creates: the info
+// tables, static closures, bytecode and strings of all loaded modules
+// and the MiscClosures.  Loading an image instead of the bytecode
+// files skips decoding and linking altogether.
+//
+// Each kind of static data lives in blocks of its own contents type
+// (kInfoTables, kStaticClosures, kBytecode and kStrings), and these
+// blocks are the sections of the image.  The image contains a copy of
+// each block.  Pointers into a section are saved as the index of the
+// block and the offset into the block, and the image lists the
+// locations of all these pointers.  Loading copies each block into a
+// fresh block of the same type and relocates the listed pointers.
+//
+// The pointers are found by following the info tables and closures
+// from the loader's symbol tables and the MiscClosures, so no other
+// word is ever mistaken for a pointer.  The only exception are the
+// non-pointer fields of static closures.  They may hold string
+// literals, so they are relocated if they point into a section.
+//
+// Pointers to C functions (LIT_CFUNC) are saved by name and looked up
+// again when the image is loaded.  Strings that don't live in a
+// string block, e.g., the names of the MiscClosures, are copied into
+// additional string blocks.
+//
+// An image must be saved before any code has been run, because CAFs
+// cannot be saved once they have been evaluated.  It can only be
+// loaded by the same build of the VM.
+//
+//     +----------------------+
+//     | ImageHeader          |
+//     +----------------------+
+//     | ImageBlock * blocks  |  contents type and size of each block
+//     | ImageRoot * roots    |  names and MiscClosures
+//     | ImageForeign * ffis  |  C function pointers
+//     | u4 * relocs          |  locations of pointers
+//     +----------------------+
+//     | block data ...       |  each block padded to a word
+//     +----------------------+
+//
+// All locations and pointers are encoded as
+// (block index << Block::kBlockSizeLog2) | offset.
+
+class Image {
+public:
+  // Save the state of `loader' and the MiscClosures.  Loads any code
+  // that hasn't been loaded yet.  Returns false and prints an error
+  // if the image could not be written.
+  static bool save(const char *filename, MemoryManager *mm, Loader *loader);
+
+  // Load an image into `mm' and a loader that hasn't loaded any
+  // modules yet.  Replaces the MiscClosures.  Modules that are loaded
+  // afterwards may refer to the modules in the image.  Returns false
+  // and prints an error if the file is not a valid image.
+  static bool load(const char *filename, MemoryManager *mm, Loader *loader);
+
+private:
+  Image();
+
+  void addBlocks(Block *list);
+  bool encode(const void *p, Word *out) const;
+  void setField(void *field, Word value);
+  void pointerField(void *field);
+  void stringField(const char **field);
+  void foreignField(Word *field);
+  Word encodeString(const char *str);
+  Word rootValue(const void *p);
+  void addRoot(u4 kind, u4 index, Word name, Word value);
+  void addRoots(Loader *loader);
+  void addInfoTable(InfoTable *info);
+  void addClosure(Closure *cl);
+  void visitInfoTable(InfoTable *info);
+  void visitClosure(Closure *cl);
+  void visitLiteral(u1 littype, Word *lit);
+  void visitAll();
+  void error(const char *what, const void *p);
+  bool write(const char *filename);
+
+  static bool load(const char *filename, const char *data, size_t size,
+                   MemoryManager *mm, Loader *loader);
+
+  typedef struct {
+    u4 contents;
+    u4 bytes;
+  } ImageBlock;
+
+  typedef struct {
+    u4 kind;
+    u4 index;
+    Word name;
+    Word value;
+  } ImageRoot;
+
+  typedef struct {
+    u4 location;
+    u4 name;
+  } ImageForeign;
+
+  typedef HASH_NAMESPACE::HASH_MAP_CLASS<u4, MiscClosures::ApContInfo>
+    ApContMap;
+
+  std::vector<ImageBlock> blocks_;
+  std::vector<std::vector<char> > data_;
+  // Start of each copied block -> index.
+  std::map<const char *, u4> sections_;
+  std::vector<ImageRoot> roots_;
+  std::vector<ImageForeign> foreign_;
+  std::vector<u4> relocs_;
+  HASH_NAMESPACE::HASH_SET_CLASS<const void *> seen_;
+  std::vector<InfoTable *> infoWork_;
+  std::vector<Closure *> closureWork_;
+  // Strings copied into the additional string blocks.
+  HASH_NAMESPACE::HASH_MAP_CLASS<const void *, Word> copied_;
+  u4 copyBlock_;  // The string block being filled, or ~0.
+  const char *current_;  // Name of the object being saved.
+  bool failed_;
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _IMAGE_H_ */
@@ -0,0 +1,421 @@
+#include "integer.hh"
+#include "memorymanager.hh"
+
+#include <string.h>
+
+_START_LAMBDACHINE_NAMESPACE
+
+#if LC_ARCH_BITS == 64
+typedef unsigned __int128 DWord;
+#else
+typedef uint64_t DWord;
+#endif
+
+static const int kLimbBits = LC_ARCH_BITS;
+
+static inline int leadingZeros(Word w) {
+#if LC_ARCH_BITS == 64
+  return __builtin_clzll(w);
+#else
+  return __builtin_clz(w);
+#endif
+}
+
+// An Integer as sign and magnitude.  The magnitude of a small integer
+// is stored in the view itself.
+typedef struct {
+  const Word *limbs;
+  Word size;  // Number of limbs.  Zero iff the value is zero.
+  bool negative;
+  Word small;
+} IntegerView;
+
+static void viewInteger(Closure *z, IntegerView *v) {
+  if (isSmallInteger(z)) {
+    WordInt k = smallIntegerValue(z);
+    v->negative = k < 0;
+    v->small = k < 0 ? (Word)0 - (Word)k : (Word)k;
+    v->limbs = &v->small;
+    v->size = k != 0;
+  } else {
+    LC_ASSERT(z->info() == MiscClosures::stg_BIGPOS_info ||
+              z->info() == MiscClosures::stg_BIGNEG_info);
+    const ByteArrayClosure *big = (const ByteArrayClosure *)z;
+    v->negative = z->info() == MiscClosures::stg_BIGNEG_info;
+    v->limbs = big->payload_;
+    v->size = big->bytes_ / sizeof(Word);
+  }
+}
+
+// Scratch space for intermediate results.  Small ones live on the C
+// stack.
+class LimbBuffer {
+public:
+  explicit LimbBuffer(Word size)
+    : limbs_(size <= kInlineLimbs ? inline_ : new Word[size]) {}
+  ~LimbBuffer() { if (limbs_ != inline_) delete[] limbs_; }
+  inline Word *limbs() { return limbs_; }
+private:
+  static const Word kInlineLimbs = 32;
+  Word inline_[kInlineLimbs];
+  Word *limbs_;
+};
+
+// Build a normalised Integer from a sign and a magnitude.  Leading
+// zero limbs are ignored.
+static Closure *makeInteger(MemoryManager *mm, bool negative,
+                            const Word *limbs, Word size, Closure *box) {
+  while (size > 0 && limbs[size - 1] == 0)
+    --size;
+  if (size == 0)
+    return setSmallInteger(box, 0);
+  if (size == 1) {
+    const Word minMagnitude = (Word)1 << (kLimbBits - 1);
+    if (!negative && limbs[0] < minMagnitude)
+      return setSmallInteger(box, (WordInt)limbs[0]);
+    if (negative && limbs[0] <= minMagnitude)
+      return setSmallInteger(box, (WordInt)((Word)0 - limbs[0]));
+  }
+  ByteArrayClosure *big = (ByteArrayClosure *)
+    mm->allocLarge(sizeof(ByteArrayClosure) + size * sizeof(Word));
+  big->header_.info_ = negative ? MiscClosures::stg_BIGNEG_info
+                                : MiscClosures::stg_BIGPOS_info;
+  big->bytes_ = size * sizeof(Word);
+  memcpy(big->payload_, limbs, size * sizeof(Word));
+  return (Closure *)big;
+}
+
+// --- Magnitudes ----------------------------------------------------
+
+static int compareMagnitudes(const Word *a, Word an,
+                             const Word *b, Word bn) {
+  if (an != bn)
+    return an < bn ? -1 : 1;
+  for (Word i = an; i > 0; --i) {
+    if (a[i - 1] != b[i - 1])
+      return a[i - 1] < b[i - 1] ? -1 : 1;
+  }
+  return 0;
+}
+
+// r = a + b, where an >= bn.  r must have room for an + 1 limbs.
+static Word addMagnitudes(Word *r, const Word *a, Word an,
+                          const Word *b, Word bn) {
+  Word carry = 0;
+  Word i;
+  for (i = 0; i < bn; ++i) {
+    Word s = a[i] + carry;
+    carry = s < carry;
+    Word t = s + b[i];
+    carry += t < s;
+    r[i] = t;
+  }
+  for (; i < an; ++i) {
+    Word s = a[i] + carry;
+    carry = s < carry;
+    r[i] = s;
+  }
+  r[an] = carry;
+  return an + 1;
+}
+
+// r = a - b, where a >= b.  r must have room for an limbs.
+static Word subMagnitudes(Word *r, const Word *a, Word an,
+                          const Word *b, Word bn) {
+  Word borrow = 0;
+  Word i;
+  for (i = 0; i < bn; ++i) {
+    Word t = a[i] - b[i];
+    Word borrow1 = a[i] < b[i];
+    r[i] = t - borrow;
+    borrow = borrow1 | (t < borrow);
+  }
+  for (; i < an; ++i) {
+    r[i] = a[i] - borrow;
+    borrow = a[i] < borrow;
+  }
+  LC_ASSERT(borrow == 0);
+  return an;
+}
+
+// r = a * b.  r must have room for an + bn limbs.
+static Word mulMagnitudes(Word *r, const Word *a, Word an,
+                          const Word *b, Word bn) {
+  memset(r, 0, (an + bn) * sizeof(Word));
+  for (Word i = 0; i < an; ++i) {
+    Word carry = 0;
+    for (Word j = 0; j < bn; ++j) {
+      DWord t = (DWord)a[i] * b[j] + r[i + j] + carry;
+      r[i + j] = (Word)t;
+      carry = (Word)(t >> kLimbBits);
+    }
+    r[i + bn] = carry;
+  }
+  return an + bn;
+}
+
+// q = a / b, r = a % b, where an >= bn > 0 and b is normalised
+// (b[bn - 1] != 0).  q must have room for an - bn + 1 limbs and r for
+// bn limbs.  This is Knuth's Algorithm D (TAOCP Vol. 2, 4.3.1).
+static void divModMagnitudes(Word *q, Word *r, const Word *a, Word an,
+                             const Word *b, Word bn) {
+  LC_ASSERT(an >= bn && bn > 0 && b[bn - 1] != 0);
+  if (bn == 1) {
+    Word rem = 0;
+    for (Word i = an; i > 0; --i) {
+      DWord t = ((DWord)rem << kLimbBits) | a[i - 1];
+      q[i - 1] = (Word)(t / b[0]);
+      rem = (Word)(t % b[0]);
+    }
+    r[0] = rem;
+    return;
+  }
+
+  // Shift both operands so that the top bit of the divisor is set.
+  // This makes the quotient estimate below off by at most 2.
+  int s = leadingZeros(b[bn - 1]);
+  LimbBuffer vbuf(bn), ubuf(an + 1);
+  Word *v = vbuf.limbs(), *u = ubuf.limbs();
+  for (Word i = bn - 1; i > 0; --i)
+    v[i] = (b[i] << s) | (s ? b[i - 1] >> (kLimbBits - s) : 0);
+  v[0] = b[0] << s;
+  u[an] = s ? a[an - 1] >> (kLimbBits - s) : 0;
+  for (Word i = an - 1; i > 0; --i)
+    u[i] = (a[i] << s) | (s ? a[i - 1] >> (kLimbBits - s) : 0);
+  u[0] = a[0] << s;
+
+  for (Word j = an - bn + 1; j > 0; ) {
+    --j;
+    DWord num = ((DWord)u[j + bn] << kLimbBits) | u[j + bn - 1];
+    DWord qhat = num / v[bn - 1];
+    DWord rhat = num - qhat * v[bn - 1];
+    while ((qhat >> kLimbBits) != 0 ||
+           qhat * v[bn - 2] > ((rhat << kLimbBits) | u[j + bn - 2])) {
+      --qhat;
+      rhat += v[bn - 1];
+      if ((rhat >> kLimbBits) != 0)
+        break;
+    }
+
+    // u[j .. j + bn] -= qhat * v
+    Word carry = 0, borrow = 0;
+    for (Word i = 0; i < bn; ++i) {
+      DWord p = qhat * v[i] + carry;
+      carry = (Word)(p >> kLimbBits);
+      Word t = u[i + j] - (Word)p;
+      Word borrow1 = u[i + j] < (Word)p;
+      u[i + j] = t - borrow;
+      borrow = borrow1 | (t < borrow);
+    }
+    Word t = u[j + bn] - carry;
+    Word borrow1 = u[j + bn] < carry;
+    u[j + bn] = t - borrow;
+    borrow = borrow1 | (t < borrow);
+
+    if (borrow) {
+      // qhat was one too large.  Add v back.
+      --qhat;
+      Word c = 0;
+      for (Word i = 0; i < bn; ++i) {
+        DWord sum = (DWord)u[i + j] + v[i] + c;
+        u[i + j] = (Word)sum;
+        c = (Word)(sum >> kLimbBits);
+      }
+      u[j + bn] += c;
+    }
+    q[j] = (Word)qhat;
+  }
+
+  for (Word i = 0; i < bn - 1; ++i)
+    r[i] = (u[i] >> s) | (s ? u[i + 1] << (kLimbBits - s) : 0);
+  r[bn - 1] = u[bn - 1] >> s;
+}
+
+// --- Integer operations --------------------------------------------
+
+static Closure *addIntegers(MemoryManager *mm, const IntegerView *x,
+                            const IntegerView *y, bool negateY,
+                            Closure *box) {
+  const IntegerView *a = x, *b = y;
+  bool aneg = x->negative, bneg = y->negative ^ negateY;
+  if (compareMagnitudes(x->limbs, x->size, y->limbs, y->size) < 0) {
+    a = y; b = x;
+    bool tmp = aneg; aneg = bneg; bneg = tmp;
+  }
+  LimbBuffer r(a->size + 1);
+  Word rn;
+  if (aneg == bneg)
+    rn = addMagnitudes(r.limbs(), a->limbs, a->size, b->limbs, b->size);
+  else
+    rn = subMagnitudes(r.limbs(), a->limbs, a->size, b->limbs, b->size);
+  return makeInteger(mm, aneg, r.limbs(), rn, box);
+}
+
+Closure *integerAdd(MemoryManager *mm, Closure *x, Closure *y, Closure *box) {
+  x = untag(x);
+  y = untag(y);
+  WordInt k;
+  if (isSmallInteger(x) && isSmallInteger(y) &&
+      !addOverflows(smallIntegerValue(x), smallIntegerValue(y), &k))
+    return setSmallInteger(box, k);
+  IntegerView vx, vy;
+  viewInteger(x, &vx);
+  viewInteger(y, &vy);
+  return addIntegers(mm, &vx, &vy, false, box);
+}
+
+Closure *integerSub(MemoryManager *mm, Closure *x, Closure *y, Closure *box) {
+  x = untag(x);
+  y = untag(y);
+  WordInt k;
+  if (isSmallInteger(x) && isSmallInteger(y) &&
+      !subOverflows(smallIntegerValue(x), smallIntegerValue(y), &k))
+    return setSmallInteger(box, k);
+  IntegerView vx, vy;
+  viewInteger(x, &vx);
+  viewInteger(y, &vy);
+  return addIntegers(mm, &vx, &vy, true, box);
+}
+
+Closure *integerMul(MemoryManager *mm, Closure *x, Closure *y, Closure *box) {
+  x = untag(x);
+  y = untag(y);
+  WordInt k;
+  if (isSmallInteger(x) && isSmallInteger(y) &&
+      !mulOverflows(smallIntegerValue(x), smallIntegerValue(y), &k))
+    return setSmallInteger(box, k);
+  IntegerView vx, vy;
+  viewInteger(x, &vx);
+  viewInteger(y, &vy);
+  if (vx.size == 0 || vy.size == 0)
+    return setSmallInteger(box, 0);
+  LimbBuffer r(vx.size + vy.size);
+  Word rn = mulMagnitudes(r.limbs(), vx.limbs, vx.size, vy.limbs, vy.size);
+  return makeInteger(mm, vx.negative != vy.negative, r.limbs(), rn, box);
+}
+
+static Closure *quotRemIntegers(MemoryManager *mm, Closure *x, Closure *y,
+                                bool wantQuot, Closure *box) {
+  IntegerView vx, vy;
+  viewInteger(x, &vx);
+  viewInteger(y, &vy);
+  LC_ASSERT(vy.size != 0);
+  if (vx.size < vy.size) {
+    // |x| < |y|
+    if (wantQuot)
+      return setSmallInteger(box, 0);
+    return makeInteger(mm, vx.negative, vx.limbs, vx.size, box);
+  }
+  LimbBuffer q(vx.size - vy.size + 1), r(vy.size);
+  divModMagnitudes(q.limbs(), r.limbs(), vx.limbs, vx.size,
+                   vy.limbs, vy.size);
+  if (wantQuot)
+    return makeInteger(mm, vx.negative != vy.negative, q.limbs(),
+                       vx.size - vy.size + 1, box);
+  return makeInteger(mm, vx.negative, r.limbs(), vy.size, box);
+}
+
+Closure *integerQuot(MemoryManager *mm, Closure *x, Closure *y, Closure *box) {
+  x = untag(x);
+  y = untag(y);
+  WordInt k;
+  if (isSmallInteger(x) && isSmallInteger(y) &&
+      !quotOverflows(smallIntegerValue(x), smallIntegerValue(y), &k))
+    return setSmallInteger(box, k);
+  return quotRemIntegers(mm, x, y, true, box);
+}
+
+Closure *integerRem(MemoryManager *mm, Closure *x, Closure *y, Closure *box) {
+  x = untag(x);
+  y = untag(y);
+  WordInt k;
+  if (isSmallInteger(x) && isSmallInteger(y) &&
+      !remOverflows(smallIntegerValue(x), smallIntegerValue(y), &k))
+    return setSmallInteger(box, k);
+  return quotRemIntegers(mm, x, y, false, box);
+}
+
+Closure *integerShl(MemoryManager *mm, Closure *x, WordInt n, Closure *box) {
+  LC_ASSERT(n >= 0);
+  x = untag(x);
+  WordInt k;
+  if (isSmallInteger(x) && !shlOverflows(smallIntegerValue(x), n, &k))
+    return setSmallInteger(box, k);
+  IntegerView vx;
+  viewInteger(x, &vx);
+  Word limbShift = (Word)n / kLimbBits;
+  int bitShift = (int)((Word)n % kLimbBits);
+  Word rn = vx.size + limbShift + 1;
+  LimbBuffer r(rn);
+  Word *rl = r.limbs();
+  memset(rl, 0, limbShift * sizeof(Word));
+  Word carry = 0;
+  for (Word i = 0; i < vx.size; ++i) {
+    rl[limbShift + i] = (vx.limbs[i] << bitShift) | carry;
+    carry = bitShift ? vx.limbs[i] >> (kLimbBits - bitShift) : 0;
+  }
+  rl[rn - 1] = carry;
+  return makeInteger(mm, vx.negative, rl, rn, box);
+}
+
+Closure *integerShr(MemoryManager *mm, Closure *x, WordInt n, Closure *box) {
+  LC_ASSERT(n >= 0);
+  x = untag(x);
+  if (isSmallInteger(x))
+    return setSmallInteger(box, shrSmallInteger(smallIntegerValue(x), n));
+  IntegerView vx;
+  viewInteger(x, &vx);
+  Word limbShift = (Word)n / kLimbBits;
+  int bitShift = (int)((Word)n % kLimbBits);
+  if (limbShift >= vx.size)
+    return setSmallInteger(box, vx.negative ? -1 : 0);
+
+  // Rounding towards negative infinity means that a negative number
+  // whose shifted-out bits are not all zero is rounded away from zero.
+  bool inexact = bitShift && (vx.limbs[limbShift] << (kLimbBits - bitShift));
+  for (Word i = 0; i < limbShift && !inexact; ++i)
+    inexact = vx.limbs[i] != 0;
+
+  Word rn = vx.size - limbShift;
+  LimbBuffer r(rn + 1);
+  Word *rl = r.limbs();
+  for (Word i = 0; i < rn; ++i) {
+    Word hi = (i + 1 < rn && bitShift)
+      ? vx.limbs[limbShift + i + 1] << (kLimbBits - bitShift) : 0;
+    rl[i] = (vx.limbs[limbShift + i] >> bitShift) | hi;
+  }
+  rl[rn] = 0;
+  if (vx.negative && inexact) {
+    // Add one to the magnitude.
+    Word i = 0;
+    while (++rl[i] == 0)
+      ++i;
+    ++rn;
+  }
+  return makeInteger(mm, vx.negative, rl, rn, box);
+}
+
+WordInt integerCompare(Closure *x, Closure *y) {
+  x = untag(x);
+  y = untag(y);
+  if (isSmallInteger(x) && isSmallInteger(y))
+    return compareSmallIntegers(smallIntegerValue(x), smallIntegerValue(y));
+  IntegerView vx, vy;
+  viewInteger(x, &vx);
+  viewInteger(y, &vy);
+  if (vx.negative != vy.negative)
+    return vx.negative ? -1 : 1;
+  int c = compareMagnitudes(vx.limbs, vx.size, vy.limbs, vy.size);
+  return vx.negative ? -c : c;
+}
+
+WordInt integerToInt(Closure *x) {
+  x = untag(x);
+  if (isSmallInteger(x))
+    return smallIntegerValue(x);
+  IntegerView vx;
+  viewInteger(x, &vx);
+  return (WordInt)(vx.negative ? (Word)0 - vx.limbs[0] : vx.limbs[0]);
+}
+
+_END_LAMBDACHINE_NAMESPACE
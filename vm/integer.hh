@@ -0,0 +1,145 @@
+#ifndef _INTEGER_H_
+#define _INTEGER_H_
+
+#include "common.hh"
+#include "objects.hh"
+#include "miscclosures.hh"
+
+_START_LAMBDACHINE_NAMESPACE
+
+class MemoryManager;
+
+// --- Integers ------------------------------------------------------
+//
+// Haskell's Integer type is implemented by the VM.  An Integer is
+// either
+//
+//   - a small integer: a stg_SMALLINT constructor (tag 1) whose only
+//     payload word is a WordInt, or
+//
+//   - a big integer: a large byte array (like the ones created by
+//     NEWBYTEA) with info table stg_BIGPOS or stg_BIGNEG.  The payload
+//     holds the magnitude as an array of limbs (words), least
+//     significant limb first.  The most significant limb is non-zero.
+//
+// An Integer that fits into a WordInt is always small.  This is the
+// same representation as GHC's integer-gmp (S#, Jp#, Jn#).
+//
+// The Integer bytecodes (ADDZ, etc.) handle small operands with a
+// small result inline.  Everything else is done by the helpers below,
+// which are also called from traces.  They never trigger a GC: a big
+// result is allocated with MemoryManager::allocLarge, and a small
+// result is written into `box', an (uninitialised) two word closure
+// which the caller has allocated on the heap.  If the result is big,
+// `box' is not used.  Operands may be tagged pointers, results are
+// never tagged.
+
+inline bool isSmallInteger(const Closure *z) {
+  return z->info() == MiscClosures::stg_SMALLINT_info;
+}
+
+inline WordInt smallIntegerValue(const Closure *z) {
+  return (WordInt)z->payload(0);
+}
+
+inline Closure *setSmallInteger(Closure *box, WordInt value) {
+  box->setInfo(MiscClosures::stg_SMALLINT_info);
+  box->setPayload(0, (Word)value);
+  return box;
+}
+
+// The number of bytes used by the Integer.
+inline Word integerAllocBytes(const Closure *z) {
+  if (isSmallInteger(z))
+    return 2 * sizeof(Word);
+  return sizeof(ByteArrayClosure) + ((const ByteArrayClosure *)z)->bytes_;
+}
+
+// Overflow-checked WordInt arithmetic.  Each returns true if the
+// result does not fit into a WordInt.  *res is undefined in that case.
+
+inline bool addOverflows(WordInt x, WordInt y, WordInt *res) {
+  Word r = (Word)x + (Word)y;
+  *res = (WordInt)r;
+  // Overflow iff both operands have the same sign and the result's
+  // sign differs.
+  return (WordInt)((r ^ (Word)x) & (r ^ (Word)y)) < 0;
+}
+
+inline bool subOverflows(WordInt x, WordInt y, WordInt *res) {
+  Word r = (Word)x - (Word)y;
+  *res = (WordInt)r;
+  return (WordInt)(((Word)x ^ (Word)y) & (r ^ (Word)x)) < 0;
+}
+
+inline bool mulOverflows(WordInt x, WordInt y, WordInt *res) {
+#if LC_ARCH_BITS == 64
+  __int128 r = (__int128)x * (__int128)y;
+#else
+  int64_t r = (int64_t)x * (int64_t)y;
+#endif
+  *res = (WordInt)r;
+  return r != (WordInt)r;
+}
+
+// Division truncates towards zero.  The divisor must not be zero.
+inline bool quotOverflows(WordInt x, WordInt y, WordInt *res) {
+  if (LC_UNLIKELY(y == -1)) return subOverflows(0, x, res);
+  *res = x / y;
+  return false;
+}
+
+inline bool remOverflows(WordInt x, WordInt y, WordInt *res) {
+  *res = (y == -1) ? 0 : x % y;
+  return false;
+}
+
+// Shifts by n >= 0 bits.  Shifting right rounds towards negative
+// infinity.
+inline bool shlOverflows(WordInt x, WordInt n, WordInt *res) {
+  if (x == 0) { *res = 0; return false; }
+  if (n >= LC_ARCH_BITS) return true;
+  *res = (WordInt)((Word)x << n);
+  return (*res >> n) != x;
+}
+
+// The high word of the unsigned double-word product.
+inline Word mulHighWord(Word x, Word y) {
+#if LC_ARCH_BITS == 64
+  return (Word)(((unsigned __int128)x * y) >> 64);
+#else
+  return (Word)(((uint64_t)x * y) >> 32);
+#endif
+}
+
+inline WordInt shrSmallInteger(WordInt x, WordInt n) {
+  if (n >= LC_ARCH_BITS) return x < 0 ? -1 : 0;
+  return x >> n;
+}
+
+inline WordInt compareSmallIntegers(WordInt x, WordInt y) {
+  return (x > y) - (x < y);
+}
+
+Closure *integerAdd(MemoryManager *mm, Closure *x, Closure *y, Closure *box);
+Closure *integerSub(MemoryManager *mm, Closure *x, Closure *y, Closure *box);
+Closure *integerMul(MemoryManager *mm, Closure *x, Closure *y, Closure *box);
+
+// Truncated division.  Like for DIVRR/REMRR the caller must make
+// sure that the divisor is not zero.
+Closure *integerQuot(MemoryManager *mm, Closure *x, Closure *y, Closure *box);
+Closure *integerRem(MemoryManager *mm, Closure *x, Closure *y, Closure *box);
+
+// Shift by n >= 0 bits.  integerShr rounds towards negative infinity.
+Closure *integerShl(MemoryManager *mm, Closure *x, WordInt n, Closure *box);
+Closure *integerShr(MemoryManager *mm, Closure *x, WordInt n, Closure *box);
+
+// Returns -1, 0, or 1.
+WordInt integerCompare(Closure *x, Closure *y);
+
+// The least significant word of the two's complement representation.
+WordInt integerToInt(Closure *x);
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _INTEGER_H_ */
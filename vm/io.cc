@@ -0,0 +1,210 @@
+#include "io.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+_START_LAMBDACHINE_NAMESPACE
+
+Handle::Handle(int fd, bool owned, bool buffered)
+  : fd_(fd), owned_(owned), closed_(false), used_(0), limit_(buffered ? kBufferSize : 0),
+    buf_(buffered ? new char[kBufferSize] : NULL) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+Handle::~Handle() {
+  close();
+  pthread_mutex_destroy(&lock_);
+}
+
+static bool writeAll(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t written = ::write(fd, p, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += written;
+    n -= written;
+  }
+  return true;
+}
+
+bool Handle::flush() {
+  pthread_mutex_lock(&lock_);
+  bool ok = flushLocked();
+  pthread_mutex_unlock(&lock_);
+  return ok;
+}
+
+bool Handle::close() {
+  pthread_mutex_lock(&lock_);
+  if (closed_) {
+    pthread_mutex_unlock(&lock_);
+    return false;
+  }
+  bool ok = flushLocked();
+  if (owned_)
+    ok = ::close(fd_) == 0 && ok;
+  closed_ = true;
+  // The fast path of putChar now always falls through to write.
+  limit_ = 0;
+  delete[] buf_;
+  buf_ = NULL;
+  pthread_mutex_unlock(&lock_);
+  return ok;
+}
+
+bool Handle::flushLocked() {
+  if (closed_)
+    return false;
+  size_t n = used_;
+  used_ = 0;
+  return writeAll(fd_, buf_, n);
+}
+
+bool Handle::write(const void *data, size_t n) {
+  pthread_mutex_lock(&lock_);
+  bool ok = writeLocked(data, n);
+  pthread_mutex_unlock(&lock_);
+  return ok;
+}
+
+bool Handle::writeLocked(const void *data, size_t n) {
+  if (closed_)
+    return false;
+  if (n > limit_ - used_ || limit_ == 0) {
+    if (!flushLocked())
+      return false;
+    // Large writes bypass the buffer.
+    if (n >= limit_)
+      return writeAll(fd_, (const char *)data, n);
+  }
+  memcpy(buf_ + used_, data, n);
+  used_ += n;
+  return true;
+}
+
+bool Handle::putCharSlow(u4 c) {
+  char utf8[4];
+  size_t n;
+  if (c < 0x80) {
+    utf8[0] = (char)c;
+    n = 1;
+  } else if (c < 0x800) {
+    utf8[0] = (char)(0xc0 | (c >> 6));
+    utf8[1] = (char)(0x80 | (c & 0x3f));
+    n = 2;
+  } else if (c < 0x10000) {
+    utf8[0] = (char)(0xe0 | (c >> 12));
+    utf8[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+    utf8[2] = (char)(0x80 | (c & 0x3f));
+    n = 3;
+  } else {
+    utf8[0] = (char)(0xf0 | ((c >> 18) & 0x07));
+    utf8[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    utf8[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    utf8[3] = (char)(0x80 | (c & 0x3f));
+    n = 4;
+  }
+  return write(utf8, n);
+}
+
+Handle *HandleTable::handles_[kMaxHandles];
+pthread_mutex_t HandleTable::lock_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t HandleTable::initOnce_ = PTHREAD_ONCE_INIT;
+
+void HandleTable::init() {
+  handles_[STDOUT_FILENO] = new Handle(STDOUT_FILENO, false);
+  handles_[STDERR_FILENO] = new Handle(STDERR_FILENO, false, false);
+  // Output must not get lost if the VM calls exit() somewhere.
+  atexit(flushAll);
+}
+
+Handle *HandleTable::get(Word h) {
+  pthread_once(&initOnce_, init);
+  return h < kMaxHandles ? __atomic_load_n(&handles_[h], __ATOMIC_ACQUIRE)
+                         : NULL;
+}
+
+WordInt HandleTable::open(const char *path, Word mode) {
+  pthread_once(&initOnce_, init);
+  int flags = O_WRONLY | O_CREAT |
+    (mode == HANDLE_APPEND ? O_APPEND : O_TRUNC);
+  int fd = ::open(path, flags, 0666);
+  if (fd < 0)
+    return -1;
+  pthread_mutex_lock(&lock_);
+  Word h = 3;
+  while (h < kMaxHandles && handles_[h] != NULL)
+    ++h;
+  if (h < kMaxHandles)
+    __atomic_store_n(&handles_[h], new Handle(fd, true), __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lock_);
+  if (h == kMaxHandles) {
+    ::close(fd);
+    return -1;
+  }
+  return (WordInt)h;
+}
+
+bool HandleTable::close(Word h) {
+  Handle *hd = get(h);
+  if (hd == NULL)
+    return false;
+  if (h <= 2)
+    return hd->flush();
+  pthread_mutex_lock(&lock_);
+  hd = handles_[h];
+  __atomic_store_n(&handles_[h], (Handle *)NULL, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lock_);
+  if (hd == NULL)
+    return false;  // Somebody else closed it.
+  // Other capabilities may still use `hd', so it is never freed.
+  return hd->close();
+}
+
+void HandleTable::flushAll() {
+  pthread_mutex_lock(&lock_);
+  for (Word h = 0; h < kMaxHandles; ++h) {
+    if (handles_[h] != NULL)
+      handles_[h]->flush();
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+WordInt handleOpen(const char *path, Word mode) {
+  return HandleTable::open(path, mode);
+}
+
+WordInt handleClose(Word h) {
+  return HandleTable::close(h) ? 0 : -1;
+}
+
+WordInt handleFlush(Word h) {
+  Handle *hd = HandleTable::get(h);
+  return hd != NULL && hd->flush() ? 0 : -1;
+}
+
+WordInt handlePutChar(Word h, Word c) {
+  Handle *hd = HandleTable::get(h);
+  return hd != NULL && hd->putChar((u4)c) ? 0 : -1;
+}
+
+WordInt handlePutStr(Word h, const char *str) {
+  Handle *hd = HandleTable::get(h);
+  return hd != NULL && hd->write(str, strlen(str)) ? 0 : -1;
+}
+
+WordInt handleWriteByteArray(Word h, Closure *arr, Word offset, Word n) {
+  LC_ASSERT(offset + n <= ((ByteArrayClosure *)arr)->bytes_);
+  Handle *hd = HandleTable::get(h);
+  return hd != NULL &&
+    hd->write((const char *)((ByteArrayClosure *)arr)->payload_ + offset, n)
+    ? 0 : -1;
+}
+
+_END_LAMBDACHINE_NAMESPACE
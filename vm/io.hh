@@ -0,0 +1,113 @@
+#ifndef _IO_H_
+#define _IO_H_
+
+#include "common.hh"
+#include "objects.hh"
+
+#include <pthread.h>
+
+_START_LAMBDACHINE_NAMESPACE
+
+// --- Buffered output -------------------------------------------------
+//
+// All capabilities share one table of output handles (see
+// HandleTable).  Handle 1 is stdout and handle 2 is stderr; HOPEN
+// adds handles for files.  A handle collects output in a buffer and
+// only writes it to its file descriptor when the buffer is full, on
+// HFLUSH or HCLOSE, when the main thread reaches STOP, and when the
+// process exits.  Stderr is not buffered.
+//
+// Every handle has a lock, so capabilities may write to the same
+// handle concurrently.  Another capability may still hold a handle
+// that HCLOSE removes from the table, so closing a handle only marks
+// it closed and the table never frees it; later writes fail.
+
+class Handle {
+public:
+  static const size_t kBufferSize = 64 * 1024;
+
+  // If `owned' is true, the handle closes `fd' when it is destroyed.
+  // An unbuffered handle writes all output immediately.
+  Handle(int fd, bool owned, bool buffered = true);
+  ~Handle();
+
+  inline int fd() const { return fd_; }
+  inline size_t buffered() const { return used_; }
+
+  // All of these return false if writing to the file descriptor
+  // failed.
+  bool write(const void *data, size_t n);
+  bool flush();
+  // Flush the buffer and close the file descriptor if the handle owns
+  // it.  Returns false if the handle was already closed.
+  bool close();
+
+  // Write the Unicode code point `c', encoded as UTF-8.
+  inline bool putChar(u4 c) {
+    pthread_mutex_lock(&lock_);
+    if (LC_LIKELY(c < 0x80 && used_ < limit_)) {
+      buf_[used_++] = (char)c;
+      pthread_mutex_unlock(&lock_);
+      return true;
+    }
+    pthread_mutex_unlock(&lock_);
+    return putCharSlow(c);
+  }
+
+private:
+  bool putCharSlow(u4 c);
+  bool writeLocked(const void *data, size_t n);
+  bool flushLocked();
+
+  int fd_;
+  bool owned_;
+  bool closed_;
+  size_t used_;
+  size_t limit_;  // kBufferSize, or 0 if unbuffered.
+  char *buf_;
+  pthread_mutex_t lock_;
+};
+
+// The output handles of the process.  Handles are numbered; the
+// number of a closed handle is reused by open.
+class HandleTable {
+public:
+  static const Word kMaxHandles = 1024;
+
+  // The handle with the given number, or NULL if there is none.
+  static Handle *get(Word h);
+  // Open a file for output.  Returns the new handle, or -1.
+  static WordInt open(const char *path, Word mode);
+  // Flush and close a handle.  Closing stdout or stderr only flushes
+  // them.
+  static bool close(Word h);
+  // Also called when the process exits.
+  static void flushAll();
+
+private:
+  static void init();
+
+  static Handle *handles_[kMaxHandles];
+  static pthread_mutex_t lock_;
+  static pthread_once_t initOnce_;
+};
+
+// Helpers for the I/O bytecodes in traces.  Each returns 0 on success
+// and -1 on error, except handleOpen, which returns the new handle or
+// -1.
+WordInt handleOpen(const char *path, Word mode);
+WordInt handleClose(Word h);
+WordInt handleFlush(Word h);
+WordInt handlePutChar(Word h, Word c);
+WordInt handlePutStr(Word h, const char *str);
+WordInt handleWriteByteArray(Word h, Closure *arr, Word offset, Word n);
+
+// Modes of HOPEN.
+enum {
+  HANDLE_WRITE = 0,   // Create or truncate.
+  HANDLE_APPEND = 1   // Create or append.
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _IO_H_ */
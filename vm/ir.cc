@@ -4,6 +4,10 @@
 #include "objects.hh"
 #include "miscclosures.hh"
 #include "capability.hh"
+#include "integer.hh"
+#include "bytearray.hh"
+#include "ffi.hh"
+#include "io.hh"
 
 #include <iostream>
 #include <iomanip>
@@ -69,7 +73,14 @@ void IR::printIRRef(std::ostream &out, IRRef ref) {
 }
 
 void printLiteralValue(ostream &out, IR *ir, bool print_raw_value) {
-  if (ir->opcode() == IR::kKINT) {
+  if (isFloatType(ir->type()) &&
+      (ir->opcode() == IR::kKINT || ir->opcode() == IR::kKWORD)) {
+    uint64_t k = ir->opcode() == IR::kKINT ? (uint64_t)ir->u32()
+      : (uint64_t)ir->u32() | ((uint64_t)(ir - 1)->u32() << 32);
+    out << ' ' << COL_PURPLE
+        << (ir->type() == IRT_F64 ? lc_w2d(k) : (double)lc_w2f(k))
+        << COL_RESET;
+  } else if (ir->opcode() == IR::kKINT) {
     int32_t i = ir->i32();
     char sign = (i < 0) ? '-' : '+';
     uint32_t k = (i < 0) ? -i : i;
@@ -182,6 +193,8 @@ void IR::debugPrint(ostream &out, IRRef self, IRBuffer *buf, bool regs) {
   printArg(out, (mod >> 2) & 3, op2(), this, buf);
   if (op == IR::kNEW && buf)
     print_heapentry(out, buf, op2());
+  if (op == IR::kCALLN)
+    out << "  " << ircall_info[op2()].name;
   out << endl;
 }
 
@@ -279,7 +292,9 @@ TRef IRBuffer::emit() {
 
 TRef IRBuffer::literal(IRType ty, uint64_t lit) {
   IRRef ref;
-  if (checki32(lit)) {
+  // KINT literals of unsigned (and non-integer) types are
+  // zero-extended by literalValue.
+  if (isSigned(ty) ? checki32(lit) : checku32(lit)) {
     int32_t k = (int32_t)lit;
     for (ref = chain_[IR::kKINT]; ref != 0; ref = buffer_[ref].prev()) {
       if (buffer_[ref].i32() == k && buffer_[ref].type() == ty)
@@ -368,6 +383,36 @@ uint64_t IRBuffer::literalValue(IRRef ref) {
   return 0;
 }
 
+// Floating point values are loaded from stack slots and fields
+// without knowing their type.  The first floating point operation
+// that uses such a value determines its type.  Returns TRef() if tr
+// cannot be used as a value of type ty.
+TRef IRBuffer::floatOperand(TRef tr, IRType ty) {
+  LC_ASSERT(isFloatType(ty));
+  IRRef ref = tr.ref();
+  IR *ins = ir(ref);
+  if (ins->type() == ty)
+    return TRef(ref, ty);
+  if (irref_islit(ref)) {
+    if (ins->opcode() == IR::kKBASEO)
+      return TRef();
+    return literal(ty, literalValue(ref));
+  }
+  // Values inherited from a parent trace keep the parent's register
+  // class.
+  if (ins->type() != IRT_UNKNOWN || ref < stopins_)
+    return TRef();
+  for (IRRef r = ref + 1; r < bufmax_; ++r) {
+    IR *use = ir(r);
+    IR::IRMode mode = IR::mode(use->opcode());
+    if ((irmode_left(mode) == IR::IRMref && use->op1() == ref) ||
+        (irmode_right(mode) == IR::IRMref && use->op2() == ref))
+      return TRef();
+  }
+  ins->setT((ins->t() & ~IRT_TYPE) | ty);
+  return TRef(ref, ty);
+}
+
 TRef IRBuffer::optCSE() {
   if (flags_.get(kOptCSE)) {
     IRRef2 op12 =
@@ -417,6 +462,32 @@ TRef IRBuffer::emitNEW(IRRef1 itblref, int nfields, HeapEntry *out) {
   return tref;
 }
 
+const CCallInfo ircall_info[IRCALL__MAX] = {
+#define IRCALLINFO(name, nargs, mode) \
+  { (void *)&name, #name, nargs, IRCALL_##mode },
+  IRCALLDEF(IRCALLINFO)
+#undef IRCALLINFO
+};
+
+TRef IRBuffer::emitCall(IRCallID id, IRType ty, int nargs, TRef *args) {
+  LC_ASSERT(nargs > 0 && nargs == ircall_info[id].nargs);
+  TRef argref = args[0];
+  for (int i = 1; i < nargs; ++i)
+    argref = emit(IR::kCARG, IRT_VOID, argref, args[i]);
+  if (ircall_info[id].mode != IRCALL_N)
+    return emitRaw(IRT(IR::kCALLN, ty), argref, id);
+  return emit(IR::kCALLN, ty, argref, id);
+}
+
+TRef IRBuffer::emitCCall(u2 sig, int nargs, TRef *args) {
+  static const IRType resultty[] = { IRT_VOID, IRT_I64, IRT_F64, IRT_F32 };
+  LC_ASSERT(nargs <= kFfiMaxArgs);
+  TRef argref = args[0];
+  for (int i = 1; i <= nargs; ++i)
+    argref = emit(IR::kCARG, IRT_VOID, argref, args[i]);
+  return emitRaw(IRT(IR::kCCALL, resultty[ffiResultType(sig)]), argref, sig);
+}
+
 uint32_t IRBuffer::setHeapOffsets() {
   int offset = 0;
   IRRef href = chain_[IR::kNEW];
@@ -719,6 +790,10 @@ const char *IR::regName(uint8_t r, IRType ty) {
     return regNames64[r];
   case IRT_I32:
   case IRT_U32:
+  case IRT_I16:
+  case IRT_U16:
+  case IRT_I8:
+  case IRT_U8:
   case IRT_CHR:
     LC_ASSERT(r < RID_MAX_GPR);
     return regNames32[r];
@@ -21,6 +21,14 @@ typedef u4 IRRef;               /* Used to pass around references */
 //     ref  FREF   base offs   ; reference to a field
 //     void FSTORE ref value
 //
+// Array elements are accessed via an AREF.  The type of the ALOAD or
+// ASTORE selects the element size: IRT_CLOS for boxed arrays, and
+// IRT_U8 .. IRT_U64 for byte arrays (see arrayElementSize).
+//
+//     ref  AREF   array index
+//     u16  ALOAD  ref         ; ((u2 *)array->payload_)[index]
+//     u16  ASTORE ref value
+//
 // Flags:
 //   N .. normal
 //   C .. commutative
@@ -48,6 +56,8 @@ typedef u4 IRRef;               /* Used to pass around references */
   _(EQINFO,  G,   ref, ref) \
   _(NEINFO,  G,   ref, ref) \
   _(HEAPCHK, S,   lit, ___) \
+  _(WBAR,    S,   ref, ref) \
+  _(SAFEPOINT, S, ___, ___) \
    \
   _(NOP,     N,   ___, ___) \
   _(BASE,    N,   lit, lit) \
@@ -71,6 +81,12 @@ typedef u4 IRRef;               /* Used to pass around references */
   _(BSAR,    N,   ref, ref) \
   _(BROL,    N,   ref, ref) \
   _(BROR,    N,   ref, ref) \
+  _(POPCNT,  N,   ref, ___) \
+  _(CLZ,     N,   ref, ___) \
+  _(CTZ,     N,   ref, ___) \
+  _(BSWAP,   N,   ref, ___) \
+  _(PDEP,    N,   ref, ref) \
+  _(PEXT,    N,   ref, ref) \
   \
   _(ADD,     C,   ref, ref) \
   _(SUB,     N,   ref, ref) \
@@ -78,6 +94,17 @@ typedef u4 IRRef;               /* Used to pass around references */
   _(DIV,     N,   ref, ref) \
   _(REM,     N,   ref, ref) \
   _(NEG,     N,   ref, ___) \
+  /* Checked arithmetic.  Always guards, exits on signed overflow. */ \
+  _(ADDOV,   C,   ref, ref) \
+  _(SUBOV,   N,   ref, ref) \
+  _(MULOV,   C,   ref, ref) \
+  _(ADDCU,   C,   ref, ref) /* carry of unsigned ADD */ \
+  _(MULHU,   C,   ref, ref) /* high word of unsigned MUL */ \
+  _(CONV,    N,   ref, lit) /* op2 = source IRType */ \
+  \
+  _(CARG,    N,   ref, ref) \
+  _(CALLN,   N,   ref, lit) /* op2 = IRCallID */ \
+  _(CCALL,   S,   ref, lit) /* foreign call, op2 = FFI signature */ \
   \
   _(FREF,    R,   ref, lit) \
   _(FLOAD,   L,   ref, ___) \
@@ -85,8 +112,11 @@ typedef u4 IRRef;               /* Used to pass around references */
   _(ILOAD,   L,   ref, ___) \
   _(RLOAD,   L,   ___, ___) \
   _(PLOAD,   L,   ref, ref) \
+  _(AREF,    R,   ref, ref) /* op1 = array, op2 = index */ \
+  _(ALOAD,   L,   ref, ___) \
   _(NEW,     A,   ref, lit) \
   _(FSTORE,  S,   ref, ref) \
+  _(ASTORE,  S,   ref, ref) /* IRT_CLOS: includes the card marking */ \
   _(UPDATE,  S,   ref, ref) \
   _(SAVE,    S,   lit, lit)
 /*
@@ -194,6 +224,17 @@ inline bool isSigned(IRType t) {
   return kOpIsSigned & (1u << (int)t);
 }
 
+// Size in bytes of an array element accessed by an ALOAD or ASTORE
+// of the given type.
+inline int arrayElementSize(IRType t) {
+  switch (t) {
+  case IRT_U8:  return 1;
+  case IRT_U16: return 2;
+  case IRT_U32: return 4;
+  default:      return 8;
+  }
+}
+
 static const uint32_t kOpIsFloat =
   (1u << (int)IRT_F32) | (1u << (int)IRT_F64);
 
@@ -203,6 +244,68 @@ inline bool isFloatType(IRType t) {
 
 #define IRT(o, t)      (cast(u4, ((o) << 8) | (t)))
 
+// C helpers that traces may call.  A call is written
+//
+//     CALLN args #id
+//
+// where `args' is the only argument or a left-nested tree of CARG
+// instructions, e.g., (CARG (CARG a b) c) for three arguments.  The
+// helpers must not trigger a GC, nor look at the Haskell stack.
+//
+// Calls to pure helpers (mode N) are subject to CSE.  Helpers that
+// read mutable memory (mode L), or that allocate mutable objects or
+// write to memory (mode S) are not.
+//
+// name, number of arguments, mode
+#define IRCALLDEF(_) \
+  _(integerAdd,     4, N) \
+  _(integerSub,     4, N) \
+  _(integerMul,     4, N) \
+  _(integerQuot,    4, N) \
+  _(integerRem,     4, N) \
+  _(integerShl,     4, N) \
+  _(integerShr,     4, N) \
+  _(integerCompare, 2, N) \
+  _(integerToInt,   1, N) \
+  _(newArray,       3, S) \
+  _(copyArray,      5, S) \
+  _(newByteArray,   2, S) \
+  _(copyByteArray,  5, S) \
+  _(setByteArray,   4, S) \
+  _(compareByteArrays, 5, L) \
+  _(findByteArray,  4, L) \
+  _(handleOpen,     2, S) \
+  _(handleClose,    1, S) \
+  _(handleFlush,    1, S) \
+  _(handlePutChar,  2, S) \
+  _(handlePutStr,   2, S) \
+  _(handleWriteByteArray, 4, S) \
+  _(claimThunkFromTrace, 2, S) \
+  _(countTraceAlloc, 2, S) \
+  _(rememberFromTrace, 2, S)
+
+typedef enum {
+#define IRCALLENUM(name, nargs, mode) IRCALL_##name,
+  IRCALLDEF(IRCALLENUM)
+#undef IRCALLENUM
+  IRCALL__MAX
+} IRCallID;
+
+enum {
+  IRCALL_N = 0,  // pure
+  IRCALL_L = 1,  // reads memory
+  IRCALL_S = 2   // side effects
+};
+
+typedef struct {
+  void *func;
+  const char *name;
+  uint8_t nargs;
+  uint8_t mode;
+} CCallInfo;
+
+extern const CCallInfo ircall_info[IRCALL__MAX];
+
 // Exception error codes
 enum {
   IROPTERR_FAILING_GUARD = 1
@@ -595,6 +698,7 @@ public:
     LC_ASSERT(n < nextentry_);
     return entries_[n];
   }
+  inline uint32_t numEntries() const { return nextentry_; }
 private:
   void grow();
   AbstractHeapEntry *entries_;
@@ -843,6 +947,7 @@ public:
 
   TRef literal(IRType ty, uint64_t lit);
   uint64_t literalValue(IRRef ref);
+  TRef floatOperand(TRef tr, IRType ty);
 
   /// A literal that represents a pointer into the stack.
   TRef baseLiteral(Word *p);
@@ -885,9 +990,24 @@ public:
     heap_.heapCheck(nwords);
   }
 
+  /// Exit the trace if another capability waits for all others to
+  /// stop.  Emitted before every jump back into a trace, so that a
+  /// loop that doesn't allocate still reaches a safepoint.
+  inline void emitSafepoint() {
+    emitRaw(IRT(IR::kSAFEPOINT, IRT_VOID|IRT_GUARD), 0, 0);
+  }
+
   typedef int HeapEntry;
   TRef emitNEW(IRRef1 itblref, int nfields, HeapEntry *entry1);
 
+  /// Emit a call to a C helper.  See IRCALLDEF.
+  TRef emitCall(IRCallID id, IRType ty, int nargs, TRef *args);
+
+  /// Emit a call to a foreign function (see ffi.hh).  args[0] is the
+  /// function's address, followed by `nargs' arguments.  Written
+  /// like CALLN, but the function is the first argument.
+  TRef emitCCall(u2 sig, int nargs, TRef *args);
+
   // Recalculates the offsets of allocations.  Returns the number of
   // heap checks.
   //
@@ -939,6 +1059,10 @@ private:
   TRef emit(); // Emit without optimisation.
 
   IRRef foldHeapcheck();
+  IRRef foldImpliedGuard();
+  IRRef lastSideEffect(IRRef lim);
+  IRRef fwdArrayLoad();
+  IRRef cseFieldLoad();
 
   IRRef doFold();
 
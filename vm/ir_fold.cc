@@ -1,7 +1,10 @@
 #include "ir.hh"
 #include "objects.hh"
+#include "integer.hh"
+#include "utils.hh"
 
 #include <iostream>
+#include <limits>
 
 _START_LAMBDACHINE_NAMESPACE
 
@@ -112,12 +115,41 @@ static int64_t kfold_intop(int64_t k1, int64_t k2, IR::Opcode op) {
   return k1;
 }
 
+static double kfold_fpop(double k1, double k2, IR::Opcode op) {
+  switch (op) {
+  case IR::kADD: return k1 + k2;
+  case IR::kSUB: return k1 - k2;
+  case IR::kMUL: return k1 * k2;
+  case IR::kDIV: return k1 / k2;
+  case IR::kNEG: return -k1;
+  default:
+    LC_ASSERT(0);
+    return k1;
+  }
+}
+
 // Constant folding. Both arguments are constants.
 FOLDF(kfold_arith) {
   if (fold_.ins.type() == IRT_I64) {
     return LITFOLD(kfold_intop(buf->literalValue(fold_.ins.op1()),
                                buf->literalValue(fold_.ins.op2()),
                                fold_.ins.opcode()));
+  } else if (fold_.ins.type() == IRT_F64) {
+    return LITFOLD(lc_d2w(kfold_fpop(lc_w2d(buf->literalValue(fold_.ins.op1())),
+                                     lc_w2d(buf->literalValue(fold_.ins.op2())),
+                                     fold_.ins.opcode())));
+  } else if (fold_.ins.type() == IRT_F32) {
+    // Evaluate in single precision to get the same rounding as the
+    // interpreter.
+    float k1 = lc_w2f(buf->literalValue(fold_.ins.op1()));
+    float k2 = lc_w2f(buf->literalValue(fold_.ins.op2()));
+    float k;
+    switch (fold_.ins.opcode()) {
+    case IR::kADD: k = k1 + k2; break;
+    case IR::kSUB: k = k1 - k2; break;
+    default: return NEXTFOLD;
+    }
+    return LITFOLD(lc_f2w(k));
   }
   return NEXTFOLD;
 }
@@ -285,6 +317,87 @@ FOLDF(simplify_intsubaddadd_cancel) {
   return NEXTFOLD;
 }
 
+// Constant folding of checked and double-word arithmetic.  A checked
+// operation that always overflows is a guard that always fails.
+FOLDF(kfold_ovarith) {
+  Word k1 = buf->literalValue(fins->op1());
+  Word k2 = buf->literalValue(fins->op2());
+  WordInt r;
+  switch (fins->opcode()) {
+  case IR::kADDOV:
+    return addOverflows(k1, k2, &r) ? FAILFOLD : LITFOLD(r);
+  case IR::kSUBOV:
+    return subOverflows(k1, k2, &r) ? FAILFOLD : LITFOLD(r);
+  case IR::kMULOV:
+    return mulOverflows(k1, k2, &r) ? FAILFOLD : LITFOLD(r);
+  case IR::kADDCU:
+    return LITFOLD(k1 + k2 < k1 ? 1 : 0);
+  case IR::kMULHU:
+    return LITFOLD(mulHighWord(k1, k2));
+  default:
+    return NEXTFOLD;
+  }
+}
+
+/// i -ov 0 ==> i
+FOLDF(simplify_subov_k) {
+  if (buf->literalValue(fins->op2()) == 0)
+    return LEFTFOLD;
+  return NEXTFOLD;
+}
+
+/// i *ov 0 ==> 0
+/// i *ov 1 ==> i
+FOLDF(simplify_mulov_k) {
+  uint64_t k = buf->literalValue(fins->op2());
+  if (k == 0)
+    return LITFOLD(0);
+  if (k == 1)
+    return LEFTFOLD;
+  return NEXTFOLD;
+}
+
+/// carry(i + 0) ==> 0
+/// hi(i * 0) ==> 0
+/// hi(i * 1) ==> 0
+FOLDF(simplify_hiword_k) {
+  uint64_t k = buf->literalValue(fins->op2());
+  if (k == 0 || (k == 1 && fins->opcode() == IR::kMULHU))
+    return LITFOLD(0);
+  return NEXTFOLD;
+}
+
+// Constant folding of bit operations.
+FOLDF(kfold_bitop) {
+  Word k1 = buf->literalValue(fins->op1());
+  switch (fins->opcode()) {
+  case IR::kPOPCNT: return LITFOLD(wordPopCount(k1));
+  case IR::kCLZ:    return LITFOLD(wordClz(k1));
+  case IR::kCTZ:    return LITFOLD(wordCtz(k1));
+  case IR::kBSWAP:  return LITFOLD(wordByteSwap(k1));
+  case IR::kPDEP:
+    return LITFOLD(wordPdep(k1, buf->literalValue(fins->op2())));
+  case IR::kPEXT:
+    return LITFOLD(wordPext(k1, buf->literalValue(fins->op2())));
+  default:
+    return NEXTFOLD;
+  }
+}
+
+/// bswap(bswap(i)) ==> i
+FOLDF(simplify_bswap_bswap) {
+  PHIBARRIER(fold_.left);
+  return fleft->op1();
+}
+
+/// pdep i 0 ==> 0
+/// pext i 0 ==> 0
+FOLDF(simplify_bitmask_k) {
+  if (buf->literalValue(fins->op2()) == 0)
+    return LITFOLD(0);
+  return NEXTFOLD;
+}
+
 IRRef IRBuffer::foldHeapcheck() {
   IRRef hpchkref = chain_[IR::kHEAPCHK];
   if (hpchkref /* && hpchkref >= loop_ */) {
@@ -296,10 +409,177 @@ IRRef IRBuffer::foldHeapcheck() {
   return NEXTFOLD;
 }
 
+/// Alias analysis for array elements.
+
+enum AliasResult { ALIAS_NO, ALIAS_MAY, ALIAS_MUST };
+
+// Is ref the result of allocating a new array on the trace?
+static bool isNewArray(IRBuffer *buf, IRRef ref) {
+  if (irref_islit(ref)) return false;
+  IR *ins = buf->ir(ref);
+  return ins->opcode() == IR::kCALLN &&
+    (ins->op2() == IRCALL_newArray || ins->op2() == IRCALL_newByteArray);
+}
+
+// Splits an array index into i + k.  Returns i, which is 0 if the
+// index is a literal.
+static IRRef splitArrayIndex(IRBuffer *buf, IRRef ref, int64_t *k) {
+  if (irref_islit(ref)) {
+    *k = (int64_t)buf->literalValue(ref);
+    return 0;
+  }
+  IR *ins = buf->ir(ref);
+  if (ins->opcode() == IR::kADD && irref_islit(ins->op2())) {
+    *k = (int64_t)buf->literalValue(ins->op2());
+    return ins->op1();
+  }
+  *k = 0;
+  return ref;
+}
+
+// May the element accessed via aref1 with type t1 overlap the one
+// accessed via aref2 with type t2?
+static AliasResult aliasArrayRef(IRBuffer *buf, IRRef aref1, IRType t1,
+                                 IRRef aref2, IRType t2) {
+  // An object is either a boxed array or a byte array.
+  if ((t1 == IRT_CLOS) != (t2 == IRT_CLOS))
+    return ALIAS_NO;
+  IR *a1 = buf->ir(aref1);
+  IR *a2 = buf->ir(aref2);
+  if (a1->op1() != a2->op1()) {
+    // An array allocated on the trace is different from any object
+    // that existed before.
+    if ((a2->op1() < a1->op1() && isNewArray(buf, a1->op1())) ||
+        (a1->op1() < a2->op1() && isNewArray(buf, a2->op1())))
+      return ALIAS_NO;
+    return ALIAS_MAY;
+  }
+  int s1 = arrayElementSize(t1);
+  int s2 = arrayElementSize(t2);
+  int64_t k1, k2;
+  IRRef i1 = splitArrayIndex(buf, a1->op2(), &k1);
+  IRRef i2 = splitArrayIndex(buf, a2->op2(), &k2);
+  if (i1 != i2 || (i1 != 0 && s1 != s2) ||
+      !checki32(k1) || !checki32(k2))
+    return ALIAS_MAY;
+  // Compare the byte ranges [k * s, (k + 1) * s) relative to i * s.
+  int64_t lo1 = k1 * s1, lo2 = k2 * s2;
+  if (lo1 + s1 <= lo2 || lo2 + s2 <= lo1)
+    return ALIAS_NO;
+  return (lo1 == lo2 && s1 == s2) ? ALIAS_MUST : ALIAS_MAY;
+}
+
+// Returns the most recent call to a helper that may write to
+// existing objects, or lim if there is none after lim.  Foreign calls
+// may write to anything.
+IRRef IRBuffer::lastSideEffect(IRRef lim) {
+  if (chain_[IR::kCCALL] > lim) lim = chain_[IR::kCCALL];
+  for (IRRef ref = chain_[IR::kCALLN]; ref > lim; ref = ir(ref)->prev()) {
+    IR *call = ir(ref);
+    if (ircall_info[call->op2()].mode == IRCALL_S && !isNewArray(this, ref))
+      return ref;
+  }
+  return lim;
+}
+
+/// ALOAD forwarding: reuse the result of an earlier load of the same
+/// element, or the value written by an earlier store to it, unless a
+/// store in between may have overwritten the element.
+IRRef IRBuffer::fwdArrayLoad() {
+  IRRef aref = fins->op1();
+  IRType ty = fins->type();
+  IRRef lim = lastSideEffect(aref);
+  for (IRRef ref = chain_[IR::kASTORE]; ref > lim; ref = ir(ref)->prev()) {
+    IR *store = ir(ref);
+    AliasResult alias = aliasArrayRef(this, aref, ty, store->op1(),
+                                      store->type());
+    if (alias == ALIAS_NO)
+      continue;
+    // Narrow stores truncate the stored value.
+    if (alias == ALIAS_MUST && arrayElementSize(ty) == sizeof(Word))
+      return store->op2();
+    lim = ref;
+    break;
+  }
+  for (IRRef ref = chain_[IR::kALOAD]; ref > lim; ref = ir(ref)->prev()) {
+    IR *load = ir(ref);
+    if (load->op1() == aref && load->type() == ty)
+      return ref;
+  }
+  return NEXTFOLD;
+}
+
+/// FLOAD CSE.  A field only changes if the object is updated or the
+/// field is written by an FSTORE.  Fields of thunks are read again
+/// after an UPDATE.
+IRRef IRBuffer::cseFieldLoad() {
+  IRRef fref = fins->op1();
+  IRRef lim = lastSideEffect(fref);
+  if (chain_[IR::kUPDATE] > lim) lim = chain_[IR::kUPDATE];
+  if (chain_[IR::kFSTORE] > lim) lim = chain_[IR::kFSTORE];
+  for (IRRef ref = chain_[IR::kFLOAD]; ref > lim; ref = ir(ref)->prev()) {
+    IR *load = ir(ref);
+    if (load->op1() == fref && load->type() == fins->type())
+      return ref;
+  }
+  return NEXTFOLD;
+}
+
+// Does the guard "x c1 k1" imply "x c2 k2"?  The conditions are
+// numbered like LT, GE, LE, GT.
+template <typename T>
+static bool impliedCmp(int c1, T k1, int c2, T k2) {
+  // The range lo <= x <= hi that passed the first guard.
+  T lo = std::numeric_limits<T>::min();
+  T hi = std::numeric_limits<T>::max();
+  switch (c1) {
+  case 0: if (k1 == lo) return false; hi = k1 - 1; break;
+  case 1: lo = k1; break;
+  case 2: hi = k1; break;
+  case 3: if (k1 == hi) return false; lo = k1 + 1; break;
+  }
+  switch (c2) {
+  case 0: return hi < k2;
+  case 1: return lo >= k2;
+  case 2: return hi <= k2;
+  case 3: return lo > k2;
+  }
+  return false;
+}
+
+/// Drops a comparison against a literal that always succeeds because
+/// of an earlier guard on the same value.  This removes redundant
+/// bounds checks such as:
+///
+///     LT x 10  ...  LT x 20 ==> LT x 10
+///     GE x 0   ...  GT x -1 ==> GE x 0
+IRRef IRBuffer::foldImpliedGuard() {
+  // Only integer comparisons.
+  if (fins->type() != IRT_VOID || !irref_islit(fins->op2()))
+    return NEXTFOLD;
+  IRRef x = fins->op1();
+  bool isUnsigned = fins->opcode() >= IR::kLTU;
+  int first = isUnsigned ? IR::kLTU : IR::kLT;
+  int c2 = fins->opcode() - first;
+  uint64_t k2 = literalValue(fins->op2());
+  for (int c1 = 0; c1 < 4; ++c1) {
+    for (IRRef ref = chain_[first + c1]; ref > x; ref = ir(ref)->prev()) {
+      IR *guard = ir(ref);
+      if (guard->op1() != x || !irref_islit(guard->op2()))
+        continue;
+      uint64_t k1 = literalValue(guard->op2());
+      if (isUnsigned ? impliedCmp<uint64_t>(c1, k1, c2, k2)
+                     : impliedCmp<int64_t>(c1, (int64_t)k1, c2, (int64_t)k2))
+        return DROPFOLD;
+    }
+  }
+  return NEXTFOLD;
+}
+
 // Constant-fold an EQGUARD where the closure is a literal. The
 // second operand will always be a literal.
 FOLDF(kfold_eqinfo) {
-  Closure *cl = (Closure *)buf->literalValue(fins->op1());
+  Closure *cl = untag(buf->literalValue(fins->op1()));
   InfoTable *itbl = (InfoTable *)buf->literalValue(fins->op2());
   if (fins->opcode() == IR::kEQINFO) {
     return (cl->info() == itbl) ? DROPFOLD : FAILFOLD;
@@ -312,6 +592,16 @@ FOLDF(kfold_eqinfo) {
 FOLDF(kfold_cmp) {
   uint64_t k1 = buf->literalValue(fins->op1());
   uint64_t k2 = buf->literalValue(fins->op2());
+  if (isFloatType(fins->type())) {
+    // Compare by value: NaN /= NaN and 0.0 == -0.0.
+    double d1 = fins->type() == IRT_F64 ? lc_w2d(k1) : lc_w2f(k1);
+    double d2 = fins->type() == IRT_F64 ? lc_w2d(k2) : lc_w2f(k2);
+    bool eq = d1 == d2;
+    if (fins->opcode() == IR::kEQ)
+      return eq ? DROPFOLD : FAILFOLD;
+    else
+      return !eq ? DROPFOLD : FAILFOLD;
+  }
   switch (fins->opcode()) {
   case IR::kEQ:
     return (k1 == k2) ? DROPFOLD : FAILFOLD;
@@ -350,6 +640,12 @@ FOLDF(kfold_update_new) {
   return NEXTFOLD;
 }
 
+// Objects allocated on the trace always live in the nursery, and
+// static closures never get promoted.  Neither needs a write barrier.
+FOLDF(kfold_wbar) {
+  return DROPFOLD;
+}
+
 // info(NEW k1 [...]) == k2 ==> k1 == k2
 FOLDF(kfold_eqinfo_new) {
   fins->setOpcode(fins->opcode() == IR::kEQINFO ? IR::kEQ : IR::kNE);
@@ -367,6 +663,15 @@ FOLDF(kfold_eqinfo_new) {
   return RETRYFOLD;
 }
 
+// untag(NEW k [...]) ==> NEW k [...]
+//
+// Objects allocated on the trace are never tagged.
+FOLDF(kfold_untag_new) {
+  if (buf->literalValue(fins->op2()) == ~kTagMask)
+    return LEFTFOLD;
+  return NEXTFOLD;
+}
+
 #undef fins
 #undef fleft
 #undef fright
@@ -451,6 +756,44 @@ retry:
     /// (y + x) - (z + x) ==> y - z
     PATTERN(ADD, ADD, simplify_intsubaddadd_cancel);
     break;
+  case IR::kADDOV:
+    PATTERN(lit, lit, kfold_ovarith);
+    /// i +ov 0 ==> i
+    PATTERN(any, lit, simplify_intadd_k);
+    PATTERN(any, any, comm_swap);
+    break;
+  case IR::kSUBOV:
+    PATTERN(lit, lit, kfold_ovarith);
+    /// i -ov 0 ==> i
+    PATTERN(any, lit, simplify_subov_k);
+    /// i -ov i ==> 0
+    PATTERN(any, any, simplify_intsub);
+    break;
+  case IR::kMULOV:
+    PATTERN(lit, lit, kfold_ovarith);
+    PATTERN(any, lit, simplify_mulov_k);
+    PATTERN(any, any, comm_swap);
+    break;
+  case IR::kADDCU:
+  case IR::kMULHU:
+    PATTERN(lit, lit, kfold_ovarith);
+    PATTERN(any, lit, simplify_hiword_k);
+    PATTERN(any, any, comm_swap);
+    break;
+  case IR::kPOPCNT:
+  case IR::kCLZ:
+  case IR::kCTZ:
+    PATTERN(lit, any, kfold_bitop);
+    break;
+  case IR::kBSWAP:
+    PATTERN(lit, any, kfold_bitop);
+    PATTERN(BSWAP, any, simplify_bswap_bswap);
+    break;
+  case IR::kPDEP:
+  case IR::kPEXT:
+    PATTERN(lit, lit, kfold_bitop);
+    PATTERN(any, lit, simplify_bitmask_k);
+    break;
   case IR::kUPDATE:
     PATTERN(NEW, any, kfold_update_new);
     break;
@@ -461,6 +804,13 @@ retry:
     // info(NEW k1 [...]) == k2 ==> k1 == k2
     PATTERN(NEW, lit, kfold_eqinfo_new);
     break;
+  case IR::kBAND:
+    PATTERN(NEW, lit, kfold_untag_new);
+    break;
+  case IR::kWBAR:
+    PATTERN(lit, any, kfold_wbar);
+    PATTERN(NEW, any, kfold_wbar);
+    break;
   case IR::kHEAPCHK:
     /// heapchk N, heapchk M ==> heapchk (N+M)
     ref = foldHeapcheck();
@@ -469,8 +819,22 @@ retry:
   case IR::kNE:
     PATTERN(lit, lit, kfold_cmp);
     break;
+  case IR::kLT:
+  case IR::kGE:
+  case IR::kLE:
+  case IR::kGT:
+  case IR::kLTU:
+  case IR::kGEU:
+  case IR::kLEU:
+  case IR::kGTU:
+    ref = foldImpliedGuard();
+    break;
   case IR::kFLOAD:
     PATTERN(any, any, load_fwd);
+    ref = cseFieldLoad();
+    break;
+  case IR::kALOAD:
+    ref = fwdArrayLoad();
     break;
   default:
     break;
@@ -4,6 +4,9 @@
 #include "thread.hh"
 #include "capability.hh"
 #include "miscclosures.hh"
+#include "integer.hh"
+#include "bytearray.hh"
+#include "ffi.hh"
 #include "time.hh"
 
 #include <iostream>
@@ -39,7 +42,13 @@ Time jit_time = 0;
 
 FRAGMENT_MAP Jit::fragmentMap_;
 std::vector<Fragment *> Jit::fragments_;
+Prng Jit::prng_;
+MachineCode *Jit::sharedMcode_ = NULL;
+uint32_t Jit::numJits_ = 0;
+pthread_mutex_t Jit::compileLock_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t Jit::fragmentMapLock_ = PTHREAD_RWLOCK_INITIALIZER;
 
+// Must not be called while traces are running or being compiled.
 void Jit::resetFragments() {
   for (size_t i = 0; i < fragments_.size(); ++i) {
     delete fragments_[i];
@@ -58,8 +67,16 @@ Jit::Jit()
   : cap_(NULL),
     startPc_(NULL), startBase_(NULL), parent_(NULL),
     flags_(), options_(), targets_(),
-    prng_(), mcode_(&prng_), asm_(this) {
-  Jit::resetFragments();
+    mcode_(NULL), asm_(this) {
+  pthread_mutex_lock(&compileLock_);
+  if (numJits_ == 0) {
+    Jit::resetFragments();
+    fragments_.reserve(kMaxFragments);
+    sharedMcode_ = new MachineCode(&prng_);
+  }
+  ++numJits_;
+  mcode_ = sharedMcode_;
+  pthread_mutex_unlock(&compileLock_);
   memset(exitStubGroup_, 0, sizeof(exitStubGroup_));
   resetRecorderState();
 #if (DEBUG_COMPONENTS & DEBUG_TRACE_PROGRESS)
@@ -68,10 +85,18 @@ Jit::Jit()
 #ifdef LC_TRACE_STATS
   stats_ = NULL;
 #endif
+  allocCounters_ = NULL;
 }
 
 Jit::~Jit() {
-  Jit::resetFragments();
+  pthread_mutex_lock(&compileLock_);
+  if (--numJits_ == 0) {
+    Jit::resetFragments();
+    asm_.mcp = NULL;  // Don't touch the area when asm_ is destroyed.
+    delete sharedMcode_;
+    sharedMcode_ = NULL;
+  }
+  pthread_mutex_unlock(&compileLock_);
 }
 
 void Jit::beginRecording(Capability *cap, BcIns *startPc, Word *base, bool isReturn)
@@ -105,6 +130,7 @@ void Jit::initRecording(Capability *cap, Word *base, BcIns *startPc)
 #ifdef LC_TRACE_STATS
   stats_ = NULL;
 #endif
+  allocSites_.clear();
 }
 
 /*
@@ -213,12 +239,18 @@ static IRType littypeToIRType(uint8_t littype) {
     return IRT_PTR;
   case LIT_WORD:
     return IRT_U64;
+  case LIT_FLOAT:
+    return IRT_F32;
+  case LIT_DOUBLE:
+    return IRT_F64;
   case LIT_CLOSURE:
     return IRT_CLOS;
   case LIT_INFO:
     return IRT_INFO;
   case LIT_PC:
     return IRT_PC;
+  case LIT_CFUNC:
+    return IRT_PTR;
   default:
     return IRT_UNKNOWN;
   }
@@ -257,6 +289,38 @@ static bool evalCond(BcIns::Opcode opc, Word left, Word right) {
   }
 }
 
+// The condition is relative to ISLTD/ISLTF.
+static bool evalFloatCond(int cond, bool isDouble, Word left, Word right) {
+  double l = isDouble ? lc_w2d(left) : lc_w2f(left);
+  double r = isDouble ? lc_w2d(right) : lc_w2f(right);
+  switch (cond) {
+  case 0: return l < r;
+  case 1: return l >= r;
+  case 2: return l <= r;
+  case 3: return l > r;
+  case 4: return l == r;
+  case 5: return l != r;
+  default:
+    cerr << "FATAL: (REC) Cannot evaluate condition: " << cond;
+    exit(2);
+  }
+}
+
+// Strip the pointer tag of a reference to a closure that may be a
+// constructor.  Pointers to functions, PAPs, thunks and indirections
+// are never tagged, so this is only needed before looking inside a
+// closure that may be a constructor.  Objects allocated on the trace
+// are never tagged, which is taken care of by the fold engine.
+static inline TRef
+untagRef(IRBuffer &buf_, TRef noderef)
+{
+  if (noderef.isLiteral())
+    return buf_.literal(IRT_CLOS,
+                        (Word)untag(buf_.literalValue(noderef.ref())));
+  TRef mask = buf_.literal(IRT_I64, ~kTagMask);
+  return buf_.emit(IR::kBAND, IRT_CLOS, noderef, mask);
+}
+
 static inline TRef
 loadField(IRBuffer &buf_, TRef noderef, int offset, uint8_t type)
 {
@@ -273,6 +337,21 @@ specialiseOnInfoTable(IRBuffer &buf_, TRef noderef, Closure *node)
   return noderef;
 }
 
+// Does the checked IR operation `iropc' (ADDOV, SUBOV, or MULOV)
+// overflow for these operands?
+static bool
+checkedArithOverflows(uint8_t iropc, Word x, Word y)
+{
+  WordInt r;
+  switch (iropc) {
+  case IR::kADDOV: return addOverflows(x, y, &r);
+  case IR::kSUBOV: return subOverflows(x, y, &r);
+  default:
+    LC_ASSERT(iropc == IR::kMULOV);
+    return mulOverflows(x, y, &r);
+  }
+}
+
 static inline void
 specialiseOnPapShape(IRBuffer &buf_, TRef papref, PapClosure *pap)
 {
@@ -284,13 +363,17 @@ specialiseOnPapShape(IRBuffer &buf_, TRef papref, PapClosure *pap)
   buf_.emit(IR::kEQ, IRT_VOID | IRT_GUARD, papinforef, papinfo_expected);
 }
 
+// The target of an indirection may be a tagged pointer.  So may the
+// slot itself if the trace is entered with an evaluated constructor
+// where the recording saw an indirection.
 static inline Closure *
 followIndirection(IRBuffer &buf_, int slot, Closure *tnode)
 {
-  TRef noderef = specialiseOnInfoTable(buf_, buf_.slot(slot), tnode);
+  TRef noderef =
+    specialiseOnInfoTable(buf_, untagRef(buf_, buf_.slot(slot)), tnode);
   TRef newnoderef = loadField(buf_, noderef, 1, IRT_CLOS);
   buf_.setSlot(slot, newnoderef);
-  return (Closure *)tnode->payload(0);
+  return untag(tnode->payload(0));
 }
 
 static inline void
@@ -345,6 +428,15 @@ Jit::recordGenericApply2(uint32_t call_info, Word *base,
     type = fnode->info()->type();
     LC_ASSERT(type == FUN);
 
+  } else if (type == BLACKHOLE ||
+             (type == THUNK && cap_->isBlackholing() &&
+              static_cast<CodeInfoTable *>(fnode->info())->blackholeInfo())) {
+    // The interpreter enters these via stg_EVAL, which claims the
+    // thunk or waits for it.  We don't record that detour.
+    logNYI(NYI_RECORD_BLACKHOLE);
+    LC_STAT_INC(record_abort_reasons[AR_NYI]);
+    return false;
+
   } else if (type == THUNK || type == CAF) {
 
     specialiseOnInfoTable(buf_, fnode_ref, fnode);
@@ -367,7 +459,7 @@ Jit::recordGenericApply2(uint32_t call_info, Word *base,
     } else {
       // Adjust size of current frame.
       if (!buf_.slots_.frame(base, base + apk_framesize)) {
-        ++record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW];
+        LC_STAT_INC(record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW]);
         //        cerr << "Abstract stack overflow." << endl;
         return false;
       }
@@ -419,7 +511,7 @@ Jit::recordGenericApply2(uint32_t call_info, Word *base,
     } else {
       buf_.setSlot(-1, funref);
       if (!buf_.slots_.frame(base, base + framesize)) {
-        ++record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW];
+        LC_STAT_INC(record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW]);
         return false;
       }
     }
@@ -493,7 +585,7 @@ Jit::recordGenericApply2(uint32_t call_info, Word *base,
     } else {
       // Adjust size of current frame.
       if (!buf_.slots_.frame(base, base + apk_framesize)) {
-        ++record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW];
+        LC_STAT_INC(record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW]);
         return false;
       }
       buf_.setSlot(-1, apk_closure_ref);
@@ -583,6 +675,7 @@ Jit::recordGenericApply2(uint32_t call_info, Word *base,
 
     IRBuffer::HeapEntry entry = 0;
     TRef new_pap = buf_.emitNEW(pap_itbl, new_pap_size - 1, &entry);
+    noteAllocSite(entry, base);
     for (int i = 0; i < new_pap_size - 1; ++i) {
       buf_.setField(entry, i, new_pap_fields[i]);
     }
@@ -602,7 +695,7 @@ Jit::recordGenericApply2(uint32_t call_info, Word *base,
       callStack_.returnTo(expectedReturnPc);
       Word *newbase = (Word *)base[-3];
       if (!buf_.slots_.frame(newbase, base - 3)) {
-        ++record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW];
+        LC_STAT_INC(record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW]);
         return false;
       }
     }
@@ -778,7 +871,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
   try {
 
   if (LC_UNLIKELY(shouldAbort_)) {
-    ++record_abort_reasons[AR_INTERPRETER_REQUEST];
+    LC_STAT_INC(record_abort_reasons[AR_INTERPRETER_REQUEST]);
     goto abort_recording;
   }
   buf_.pc_ = ins;
@@ -797,7 +890,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     if (LC_LIKELY(loopentry == -1)) {  // Not a loop.
       btb_.emit(ins);
       if (btb_.size() > 100) {
-        ++record_abort_reasons[AR_TRACE_TOO_LONG];
+        LC_STAT_INC(record_abort_reasons[AR_TRACE_TOO_LONG]);
         // cerr << COL_RED << "TRACE TOO LONG (" << btb_.size()
         //      << ")" << COL_RESET << endl;
         goto abort_recording;
@@ -805,6 +898,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     } else {  // We found a true loop.
       if (loopentry == 0) {
         DBG(cerr << "REC: Loop to entry detected." << endl);
+        buf_.emitSafepoint();
         buf_.emit(IR::kSAVE, IRT_VOID | IRT_GUARD, IR_SAVE_LOOP, 0);
         finishRecording();
         return true;
@@ -900,9 +994,117 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     ARITH_OP_RRR(kBSHL, kBSHL, IRT_I64);
     ARITH_OP_RRR(kBSHR, kBSHR, IRT_I64);
 
+    ARITH_OP_RR(kPOPCNT, kPOPCNT, IRT_I64);
+    ARITH_OP_RR(kCLZ, kCLZ, IRT_I64);
+    ARITH_OP_RR(kCTZ, kCTZ, IRT_I64);
+    ARITH_OP_RR(kBSWAP, kBSWAP, IRT_I64);
+    ARITH_OP_RRR(kPDEP, kPDEP, IRT_I64);
+    ARITH_OP_RRR(kPEXT, kPEXT, IRT_I64);
+
+    ARITH_OP_RRR(kADDCU, kADDCU, IRT_I64);
+    ARITH_OP_RRR(kMULHU, kMULHU, IRT_I64);
+
 #undef ARITH_OP_RR
 #undef ARITH_OP_RRR
 
+  case BcIns::kADDOV:
+  case BcIns::kSUBOV:
+  case BcIns::kMULOV: {
+    // We specialise on the overflow check succeeding.  The checked
+    // IR instruction exits the trace on overflow, so the flag is a
+    // constant and a branch on it folds away.
+    uint8_t iropc = IR::kADDOV + (ins->opcode() - BcIns::kADDOV);
+    if (checkedArithOverflows(iropc, base[ins->b()], base[ins->c()])) {
+      logNYI(NYI_RECORD_OVERFLOW);
+      LC_STAT_INC(record_abort_reasons[AR_NYI]);
+      goto abort_recording;
+    }
+    TRef bref = buf_.slot(ins->b());
+    TRef cref = buf_.slot(ins->c());
+    buf_.emit(iropc, IRT_I64 | IRT_GUARD, bref, cref);
+    buf_.setSlot(ins->a(), buf_.literal(IRT_I64, 0));
+    break;
+  }
+
+  case BcIns::kISLTD: case BcIns::kISGED: case BcIns::kISLED:
+  case BcIns::kISGTD: case BcIns::kISEQD: case BcIns::kISNED:
+  case BcIns::kISLTF: case BcIns::kISGEF: case BcIns::kISLEF:
+  case BcIns::kISGTF: case BcIns::kISEQF: case BcIns::kISNEF: {
+    bool isDouble = ins->opcode() <= BcIns::kISNED;
+    IRType ty = isDouble ? IRT_F64 : IRT_F32;
+    int cond = ins->opcode() - (isDouble ? BcIns::kISLTD : BcIns::kISLTF);
+    bool taken = evalFloatCond(cond, isDouble,
+                               base[ins->a()], base[ins->d()]);
+    TRef aref = buf_.floatOperand(buf_.slot(ins->a()), ty);
+    TRef bref = buf_.floatOperand(buf_.slot(ins->d()), ty);
+    if (aref.isNone() || bref.isNone())
+      goto abort_fp_operand;
+    // Inverting the condition is not quite right in the presence of
+    // NaNs, but that only causes a spurious trace exit.
+    uint8_t iropc = (IR::kLT + cond) ^ (uint8_t)(taken ? 0 : 1);
+    buf_.emit(iropc, ty | IRT_GUARD, aref, bref);
+    break;
+  }
+
+#define FP_ARITH_OP_RRR(bcop, irop, irtype) \
+  case BcIns::bcop: { \
+    TRef bref = buf_.floatOperand(buf_.slot(ins->b()), irtype); \
+    TRef cref = buf_.floatOperand(buf_.slot(ins->c()), irtype); \
+    if (bref.isNone() || cref.isNone()) goto abort_fp_operand; \
+    TRef aref = buf_.emit(IR::irop, irtype, bref, cref); \
+    buf_.setSlot(ins->a(), aref); \
+    break; \
+  }
+
+#define FP_ARITH_OP_RR(bcop, irop, irtype) \
+  case BcIns::bcop: { \
+    TRef dref = buf_.floatOperand(buf_.slot(ins->d()), irtype); \
+    if (dref.isNone()) goto abort_fp_operand; \
+    TRef aref = buf_.emit(IR::irop, irtype, dref, TRef()); \
+    buf_.setSlot(ins->a(), aref); \
+    break; \
+  }
+
+    FP_ARITH_OP_RRR(kADDD, kADD, IRT_F64);
+    FP_ARITH_OP_RRR(kSUBD, kSUB, IRT_F64);
+    FP_ARITH_OP_RRR(kMULD, kMUL, IRT_F64);
+    FP_ARITH_OP_RRR(kDIVD, kDIV, IRT_F64);
+    FP_ARITH_OP_RR(kNEGD, kNEG, IRT_F64);
+    FP_ARITH_OP_RRR(kADDF, kADD, IRT_F32);
+    FP_ARITH_OP_RRR(kSUBF, kSUB, IRT_F32);
+    FP_ARITH_OP_RRR(kMULF, kMUL, IRT_F32);
+    FP_ARITH_OP_RRR(kDIVF, kDIV, IRT_F32);
+    FP_ARITH_OP_RR(kNEGF, kNEG, IRT_F32);
+
+#undef FP_ARITH_OP_RR
+#undef FP_ARITH_OP_RRR
+
+  // CONV stores the source type in op2.
+  case BcIns::kI2D:
+  case BcIns::kI2F: {
+    IRType ty = ins->opcode() == BcIns::kI2D ? IRT_F64 : IRT_F32;
+    TRef dref = buf_.slot(ins->d());
+    TRef aref = buf_.emit(IR::kCONV, ty, dref, IRT_I64);
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+  case BcIns::kD2I:
+  case BcIns::kF2I:
+  case BcIns::kF2D:
+  case BcIns::kD2F: {
+    BcIns::Opcode opc = ins->opcode();
+    IRType srcty = (opc == BcIns::kD2I || opc == BcIns::kD2F)
+      ? IRT_F64 : IRT_F32;
+    IRType dstty = (opc == BcIns::kF2D) ? IRT_F64
+      : (opc == BcIns::kD2F) ? IRT_F32 : IRT_I64;
+    TRef dref = buf_.floatOperand(buf_.slot(ins->d()), srcty);
+    if (dref.isNone())
+      goto abort_fp_operand;
+    TRef aref = buf_.emit(IR::kCONV, dstty, dref, srcty);
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
   case BcIns::kPTROFSC: {
     TRef ptrref = buf_.slot(ins->b());
     TRef ofsref = buf_.slot(ins->c());
@@ -1026,23 +1228,37 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     break;
 
   case BcIns::kEVAL: {
-    Closure *tnode = (Closure *)base[ins->a()];
+    // We guard on the info table even if the pointer is tagged.
+    // Objects allocated on the trace are not tagged, so a guard on
+    // the tag would fail spuriously.
+    Closure *tnode = untag(base[ins->a()]);
     while (tnode->isIndirection()) {
       tnode = followIndirection(buf_, ins->a(), tnode);
     }
     TRef noderef = buf_.slot(ins->a());
     TRef inforef = buf_.literal(IRT_INFO, (Word)tnode->info());
-    buf_.emit(IR::kEQINFO, IRT_VOID | IRT_GUARD, noderef, inforef);
+    buf_.emit(IR::kEQINFO, IRT_VOID | IRT_GUARD, untagRef(buf_, noderef),
+              inforef);
     if (tnode->isHNF()) {
       Word *top = cap_->currentThread()->top();
       int topslot = top - base;
       buf_.setSlot(topslot + FRAME_SIZE, noderef);
       // TODO: Clear dead registers.
     } else {
+      CodeInfoTable *info = static_cast<CodeInfoTable *>(tnode->info());
+      if (cap_->isBlackholing() && info->type() == THUNK &&
+          info->blackholeInfo() != NULL) {
+        // Claim the thunk like the interpreter does.  If another
+        // thread got there first we exit and the interpreter waits.
+        TRef args[2] = { untagRef(buf_, noderef), inforef };
+        TRef okref = buf_.emitCall(IRCALL_claimThunkFromTrace, IRT_I64,
+                                   2, args);
+        buf_.emit(IR::kNE, IRT_VOID | IRT_GUARD, okref,
+                  buf_.literal(IRT_I64, 0));
+      }
       Word *top = cap_->currentThread()->top();
       int topslot = top - base;
       LC_ASSERT(buf_.slots_.top() == topslot);
-      CodeInfoTable *info = static_cast<CodeInfoTable *>(tnode->info());
       u4 framesize = info->code()->framesize;
       // TODO: Check for stack overflow and abort recording?
       BcIns *returnPc = ins + 2;
@@ -1098,7 +1314,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     // is quite wasteful.
     Word *newbase = (Word *)base[-3];
     if (!buf_.slots_.frame(newbase, base - 3)) {
-      ++record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW];
+      LC_STAT_INC(record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW]);
       goto abort_recording;
     }
 
@@ -1128,7 +1344,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     // is quite wasteful.
     Word *newbase = (Word *)base[-3];
     if (!buf_.slots_.frame(newbase, base - 3)) {
-      ++record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW];
+      LC_STAT_INC(record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW]);
       // cerr << "Abstract stack overflow/underflow" << endl;
       goto abort_recording;
     }
@@ -1156,7 +1372,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
 
     if (info->type() == CAF) {
       logNYI(NYI_RECORD_UPDATE_CAF);
-      ++record_abort_reasons[AR_NYI];
+      LC_STAT_INC(record_abort_reasons[AR_NYI]);
       goto abort_recording;
     }
 
@@ -1178,12 +1394,18 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     TRef inforef = buf_.literal(IRT_INFO, (Word)info);
     buf_.emit(IR::kEQINFO, IRT_VOID | IRT_GUARD, oldref, inforef);
 
+    // Write barrier.  If the updated thunk has been promoted to the
+    // old generation the trace adds it to the remembered set (see
+    // Assembler::writeBarrier).
+    buf_.emit(IR::kWBAR, IRT_VOID, oldref,
+              buf_.literal(IRT_PTR, (Word)cap_->memoryManager()));
+
     buf_.emit(IR::kUPDATE, IRT_VOID, oldref, newref);
     break;
   }
 
   case BcIns::kLOADF: {
-    TRef rbase = buf_.slot(ins->b());
+    TRef rbase = untagRef(buf_, buf_.slot(ins->b()));
     TRef fref = buf_.emit(IR::kFREF, IRT_PTR, rbase, ins->c());
     TRef res = buf_.emit(IR::kFLOAD, IRT_UNKNOWN, fref, 0);
     buf_.setSlot(ins->a(), res);
@@ -1204,6 +1426,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     buf_.emitHeapCheck(2);
     IRBuffer::HeapEntry entry = 0;
     TRef clos = buf_.emitNEW(itbl, 1, &entry);
+    noteAllocSite(entry, base);
     buf_.setField(entry, 0, field);
     buf_.setSlot(ins->a(), clos);
     break;
@@ -1222,6 +1445,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     for (int i = 0; i < nfields; ++i) buf_.slot(*args++);
 
     TRef clos = buf_.emitNEW(itbl, nfields, &entry);
+    noteAllocSite(entry, base);
     args = (const uint8_t *)(ins + 1);
     for (int i = 0; i < nfields; ++i) {
       TRef field = buf_.slot(*args++);
@@ -1248,6 +1472,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     TRef itbl = buf_.literal(IRT_INFO, (Word)info);
     IRBuffer::HeapEntry entry = 0;
     TRef clos = buf_.emitNEW(itbl, nfields, &entry);
+    noteAllocSite(entry, base);
     args = (const uint8_t *)(ins + 1);
     for (int i = 0; i < nfields; ++i) {
       TRef field = buf_.slot(*args++);
@@ -1257,6 +1482,290 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     break;
   }
 
+  // Integer primops.  The box for a small result is allocated on the
+  // trace, the helper does the rest (see integer.hh).  Addition,
+  // subtraction and multiplication of small Integers are done inline
+  // if the result is small, too.
+#define INTEGER_OP(bcop, irop, helper) \
+  case BcIns::bcop: { \
+    if (irop != IR::kNOP && recordSmallIntegerArith(ins, irop, base)) \
+      break; \
+    TRef args[4]; \
+    args[0] = buf_.literal(IRT_PTR, (Word)cap_->memoryManager()); \
+    args[1] = buf_.slot(ins->b()); \
+    args[2] = buf_.slot(ins->c()); \
+    args[3] = emitSmallInteger(buf_.literal(IRT_I64, 0), base); \
+    TRef aref = buf_.emitCall(helper, IRT_CLOS, 4, args); \
+    noteAllocCall(aref, base); \
+    buf_.setSlot(ins->a(), aref); \
+    break; \
+  }
+
+    INTEGER_OP(kADDZ, IR::kADDOV, IRCALL_integerAdd);
+    INTEGER_OP(kSUBZ, IR::kSUBOV, IRCALL_integerSub);
+    INTEGER_OP(kMULZ, IR::kMULOV, IRCALL_integerMul);
+    INTEGER_OP(kQUOTZ, IR::kNOP, IRCALL_integerQuot);
+    INTEGER_OP(kREMZ, IR::kNOP, IRCALL_integerRem);
+    INTEGER_OP(kSHLZ, IR::kNOP, IRCALL_integerShl);
+    INTEGER_OP(kSHRZ, IR::kNOP, IRCALL_integerShr);
+
+#undef INTEGER_OP
+
+  case BcIns::kI2Z: {
+    TRef dref = buf_.slot(ins->d());
+    buf_.setSlot(ins->a(), emitSmallInteger(dref, base));
+    break;
+  }
+
+  case BcIns::kZ2I: {
+    Closure *z = untag(base[ins->d()]);
+    TRef zref = buf_.slot(ins->d());
+    TRef aref;
+    if (isSmallInteger(z)) {
+      TRef node = specialiseOnInfoTable(buf_, untagRef(buf_, zref), z);
+      aref = loadField(buf_, node, 1, IRT_I64);
+    } else {
+      aref = buf_.emitCall(IRCALL_integerToInt, IRT_I64, 1, &zref);
+    }
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kCMPZ: {
+    Closure *x = untag(base[ins->b()]);
+    Closure *y = untag(base[ins->c()]);
+    TRef args[2];
+    args[0] = buf_.slot(ins->b());
+    args[1] = buf_.slot(ins->c());
+    TRef aref;
+    if (isSmallInteger(x) && isSmallInteger(y)) {
+      // Specialise on the outcome, like a branch.
+      TRef xref = specialiseOnInfoTable(buf_, untagRef(buf_, args[0]), x);
+      TRef yref = specialiseOnInfoTable(buf_, untagRef(buf_, args[1]), y);
+      xref = loadField(buf_, xref, 1, IRT_I64);
+      yref = loadField(buf_, yref, 1, IRT_I64);
+      WordInt c = compareSmallIntegers(smallIntegerValue(x),
+                                       smallIntegerValue(y));
+      uint8_t iropc = c < 0 ? IR::kLT : (c > 0 ? IR::kGT : IR::kEQ);
+      buf_.emit(iropc, IRT_VOID | IRT_GUARD, xref, yref);
+      aref = buf_.literal(IRT_I64, c);
+    } else {
+      aref = buf_.emitCall(IRCALL_integerCompare, IRT_I64, 2, args);
+    }
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kHOPEN: {
+    TRef args[2];
+    args[0] = buf_.slot(ins->b());
+    args[1] = buf_.slot(ins->c());
+    buf_.setSlot(ins->a(), buf_.emitCall(IRCALL_handleOpen, IRT_I64, 2, args));
+    break;
+  }
+
+  case BcIns::kHCLOSE:
+  case BcIns::kHFLUSH: {
+    TRef href = buf_.slot(ins->d());
+    IRCallID id = ins->opcode() == BcIns::kHCLOSE
+      ? IRCALL_handleClose : IRCALL_handleFlush;
+    buf_.setSlot(ins->a(), buf_.emitCall(id, IRT_I64, 1, &href));
+    break;
+  }
+
+  case BcIns::kHPUTC:
+  case BcIns::kHPUTS: {
+    TRef args[2];
+    args[0] = buf_.slot(ins->b());
+    args[1] = buf_.slot(ins->c());
+    IRCallID id = ins->opcode() == BcIns::kHPUTC
+      ? IRCALL_handlePutChar : IRCALL_handlePutStr;
+    buf_.setSlot(ins->a(), buf_.emitCall(id, IRT_I64, 2, args));
+    break;
+  }
+
+  case BcIns::kHWRITEBA: {
+    const u1 *arg = (const u1 *)(ins + 1);
+    TRef args[4];
+    args[0] = buf_.slot(ins->b());
+    args[1] = buf_.slot(ins->c());
+    args[2] = buf_.slot(arg[0]);
+    args[3] = buf_.slot(arg[1]);
+    TRef aref = buf_.emitCall(IRCALL_handleWriteByteArray, IRT_I64, 4, args);
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kCCALL:
+  case BcIns::kCCALLS: {
+    // A safe call keeps the capability attached inside a trace, i.e.,
+    // it becomes an unsafe call.
+    u4 info = (ins + 1)->raw();
+    u2 sig = info >> 16;
+    const u1 *arg = (const u1 *)(ins + 2);
+    TRef args[1 + kFfiMaxArgs];
+    args[0] = buf_.literal(IRT_PTR, code->lits[info & 0xffff]);
+    for (int i = 0; i < ins->c(); ++i) {
+      TRef aref = buf_.slot(arg[i]);
+      switch (ffiArgType(sig, i)) {
+      case FFI_DOUBLE:
+        aref = buf_.floatOperand(aref, IRT_F64);
+        break;
+      case FFI_FLOAT:
+        aref = buf_.floatOperand(aref, IRT_F32);
+        break;
+      default:
+        if (isFloatType((IRType)(aref.t() & IRT_TYPE)))
+          aref = TRef();
+        break;
+      }
+      if (aref.isNone())
+        goto abort_fp_operand;
+      args[1 + i] = aref;
+    }
+    TRef aref = buf_.emitCCall(sig, ins->c(), args);
+    if (ffiResultType(sig) != FFI_VOID)
+      buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kNEWARR: {
+    TRef args[3];
+    args[0] = buf_.literal(IRT_PTR, (Word)cap_->memoryManager());
+    args[1] = buf_.slot(ins->b());
+    args[2] = buf_.slot(ins->c());
+    TRef aref = buf_.emitCall(IRCALL_newArray, IRT_CLOS, 3, args);
+    noteAllocCall(aref, base);
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kREADARR: {
+    TRef eref = buf_.emit(IR::kAREF, IRT_PTR, buf_.slot(ins->b()),
+                          buf_.slot(ins->c()));
+    buf_.setSlot(ins->a(), buf_.emit(IR::kALOAD, IRT_CLOS, eref, 0));
+    break;
+  }
+
+  case BcIns::kWRITEARR: {
+    TRef eref = buf_.emit(IR::kAREF, IRT_PTR, buf_.slot(ins->b()),
+                          buf_.slot(ins->c()));
+    buf_.emit(IR::kASTORE, IRT_CLOS, eref, buf_.slot(ins->a()));
+    break;
+  }
+
+  case BcIns::kSIZEARR: {
+    TRef aref = loadField(buf_, buf_.slot(ins->d()), 1, IRT_I64);
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kFREEZEARR:
+  case BcIns::kTHAWARR: {
+    InfoTable *info = ins->opcode() == BcIns::kFREEZEARR
+      ? MiscClosures::stg_ARR_info : MiscClosures::stg_MUT_ARR_info;
+    TRef arr = buf_.slot(ins->d());
+    TRef fref = buf_.emit(IR::kFREF, IRT_PTR, arr, 0);
+    buf_.emit(IR::kFSTORE, IRT_VOID, fref,
+              buf_.literal(IRT_INFO, (Word)info));
+    buf_.setSlot(ins->a(), arr);
+    break;
+  }
+
+  case BcIns::kCOPYARR: {
+    const u1 *arg = (const u1 *)(ins + 1);
+    TRef args[5];
+    args[0] = buf_.slot(ins->a());
+    args[1] = buf_.slot(ins->b());
+    args[2] = buf_.slot(ins->c());
+    args[3] = buf_.slot(arg[0]);
+    args[4] = buf_.slot(arg[1]);
+    buf_.emitCall(IRCALL_copyArray, IRT_VOID, 5, args);
+    break;
+  }
+
+  case BcIns::kCOPYBYTEA: {
+    const u1 *arg = (const u1 *)(ins + 1);
+    TRef args[5];
+    args[0] = buf_.slot(ins->a());
+    args[1] = buf_.slot(ins->b());
+    args[2] = buf_.slot(ins->c());
+    args[3] = buf_.slot(arg[0]);
+    args[4] = buf_.slot(arg[1]);
+    buf_.emitCall(IRCALL_copyByteArray, IRT_VOID, 5, args);
+    break;
+  }
+
+  case BcIns::kSETBYTEA: {
+    const u1 *arg = (const u1 *)(ins + 1);
+    TRef args[4];
+    args[0] = buf_.slot(ins->a());
+    args[1] = buf_.slot(ins->b());
+    args[2] = buf_.slot(ins->c());
+    args[3] = buf_.slot(arg[0]);
+    buf_.emitCall(IRCALL_setByteArray, IRT_VOID, 4, args);
+    break;
+  }
+
+  case BcIns::kCMPBYTEA: {
+    const u1 *arg = (const u1 *)(ins + 1);
+    TRef args[5];
+    args[0] = buf_.slot(ins->b());
+    args[1] = buf_.slot(ins->c());
+    args[2] = buf_.slot(arg[0]);
+    args[3] = buf_.slot(arg[1]);
+    args[4] = buf_.slot(arg[2]);
+    TRef aref = buf_.emitCall(IRCALL_compareByteArrays, IRT_I64, 5, args);
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kFINDBYTEA: {
+    const u1 *arg = (const u1 *)(ins + 1);
+    TRef args[4];
+    args[0] = buf_.slot(ins->b());
+    args[1] = buf_.slot(ins->c());
+    args[2] = buf_.slot(arg[0]);
+    args[3] = buf_.slot(arg[1]);
+    TRef aref = buf_.emitCall(IRCALL_findByteArray, IRT_I64, 4, args);
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kNEWBYTEA: {
+    TRef args[2];
+    args[0] = buf_.literal(IRT_PTR, (Word)cap_->memoryManager());
+    args[1] = buf_.slot(ins->b());
+    TRef aref = buf_.emitCall(IRCALL_newByteArray, IRT_CLOS, 2, args);
+    noteAllocCall(aref, base);
+    buf_.setSlot(ins->a(), aref);
+    break;
+  }
+
+  case BcIns::kGETA1:
+  case BcIns::kGETA2:
+  case BcIns::kGETA4:
+  case BcIns::kGETA8: {
+    static const IRType elemty[] = { IRT_U8, IRT_U16, IRT_U32, IRT_U64 };
+    IRType ty = elemty[ins->opcode() - BcIns::kGETA1];
+    TRef eref = buf_.emit(IR::kAREF, IRT_PTR, buf_.slot(ins->b()),
+                          buf_.slot(ins->c()));
+    buf_.setSlot(ins->a(), buf_.emit(IR::kALOAD, ty, eref, 0));
+    break;
+  }
+
+  case BcIns::kSETA1:
+  case BcIns::kSETA2:
+  case BcIns::kSETA4:
+  case BcIns::kSETA8: {
+    static const IRType elemty[] = { IRT_U8, IRT_U16, IRT_U32, IRT_U64 };
+    IRType ty = elemty[ins->opcode() - BcIns::kSETA1];
+    TRef eref = buf_.emit(IR::kAREF, IRT_PTR, buf_.slot(ins->b()),
+                          buf_.slot(ins->c()));
+    buf_.emit(IR::kASTORE, ty, eref, buf_.slot(ins->a()));
+    break;
+  }
+
   case BcIns::kCASE_S:
     // TODO: It is quite common to have only one alternative for
     // sparse cases.  In that case we really have just a binary branch
@@ -1265,8 +1774,8 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     // other.  Unfortunately, that requires a mechanism to get an info
     // table from a tag, which we don't have yet.
   case BcIns::kCASE: {
-    Closure *cl = (Closure *)base[ins->a()];
-    TRef clos = buf_.slot(ins->a());
+    Closure *cl = untag(base[ins->a()]);
+    TRef clos = untagRef(buf_, buf_.slot(ins->a()));
     TRef itbl = buf_.literal(IRT_INFO, (Word)cl->info());
     buf_.emit(IR::kEQINFO, IRT_VOID | IRT_GUARD, clos, itbl);
     break;
@@ -1285,6 +1794,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
         cerr << COL_RED "Loop-back to parent ("
              << parent->traceId() << ") found." COL_RESET "\n";
 #endif
+        buf_.emitSafepoint();
         buf_.emit(IR::kSAVE, IRT_VOID | IRT_GUARD, IR_SAVE_LINK,
                   parent->traceId());
         finishRecording();
@@ -1296,6 +1806,7 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
       // For now we just use "stop-at-existing trace".
       LC_ASSERT(F->startPc() == ins);
       DBG(cerr << "Linking to existing trace: " << F->traceId() << endl);
+      buf_.emitSafepoint();
       buf_.emit(IR::kSAVE, IRT_VOID | IRT_GUARD, IR_SAVE_LINK,
                 F->traceId());
       finishRecording();
@@ -1303,14 +1814,42 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     }
   }
 
+  case BcIns::kCATCH: {
+    // Push the catch frame.  The call of the IO action in the code of
+    // stg_CATCH is recorded as usual.
+    TRef actionref = buf_.slot(ins->a());
+    TRef handlerref = buf_.slot(ins->d());
+    TRef noderef =
+      buf_.literal(IRT_CLOS, (Word)MiscClosures::stg_CATCH_closure_addr);
+    Word *newbase = pushFrame(base, ins + 2, noderef,
+                              MiscClosures::CATCH_frame_size);
+    if (!newbase) goto abort_recording;
+    buf_.setSlot(0, handlerref);
+    buf_.setSlot(1, actionref);
+    buf_.setSlot(2, buf_.literal(IRT_I64, 0));
+    flags_.set(kLastInsWasBranch);
+    break;
+  }
+
+  case BcIns::kRAISE:
+    // The trace ends here and the interpreter unwinds the stack.  A
+    // trace that would consist of just the RAISE is pointless.
+    if (ins == startPc_) {
+      LC_STAT_INC(record_abort_reasons[AR_NYI]);
+      goto abort_recording;
+    }
+    buf_.emit(IR::kSAVE, IRT_VOID | IRT_GUARD, IR_SAVE_FALLTHROUGH, 0);
+    finishRecording();
+    return true;
+
   case BcIns::kGETTAG: {
     // WARNING: We currently overspecialise.  The idea is that GETTAG
     // is usually followed by an integer comparison on the tag.  So we
     // can specialise on the info-table and just load a static
     // constant.  This may not be a good idea in other cases.
-    Closure *cl = (Closure *)base[ins->d()];
+    Closure *cl = untag(base[ins->d()]);
     LC_ASSERT(!cl->isIndirection() && cl->isHNF());
-    specialiseOnInfoTable(buf_, buf_.slot(ins->d()), cl);
+    specialiseOnInfoTable(buf_, untagRef(buf_, buf_.slot(ins->d())), cl);
     TRef taglit = buf_.literal(IRT_I64, cl->tag() - 1);
     //    cerr << "nodespec = " << buf_.slot(ins->d()).ref() - REF_BIAS << endl;
     buf_.setSlot(ins->a(), taglit);
@@ -1327,8 +1866,12 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
 
   return false;
 
+abort_fp_operand:
+  logNYI(NYI_RECORD_FP_BITCAST);
+  LC_STAT_INC(record_abort_reasons[AR_NYI]);
+
 abort_recording:
-  ++record_aborts;
+  LC_STAT_INC(record_aborts);
   resetRecorderState();
   return true;
 
@@ -1337,8 +1880,8 @@ abort_recording:
     switch (err) {
     case IROPTERR_FAILING_GUARD:
       DBG(cerr << "Aborting due to permanently failing guard.\n");
-      ++record_aborts;
-      ++record_abort_reasons[AR_KNOWN_TO_FAIL_GUARD];
+      LC_STAT_INC(record_aborts);
+      LC_STAT_INC(record_abort_reasons[AR_KNOWN_TO_FAIL_GUARD]);
       resetRecorderState();
       return true;
     default:
@@ -1348,9 +1891,89 @@ abort_recording:
   }
 }
 
+void Jit::noteAllocSite(IRBuffer::HeapEntry entry, Word *base) {
+  if (!options_.get(kOptAllocProfile))
+    return;
+  AllocSite unknown = { NULL, NULL, 0, 0 };
+  if (allocSites_.size() <= (size_t)entry)
+    allocSites_.resize(entry + 1, unknown);
+  AllocSite &s = allocSites_[entry];
+  s.fun = ((Closure *)base[-1])->info();
+  s.pc = (const BcIns *)buf_.pc_;
+}
+
+// Count the allocation of `clos' by the helper call that was just
+// emitted.
+void Jit::noteAllocCall(TRef clos, Word *base) {
+  if (!options_.get(kOptAllocProfile))
+    return;
+  AllocSite *s = new AllocSite;
+  s->fun = ((Closure *)base[-1])->info();
+  s->pc = (const BcIns *)buf_.pc_;
+  s->allocs = 0;
+  s->bytes = 0;
+  allocCalls_.push_back(s);
+  TRef args[2] = { buf_.literal(IRT_PTR, (Word)s), clos };
+  buf_.emitCall(IRCALL_countTraceAlloc, IRT_VOID, 2, args);
+}
+
+// Allocate a small Integer on the trace.
+TRef Jit::emitSmallInteger(TRef value, Word *base) {
+  TRef itbl = buf_.literal(IRT_INFO, (Word)MiscClosures::stg_SMALLINT_info);
+  buf_.emitHeapCheck(2);
+  IRBuffer::HeapEntry entry = 0;
+  TRef clos = buf_.emitNEW(itbl, 1, &entry);
+  noteAllocSite(entry, base);
+  buf_.setField(entry, 0, value);
+  return clos;
+}
+
+// Small Integer operands with a small result:
+//
+//     EQINFO x SMALLINT; EQINFO y SMALLINT
+//     r = ADDOV x.1 y.1         ; exits on overflow
+//     NEW SMALLINT r
+//
+// The interpreter handles the overflow case after the trace exit.
+bool Jit::recordSmallIntegerArith(BcIns *ins, uint8_t iropc, Word *base) {
+  Closure *x = untag(base[ins->b()]);
+  Closure *y = untag(base[ins->c()]);
+  if (!isSmallInteger(x) || !isSmallInteger(y) ||
+      checkedArithOverflows(iropc, smallIntegerValue(x),
+                            smallIntegerValue(y)))
+    return false;
+  TRef xref = untagRef(buf_, buf_.slot(ins->b()));
+  TRef yref = untagRef(buf_, buf_.slot(ins->c()));
+  specialiseOnInfoTable(buf_, xref, x);
+  specialiseOnInfoTable(buf_, yref, y);
+  xref = loadField(buf_, xref, 1, IRT_I64);
+  yref = loadField(buf_, yref, 1, IRT_I64);
+  TRef rref = buf_.emit(iropc, IRT_I64 | IRT_GUARD, xref, yref);
+  buf_.setSlot(ins->a(), emitSmallInteger(rref, base));
+  return true;
+}
+
+// Called by the assembler.  The counters are owned by the Fragment
+// once it has been saved.
+void Jit::initAllocCounters() {
+  LC_ASSERT(allocCounters_ == NULL);
+  // Heap entries that were not created by an allocation instruction
+  // (if any) are attributed to an unknown site.
+  uint32_t nentries = buf_.heap_.numEntries();
+  AllocSite unknown = { NULL, NULL, 0, 0 };
+  allocSites_.resize(nentries, unknown);
+  allocCounters_ = new AllocSite[nentries];
+  for (uint32_t i = 0; i < nentries; ++i)
+    allocCounters_[i] = allocSites_[i];
+}
+
 inline void Jit::resetRecorderState() {
   flags_.clear();
   targets_.clear();
+  // Left over if the trace was not saved.
+  for (size_t i = 0; i < allocCalls_.size(); ++i)
+    delete allocCalls_[i];
+  allocCalls_.clear();
   cap_ = NULL;
   shouldAbort_ = false;
 }
@@ -1358,6 +1981,26 @@ inline void Jit::resetRecorderState() {
 void Jit::finishRecording() {
   Time compilestart = getProcessElapsedTime();
   DBG(cerr << "Recorded: " << endl);
+  // No other capability may run traces while we write to the machine
+  // code area.  If another capability is about to stop the world, we
+  // can't wait for it here, so we drop the trace.
+  MemoryManager *mm = cap_->memoryManager();
+  if (!mm->stopOtherCapabilities()) {
+    LC_STAT_INC(record_aborts);
+    resetRecorderState();
+    return;
+  }
+  pthread_mutex_lock(&compileLock_);
+  // Another capability may have compiled a trace for the same
+  // location in the meantime, or the trace cache may be full.
+  if ((traceType_ != TT_SIDE && traceAt(startPc_) != NULL) ||
+      fragments_.size() >= kMaxFragments) {
+    pthread_mutex_unlock(&compileLock_);
+    mm->resumeOtherCapabilities();
+    LC_STAT_INC(record_aborts);
+    resetRecorderState();
+    return;
+  }
 #ifdef LC_TRACE_STATS
   uint32_t nStatCounters = 1 + buffer()->snaps_.size();
   stats_ = new uint64_t[nStatCounters];
@@ -1409,14 +2052,26 @@ void Jit::finishRecording() {
     mcode()->dumpAsm(out);
     out.close();
   };
+  pthread_mutex_unlock(&compileLock_);
+  mm->resumeOtherCapabilities();
 
-  jit_time += getProcessElapsedTime() - compilestart;
+  LC_STAT_ADD(jit_time, getProcessElapsedTime() - compilestart);
 }
 
+// Like finishRecording, give up if the other capabilities cannot be
+// stopped.  The exit then keeps falling back to the interpreter
+// until its counter gets hot again.
 void
-Jit::patchFallthrough(Fragment *parent, ExitNo exitno, Fragment *target)
+Jit::patchFallthrough(Capability *cap, Fragment *parent, ExitNo exitno,
+                      Fragment *target)
 {
+  MemoryManager *mm = cap->memoryManager();
+  if (!mm->stopOtherCapabilities())
+    return;
+  pthread_mutex_lock(&compileLock_);
   asm_.patchFallthrough(parent, exitno, target);
+  pthread_mutex_unlock(&compileLock_);
+  mm->resumeOtherCapabilities();
 }
 
 /*
@@ -1452,7 +2107,9 @@ created.  It is not a 100% solution, but it shouldn't hurt either.
 */
 
 Fragment::Fragment()
-  : flags_(0), traceId_(0), startPc_(NULL), targets_(NULL) {
+  : flags_(0), traceId_(0), startPc_(NULL), targets_(NULL),
+    allocSites_(NULL), numAllocSites_(0), allocCalls_(NULL),
+    numAllocCalls_(0) {
 #ifdef LC_TRACE_STATS
   stats_ = NULL;
 #endif
@@ -1461,6 +2118,12 @@ Fragment::Fragment()
 Fragment::~Fragment() {
   if (targets_ != NULL)
     delete[] targets_;
+  if (allocSites_ != NULL)
+    delete[] allocSites_;
+  for (uint32_t i = 0; i < numAllocCalls_; ++i)
+    delete allocCalls_[i];
+  if (allocCalls_ != NULL)
+    delete[] allocCalls_;
 #ifdef LC_TRACE_STATS
   if (stats_ != NULL)
     delete[] stats_;
@@ -1516,6 +2179,18 @@ Fragment *Jit::saveFragment() {
   F->stats_ = stats_;  // Transfers ownership.
   stats_ = NULL;
 #endif
+  if (allocCounters_ != NULL) {
+    F->allocSites_ = allocCounters_;  // Transfers ownership.
+    F->numAllocSites_ = buf->heap_.numEntries();
+    allocCounters_ = NULL;
+  }
+  if (!allocCalls_.empty()) {
+    F->numAllocCalls_ = allocCalls_.size();
+    F->allocCalls_ = new AllocSite*[F->numAllocCalls_];
+    for (uint32_t i = 0; i < F->numAllocCalls_; ++i)
+      F->allocCalls_[i] = allocCalls_[i];  // Transfers ownership.
+    allocCalls_.clear();
+  }
 
   return F;
 }
@@ -1533,7 +2208,7 @@ Word *Jit::pushFrame(Word *base, BcIns *returnPc,
   buf_.setSlot(topslot + 2, noderef);
   Word *newbase = base + topslot + 3;
   if (!buf_.slots_.frame(newbase, newbase + framesize)) {
-    ++record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW];
+    LC_STAT_INC(record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW]);
     //    cerr << "Abstract stack overflow." << endl;
     return NULL;
   }
@@ -1641,6 +2316,17 @@ void Fragment::restoreSnapshot(ExitNo exitno, ExitState *ex) {
             << dec << spill[ins->spill()] << ")"
             << endl);
         base[slot] = spill[ins->spill()];
+        // The upper half of a spilled Float# is garbage.
+        if (ins->type() == IRT_F32)
+          base[slot] = lc_f2w(lc_w2f(base[slot]));
+      } else if (ins->reg() >= RID_MIN_FPR) {
+        LC_ASSERT(isReg(ins->reg()));
+        DBG(cerr << IR::regName(ins->reg(), ins->type()) << " ("
+            << ex->fpr[ins->reg() - RID_MIN_FPR] << ")" << endl);
+        base[slot] = lc_d2w(ex->fpr[ins->reg() - RID_MIN_FPR]);
+        // A Float# only uses the low 32 bits of the register.
+        if (ins->type() == IRT_F32)
+          base[slot] = lc_f2w(lc_w2f(base[slot]));
       } else {
         LC_ASSERT(isReg(ins->reg()));
         DBG(cerr << IR::regName(ins->reg(), ins->type()) << " ("
@@ -1666,7 +2352,22 @@ void Fragment::restoreSnapshot(ExitNo exitno, ExitState *ex) {
   cap->traceExitHp_ = (Word *)ex->gpr[RID_HP];
   cap->traceExitHpLim_ = ex->hplim;
 
-  if (snapins->opcode() != IR::kHEAPCHK && sn.bumpExitCounter()) {
+  // A SAVE that does not fall through can only exit because the
+  // stack check failed.  Such exits don't start side traces.
+  bool stackCheckExit = snapins->opcode() == IR::kSAVE &&
+    snapins->op1() != IR_SAVE_FALLTHROUGH;
+  // A trace that ends at a RAISE falls through to the interpreter at
+  // the RAISE.  A new trace there would consist of just the RAISE, so
+  // such exits never start a trace.
+  bool raiseExit = snapins->opcode() == IR::kSAVE &&
+    snapins->op1() == IR_SAVE_FALLTHROUGH &&
+    sn.pc() != NULL && sn.pc()->opcode() == BcIns::kRAISE;
+
+  // Exits at a safepoint only let another capability stop the world.
+  bool safepointExit = snapins->opcode() == IR::kSAFEPOINT;
+
+  if (snapins->opcode() != IR::kHEAPCHK && !stackCheckExit && !raiseExit &&
+      !safepointExit && sn.bumpExitCounter()) {
     if (snapins->opcode() == IR::kSAVE && snapins->op1() == IR_SAVE_FALLTHROUGH) {
       // If the parent trace falls back directly to the interpreter
       // then this new traces should be treated like a root trace.
@@ -1678,7 +2379,7 @@ void Fragment::restoreSnapshot(ExitNo exitno, ExitState *ex) {
         // the side exit got hot.
         Fragment *target = cap->jit()->lookupFragment(pc);
         LC_ASSERT(target && target->traceId() == pc->d());
-        cap->jit()->patchFallthrough(this, exitno, target);
+        cap->jit()->patchFallthrough(cap, this, exitno, target);
       } else {
         bool isReturn = !(pc->opcode() == BcIns::kFUNC || pc->opcode() == BcIns::kIFUNC);
         cap->jit()->beginRecording(cap, pc, base, isReturn);
@@ -1771,7 +2472,7 @@ void
 logNYI(uint32_t nyi_id)
 {
   LC_ASSERT(nyi_id < NYI__MAX);
-  ++nyiCount[nyi_id];
+  LC_STAT_INC(nyiCount[nyi_id]);
 #ifndef NDEBUG
   fprintf(stderr, "%s\n", nyiDescription[nyi_id]);
 #endif
@@ -7,9 +7,11 @@
 #include "ir.hh"
 #include "assembler.hh"
 #include "objects.hh"
+#include "allocprofile.hh"
 
 #include <vector>
 #include <iostream>
+#include <pthread.h>
 #include HASH_MAP_H
 
 _START_LAMBDACHINE_NAMESPACE
@@ -181,6 +183,8 @@ public:
   // Returns the fragment starting at the given PC. NULL, otherwise.
   inline Fragment *traceAt(BcIns *pc);
 
+  // Does not need a lock.  The registry never moves its entries
+  // (see fragments_).
   static inline Fragment *traceById(TraceId traceId) {
     LC_ASSERT(traceId < fragments_.size());
     return fragments_[traceId];
@@ -188,7 +192,8 @@ public:
 
   typedef enum {
     kOptDebugTrace,
-    kOptFastHeapCheckFail
+    kOptFastHeapCheckFail,
+    kOptAllocProfile      // Count allocations per heap entry.
   } JitOption;
 
   inline void setOption(JitOption option, bool value) {
@@ -199,14 +204,15 @@ public:
     return options_.get((int)option);
   }
 
-  inline MachineCode *mcode() { return &mcode_; }
+  inline MachineCode *mcode() { return mcode_; }
   inline IRBuffer *buffer() { return &buf_; }
   inline Assembler *assembler() { return &asm_; }
 
   Fragment *saveFragment();
+  // The trace started by the given JFUNC instruction.
   Fragment *lookupFragment(BcIns *pc) {
-    Word idx = reinterpret_cast<Word>(pc) >> 2;
-    return fragments_[fragmentMap_[idx]];
+    LC_ASSERT(pc->opcode() == BcIns::kJFUNC);
+    return traceById(pc->d());
   }
 
   inline void setDebugTrace(bool val) { options_.set(kOptDebugTrace, val); }
@@ -214,14 +220,24 @@ public:
   static void resetFragments();
   static uint32_t numFragments();
 
+  // The maximum number of traces.  Bounded by the size of the machine
+  // code area anyway.
+  static const uint32_t kMaxFragments = 1 << 16;
+
   void setFallthroughParent(Fragment *parent, SnapNo snapno);
-  void patchFallthrough(Fragment *parent, ExitNo exitno, Fragment *target);
+  void patchFallthrough(Capability *cap, Fragment *parent, ExitNo exitno,
+                        Fragment *target);
 
 private:
   void initRecording(Capability *cap, Word *base, BcIns *startPc);
   Word *pushFrame(Word *base, BcIns *returnPc, TRef noderef,
                   uint32_t framesize);
   void finishRecording();
+  void noteAllocSite(IRBuffer::HeapEntry entry, Word *base);
+  void noteAllocCall(TRef clos, Word *base);
+  TRef emitSmallInteger(TRef value, Word *base);
+  bool recordSmallIntegerArith(BcIns *ins, uint8_t iropc, Word *base);
+  void initAllocCounters();
   void resetRecorderState();
   void replaySnapshot(Fragment *parent, SnapNo snapno, Word *base);
   int32_t checkFreeHeapAvail(Fragment *F, SnapNo snapno);
@@ -238,8 +254,7 @@ private:
   Flags32 options_; // configuration options
   TraceType traceType_;
   std::vector<BcIns*> targets_;
-  Prng prng_;
-  MachineCode mcode_;
+  MachineCode *mcode_;  // Shared by all Jits.
   IRBuffer buf_;
   Assembler asm_;
   CallStack callStack_;
@@ -249,9 +264,39 @@ private:
 #ifdef LC_TRACE_STATS
   uint64_t *stats_;
 #endif
-
+  // Allocation site of each heap entry of the current trace.  Only
+  // used with kOptAllocProfile.
+  std::vector<AllocSite> allocSites_;
+  AllocSite *allocCounters_;
+  // The counters of the allocating helper calls of the current trace.
+  // Their addresses are literals of the trace, so they are allocated
+  // while recording.
+  std::vector<AllocSite *> allocCalls_;
+
+  // --- Shared State ---
+  //
+  // All capabilities share the compiled traces.  The fragment
+  // registry and the machine code area are created with the first
+  // Jit and destroyed with the last one.
+  //
+  // Recording is private to each Jit, but compiling, registering and
+  // linking a trace, and patching machine code is serialised by
+  // compileLock_.  The machine code area is only writable during
+  // these steps, and no trace may run then.  So the compiling
+  // capability first stops all others (see
+  // MemoryManager::stopOtherCapabilities); if it cannot, it drops the
+  // trace or the patch.  fragments_ has a fixed capacity, so that entries
+  // can be read without a lock: a trace ID only becomes known to
+  // other capabilities (via a JFUNC instruction or a patched exit)
+  // after the trace has been registered.  fragmentMap_ is protected
+  // by fragmentMapLock_.
   static FRAGMENT_MAP fragmentMap_;
   static std::vector<Fragment*> fragments_;
+  static Prng prng_;
+  static MachineCode *sharedMcode_;
+  static uint32_t numJits_;
+  static pthread_mutex_t compileLock_;
+  static pthread_rwlock_t fragmentMapLock_;
 
   void genCode(IRBuffer *buf);
   void genCode(IRBuffer *buf, IR *ir);
@@ -261,11 +306,13 @@ private:
 
 inline Fragment *Jit::traceAt(BcIns *pc) {
   Word idx = reinterpret_cast<Word>(pc) >> 2;
+  Fragment *F = NULL;
+  pthread_rwlock_rdlock(&fragmentMapLock_);
   FRAGMENT_MAP::const_iterator it = fragmentMap_.find(idx);
   if (it != fragmentMap_.end())
-    return fragments_[it->second];
-  else
-    return NULL;
+    F = fragments_[it->second];
+  pthread_rwlock_unlock(&fragmentMapLock_);
+  return F;
 }
 
 typedef struct _ExitState ExitState; // architecture-specific.
@@ -302,6 +349,25 @@ public:
 
   inline uint32_t numExits() const { return nsnaps_; }
 
+  // Allocation counters, one per heap entry.  Zero unless the trace
+  // was compiled with allocation profiling enabled.
+  inline uint32_t numAllocSites() const { return numAllocSites_; }
+  inline const AllocSite &allocSite(uint32_t n) const {
+    LC_ASSERT(n < numAllocSites_);
+    return allocSites_[n];
+  }
+  inline uint32_t allocSiteWords(uint32_t n) {
+    return 1 + heap_.entry(n).size();
+  }
+
+  // Allocation counters, one per call of a helper that allocates
+  // (e.g., newByteArray).  These count bytes, too.
+  inline uint32_t numAllocCalls() const { return numAllocCalls_; }
+  inline const AllocSite &allocCall(uint32_t n) const {
+    LC_ASSERT(n < numAllocCalls_);
+    return *allocCalls_[n];
+  }
+
 #ifdef LC_TRACE_STATS
   inline uint64_t traceCompletions() const { return stats_[0]; }
   inline uint64_t traceExitsAt(ExitNo n) const {
@@ -345,6 +411,11 @@ private:
   MCode *mcode_;
   //  size_t sizemcode_;
 
+  AllocSite *allocSites_;
+  uint32_t numAllocSites_;
+  AllocSite **allocCalls_;
+  uint32_t numAllocCalls_;
+
 #ifdef LC_TRACE_STATS
   uint64_t *stats_;
 #endif
@@ -355,10 +426,13 @@ private:
 
 inline void Jit::registerFragment(BcIns *startPc, Fragment *F, bool isSideTrace) {
   LC_ASSERT(F->traceId() == fragments_.size());
+  LC_ASSERT(fragments_.size() < fragments_.capacity());
   fragments_.push_back(F);
   Word idx = reinterpret_cast<Word>(startPc) >> 2;
   if (!isSideTrace) {
+    pthread_rwlock_wrlock(&fragmentMapLock_);
     fragmentMap_[idx] = F->traceId();
+    pthread_rwlock_unlock(&fragmentMapLock_);
   }
 #if (DEBUG_COMPONENTS & DEBUG_TRACE_CREATION)
   std::cerr << "ADD TRACE " << F->traceId() << " pc=" << startPc;
@@ -408,7 +482,6 @@ extern "C" void asmEnter(TraceId F_id, Thread *T,
 extern "C" void asmExit(int);
 
 extern "C" void asmHeapOverflow(void);
-extern "C" void asmStackOverflow(void);
 extern "C" void asmTrace(void);
 extern "C" void debugTrace(ExitState *);
 
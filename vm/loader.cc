@@ -1,5 +1,6 @@
 #include "loader.hh"
 #include "fileutils.hh"
+#include "ffi.hh"
 #include "miscclosures.hh"
 #include "time.hh"
 
@@ -8,6 +9,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include HASH_SET_H
 
 using namespace std;
 
@@ -20,29 +27,43 @@ _START_LAMBDACHINE_NAMESPACE
 Time loader_time = 0;
 
 BytecodeFile::BytecodeFile(const char *filename)
-  : name_(filename), f_(NULL) {
+  : name_(filename), data_(NULL), pos_(NULL), end_(NULL) {
   LC_ASSERT(filename != NULL);
 }
 
 bool BytecodeFile::open() {
-  f_ = fopen(name_, "rb");
-  if (!f_) {
+  int fd = ::open(name_, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
     fprintf(stderr, "ERROR: Could not open file %s\n", name_);
+    if (fd >= 0) ::close(fd);
     return false;
   }
+  // The file descriptor isn't needed once the file is mapped.
+  if (st.st_size > 0) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "ERROR: Could not map file %s\n", name_);
+      ::close(fd);
+      return false;
+    }
+    data_ = (const uint8_t *)p;
+  }
+  ::close(fd);
+  pos_ = data_;
+  end_ = data_ + st.st_size;
   return true;
 }
 
 void BytecodeFile::close() {
-  fclose(f_);
+  if (data_ != NULL)
+    munmap((void *)data_, end_ - data_);
+  data_ = pos_ = end_ = NULL;
 }
 
-uint32_t BytecodeFile::get_u4() {
-  uint32_t hh = get_u1();
-  uint32_t hl = get_u1();
-  uint32_t lh = get_u1();
-  uint32_t ll = get_u1();
-  return MSB_u4(hh, hl, lh, ll);
+void BytecodeFile::truncated() {
+  fprintf(stderr, "ERROR: Unexpected end of file %s\n", name_);
+  exit(1);
 }
 
 // Decode an unsigned variable length integer.
@@ -72,7 +93,7 @@ bool BytecodeFile::magic(const char *bytes) {
 
 Loader::Loader(MemoryManager *mm, const char *basepaths)
   : mm_(mm), loadedModules_(10), infoTables_(100), closures_(100),
-    basepaths_(NULL) {
+    basepaths_(NULL), lazyCode_(100) {
   initBasePath(basepaths);
   MiscClosures::init(mm);
 }
@@ -81,6 +102,8 @@ Loader::~Loader() {
   STRING_MAP(Module *)::iterator it;
   for (it = loadedModules_.begin();
        it != loadedModules_.end(); ++it) {
+    if (it->second != NULL && it->second->file_ != NULL)
+      closeModuleFile(it->second);
     delete it->second;
   }
 }
@@ -260,8 +283,10 @@ bool Loader::loadModule(const char *moduleName) {
   {
     AllocInfoTableHandle h(*mm_); // Prevent lots of mprotect calls
     ans = loadModule(moduleName, 0) && checkNoForwardRefs();
+    if (ans)
+      tagStaticReferences();
   }
-  loader_time += getProcessElapsedTime() - starttime;
+  LC_STAT_ADD(loader_time, getProcessElapsedTime() - starttime);
   return ans;
 }
 
@@ -282,30 +307,45 @@ bool Loader::loadModule(const char *moduleName, int level) {
 
   DLOG("[%d] Loading %s ... (%s)\n", level, moduleName, filename);
 
-  BytecodeFile f(filename);
-  if (!f.open())
+  BytecodeFile *f = new BytecodeFile(filename);
+  if (!f->open()) {
+    delete f;
     return false;
+  }
 
-  mdl = loadModuleHeader(f);
-  if (!mdl)
+  mdl = loadModuleHeader(*f);
+  if (!mdl) {
+    delete f;
     return false;
+  }
 
   loadedModules_[moduleName] = mdl;
 
   // Load dependencies first.  This avoids creating many forward
-  // references.  The downside is that we keep more file descriptors
-  // open.
+  // references.  The downside is that we keep more files mapped.
   for (uint32_t i = 0; i < mdl->numImports_; i++)
     loadModule(mdl->imports_[i], level + 1);
 
-  loadModuleBody(f, mdl);
+  loadModuleBody(*f, mdl);
 
-  f.close();
+  // The string table points into the file, so both are kept until
+  // the code has been loaded.
+  mdl->file_ = f;
+  if (mdl->lazyCode_ == 0)
+    closeModuleFile(mdl);
   DLOG("[%d] DONE (%s)\n", level, moduleName);
-  delete[] filename;
   return true;
 }
 
+void Loader::closeModuleFile(Module *mdl) {
+  const char *filename = mdl->file_->filename();
+  delete mdl->file_;
+  delete[] filename;
+  mdl->file_ = NULL;
+  delete[] mdl->strings_;
+  mdl->strings_ = NULL;
+}
+
 void Loader::loadStringTabEntry(BytecodeFile &f, StringTabEntry *e /*out*/) {
   e->len = f.get_varuint();
   e->str = f.get_string(e->len);
@@ -437,6 +477,38 @@ bool Loader::checkNoForwardRefs() {
   return errors == 0;
 }
 
+// Tag all references to static constructors, both from the literals
+// of bytecode and from the fields of other static closures.  We can
+// only do this once all forward references have been resolved.
+// Previously loaded modules are visited again, which is harmless:
+// the tag of a constructor never changes.
+void Loader::tagStaticReferences() {
+  for (STRING_MAP(InfoTable *)::iterator it = infoTables_.begin();
+       it != infoTables_.end(); ++it) {
+    InfoTable *info = it->second;
+    if (info == NULL || !info->hasCode())
+      continue;
+    Code *code = &static_cast<CodeInfoTable *>(info)->code_;
+    for (u4 i = 0; i < code->sizelits; ++i) {
+      if (code->littypes[i] == LIT_CLOSURE)
+        code->lits[i] = tagPointer(untag(code->lits[i]));
+    }
+  }
+
+  for (STRING_MAP(Closure *)::iterator it = closures_.begin();
+       it != closures_.end(); ++it) {
+    Closure *cl = it->second;
+    if (cl == NULL || cl->info()->type() != CONSTR)
+      continue;
+    InfoTable *info = cl->info();
+    u4 bitmap = info->layout().bitmap;
+    for (u4 i = 0; bitmap != 0; ++i, bitmap >>= 1) {
+      if (bitmap & 1)
+        cl->payload_[i] = tagPointer(untag(cl->payload_[i]));
+    }
+  }
+}
+
 void Loader::loadModuleBody(BytecodeFile &f, Module *mdl) {
   if (!f.magic("BCCL")) {
     fprintf(stderr, "Wrong magic for module body\n");
@@ -446,7 +518,7 @@ void Loader::loadModuleBody(BytecodeFile &f, Module *mdl) {
   DLOG("Loading module body...");
 
   for (u4 i = 0; i < mdl->numInfoTables_; ++i) {
-    loadInfoTable(f, mdl->strings_);
+    loadInfoTable(f, mdl);
   }
 
   for (u4 i = 0; i < mdl->numClosures_; ++i) {
@@ -458,8 +530,19 @@ void Loader::loadModuleBody(BytecodeFile &f, Module *mdl) {
 #define FMT_FWD_PTR   COLOURED(COL_RED, "%p")
 #define FMT_CLOS_PTR  COLOURED(COL_GREEN, "%p")
 
-InfoTable *Loader::loadInfoTable(BytecodeFile &f,
-                                 const StringTabEntry *strings) {
+// Compute the SRT bitmap of a piece of code.  See
+// InfoTable::srtBitmap().
+static u2 srtBitmap(const Code *code) {
+  u2 bitmap = 0;
+  for (u4 i = 0; i < code->sizelits; ++i) {
+    if (code->littypes[i] == LIT_CLOSURE || code->littypes[i] == LIT_INFO)
+      bitmap |= i < 15 ? (1u << i) : InfoTable::kSrtOverflowBit;
+  }
+  return bitmap;
+}
+
+InfoTable *Loader::loadInfoTable(BytecodeFile &f, Module *mdl) {
+  const StringTabEntry *strings = mdl->strings_;
   if (!f.magic("ITBL")) {
     fprintf(stderr, "Wrong magic for info table\n");
     exit(1);
@@ -504,13 +587,16 @@ InfoTable *Loader::loadInfoTable(BytecodeFile &f,
     CodeInfoTable *info = static_cast<CodeInfoTable *>
       (mm_->allocInfoTable(h, wordsof(CodeInfoTable)));
     info->type_ = cl_type;
-    info->tagOrBitmap_ = 0; // TODO: anything useful to put in here?
     Word sz = f.get_varuint();
     assert(sz <= 32);
     info->size_ = sz;
     info->layout_.bitmap = sz > 0 ? f.get_u4() : 0;
     info->name_ = loadId(f, strings, ".");
-    loadCode(f, &info->code_, strings);
+    skipCode(f, mdl, info);
+    info->tagOrBitmap_ = 0;  // No literals yet.
+    info->blackholeInfo_ = NULL;
+    if (cl_type == THUNK)
+      MiscClosures::buildBlackholeInfo(mm_, info);
     new_itbl = (InfoTable *)info;
   }
   break;
@@ -537,8 +623,7 @@ void Loader::loadCode(BytecodeFile &f, Code *code /* out */,
   code->sizelits = f.get_varuint();
   code->sizecode = f.get_u2();
   code->sizebitmaps = f.get_u2();
-  code->lits = new Word[code->sizelits];
-  code->littypes = new u1[code->sizelits];
+  mm_->allocLiterals(code->sizelits, &code->lits, &code->littypes);
   for (u2 i = 0; i < code->sizelits; ++i) {
     loadLiteral(f, &code->littypes[i], &code->lits[i], strings);
   }
@@ -572,10 +657,20 @@ void Loader::loadLiteral(BytecodeFile &f,
   case LIT_FLOAT:
     *literal = (Word)f.get_u4();
     break;
-  case LIT_STRING:
+  case LIT_DOUBLE: {
+    Word hi = f.get_u4();
+    *literal = (hi << 32) | f.get_u4();
+  }
+  break;
+  case LIT_STRING: {
+    // String literals must outlive the file and be NUL-terminated.
     i = f.get_varuint();
-    *literal = (Word)strings[i].str;
-    break;
+    char *str = mm_->allocString(strings[i].len);
+    memcpy(str, strings[i].str, strings[i].len);
+    str[strings[i].len] = '\0';
+    *literal = (Word)str;
+  }
+  break;
   case LIT_CLOSURE: {
     const char *clname = loadId(f, strings, ".");
     loadClosureReference(clname, literal);
@@ -586,6 +681,18 @@ void Loader::loadLiteral(BytecodeFile &f,
     loadInfoTableReference(infoname, (InfoTable **)literal);
   }
   break;
+  case LIT_CFUNC: {
+    i = f.get_varuint();
+    std::string name(strings[i].str, strings[i].len);
+    const void *func = lookupForeignFunction(name.c_str());
+    if (func == NULL) {
+      fprintf(stderr, "ERROR: Unknown foreign function %s "
+              "in file: %s\n", name.c_str(), f.filename());
+      exit(1);
+    }
+    *literal = (Word)func;
+  }
+  break;
   default:
     fprintf(stderr, "ERROR: Unknown literal type (%d) "
             "when loading file: %s\n",
@@ -594,6 +701,173 @@ void Loader::loadLiteral(BytecodeFile &f,
   }
 }
 
+// Lazy Code Loading
+// -----------------
+//
+// Most programs only use a small part of the code in the modules
+// they import.  The loader therefore creates all info tables and
+// static closures up front, but only skips over the bytecode of each
+// info table and remembers where it is in the file.  Until the code
+// is loaded, the info table has an empty Code with no literals, so
+// the GC and tagStaticReferences() treat it like code that doesn't
+// refer to anything.
+//
+// The code of an info table is loaded when the interpreter first
+// enters it, i.e., evaluates a thunk or CAF or applies a function (see
+// entryCode()).  Code that is returned to or jumped to by a trace has
+// been entered before.  Until then, `code' is NULL and `lits' points
+// to the Loader which knows where to find the code.  The frame size
+// and arity are always known.
+//
+// The GC treats code that hasn't been loaded as code that keeps no
+// CAFs alive.  A CAF that is only referred to by such code may be
+// reverted; that only costs a re-evaluation if the code is entered
+// later.
+//
+// The file of a module stays mapped until all its code has been
+// loaded.  References to unknown closures or info tables and unknown
+// foreign functions are only detected when the code is loaded.
+// Loading takes lazyLock_, since several capabilities may enter code
+// at the same time.
+
+pthread_mutex_t Loader::lazyLock_ = PTHREAD_MUTEX_INITIALIZER;
+
+void Loader::skipId(BytecodeFile &f) {
+  u4 numparts = f.get_varuint();
+  for (u4 i = 0; i < numparts; ++i)
+    f.get_varuint();
+}
+
+void Loader::skipLiteral(BytecodeFile &f) {
+  u1 littype = f.get_u1();
+  switch (littype) {
+  case LIT_INT:
+  case LIT_CHAR:
+  case LIT_WORD:
+  case LIT_STRING:
+  case LIT_CFUNC:
+    f.get_varuint();
+    break;
+  case LIT_FLOAT:
+    f.skip(4);
+    break;
+  case LIT_DOUBLE:
+    f.skip(8);
+    break;
+  case LIT_CLOSURE:
+  case LIT_INFO:
+    skipId(f);
+    break;
+  default:
+    fprintf(stderr, "ERROR: Unknown literal type (%d) "
+            "when loading file: %s\n",
+            littype, f.filename());
+    exit(1);
+  }
+}
+
+// Skip over the code of `info', see loadCode().  Only the frame size
+// and arity are filled in.
+void Loader::skipCode(BytecodeFile &f, Module *mdl, CodeInfoTable *info) {
+  LazyCode lazy = { mdl, (u4)f.offset() };
+  Code *code = &info->code_;
+  code->framesize = f.get_varuint();
+  code->arity = f.get_varuint();
+  u4 sizelits = f.get_varuint();
+  u4 sizecode = f.get_u2();
+  u4 sizebitmaps = f.get_u2();
+  for (u4 i = 0; i < sizelits; ++i)
+    skipLiteral(f);
+  f.skip(4 * sizecode + 2 * sizebitmaps);
+  code->sizelits = 0;
+  code->sizecode = 0;
+  code->sizebitmaps = 0;
+  code->lits = (Word *)this;
+  code->littypes = NULL;
+  code->code = NULL;
+  lazyCode_[info] = lazy;
+  ++mdl->lazyCode_;
+}
+
+void Loader::loadLazyCode(CodeInfoTable *info) {
+  LazyCodeMap::iterator it = lazyCode_.find(info);
+  LC_ASSERT(it != lazyCode_.end());
+  Module *mdl = it->second.module;
+  BytecodeFile *f = mdl->file_;
+  f->seek(it->second.offset);
+  lazyCode_.erase(it);
+
+  DLOG("loadLazyCode: %s\n", info->name());
+  // The info table is most likely in a block that is read-only by
+  // now, so the code is only copied into it at the end.
+  Code loaded;
+  Code *code = &loaded;
+  loadCode(*f, code, mdl->strings_);
+
+  // All modules have been linked, so any reference that is still
+  // unresolved is an error.  See tagStaticReferences() for the tags.
+  for (u4 i = 0; i < code->sizelits; ++i) {
+    if (code->littypes[i] != LIT_CLOSURE && code->littypes[i] != LIT_INFO)
+      continue;
+    if (code->lits[i] == 0) {
+      fprintf(stderr, "ERROR: Unresolved reference in %s (%s)\n",
+              info->name(), f->filename());
+      exit(1);
+    }
+    if (code->littypes[i] == LIT_CLOSURE)
+      code->lits[i] = tagPointer((Closure *)code->lits[i]);
+  }
+  u2 bitmap = srtBitmap(code);
+
+  // Other capabilities check `code' without taking the lock, so it is
+  // written last.
+  BcIns *bytecode = loaded.code;
+  loaded.code = NULL;
+
+  mm_->unprotectInfoTable(info);
+  info->code_ = loaded;
+  info->tagOrBitmap_ = bitmap;
+  __atomic_store_n(&info->code_.code, bytecode, __ATOMIC_RELEASE);
+  mm_->protectInfoTable(info);
+
+  // The blackhole info table is a copy of the thunk's.
+  if (info->blackholeInfo_ != NULL) {
+    CodeInfoTable *bh = static_cast<CodeInfoTable *>(info->blackholeInfo_);
+    mm_->unprotectInfoTable(bh);
+    bh->code_ = loaded;
+    bh->tagOrBitmap_ = bitmap;
+    __atomic_store_n(&bh->code_.code, bytecode, __ATOMIC_RELEASE);
+    mm_->protectInfoTable(bh);
+  }
+
+  if (--mdl->lazyCode_ == 0)
+    closeModuleFile(mdl);
+}
+
+const Code *Loader::loadCodeOnEntry(const CodeInfoTable *info) {
+  Time starttime = getProcessElapsedTime();
+  pthread_mutex_lock(&lazyLock_);
+  // Another capability may have loaded it in the meantime.
+  if (info->code_.code == NULL) {
+    Loader *loader = (Loader *)info->code_.lits;
+    loader->loadLazyCode(const_cast<CodeInfoTable *>(info));
+  }
+  pthread_mutex_unlock(&lazyLock_);
+  LC_STAT_ADD(loader_time, getProcessElapsedTime() - starttime);
+  return info->code();
+}
+
+void Loader::loadAllCode() {
+  Time starttime = getProcessElapsedTime();
+  pthread_mutex_lock(&lazyLock_);
+  while (!lazyCode_.empty()) {
+    InfoTable *info = lazyCode_.begin()->first;
+    loadLazyCode(static_cast<CodeInfoTable *>(info));
+  }
+  pthread_mutex_unlock(&lazyLock_);
+  LC_STAT_ADD(loader_time, getProcessElapsedTime() - starttime);
+}
+
 // Forward References
 // ------------------
 //
@@ -776,6 +1050,7 @@ void Loader::loadClosure(BytecodeFile &f,
 }
 
 void Loader::printInfoTables(ostream &out) {
+  loadAllCode();
   STRING_MAP(InfoTable *)::iterator it;
   for (it = infoTables_.begin();
        it != infoTables_.end(); ++it) {
@@ -6,6 +6,7 @@
 #include "objects.hh"
 #include "fileutils.hh"
 
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <iostream>
@@ -18,9 +19,11 @@ _START_LAMBDACHINE_NAMESPACE
 #define INFO_MAGIC              MSB_u4('I','T','B','L')
 #define CLOSURE_MAGIC           MSB_u4('C','L','O','S')
 
+// The string is not NUL-terminated.  It points into the bytecode file
+// and is only valid while the file is being loaded.
 typedef struct _StringTabEntry {
   Word len;
-  char *str;
+  const char *str;
 } StringTabEntry;
 
   // If only C++ had type classes.  Or concepts...
@@ -51,6 +54,8 @@ struct hashstr {
 #define STRING_MAP(valueType) \
   HASH_NAMESPACE::HASH_MAP_CLASS<const char*, valueType, hashstr, eqstr>
 
+class BytecodeFile;
+
 class Module {
 public:
   inline const char *name() const { return name_; }
@@ -64,23 +69,45 @@ private:
 
   StringTabEntry *strings_;
   const char    **imports_;
+  // The file and its string table stay around until the code of all
+  // info tables of the module has been loaded.
+  BytecodeFile   *file_;
+  uint32_t        lazyCode_;    // Number of info tables without code
   friend class Loader;
+  friend class Image;
 };
 
 typedef struct _BasePathEntry BasePathEntry;  // Defined in loader.cc
 
+// A bytecode file is mapped into memory while it is being loaded.
+// All decoding reads straight from the mapping.  Reading past the end
+// of the file is a fatal error.
 class BytecodeFile {
 public:
   BytecodeFile(const char *filename);
+  ~BytecodeFile() { close(); }
   bool open();
   void close();
   inline const char *filename() const { return name_; }
-  inline uint8_t get_u1() { return (uint8_t)fgetc(f_); }
+  inline uint8_t get_u1() {
+    if (LC_UNLIKELY(pos_ >= end_))
+      truncated();
+    return *pos_++;
+  }
   inline uint16_t get_u2() {
-    uint16_t hi = get_u1();
-    uint16_t lo = get_u1();
+    ensure(2);
+    uint16_t hi = pos_[0];
+    uint16_t lo = pos_[1];
+    pos_ += 2;
     return hi << 8 | lo;
   }
+  inline uint32_t get_u4() {
+    ensure(4);
+    uint32_t w = MSB_u4((uint32_t)pos_[0], (uint32_t)pos_[1],
+                        (uint32_t)pos_[2], (uint32_t)pos_[3]);
+    pos_ += 4;
+    return w;
+  }
   inline Word get_varuint() {
     Word b = get_u1();
     if ((b & 0x80) == 0)
@@ -93,24 +120,38 @@ public:
     return zigZagDecode(get_varuint());
   }
 
-  inline char *get_string(size_t len) {
-    char *p = new char[len + 1];
-    fread(p, 1, len, f_);
-    p[len] = '\0';
+  // Returns a pointer to the next `len' bytes of the mapping.  The
+  // string is not NUL-terminated and only valid until close().
+  inline const char *get_string(size_t len) {
+    ensure(len);
+    const char *p = (const char *)pos_;
+    pos_ += len;
     return p;
   }
-  // Require the file to contain the exact byte sequence.
-  inline bool magic(const char *bytes);
-  inline void get_string(char *buf, size_t len) {
-    fread(buf, 1, len, f_);
+  inline void skip(size_t n) {
+    ensure(n);
+    pos_ += n;
+  }
+  // Continue decoding at the given offset, see offset().
+  inline void seek(long offset) {
+    LC_ASSERT(offset >= 0 && offset <= end_ - data_);
+    pos_ = data_ + offset;
   }
-  uint32_t get_u4();
-  inline long offset() { return ftell(f_); }
+  // Require the file to contain the exact byte sequence.
+  bool magic(const char *bytes);
+  inline long offset() const { return pos_ - data_; }
 private:
+  inline void ensure(size_t n) {
+    if (LC_UNLIKELY((size_t)(end_ - pos_) < n))
+      truncated();
+  }
   Word get_varuint_slow(Word first);
+  void truncated() LC_NORET;
 
   const char *name_;
-  FILE *f_;
+  const uint8_t *data_;
+  const uint8_t *pos_;
+  const uint8_t *end_;
 };
 
 typedef const StringTabEntry *StringTable;
@@ -134,6 +175,19 @@ public:
     Closure *cl = closures_[name];
     return cl;
   }
+  // Load the code of all info tables.
+  void loadAllCode();
+  // The number of info tables whose code has not been loaded yet.
+  inline size_t pendingCode() const { return lazyCode_.size(); }
+
+  // Returns the code of `info', which the interpreter is about to
+  // enter.  Loads the code first if necessary.
+  static inline const Code *entryCode(const CodeInfoTable *info) {
+    const Code *code = info->code();
+    if (LC_UNLIKELY(__atomic_load_n(&code->code, __ATOMIC_ACQUIRE) == NULL))
+      return loadCodeOnEntry(info);
+    return code;
+  }
 
 private:
   void initBasePath(const char *);
@@ -146,9 +200,15 @@ private:
   bool loadModule(const char *moduleName, int);
   Module *loadModuleHeader(BytecodeFile&);
   void loadModuleBody(BytecodeFile &f, Module *mdl);
-  InfoTable *loadInfoTable(BytecodeFile &f, const StringTabEntry *strings);
+  void closeModuleFile(Module *mdl);
+  InfoTable *loadInfoTable(BytecodeFile &f, Module *mdl);
   void loadCode(BytecodeFile &, Code * /* out */,
                 const StringTabEntry *strings);
+  void skipCode(BytecodeFile &, Module *mdl, CodeInfoTable *info);
+  void skipLiteral(BytecodeFile &);
+  void skipId(BytecodeFile &);
+  void loadLazyCode(CodeInfoTable *info);
+  static const Code *loadCodeOnEntry(const CodeInfoTable *info);
   void loadLiteral(BytecodeFile &, u1 *littypes, Word *lits,
                    const StringTabEntry *strings);
   void loadClosure(BytecodeFile &, const StringTabEntry *strings);
@@ -158,12 +218,28 @@ private:
   void loadInfoTableReference(const char *name, InfoTable **dest /* out */);
   void fixInfoTableForwardReference(const char *name, InfoTable *info);
   bool checkNoForwardRefs();
+  void tagStaticReferences();
 
   MemoryManager *mm_;
   STRING_MAP(Module*) loadedModules_;
   STRING_MAP(InfoTable*) infoTables_;
   STRING_MAP(Closure*) closures_;
   BasePathEntry *basepaths_;
+
+  // Where to find the code of an info table that hasn't been loaded
+  // yet.  See "Lazy Code Loading" in loader.cc.
+  typedef struct {
+    Module *module;
+    u4 offset;
+  } LazyCode;
+  typedef HASH_NAMESPACE::HASH_MAP_CLASS<InfoTable *, LazyCode>
+    LazyCodeMap;
+  LazyCodeMap lazyCode_;
+  // Capabilities may enter code that is not loaded yet at the same
+  // time.  Protects lazyCode_ and the module files of all loaders.
+  static pthread_mutex_t lazyLock_;
+
+  friend class Image;
 };
 
 inline bool Loader::isFullyLoadedInfoTable(InfoTable *info) {
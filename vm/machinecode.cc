@@ -110,6 +110,7 @@ void MachineCode::allocArea() {
   protection_ = MCPROT_GEN;
   bottom_ = area_;
   top_ = (MCode *)((char *)area_ + size_);
+  protect(MCPROT_GEN);
 }
 
 void MachineCode::commit(MCode *top) {
@@ -1,13 +1,18 @@
 #include "options.hh"
 #include "memorymanager.hh"
 #include "loader.hh"
+#include "image.hh"
 #include "capability.hh"
 #include "thread.hh"
 #include "time.hh"
+#include "sparks.hh"
 
 
 #include <iostream>
 #include <memory>
+#include <vector>
+#include <pthread.h>
+#include <string.h>
 
 using namespace std;
 _USE_LAMBDACHINE_NAMESPACE
@@ -17,7 +22,27 @@ void formatWithThousands(char *str, uint64_t n);
 void printGCStats(FILE *out, MemoryManager *mm, Time mut_time);
 void printTraceStats(FILE *out);
 void printStats(FILE *out, MemoryManager *mm, Capability *cap,
+                const AllocProfile *allocs,
                 Time startup_time, Time start_time, Time stop_time);
+void addSparkStats(Capability::SparkStats *total, Capability *cap);
+void printSparkStats(FILE *out, const Capability::SparkStats &sparks);
+
+static const size_t kAllocSitesShown = 20;
+
+// A capability that evaluates the entry point on its own OS thread
+// (see --caps).  Only the result of the main capability is printed.
+typedef struct {
+  Capability *cap;
+  Thread *T;
+  Closure *entry;
+  bool ok;
+} Worker;
+
+static void *runWorker(void *arg) {
+  Worker *w = (Worker *)arg;
+  w->ok = w->cap->eval(w->T, w->entry);
+  return NULL;
+}
 
 inline double percent(double num, double denom) {
   return (num * 100) / denom;
@@ -34,9 +59,26 @@ int main(int argc, char *argv[]) {
   initializeTimer();
   Time startup_time = getProcessElapsedTime();
   MemoryManager mm;
-  mm.setMinHeapSize(1UL * 1024 * 1024);
+  mm.setNurserySize(opts->nurserySize());
+  mm.setSuggestedHeapSize(opts->suggestedHeapSize());
+  mm.setMaxHeapSize(opts->maxHeapSize());
+  mm.setGCTimeTarget(opts->gcTimeTarget());
+  mm.setGCThreads(opts->gcThreads());
+  if (opts->heapProfile() &&
+      !mm.startHeapProfile(opts->heapProfileFile().c_str(),
+                           opts->heapProfileGCs(),
+                           (Time)(opts->heapProfileSeconds() *
+                                  TIME_RESOLUTION))) {
+    fprintf(stderr, "Could not open heap profile file: %s\n",
+            opts->heapProfileFile().c_str());
+    return 1;
+  }
   Loader loader(&mm, opts->basePath().c_str());
 
+  if (!opts->loadImageFile().empty() &&
+      !Image::load(opts->loadImageFile().c_str(), &mm, &loader))
+    return 1;
+
   if (!loader.loadWiredInModules())
     return 1;
 
@@ -56,6 +98,10 @@ int main(int argc, char *argv[]) {
     loader.printClosures(cout);
   }
 
+  if (!opts->saveImageFile().empty()) {
+    return Image::save(opts->saveImageFile().c_str(), &mm, &loader) ? 0 : 1;
+  }
+
   if (opts->entry().empty()) {
     return 0;
   }
@@ -70,31 +116,92 @@ int main(int argc, char *argv[]) {
 
   Capability cap(&mm);
   Thread *T = Thread::createThread(&cap, opts->stackSize() / sizeof(Word));
+  if (opts->maxStackSize() > 0)
+    T->setMaxStackSize(opts->maxStackSize() / sizeof(Word));
 
   cap.jit()->setOption(Jit::kOptFastHeapCheckFail, true);
+  if (opts->allocProfile())
+    cap.enableAllocProfiling();
 
   if (opts->traceInterpreter()) {
     cap.enableBytecodeTracing();
     cap.enableDecodeClosures();
   }
 
+  vector<Worker> workers(opts->capabilities() - 1);
+  vector<pthread_t> workerThreads(workers.size());
+  for (size_t i = 0; i < workers.size(); ++i) {
+    Worker *w = &workers[i];
+    w->cap = new Capability(&mm);
+    w->cap->jit()->setOption(Jit::kOptFastHeapCheckFail, true);
+    if (opts->allocProfile())
+      w->cap->enableAllocProfiling();
+    w->T = Thread::createThread(w->cap, opts->stackSize() / sizeof(Word));
+    if (opts->maxStackSize() > 0)
+      w->T->setMaxStackSize(opts->maxStackSize() / sizeof(Word));
+    w->entry = entryClosure;
+    w->ok = false;
+  }
+
+  Capability::SparkStats sparks;
+  memset(&sparks, 0, sizeof(sparks));
+  AllocProfile allocs;
+  SparkWorkers *sparkWorkers = NULL;
+
   Time start_time = getProcessElapsedTime();
 
-  if (!cap.eval(T, entryClosure)) {
+  if (opts->sparkWorkers() > 0)
+    sparkWorkers = new SparkWorkers(&mm, opts->sparkWorkers(),
+                                    opts->stackSize() / sizeof(Word),
+                                    opts->allocProfile());
+  for (size_t i = 0; i < workers.size(); ++i)
+    pthread_create(&workerThreads[i], NULL, runWorker, &workers[i]);
+
+  // Stay attached until the result is printed, so that no other
+  // capability can move it.
+  cap.attach();
+  bool ok = cap.eval(T, entryClosure);
+  if (ok) {
+    Closure *result = (Closure*)T->slot(0);
+    cout << "@Result@ ";
+    printClosure(cout, result, true);
+  }
+  cap.detach();
+
+  for (size_t i = 0; i < workers.size(); ++i) {
+    pthread_join(workerThreads[i], NULL);
+    ok = ok && workers[i].ok;
+    addSparkStats(&sparks, workers[i].cap);
+    allocs.merge(workers[i].cap->allocProfile());
+    delete workers[i].T;
+    delete workers[i].cap;
+  }
+  if (sparkWorkers != NULL) {
+    for (u4 i = 0; i < sparkWorkers->numWorkers(); ++i) {
+      addSparkStats(&sparks, sparkWorkers->capability(i));
+      allocs.merge(sparkWorkers->capability(i)->allocProfile());
+    }
+    delete sparkWorkers;
+  }
+  addSparkStats(&sparks, &cap);
+  allocs.merge(cap.allocProfile());
+  if (!ok) {
     cerr << "Error during evaluation." << endl;
     return 1;
   }
 
-  Closure *result = (Closure*)T->slot(0);
-  cout << "@Result@ ";
-  printClosure(cout, result, true);
-
   Time stop_time = getProcessElapsedTime();
 
   delete T;
 
   if (opts->printStats()) {
-    printStats(stdout, &mm, &cap, startup_time, start_time, stop_time);
+    printStats(stdout, &mm, &cap, opts->allocProfile() ? &allocs : NULL,
+               startup_time, start_time, stop_time);
+    if (sparks.created + sparks.dud + sparks.overflowed > 0)
+      printSparkStats(stdout, sparks);
+  } else if (opts->allocProfile()) {
+    printf("\n\n");
+    allocs.print(stdout, kAllocSitesShown);
   }
 
   return 0;
@@ -134,7 +241,30 @@ void printGCStats(FILE *out, MemoryManager *mm, Time mut_time) {
   uint64_t alloc_rate = (uint64_t)(total_alloc / mut_seconds);
   formatWithThousands(buf, alloc_rate);
   fprintf(out, "   (%18s bytes per MUT second)\n", buf);
-  fprintf(out, "    %18d collections\n\n", mm->numGCs());
+  formatWithThousands(buf, mm->copied());
+  fprintf(out, "  %20s bytes copied during GC\n", buf);
+  fprintf(out, "    %18d collections (%d minor, %d major, %d GC threads)\n",
+          mm->numGCs(), mm->numMinorGCs(), mm->numMajorGCs(),
+          mm->gcThreads());
+  fprintf(out, "    %18" FMT_Word64 " CAFs reverted\n\n",
+          mm->numRevertedCAFs());
+}
+
+void addSparkStats(Capability::SparkStats *total, Capability *cap) {
+  const Capability::SparkStats &s = cap->sparkStats();
+  total->created += s.created;
+  total->dud += s.dud;
+  total->overflowed += s.overflowed;
+  total->converted += s.converted;
+  total->fizzled += s.fizzled;
+}
+
+void printSparkStats(FILE *out, const Capability::SparkStats &s) {
+  fprintf(out,
+          "  SPARKS: %" FMT_Word64 " (%" FMT_Word64 " converted, %"
+          FMT_Word64 " fizzled, %" FMT_Word64 " dud, %" FMT_Word64
+          " overflowed)\n\n",
+          s.created, s.converted, s.fizzled, s.dud, s.overflowed);
 }
 
 void
@@ -226,6 +356,7 @@ printBasicStats(FILE *out, Capability *cap,
 
 void
 printStats(FILE *out, MemoryManager *mm, Capability *cap,
+           const AllocProfile *allocs,
            Time startup_time, Time start_time, Time stop_time)
 {
     printf("\n\n");
@@ -237,6 +368,9 @@ printStats(FILE *out, MemoryManager *mm, Capability *cap,
     printf("\n\n");
     printGCStats(out, mm, mut_time);
 
+    if (allocs != NULL)
+      allocs->print(out, kAllocSitesShown);
+
 #ifdef LC_TRACE_STATS
     printf("\n\n");
     printTraceStats(out);
@@ -6,8 +6,13 @@
 #include "time.hh"
 
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sched.h>
+#include <algorithm>
 
 _START_LAMBDACHINE_NAMESPACE
 
@@ -161,12 +166,14 @@ void Region::initBlocks(SmallObjectRegionData *r) {
     metadata = alignToBlockBoundary(metadata + 1);
     r->blocks_[i].end_ = metadata;
     r->blocks_[i].free_ = metadata;
+    r->blocks_[i].scan_ = metadata;
     r->blocks_[i].link_ = NULL;
   }
   for (Word i = first_avail; i < kBlocksPerRegion; i++) {
     r->blocks_[i].flags_ = Block::kUninitialized;
     r->blocks_[i].start_ = ptr;
     r->blocks_[i].free_ = ptr;
+    r->blocks_[i].scan_ = ptr;
     ptr = alignToBlockBoundary(ptr + 1);
     r->blocks_[i].end_ = ptr;
     r->blocks_[i].link_ = &r->blocks_[i + 1];
@@ -208,22 +215,67 @@ MemoryManager::MemoryManager()
     largeObjects_(NULL),
     evacuatedLargeObjects_(NULL),
     scavengedLargeObjects_(NULL),
-    freeLargeRegions_(NULL),
-    minHeapSize_(2),
-    nextGC_(minHeapSize_),
-    allocated_(0), num_gcs_(0)
+    freeLargeRegions_(NULL), largeBytes_(0), largeSinceGC_(0),
+    baseNurseryBlocks_(2), nurseryBlocks_(2),
+    suggestedHeapBlocks_(0), maxHeapBlocks_(0),
+    gcTimeTarget_(0), gcTimeFraction_(0), lastGCEnd_(0),
+    nextGC_(2),
+    oldGenBlocks_(1),
+    nextMajorGC_(2 * kOldGenGrowthFactor),
+    majorGC_(false),
+    allocated_(0), copied_(0), mapped_(0), num_gcs_(0), num_major_gcs_(0),
+    reverted_cafs_(0), heapProfiler_(NULL), census_(false),
+    gcThreads_(1), parallelGC_(false), workersStarted_(false),
+    shutdownWorkers_(false), gcIdle_(0), gcRunning_(0), gcGeneration_(0),
+    attachedCaps_(0), shared_(false), nextVictim_(0), stoppedCaps_(0),
+    stopTheWorld_(false), gcEpoch_(0)
 {
+  pthread_mutex_init(&blockLock_, NULL);
   region_ = Region::newRegion(Region::kSmallObjectRegion);
   static_closures_ = grabFreeBlock(Block::kStaticClosures);
   info_tables_ = grabFreeBlock(Block::kInfoTables);
   bool ok = markBlockReadOnly(info_tables_);
   LC_ASSERT(ok);
   closures_ = grabFreeBlock(Block::kClosures);
+  aging_ = NULL;
+  old_gen_ = grabFreeBlock(Block::kClosures);
+  old_gen_->setFlag(Block::kOld);
   strings_ = grabFreeBlock(Block::kStrings);
   bytecode_ = grabFreeBlock(Block::kBytecode);
+
+  setNurserySize(0);
+
+  workers_ = new GCWorker*[1];
+  workers_[0] = new GCWorker(this, 0);
+  pthread_mutex_init(&gcLock_, NULL);
+  pthread_cond_init(&gcStart_, NULL);
+  pthread_cond_init(&gcDone_, NULL);
+  pthread_mutex_init(&heapLock_, NULL);
+  pthread_cond_init(&worldStopped_, NULL);
+  pthread_cond_init(&worldResumed_, NULL);
 }
 
 MemoryManager::~MemoryManager() {
+  delete heapProfiler_;
+  stopGCWorkers();
+  for (u4 i = 0; i < gcThreads_; ++i)
+    delete workers_[i];
+  delete[] workers_;
+  pthread_cond_destroy(&gcDone_);
+  pthread_cond_destroy(&gcStart_);
+  pthread_mutex_destroy(&blockLock_);
+  pthread_mutex_destroy(&gcLock_);
+  LC_ASSERT(capabilities_.empty());
+  pthread_cond_destroy(&worldResumed_);
+  pthread_cond_destroy(&worldStopped_);
+  pthread_mutex_destroy(&heapLock_);
+
+  for (LargeObject *p = largeObjects_, *next; p != NULL; p = next) {
+    next = p->next_;
+    if (p->isMappedFile())
+      unmapFile(p);
+  }
+
   Region *r = region_;
   while (r != NULL) {
     Region *next = r->meta_.region_link_;
@@ -233,12 +285,77 @@ MemoryManager::~MemoryManager() {
   MiscClosures::reset();
 }
 
+bool MemoryManager::startHeapProfile(const char *filename, u4 gcInterval,
+                                     Time timeInterval) {
+  HeapProfiler *profiler = new HeapProfiler();
+  if (!profiler->open(filename, gcInterval, timeInterval)) {
+    delete profiler;
+    return false;
+  }
+  delete heapProfiler_;
+  heapProfiler_ = profiler;
+  return true;
+}
+
+void MemoryManager::setNurserySize(size_t bytes) {
+  if (bytes == 0) {
+    bytes = cacheSize();
+    if (bytes < kMinNurserySize) bytes = kMinNurserySize;
+    if (bytes > kMaxDefaultNurserySize) bytes = kMaxDefaultNurserySize;
+  }
+  u4 blocks = idivCeil(bytes, Block::kBlockSize);
+  if (blocks < 2) blocks = 2;
+  baseNurseryBlocks_ = blocks;
+  nurseryBlocks_ = blocks;
+  nextGC_ = blocks;
+  nextMajorGC_ = blocks * kOldGenGrowthFactor;
+}
+
+// Read the cache sizes from sysfs.  The result is cached.
+size_t MemoryManager::cacheSize() {
+  static size_t size = (size_t)-1;
+  if (size != (size_t)-1)
+    return size;
+  size = 0;
+  for (int i = 0; i < 16; ++i) {
+    char path[80];
+    int level = 0;
+    unsigned long kbytes = 0;
+    char unit = 'K';
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+      break;
+    int ok = fscanf(f, "%d", &level);
+    fclose(f);
+    if (ok != 1 || level < 2)
+      continue;
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+    f = fopen(path, "r");
+    if (f == NULL)
+      continue;
+    ok = fscanf(f, "%lu%c", &kbytes, &unit);
+    fclose(f);
+    if (ok < 1)
+      continue;
+    size_t bytes = kbytes << (unit == 'M' ? 20 : unit == 'G' ? 30 : 10);
+    if (bytes > size)
+      size = bytes;
+  }
+  return size;
+}
+
+// May be called by several capabilities or GC workers at once.
 Block *MemoryManager::grabFreeBlock(Block::Flags flags) {
+  pthread_mutex_lock(&blockLock_);
   // 1. Try to grab a block from the free block list (very likely).
   Block *b = NULL;
   if (free_ != NULL) {
     b = free_;
     free_ = b->link_;
+    pthread_mutex_unlock(&blockLock_);
     b->link_ = NULL;
     b->flags_ = static_cast<uint32_t>(flags);
     return b;
@@ -255,6 +372,7 @@ Block *MemoryManager::grabFreeBlock(Block::Flags flags) {
     region_ = r;
     b = r->grabFreeBlock();
   }
+  pthread_mutex_unlock(&blockLock_);
 
   b->flags_ = static_cast<uint32_t>(flags);
   return b;
@@ -263,11 +381,75 @@ Block *MemoryManager::grabFreeBlock(Block::Flags flags) {
 void MemoryManager::blockFull(Block **block) {
   Block *fullBlock = *block;
   Block *emptyBlock = grabFreeBlock(fullBlock->contents());
+  // New blocks stay in the same generation.
+  emptyBlock->flags_ |= fullBlock->flags_ & (Block::kAged | Block::kOld);
   dout << "BLOCK_FULL" << endl;
   emptyBlock->link_ = *block;
   *block = emptyBlock;
 }
 
+void MemoryManager::allocLiterals(size_t n, Word **lits, u1 **littypes) {
+  if (n == 0) {
+    *lits = NULL;
+    *littypes = NULL;
+    return;
+  }
+  size_t bytes = n * (sizeof(Word) + sizeof(u1));
+  char *ptr;
+  for (;;) {
+    Block *b = bytecode_;
+    ptr = (char *)roundUpToPowerOf2(LC_ARCH_BYTES_LOG2, (Word)b->free());
+    if (ptr + bytes <= b->end()) {
+      countAllocated(ptr + bytes - b->free());
+      b->free_ = ptr + bytes;
+      break;
+    }
+    blockFull(&bytecode_);
+  }
+  *lits = (Word *)ptr;
+  *littypes = (u1 *)(ptr + n * sizeof(Word));
+}
+
+// Get a block for static data loaded from an image (see image.hh).
+// It is linked into the list of blocks with the same contents, behind
+// the block that is currently allocated into, so it is never
+// allocated into.  Images may contain blocks of the full block size,
+// so the smaller first block of a region is not used.
+Block *MemoryManager::grabStaticBlock(Block::Flags contents) {
+  Block **list;
+  switch (contents) {
+  case Block::kInfoTables:     list = &info_tables_; break;
+  case Block::kStaticClosures: list = &static_closures_; break;
+  case Block::kStrings:        list = &strings_; break;
+  case Block::kBytecode:       list = &bytecode_; break;
+  default:
+    return NULL;
+  }
+
+  Block *small = NULL;
+  Block *b = grabFreeBlock(contents);
+  while (b->size() < Block::kBlockSize) {
+    b->link_ = small;
+    small = b;
+    b = grabFreeBlock(contents);
+  }
+  if (small != NULL) {
+    pthread_mutex_lock(&blockLock_);
+    while (small != NULL) {
+      Block *next = small->link_;
+      small->markAsFree();
+      small->link_ = free_;
+      free_ = small;
+      small = next;
+    }
+    pthread_mutex_unlock(&blockLock_);
+  }
+
+  b->link_ = (*list)->link_;
+  (*list)->link_ = b;
+  return b;
+}
+
 bool
 MemoryManager::markBlockReadOnly(const Block *block)
 {
@@ -311,10 +493,30 @@ MemoryManager::allocInfoTable(AllocInfoTableHandle&, Word nwords)
     }
     ptr = info_tables_->alloc(bytes);
   }
-  allocated_ += bytes;
+  countAllocated(bytes);
   return (InfoTable *)ptr;
 }
 
+void
+MemoryManager::unprotectInfoTable(const InfoTable *info)
+{
+  Block *block = Region::blockFromPointer((void *)info);
+  if (block == info_tables_ && beginAllocInfoTableLevel_ > 0)
+    return;
+  bool ok = markBlockReadWrite(block);
+  LC_ASSERT(ok && "Failed to mark block as R/W");
+}
+
+void
+MemoryManager::protectInfoTable(const InfoTable *info)
+{
+  Block *block = Region::blockFromPointer((void *)info);
+  if (block == info_tables_ && beginAllocInfoTableLevel_ > 0)
+    return;
+  bool ok = markBlockReadOnly(block);
+  LC_ASSERT(ok && "Failed to mark block R/O");
+}
+
 void
 MemoryManager::beginAllocInfoTable()
 {
@@ -335,32 +537,166 @@ MemoryManager::endAllocInfoTable()
   }
 }
 
+void MemoryManager::registerCapability(Capability *cap) {
+  pthread_mutex_lock(&heapLock_);
+  while (stopTheWorld_)
+    pthread_cond_wait(&worldResumed_, &heapLock_);
+  cap->nursery_ = grabFreeBlock(Block::kClosures);
+  capabilities_.push_back(cap);
+  if (capabilities_.size() > 1)
+    shared_ = true;
+  pthread_mutex_unlock(&heapLock_);
+}
+
+void MemoryManager::unregisterCapability(Capability *cap) {
+  pthread_mutex_lock(&heapLock_);
+  while (stopTheWorld_)
+    pthread_cond_wait(&worldResumed_, &heapLock_);
+  // Objects in the nursery block may still be reachable from other
+  // capabilities.
+  retireNursery(cap);
+  cap->nursery_ = NULL;
+  capabilities_.erase(std::find(capabilities_.begin(), capabilities_.end(),
+                                cap));
+  pthread_mutex_unlock(&heapLock_);
+}
+
+void MemoryManager::attachCapability() {
+  pthread_mutex_lock(&heapLock_);
+  while (stopTheWorld_)
+    pthread_cond_wait(&worldResumed_, &heapLock_);
+  ++attachedCaps_;
+  pthread_mutex_unlock(&heapLock_);
+}
+
+void MemoryManager::detachCapability() {
+  pthread_mutex_lock(&heapLock_);
+  LC_ASSERT(attachedCaps_ > 0);
+  --attachedCaps_;
+  if (stopTheWorld_)
+    pthread_cond_signal(&worldStopped_);
+  pthread_mutex_unlock(&heapLock_);
+}
+
+bool MemoryManager::stealSpark(Capability *thief, Closure **spark) {
+  bool found = false;
+  pthread_mutex_lock(&heapLock_);
+  size_t n = capabilities_.size();
+  for (size_t i = 0; i < n && !found; ++i) {
+    Capability *victim = capabilities_[(nextVictim_ + i) % n];
+    if (victim != thief && victim->sparks_.steal(spark))
+      found = true;
+  }
+  ++nextVictim_;
+  pthread_mutex_unlock(&heapLock_);
+  return found;
+}
+
+void MemoryManager::retireNursery(Capability *cap) {
+  Block *block = cap->nursery_;
+  block->link_ = closures_;
+  closures_ = block;
+}
+
+u4 MemoryManager::safepointRequests_ = 0;
+
+// Wait until all other attached capabilities have stopped.
+void MemoryManager::stopTheWorld() {
+  LC_ASSERT(!stopTheWorld_);
+  stopTheWorld_ = true;
+  __atomic_add_fetch(&safepointRequests_, 1, __ATOMIC_RELAXED);
+  while (stoppedCaps_ + 1 < attachedCaps_)
+    pthread_cond_wait(&worldStopped_, &heapLock_);
+}
+
+void MemoryManager::resumeTheWorld() {
+  stopTheWorld_ = false;
+  __atomic_sub_fetch(&safepointRequests_, 1, __ATOMIC_RELAXED);
+  ++gcEpoch_;
+  pthread_cond_broadcast(&worldResumed_);
+}
+
+// Called by an attached capability at a safepoint while another
+// capability is waiting to collect garbage.
+void MemoryManager::waitForGC() {
+  u4 epoch = gcEpoch_;
+  ++stoppedCaps_;
+  pthread_cond_signal(&worldStopped_);
+  while (gcEpoch_ == epoch)
+    pthread_cond_wait(&worldResumed_, &heapLock_);
+  --stoppedCaps_;
+}
+
+bool MemoryManager::stopOtherCapabilities() {
+  pthread_mutex_lock(&heapLock_);
+  if (stopTheWorld_) {
+    pthread_mutex_unlock(&heapLock_);
+    return false;
+  }
+  stopTheWorld();
+  pthread_mutex_unlock(&heapLock_);
+  return true;
+}
+
+void MemoryManager::resumeOtherCapabilities() {
+  pthread_mutex_lock(&heapLock_);
+  resumeTheWorld();
+  pthread_mutex_unlock(&heapLock_);
+}
+
+void MemoryManager::safepoint(Capability *cap, char **heap, char **heaplim) {
+  sync(cap->nursery_, *heap, *heaplim);
+  pthread_mutex_lock(&heapLock_);
+  while (stopTheWorld_)
+    waitForGC();
+  pthread_mutex_unlock(&heapLock_);
+  // The GC may have given us a new block.
+  getBumpAllocatorBounds(cap->nursery_, heap, heaplim);
+}
+
 // Returns non-zero if GC is necessary.
 int
-MemoryManager::bumpAllocatorFullNoGC(char **heap, char **heaplim)
+MemoryManager::bumpAllocatorFullNoGC(Capability *cap,
+                                     char **heap, char **heaplim)
 {
-  sync(*heap, *heaplim);
-  --nextGC_;
-  if (LC_UNLIKELY(nextGC_ == 0)) {
-    ++nextGC_;
+  sync(cap->nursery_, *heap, *heaplim);
+  pthread_mutex_lock(&heapLock_);
+  if (LC_UNLIKELY(stopTheWorld_ || nextGC_ == 1)) {
+    pthread_mutex_unlock(&heapLock_);
     return 1;
   }
-
-  blockFull(&closures_);
-  getBumpAllocatorBounds(heap, heaplim);
+  --nextGC_;
+  retireNursery(cap);
+  cap->nursery_ = grabFreeBlock(Block::kClosures);
+  pthread_mutex_unlock(&heapLock_);
+  getBumpAllocatorBounds(cap->nursery_, heap, heaplim);
   return 0;
 }
 
 void MemoryManager::bumpAllocatorFull(char **heap, char **heaplim,
                                       Capability *cap) {
-  sync(*heap, *heaplim);
-  --nextGC_;
-  if (LC_UNLIKELY(nextGC_ == 0)) {
+  sync(cap->nursery_, *heap, *heaplim);
+  pthread_mutex_lock(&heapLock_);
+  bool collected = false;
+  while (LC_UNLIKELY(stopTheWorld_) && !collected) {
+    // The capability that collects garbage gives us a new block.  If
+    // it stopped the world for another reason, we still need one.
+    uint64_t gcs = num_gcs_;
+    waitForGC();
+    collected = num_gcs_ != gcs;
+  }
+  if (collected) {
+    // Nothing to do.
+  } else if (LC_UNLIKELY(--nextGC_ == 0)) {
+    stopTheWorld();
     performGC(cap);
+    resumeTheWorld();
   } else {
-    blockFull(&closures_);
+    retireNursery(cap);
+    cap->nursery_ = grabFreeBlock(Block::kClosures);
   }
-  getBumpAllocatorBounds(heap, heaplim);
+  pthread_mutex_unlock(&heapLock_);
+  getBumpAllocatorBounds(cap->nursery_, heap, heaplim);
   dout << "MM: heap=" << (void *)*heap
        << " heaplim=" << (void *)*heaplim
        << " nextGC=" << nextGC_
@@ -379,59 +715,229 @@ MemoryManager::allocLarge(Word nbytes)
             maxObjectSize);
     exit(1);
   }
+  // Keep the payload word-aligned.
+  nbytes = roundUpBytesToWords(nbytes) * sizeof(Word);
+  pthread_mutex_lock(&heapLock_);
 
   char *result = NULL;
   Word nbytesWithMeta = sizeof(LargeObject) + nbytes;
 
   // 1. Try to find a free'd large object using best-fit with bounded
   // look-ahead.
-  // if (freeLargeRegions_) { ... }
-
-  Region *large = largeObjectRegion_;
-
-  // 2. Try to fit into existing large regions (using first fit).
-  while (large) {
-    char *start = large->largeSelf()->free_;
-    char *end = start + nbytesWithMeta;
-
-    if (end <= largeObjectRegion_->largeSelf()->end_) {
-      largeObjectRegion_->largeSelf()->free_ = end;
-      // TODO: If remaining space is less than minimum large objects
-      // size, mark whole object as full?  Or keep as large object gap
-      // and try to merge later when the adjacent region gets free'd.
+  LargeObject *obj = reuseLargeObject(nbytes);
+  if (obj != NULL)
+    goto reused;
+
+  {
+    Region *large = largeObjectRegion_;
+
+    // 2. Try to fit into existing large regions (using first fit).
+    while (large) {
+      char *start = large->largeSelf()->free_;
+      char *end = start + nbytesWithMeta;
+
+      if (end <= large->largeSelf()->end_) {
+        large->largeSelf()->free_ = end;
+        result = start;
+        goto found;
+      }
 
-      result = start;
-      goto found;
+      large = large->largeSelf()->header_.region_link_;
     }
 
-    large = large->largeSelf()->header_.region_link_;
-  }
-
-  LC_ASSERT(large == NULL);
+    LC_ASSERT(large == NULL);
 
-  // 3. We couldn't find any space in the existing regions.  Allocate
-  // a new region.
-  large = Region::newRegion(Region::kLargeObjectRegion);
-  result = large->largeSelf()->free_;
-  large->largeSelf()->free_ += nbytesWithMeta;
-  large->largeSelf()->header_.region_link_ = largeObjectRegion_;
+    // 3. We couldn't find any space in the existing regions.  Allocate
+    // a new region.
+    large = Region::newRegion(Region::kLargeObjectRegion);
+    result = large->largeSelf()->free_;
+    large->largeSelf()->free_ += nbytesWithMeta;
+    large->largeSelf()->header_.region_link_ = largeObjectRegion_;
 
-  largeObjectRegion_ = large;
+    largeObjectRegion_ = large;
+  }
 
  found:
   LC_ASSERT(result != NULL);
+  obj = (LargeObject*)result;
+  obj->payloadSize_ = nbytes;
 
+ reused:
   // Initialise and link onto large object list.
-  LargeObject *obj = (LargeObject*)result;
-  obj->prev_ = NULL;
-  obj->next_ = largeObjects_;
   obj->flags_ = 0;
-  obj->payloadSize_ = nbytes;
-  largeObjects_ = obj;
+  linkLargeObject(obj, &largeObjects_);
+
+  // Large objects count towards the next GC like nursery blocks, but
+  // we must not trigger a GC here.  They only die in a major GC, so
+  // they also count towards the size of the old generation.
+  largeBytes_ += obj->payloadSize_;
+  largeSinceGC_ += obj->payloadSize_;
+  while (largeSinceGC_ >= Block::kBlockSize && nextGC_ > 1) {
+    largeSinceGC_ -= Block::kBlockSize;
+    --nextGC_;
+  }
+  pthread_mutex_unlock(&heapLock_);
 
   return closureFromLargeObject(obj);
 }
 
+// Take the smallest free large object that can hold `nbytes' among
+// the first few candidates.  Requires heapLock_.
+LargeObject *
+MemoryManager::reuseLargeObject(Word nbytes)
+{
+  static const int kLookAhead = 8;
+  LargeObject *best = NULL;
+  int candidates = 0;
+  for (LargeObject *p = freeLargeRegions_;
+       p != NULL && candidates < kLookAhead; p = p->next_) {
+    if (p->payloadSize_ < nbytes)
+      continue;
+    ++candidates;
+    if (best == NULL || p->payloadSize_ < best->payloadSize_)
+      best = p;
+    if (best->payloadSize_ == nbytes)
+      break;
+  }
+  // Don't waste more than half of a big free object.
+  if (best == NULL || best->payloadSize_ / 2 > nbytes)
+    return NULL;
+  unlinkLargeObject(best, &freeLargeRegions_);
+  return best;
+}
+
+ArrayClosure *
+MemoryManager::allocArray(Word ptrs, Closure *init)
+{
+  ArrayClosure *arr =
+    (ArrayClosure *)allocLarge(ArrayClosure::allocBytes(ptrs));
+  arr->header_.info_ = MiscClosures::stg_MUT_ARR_info;
+  arr->ptrs_ = ptrs;
+  for (Word i = 0; i < ptrs; ++i)
+    arr->payload_[i] = init;
+  memset(arr->cards(), isYoungGeneration(init) ? 1 : 0,
+         ArrayClosure::numCards(ptrs));
+  pthread_mutex_lock(&heapLock_);
+  arrays_.push_back(arr);
+  pthread_mutex_unlock(&heapLock_);
+  return arr;
+}
+
+ByteArrayClosure *
+MemoryManager::allocByteArray(Word bytes)
+{
+  ByteArrayClosure *arr = (ByteArrayClosure *)allocLarge
+    (sizeof(ByteArrayClosure) + roundUpBytesToWords(bytes) * sizeof(Word));
+  arr->header_.info_ = MiscClosures::stg_BYTEARR_info;
+  arr->bytes_ = bytes;
+  return arr;
+}
+
+// A mapped file looks like a large object region that contains a
+// single byte array.  The first page holds the region header and the
+// object header, which ends where the second page begins.  The file
+// is mapped from the second page on.  The whole mapping is aligned at
+// a region boundary, so Region::regionFromPointer works for the array
+// and the GC treats it like any other large object.
+ByteArrayClosure *
+MemoryManager::mapFile(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+
+  Word bytes = st.st_size;
+  Word pageSize = sysconf(_SC_PAGESIZE);
+  Word size = pageSize + ((bytes + pageSize - 1) & ~(pageSize - 1));
+
+  // Reserve enough to find an aligned start and trim the slop.
+  char *reserved = static_cast<char *>
+    (mmap(NULL, size + Region::kRegionSize, kMMapProtection, kMMapFlags,
+          -1, 0));
+  if (reserved == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  char *start = Region::alignToRegionBoundary(reserved);
+  char *reservedEnd = reserved + size + Region::kRegionSize;
+  if (start > reserved)
+    munmap(reserved, start - reserved);
+  if (reservedEnd > start + size)
+    munmap(start + size, reservedEnd - (start + size));
+
+  if (bytes > 0 &&
+      mmap(start + pageSize, bytes, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+           fd, 0) == MAP_FAILED) {
+    munmap(start, size);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  DLOG("Mapped %s at %p-%p\n", path, start, start + size);
+
+  Region *region = reinterpret_cast<Region *>(start);
+  region->meta_.magic_ = REGION_MAGIC;
+  region->meta_.region_info_ = Region::kLargeObjectRegion;
+  region->meta_.region_link_ = NULL;
+  region->largeSelf()->free_ = start + size;
+  region->largeSelf()->end_ = start + size;
+
+  ByteArrayClosure *arr = reinterpret_cast<ByteArrayClosure *>
+    (start + pageSize - BYTEARRAY_PAYLOAD_OFFSET);
+  LargeObject *obj = largeObjectFromClosure((Closure *)arr);
+  LC_ASSERT((char *)obj >= start + sizeof(Region::LargeObjectRegionData));
+  obj->flags_ = 0;
+  obj->setMappedFile();
+  obj->payloadSize_ = BYTEARRAY_PAYLOAD_OFFSET + bytes;
+  arr->header_.info_ = MiscClosures::stg_BYTEARR_info;
+  arr->bytes_ = bytes;
+
+  pthread_mutex_lock(&heapLock_);
+  linkLargeObject(obj, &largeObjects_);
+  mapped_ += bytes;
+  pthread_mutex_unlock(&heapLock_);
+  return arr;
+}
+
+void
+MemoryManager::unmapFile(LargeObject *obj)
+{
+  ByteArrayClosure *arr = (ByteArrayClosure *)closureFromLargeObject(obj);
+  Region *region = Region::regionFromPointer(arr);
+  char *start = reinterpret_cast<char *>(region);
+  DLOG("Unmapping %p-%p\n", start, region->largeSelf()->end_);
+  mapped_ -= arr->bytes_;
+  munmap(start, region->largeSelf()->end_ - start);
+}
+
+Closure *newArray(MemoryManager *mm, Word ptrs, Closure *init) {
+  return (Closure *)mm->allocArray(ptrs, init);
+}
+
+Closure *newByteArray(MemoryManager *mm, Word bytes) {
+  return (Closure *)mm->allocByteArray(bytes);
+}
+
+void rememberFromTrace(MemoryManager *mm, Closure *cl) {
+  mm->writeBarrier(cl);
+}
+
+void copyArray(Closure *src, Word srcOffset, Closure *dst, Word dstOffset,
+               Word n) {
+  ArrayClosure *from = (ArrayClosure *)src;
+  ArrayClosure *to = (ArrayClosure *)dst;
+  LC_ASSERT(srcOffset + n <= from->ptrs_ && dstOffset + n <= to->ptrs_);
+  // The arrays may be the same.
+  memmove(&to->payload_[dstOffset], &from->payload_[srcOffset],
+          n * sizeof(Word));
+  to->markCards(dstOffset, n);
+}
+
 
 unsigned int MemoryManager::infoTables() {
   Block *b = info_tables_;
@@ -453,6 +959,7 @@ void MemoryManager::debugPrint() {
 }
 
 bool MemoryManager::looksLikeClosure(void *p) {
+  p = (void *)untag((Word)p);
   Region *r = Region::regionFromPointer(p);
   if (r->isLargeObjectRegion())
     return true;
@@ -511,72 +1018,249 @@ std::ostream &operator<<(std::ostream &out, const MemoryManager &mm) {
 
 //= Garbage Collection Stuff =========================================
 
+void MemoryManager::remember(Closure *cl) {
+  dout << "MM: Remembering old object " << (void *)cl << endl;
+  pthread_mutex_lock(&heapLock_);
+  remembered_.push_back(cl);
+  pthread_mutex_unlock(&heapLock_);
+}
+
+GCWorker::GCWorker(MemoryManager *mm, u4 id)
+  : mm_(mm), id_(id) {
+  reset();
+}
+
+GCWorker::~GCWorker() {}
+
+void GCWorker::reset() {
+  aging_ = NULL;
+  old_ = NULL;
+  scanning_ = NULL;
+  copied_ = 0;
+  staticSeen_.clear();
+  LC_ASSERT(statics_.empty() && srts_.empty());
+  LC_ASSERT(pending_.looksEmpty());
+  LC_ASSERT(overflow_.empty());
+  LC_ASSERT(remembered_.empty());
+}
+
+void MemoryManager::setGCThreads(u4 threads) {
+  LC_ASSERT(!gcInProgress());
+  if (threads < 1) threads = 1;
+  if (threads > kMaxGCThreads) threads = kMaxGCThreads;
+  if (threads == gcThreads_)
+    return;
+  stopGCWorkers();
+  GCWorker **workers = new GCWorker*[threads];
+  for (u4 i = 0; i < threads; ++i) {
+    workers[i] = i < gcThreads_ ? workers_[i] : new GCWorker(this, i);
+  }
+  for (u4 i = threads; i < gcThreads_; ++i)
+    delete workers_[i];
+  delete[] workers_;
+  workers_ = workers;
+  gcThreads_ = threads;
+}
+
+// Helper threads are started lazily on the first parallel GC.  They
+// then sleep until the next GC.
+void MemoryManager::startGCWorkers() {
+  LC_ASSERT(!workersStarted_);
+  shutdownWorkers_ = false;
+  for (u4 i = 1; i < gcThreads_; ++i) {
+    if (pthread_create(&workers_[i]->thread_, NULL, gcWorkerMain,
+                       workers_[i]) != 0) {
+      fprintf(stderr, "FATAL: Could not create GC thread.\n");
+      exit(1);
+    }
+  }
+  workersStarted_ = true;
+}
+
+void MemoryManager::stopGCWorkers() {
+  if (!workersStarted_)
+    return;
+  pthread_mutex_lock(&gcLock_);
+  shutdownWorkers_ = true;
+  pthread_cond_broadcast(&gcStart_);
+  pthread_mutex_unlock(&gcLock_);
+  for (u4 i = 1; i < gcThreads_; ++i)
+    pthread_join(workers_[i]->thread_, NULL);
+  workersStarted_ = false;
+}
+
+void *MemoryManager::gcWorkerMain(void *arg) {
+  GCWorker *w = static_cast<GCWorker *>(arg);
+  MemoryManager *mm = w->mm_;
+  u4 seen = 0;
+  pthread_mutex_lock(&mm->gcLock_);
+  for (;;) {
+    while (mm->gcGeneration_ == seen && !mm->shutdownWorkers_)
+      pthread_cond_wait(&mm->gcStart_, &mm->gcLock_);
+    if (mm->shutdownWorkers_)
+      break;
+    seen = mm->gcGeneration_;
+    pthread_mutex_unlock(&mm->gcLock_);
+
+    mm->scavengeLoop(w);
+
+    pthread_mutex_lock(&mm->gcLock_);
+    if (--mm->gcRunning_ == 0)
+      pthread_cond_signal(&mm->gcDone_);
+  }
+  pthread_mutex_unlock(&mm->gcLock_);
+  return NULL;
+}
+
+// Move all blocks of the given list to the from-space.
+void MemoryManager::addToFromSpace(Block **blocks) {
+  Block *block = *blocks;
+  while (block != NULL) {
+    Block *next = block->link_;
+    block->setFlag(Block::kFromSpace);
+    block->link_ = old_heap_;
+    old_heap_ = block;
+    block = next;
+  }
+  *blocks = NULL;
+}
+
+// Prepend a worker's to-space blocks to the given list.
+void MemoryManager::mergeToSpace(Block **list, Block *blocks) {
+  if (blocks == NULL)
+    return;
+  Block *last = blocks;
+  while (last->link_ != NULL)
+    last = last->link_;
+  last->link_ = *list;
+  *list = blocks;
+}
+
+// The heap is split into two generations.  The mutator allocates into
+// the nursery (closures_).  A minor GC copies live nursery objects
+// into the aging area and live objects from the aging area into the
+// old generation.  That is, an object gets promoted once it has
+// survived two minor GCs.  A minor GC does not look at old objects,
+// apart from those that are in the remembered set, i.e., old objects
+// that may point into the young generation.
+//
+// A major GC is triggered once the old generation has grown by
+// kOldGenGrowthFactor since the last major GC.  It copies all live
+// objects into a fresh old generation.
+//
+// The roots are always evacuated by worker 0.  Scavenging is then
+// done by all workers in parallel (see scavengeLoop).
+//
+// The roots are the threads and CAFs of all capabilities.  `cap' is
+// the capability that triggered the GC; all other capabilities must
+// be stopped or detached.
 void MemoryManager::performGC(Capability *cap) {
   Time gc_start = getProcessElapsedTime();
   Thread *T = cap->currentThread();
-  BcIns *pc = T->pc();
-  Word *base = T->base();
-  Word *top = T->top();
 
   if (DEBUG_COMPONENTS & DEBUG_SANITY_CHECK_GC) {
     cerr << ">>> GC " << num_gcs_ << endl;
     // This ensures that the mutator hasn't introduced any corrupt
     // state.
-    sanityCheckHeap(cap);
+    sanityCheckHeap();
   }
 
+  // A census needs to see all live objects, so it requires a major
+  // GC.
+  census_ = heapProfiler_ != NULL &&
+    heapProfiler_->censusDue(num_gcs_, gc_start);
+  majorGC_ = census_ || oldGenBlocks_ + largeBlocks() >= nextMajorGC_;
+  largeSinceGC_ = 0;
+  parallelGC_ = gcThreads_ > 1;
+
   ++num_gcs_;
+  if (majorGC_) ++num_major_gcs_;
 
   LC_ASSERT(old_heap_ == NULL);
-  old_heap_ = closures_;
-
-  closures_ = grabFreeBlock(closures_->contents());
-  closures_->link_ = NULL;
-
-  // Traverse the roots.
-  // TODO: Traverse updated CAFs
-  scavengeStack(base, top, pc);
-  scavengeStaticRoots(cap->staticRoots());
+  addToFromSpace(&closures_);
+  addToFromSpace(&aging_);
+  for (size_t i = 0; i < capabilities_.size(); ++i)
+    addToFromSpace(&capabilities_[i]->nursery_);
+
+  GCWorker *w0 = workers_[0];
+  if (majorGC_) {
+    addToFromSpace(&old_gen_);
+    remembered_.clear();
+    liveStatics_.clear();
+  } else if (old_gen_ != NULL) {
+    // Objects already in the old generation have been scavenged
+    // before.  Only newly promoted objects need to be scavenged.
+    old_gen_->scan_ = old_gen_->free_;
+    w0->old_ = old_gen_;
+    old_gen_ = NULL;
+  }
 
-  // TODO: We need to alternate scavenge a block and scavenging large blocks until both have no more work left.
+  // Traverse the roots.  A minor GC keeps all updated CAFs alive.  A
+  // major GC only keeps those CAFs that are still reachable from the
+  // stack or from the code of live objects (via their SRTs).
+  for (size_t i = 0; i < capabilities_.size(); ++i) {
+    scavengeThreads(w0, capabilities_[i]);
+    scavengeSparks(w0, capabilities_[i]);
+  }
+  if (!majorGC_) {
+    for (size_t i = 0; i < capabilities_.size(); ++i)
+      scavengeStaticRoots(w0, capabilities_[i]->staticRoots());
+    scavengeRememberedSet(w0);
+    scavengeArrayCards(w0);
+  }
 
-  // Scavenging allocates into closures_ and pushes filled blocks onto
-  // the front of the list.  So we repeatedly traverse closures_ until
-  // we reach the end of a list or a block that we've already
-  // processed.
-  for (;;) {
-    Block *block = closures_;
-    if (block == NULL || block->getFlag(Block::kScavenged)) {
-      break;  // we're done
-    } else {
-      // If the block we are evacuating into and the block we're
-      // scavanging is the same then it definitely must be the last
-      // block.  Otherwise, we may finish scavenging the block
-      // and then continue to evacuate into it again.  Those newly
-      // evacuated objects will then never get scavenged.  Ouch!
-      //
-      // To avoid this problem, we only scavenge the first block if
-      // there is no second block.
-      if (block == closures_ && block->link_ &&
-          !block->link_->getFlag(Block::kScavenged))
-        block = block->link_;
-
-      while (block != NULL && !block->getFlag(Block::kScavenged)) {
-        scavengeBlock(block);
-        block = block->link_;
+  scavengeToSpace(w0);
+  if (majorGC_) {
+    // Static objects and large objects are traversed by worker 0
+    // alone.  Live CAFs and arrays may in turn cause more heap objects
+    // to be copied.
+    for (;;) {
+      bool more = scavengeStatics(w0);
+      more = scavengeLarge(w0) || more;
+      if (!more)
+        break;
+      scavengeToSpace(w0);
+    }
+    for (size_t i = 0; i < capabilities_.size(); ++i)
+      revertCAFs(capabilities_[i]->staticRoots());
+    pruneArrays();
+    sweepLargeObjects();
+  }
+  parallelGC_ = false;
+
+  if (census_) {
+    CensusTable census;
+    for (u4 i = 0; i < gcThreads_; ++i) {
+      CensusTable &c = workers_[i]->census_;
+      for (CensusTable::iterator it = c.begin(); it != c.end(); ++it) {
+        CensusEntry &e = census[it->first];
+        e.objects += it->second.objects;
+        e.bytes += it->second.bytes;
       }
+      c.clear();
     }
+    heapProfiler_->writeSample(num_gcs_, gc_start, census);
+    census_ = false;
   }
 
-  // Mark blocks as no longer scavenged.
-  // TODO: Would it help much to not do this?
-  u4 fullBlocks = 0;
-  for (Block *block = closures_; block != NULL; block = block->link_) {
-    block->clearFlag(Block::kScavenged);
-    ++fullBlocks;
+  // Collect the to-spaces of all workers.
+  for (u4 i = 0; i < gcThreads_; ++i) {
+    GCWorker *w = workers_[i];
+    mergeToSpace(&aging_, w->aging_);
+    mergeToSpace(&old_gen_, w->old_);
+    remembered_.insert(remembered_.end(),
+                       w->remembered_.begin(), w->remembered_.end());
+    w->remembered_.clear();
+    copied_ += w->copied_;
+    w->reset();
   }
 
-  // O
+  oldGenBlocks_ = 0;
+  for (Block *block = old_gen_; block != NULL; block = block->link_) {
+    ++oldGenBlocks_;
+  }
+
+  // Free the from-space.
   for (Block *block = old_heap_; block != NULL; ) {
     block->markAsFree();
     Block *next = block->link_;
@@ -586,21 +1270,121 @@ void MemoryManager::performGC(Capability *cap) {
   }
   old_heap_ = NULL;
 
+  // The mutator continues with an empty nursery.
+  closures_ = grabFreeBlock(Block::kClosures);
+  for (size_t i = 0; i < capabilities_.size(); ++i)
+    capabilities_[i]->nursery_ = grabFreeBlock(Block::kClosures);
+
   // TODO: Add sanity check.  Everything reachable from the roots must
   // be in a k[Static]Closures block now.
 
-  // TODO: Is this correct?
-  nextGC_ = (fullBlocks > minHeapSize_ ? fullBlocks : minHeapSize_) + 1;
+  u4 agingBlocks = 0;
+  for (Block *block = aging_; block != NULL; block = block->link_) {
+    ++agingBlocks;
+  }
+  if (majorGC_) {
+    nextMajorGC_ = (oldGenBlocks_ + largeBlocks()) * kOldGenGrowthFactor;
+    if (nextMajorGC_ < baseNurseryBlocks_)
+      nextMajorGC_ = baseNurseryBlocks_;
+  }
+  resizeHeap(oldGenBlocks_ + agingBlocks, gc_start, getProcessElapsedTime());
 
   if (DEBUG_COMPONENTS & DEBUG_SANITY_CHECK_GC) {
-    cerr << ">>> GC " << num_gcs_ - 1 << " DONE (full blocks = "
-         << fullBlocks << ")\n";
+    cerr << ">>> GC " << num_gcs_ - 1 << " DONE ("
+         << (majorGC_ ? "major" : "minor")
+         << ", old blocks = " << oldGenBlocks_
+         << ", remembered = " << remembered_.size() << ")\n";
     // This ensures that the collector itself hasn't introduced any
     // corrupt state.
-    sanityCheckHeap(cap);
+    sanityCheckHeap();
+  }
+
+  // Give back the stack chunk that was kept around in case the stack
+  // grows again.
+  T->shrinkStack();
+
+  lastGCEnd_ = getProcessElapsedTime();
+  gc_time += lastGCEnd_ - gc_start;
+}
+
+// Decide how much the mutator may allocate before the next GC.
+void MemoryManager::resizeHeap(u4 liveBlocks, Time gcStart, Time gcEnd) {
+  if (gcTimeTarget_ > 0 && lastGCEnd_ != 0) {
+    double gc = (double)(gcEnd - gcStart);
+    double mut = (double)(gcStart - lastGCEnd_);
+    gcTimeFraction_ = 0.5 * gcTimeFraction_ + 0.5 * (gc / (gc + mut + 1));
+    u4 maxNursery = baseNurseryBlocks_ * kMaxNurseryGrowth;
+    if (gcTimeFraction_ > gcTimeTarget_ && nurseryBlocks_ < maxNursery) {
+      nurseryBlocks_ = nurseryBlocks_ + nurseryBlocks_ / 2;
+      if (nurseryBlocks_ > maxNursery) nurseryBlocks_ = maxNursery;
+    } else if (gcTimeFraction_ < gcTimeTarget_ / 2 &&
+               nurseryBlocks_ > baseNurseryBlocks_) {
+      nurseryBlocks_ = nurseryBlocks_ - nurseryBlocks_ / 3;
+      if (nurseryBlocks_ < baseNurseryBlocks_)
+        nurseryBlocks_ = baseNurseryBlocks_;
+    }
+  }
+
+  u4 nursery = nurseryBlocks_;
+  if (suggestedHeapBlocks_ > liveBlocks + nursery)
+    nursery = suggestedHeapBlocks_ - liveBlocks;
+
+  if (maxHeapBlocks_ != 0) {
+    if (liveBlocks + 2 > maxHeapBlocks_) {
+      // Only a major GC can tell whether the live data really
+      // doesn't fit.
+      if (majorGC_)
+        heapOverflow(liveBlocks);
+      nursery = 2;
+      nextMajorGC_ = 0;
+    } else {
+      if (liveBlocks + nursery > maxHeapBlocks_)
+        nursery = maxHeapBlocks_ - liveBlocks;
+      // Collect the old generation before it outgrows the heap.
+      if (nextMajorGC_ > maxHeapBlocks_ - nursery)
+        nextMajorGC_ = maxHeapBlocks_ - nursery;
+    }
+  }
+
+  DLOG("Next GC after %u blocks (live = %u, next major at %u)\n",
+       nursery, liveBlocks, nextMajorGC_);
+  nextGC_ = nursery;
+}
+
+void MemoryManager::heapOverflow(u4 liveBlocks) {
+  fprintf(stderr, "FATAL: Heap exhausted.  Live data is %" FMT_Word
+          " bytes, maximum heap size is %" FMT_Word " bytes.\n"
+          "Use --max-heap=SIZE to increase it.\n",
+          (Word)liveBlocks * Block::kBlockSize,
+          (Word)maxHeapBlocks_ * Block::kBlockSize);
+  fflush(stderr);
+  exit(251);
+}
+
+// Scavenging copies objects into the aging area and the old
+// generation which in turn may need to be scavenged.  Repeat until
+// no worker has any unscavenged objects left.
+void MemoryManager::scavengeToSpace(GCWorker *w0) {
+  if (!parallelGC_) {
+    scavengeLoop(w0);
+    return;
   }
 
-  gc_time += getProcessElapsedTime() - gc_start;
+  if (!workersStarted_)
+    startGCWorkers();
+  gcIdle_ = 0;
+  pthread_mutex_lock(&gcLock_);
+  gcRunning_ = gcThreads_ - 1;
+  ++gcGeneration_;
+  pthread_cond_broadcast(&gcStart_);
+  pthread_mutex_unlock(&gcLock_);
+
+  scavengeLoop(w0);
+
+  pthread_mutex_lock(&gcLock_);
+  while (gcRunning_ > 0)
+    pthread_cond_wait(&gcDone_, &gcLock_);
+  pthread_mutex_unlock(&gcLock_);
 }
 
 static inline bool isForwardingPointer(const InfoTable *p) {
@@ -615,58 +1399,154 @@ static inline InfoTable *makeForwardingPointer(Closure *p) {
   return cast (InfoTable *, (Word)p | 1);
 }
 
-static inline void copy(MemoryManager *mm, Closure **src,
-                        InfoTable *info, u4 payloadSize) {
-  Closure *from = *src;
-  Closure *to = mm->allocClosure(info, payloadSize);
-  *src = to;
+// Allocate memory in one of the worker's to-spaces.  Only the owning
+// worker allocates into its to-space blocks.
+char *MemoryManager::allocToSpace(GCWorker *w, Block **dest,
+                                  Block::Flags gen, size_t bytes) {
+  Block *block = *dest;
+  char *ptr = block != NULL ? block->alloc(bytes) : NULL;
+  if (LC_UNLIKELY(ptr == NULL)) {
+    Block *fresh = grabFreeBlock(Block::kClosures);
+    fresh->setFlag(gen);
+    fresh->link_ = block;
+    *dest = fresh;
+    // The full block may still contain objects that need to be
+    // scavenged.  Make it available to other workers.  If we are
+    // currently scavenging it, stop after the current object.
+    if (block != NULL && block->scan_ < block->free()) {
+      if (block == w->scanning_)
+        w->scanning_ = NULL;
+      pushWork(w, block);
+    }
+    ptr = fresh->alloc(bytes);
+  }
+  return ptr;
+}
+
+void MemoryManager::pushWork(GCWorker *w, Block *block) {
+  if (!w->pending_.push(block))
+    w->overflow_.push_back(block);
+}
+
+void MemoryManager::copy(GCWorker *w, Block **dest, Block::Flags gen,
+                         Closure **p, InfoTable *info, u4 payloadSize) {
+  Closure *from = *p;
+  size_t bytes = (wordsof(ClosureHeader) + payloadSize) * sizeof(Word);
+  Closure *to = reinterpret_cast<Closure *>
+    (allocToSpace(w, dest, gen, bytes));
+  Closure::initHeader(to, info);
   for (u4 i = 0; i < payloadSize; ++i) {
     to->setPayload(i, from->payload(i));
   }
   dout << "(fwd@" << from << ")";
-  from->setInfo(makeForwardingPointer(to));
+  if (parallelGC_) {
+    // Another worker may be copying the same object.  Only one of
+    // them may install the forwarding pointer; the loser abandons
+    // its copy.  The copy is the last object in our to-space block,
+    // so we can simply give the memory back.
+    InfoTable *expected = info;
+    if (!__atomic_compare_exchange_n(&from->header_.info_, &expected,
+                                     makeForwardingPointer(to), false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      LC_ASSERT(isForwardingPointer(expected));
+      (*dest)->free_ = reinterpret_cast<char *>(to);
+      *p = getForwardingPointer(expected);
+      dout << COL_YELLOW << *p << COL_RESET << " (lost race)" << endl;
+      return;
+    }
+  } else {
+    from->setInfo(makeForwardingPointer(to));
+  }
+  *p = to;
+  w->copied_ += bytes;
   dout << COL_GREEN << to << COL_RESET << endl;
 }
 
-void MemoryManager::evacuate(Closure **p) {
+// Pointers to constructors get (re-)tagged as a side effect of
+// evacuation.  The copy's header is written before the forwarding
+// pointer is installed, so it is safe to read its info table here.
+void MemoryManager::evacuate(GCWorker *w, Closure **p) {
   Closure *q;
   InfoTable *info;
   Block *block;
 
-  q = *p;
+  q = untag(*p);
 
   LC_ASSERT(q != NULL);
   dout << "MM: Evac: " COL_RED << q << COL_RESET;
 
 loop:
-  info = q->info();
+  info = __atomic_load_n(&q->header_.info_, __ATOMIC_ACQUIRE);
 
   if (isForwardingPointer(info)) {
-    *p = getForwardingPointer(info);
+    *p = (Closure *)tagPointer(getForwardingPointer(info));
     dout << " -F-> " COL_YELLOW << *p << COL_RESET << endl;
     return;
   }
 
   dout << ' ' << info->name();
 
+  if (Region::regionFromPointer(q)->isLargeObjectRegion()) {
+    // Don't copy large objects.  Just mark them.  A minor GC treats
+    // them like old objects: they stay alive and the ones that may
+    // point into the young generation (arrays) are scanned by
+    // scavengeArrayCards.
+    if (!majorGC_) {
+      dout << " -L-> " COL_YELLOW "large object" COL_RESET << endl;
+      return;
+    }
+    if (parallelGC_) {
+      pthread_mutex_lock(&blockLock_);
+      evacuateLarge(q);
+      pthread_mutex_unlock(&blockLock_);
+    } else {
+      evacuateLarge(q);
+    }
+    return;
+  }
+
   block = Region::blockFromPointer(q);
-  if (block->contents() != Block::kClosures) {
-    // TODO: Need to follow indirections from static closures into
-    // dynamic heap.
-    dout << " -S-> " COL_YELLOW "static object" COL_RESET << endl;
+  if (!block->getFlag(Block::kFromSpace)) {
+    // Static closures are never copied, but a major GC needs to know
+    // which ones are reachable.
+    if (majorGC_ && block->contents() == Block::kStaticClosures)
+      recordStatic(w, q);
+    *p = (Closure *)((Word)q | info->pointerTag());
+    dout << " -S-> " COL_YELLOW "static or old object" COL_RESET << endl;
     return;
   }
 
+  // Objects from the nursery go into the aging area, everything else
+  // gets promoted.
+  Block **dest;
+  Block::Flags gen;
+  if (majorGC_ || block->getFlag(Block::kAged)) {
+    dest = &w->old_;
+    gen = Block::kOld;
+  } else {
+    dest = &w->aging_;
+    gen = Block::kAged;
+  }
+
   switch (info->type()) {
   case CONSTR:
+    dout << " -C(" << info->size() << ")-> ";
+    *p = q;
+    copy(w, dest, gen, p, info, info->size());
+    *p = (Closure *)((Word)*p | info->pointerTag());
+    break;
+
   case THUNK:
+  case BLACKHOLE:
   case FUN:
-    dout << " -CTF(" << info->size() << ")-> ";
-    copy(this, p, info, info->size());
+  case MVAR:
+    dout << " -TF(" << info->size() << ")-> ";
+    *p = q;
+    copy(w, dest, gen, p, info, info->size());
     break;
 
   case IND:
-    q = (Closure *)q->payload(0);
+    q = untag(q->payload(0));
     dout << " -I-> " << q;
     *p = q;
     goto loop;
@@ -676,13 +1556,8 @@ loop:
     u4 size = pap->info_.nargs_ + wordsof(PapClosure)
               - wordsof(ClosureHeader);
     dout << " -PAP(" << pap->info_.nargs_ << ")-> " << pap;
-    copy(this, p, info, size);
-    break;
-  }
-
-    // Don't copy large objects.  Just mark them.
-  case LARGE: {
-    evacuateLarge(q);
+    *p = q;
+    copy(w, dest, gen, p, info, size);
     break;
   }
 
@@ -720,10 +1595,24 @@ MemoryManager::evacuateLarge(Closure *c)
   evacuatedLargeObjects_ = q;
 }
 
-void
-MemoryManager::scavengeLarge()
+// The size of a large object in words: an array, or a byte array
+// (which includes big Integers and mapped files).
+static inline u4 largeClosureWords(Closure *cl) {
+  if (cl->info()->type() == ARRAY)
+    return ArrayClosure::allocBytes(((ArrayClosure *)cl)->ptrs_) /
+      sizeof(Word);
+  return wordsof(ByteArrayClosure) +
+    roundUpBytesToWords(((ByteArrayClosure *)cl)->bytes_);
+}
+
+// Returns true if any large object has been scavenged.  Large
+// objects are only evacuated by a major GC.  Every large object that
+// gets scavenged is live, so this is where a census counts them.
+bool
+MemoryManager::scavengeLarge(GCWorker *w)
 {
   LargeObject *obj = evacuatedLargeObjects_;
+  bool scavenged = obj != NULL;
 
   // Process all evacuated (i.e., grey) large objects.  Note that
   // during the processing of one object, new objects may get added to
@@ -734,14 +1623,70 @@ MemoryManager::scavengeLarge()
     // onto the front of the list while we scavenge this one.
     evacuatedLargeObjects_ = obj->next_;
 
-    // TODO: Actually scavenge something, once we have large objects
-    // with pointers in them.
+    Closure *cl = closureFromLargeObject(obj);
+    if (LC_UNLIKELY(census_))
+      addToCensus(w->census_, cl->info(), largeClosureWords(cl));
+    if (cl->info()->type() == ARRAY)
+      scavengeArray(w, (ArrayClosure *)cl);
 
     // We're done scavenging.  Mark the object as black by adding it
     // to the scavengedLargeObjects_ list.
     obj->next_ = scavengedLargeObjects_;
     scavengedLargeObjects_ = obj;
   }
+  return scavenged;
+}
+
+// Scavenge all elements of an array.  Afterwards everything it
+// points to is old, so all cards are clean.
+void
+MemoryManager::scavengeArray(GCWorker *w, ArrayClosure *arr)
+{
+  dout << "MM: * Scav array " << (void *)arr
+       << " (" << arr->ptrs_ << ")" << endl;
+  for (Word i = 0; i < arr->ptrs_; ++i)
+    evacuate(w, &arr->payload_[i]);
+  memset(arr->cards(), 0, ArrayClosure::numCards(arr->ptrs_));
+}
+
+// Minor GC only.  Scavenge the elements of the dirty cards of all
+// arrays.  A card stays dirty if one of its elements still points
+// into the aging area.
+void
+MemoryManager::scavengeArrayCards(GCWorker *w)
+{
+  dout << "MM: Scavenging array cards (" << arrays_.size() << ")" << endl;
+  for (size_t a = 0; a < arrays_.size(); ++a) {
+    ArrayClosure *arr = arrays_[a];
+    u1 *cards = arr->cards();
+    Word ncards = ArrayClosure::numCards(arr->ptrs_);
+    for (Word c = 0; c < ncards; ++c) {
+      if (!cards[c])
+        continue;
+      Word i = c << kArrayCardBits;
+      Word end = i + ((Word)1 << kArrayCardBits);
+      if (end > arr->ptrs_) end = arr->ptrs_;
+      bool young = false;
+      for ( ; i < end; ++i) {
+        evacuate(w, &arr->payload_[i]);
+        young = young || isYoungGeneration(arr->payload_[i]);
+      }
+      cards[c] = young;
+    }
+  }
+}
+
+// Major GC only, before sweepLargeObjects.  Forget about dead arrays.
+void
+MemoryManager::pruneArrays()
+{
+  size_t live = 0;
+  for (size_t i = 0; i < arrays_.size(); ++i) {
+    ArrayClosure *arr = arrays_[i];
+    if (largeObjectFromClosure((Closure *)arr)->getMark())
+      arrays_[live++] = arr;
+  }
+  arrays_.resize(live);
 }
 
 
@@ -752,22 +1697,45 @@ MemoryManager::sweepLargeObjects()
   // modern malloc implementations do.
 
   // All objects remaining in the large objects after evacuation and
-  // scavenging are free.  Add to existing free list.
-  if (largeObjects_) {
-    if (freeLargeRegions_) {
-      // Append both lists.  Let's assume the newly-freed object list
-      // is a bit shorter than the existing free regions.
-      LargeObject *p = largeObjects_;
-      while (p->next_ != NULL) {
-        p = p->next_;
-      }
-      freeLargeRegions_->prev_ = p;
-      p->next_ = freeLargeRegions_;
-      freeLargeRegions_ = p;
+  // scavenging are free.  Mapped files are given back to the OS, the
+  // rest joins the existing free objects.
+  vector<LargeObject *> dead;
+  for (LargeObject *p = largeObjects_, *next; p != NULL; p = next) {
+    next = p->next_;
+    if (p->isMappedFile()) {
+      unmapFile(p);
+    } else {
+      largeBytes_ -= p->payloadSize_;
+      dead.push_back(p);
+    }
+  }
+  for (LargeObject *p = freeLargeRegions_; p != NULL; p = p->next_)
+    dead.push_back(p);
+  largeObjects_ = NULL;
+  freeLargeRegions_ = NULL;
+
+  // Merge adjacent free objects, and give the free space at the end
+  // of a region back to its bump allocator.  Going backwards, each
+  // object can absorb its successor.
+  sort(dead.begin(), dead.end());
+  LargeObject *succ = NULL;
+  for (size_t i = dead.size(); i > 0; --i) {
+    LargeObject *p = dead[i - 1];
+    Region *region = Region::regionFromPointer(p);
+    char *end = (char *)p + sizeof(LargeObject) + p->payloadSize_;
+    if (succ != NULL && end == (char *)succ &&
+        Region::regionFromPointer(succ) == region) {
+      unlinkLargeObject(succ, &freeLargeRegions_);
+      p->payloadSize_ += sizeof(LargeObject) + succ->payloadSize_;
+      end = (char *)p + sizeof(LargeObject) + p->payloadSize_;
+    }
+    if (end == region->largeSelf()->free_) {
+      region->largeSelf()->free_ = (char *)p;
+      succ = NULL;
     } else {
-      freeLargeRegions_ = largeObjects_;
+      linkLargeObject(p, &freeLargeRegions_);
+      succ = p;
     }
-    largeObjects_ = NULL;
   }
 
   // Traverse the scavenged large objects. Re-enlist them in the
@@ -779,12 +1747,14 @@ MemoryManager::sweepLargeObjects()
     p->clearMark();
     p = n;
   }
+  scavengedLargeObjects_ = NULL;
 }
 
-void MemoryManager::scavengeFrame(Word *base, Word *top, const u2 *bitmaps) {
+void MemoryManager::scavengeFrame(GCWorker *w, Word *base, Word *top,
+                                  const u2 *bitmaps) {
   dout << "Scavenging frame " << base << '-' << top << endl;
   dout << "-1:";
-  evacuate((Closure **)&base[-1]); // The frame node
+  evacuate(w, (Closure **)&base[-1]); // The frame node
   if (bitmaps == NULL)
     return;
   u2 bitmap;
@@ -797,7 +1767,7 @@ void MemoryManager::scavengeFrame(Word *base, Word *top, const u2 *bitmaps) {
       if (bitmap & 1) {
         LC_ASSERT(slot < slots);
         dout << slot << ": ";
-        evacuate((Closure **)&base[slot]);
+        evacuate(w, (Closure **)&base[slot]);
       }
     }
   } while (bitmap != 0);
@@ -812,13 +1782,96 @@ static inline const u2 *topFrameBitmask(const BcIns *pc) {
     return BcIns::offsetToBitmask(pc + 1 + BC_ROUND(ins.c()));
   case BcIns::kALLOCAP:
     return BcIns::offsetToBitmask(pc + 1 + BC_ROUND((u4)ins.c() + 1));
+  case BcIns::kADDZ:
+  case BcIns::kSUBZ:
+  case BcIns::kMULZ:
+  case BcIns::kQUOTZ:
+  case BcIns::kREMZ:
+  case BcIns::kSHLZ:
+  case BcIns::kSHRZ:
+  case BcIns::kI2Z:
+    return BcIns::offsetToBitmask(pc + 1);
+  case BcIns::kCCALLS:
+    // The GC may run while the call is in progress.
+    return BcIns::offsetToBitmask(pc + 2 + BC_ROUND(ins.c()));
+  case BcIns::kFORK:
+  case BcIns::kYIELD:
+  case BcIns::kNEWMVAR:
+  case BcIns::kTAKEMVAR:
+  case BcIns::kPUTMVAR:
+  case BcIns::kEVAL:
+    // Threads other than the current one are suspended at one of
+    // these.
+    return BcIns::offsetToBitmask(pc + 1);
   default:
     cerr << "FATAL: Instruction should not have triggered GC: " << ins.name() << endl;
     exit(1);
   }
 }
 
-void MemoryManager::scavengeStack(Word *base, Word *top, const BcIns *pc) {
+// The top of the frame that the frame at `base' returns to.  Frames
+// are contiguous, except that an underflow frame returns to a frame
+// in the previous stack chunk.  It keeps the top of that frame in its
+// only slot.
+static inline Word *callerFrameTop(Word *base) {
+  if ((Closure *)base[-1] == MiscClosures::stg_UNDERFLOW_closure_addr)
+    return (Word *)base[0];
+  return base - 3;
+}
+
+// The stacks of all threads of the capability are roots, whether
+// they are running, runnable or blocked.  They are suspended in the
+// interpreter, so the top frame is always described by the bitmap of
+// the current instruction, unless the capability has set a mask for
+// its current thread.
+void MemoryManager::scavengeThreads(GCWorker *w, Capability *cap) {
+  const std::vector<Thread *> &threads = cap->threads();
+  for (size_t i = 0; i < threads.size(); ++i) {
+    Thread *T = threads[i];
+    topOfStackMask_ =
+      T == cap->currentThread() ? cap->topOfStackMask_ : kNoMask;
+    scavengeStack(w, T->base(), T->top(), T->pc());
+    if (T->blackhole_ != NULL)
+      evacuate(w, &T->blackhole_);
+  }
+  topOfStackMask_ = kNoMask;
+}
+
+// Sparks are weak roots in the sense that a spark whose thunk has
+// already been evaluated (it "fizzled") is dropped.  The pool is only
+// touched while the world is stopped.
+void MemoryManager::scavengeSparks(GCWorker *w, Capability *cap) {
+  void *env[2] = { w, cap };
+  cap->sparks_.filter(keepSpark, env);
+}
+
+bool MemoryManager::keepSpark(Closure **spark, void *env) {
+  GCWorker *w = (GCWorker *)((void **)env)[0];
+  Capability *cap = (Capability *)((void **)env)[1];
+  Closure *cl = *spark;
+  InfoTable *info = cl->header_.info_;
+  for (;;) {
+    if (isForwardingPointer(info)) {
+      cl = getForwardingPointer(info);
+      info = cl->header_.info_;
+    } else if (info->type() == IND) {
+      cl = untag((Closure *)cl->payload(0));
+      info = cl->header_.info_;
+    } else {
+      break;
+    }
+  }
+  if (info->type() != THUNK) {
+    ++cap->sparkStats_.fizzled;
+    return false;
+  }
+  *spark = cl;
+  w->mm_->evacuate(w, spark);
+  return true;
+}
+
+void MemoryManager::scavengeStack(GCWorker *w, Word *base, Word *top,
+                                  const BcIns *pc) {
   u2 dummy_mask[3];
   const u2 *bitmask;
   if (topOfStackMask_ != kNoMask) {
@@ -834,95 +1887,367 @@ void MemoryManager::scavengeStack(Word *base, Word *top, const BcIns *pc) {
   } else {
     bitmask = topFrameBitmask(pc);
   }
-  scavengeFrame(base, top, bitmask);
-  top = base - 3;
+  scavengeFrame(w, base, top, bitmask);
+  top = callerFrameTop(base);
   pc = (BcIns *)base[-2];
   base = (Word *)base[-3];
 
   while (base) {
-    scavengeFrame(base, top, BcIns::offsetToBitmask(pc - 1));
-    top = base - 3;
+    scavengeFrame(w, base, top, BcIns::offsetToBitmask(pc - 1));
+    top = callerFrameTop(base);
     pc = (BcIns *)base[-2];
     base = (Word *)base[-3];
   }
 }
 
-void MemoryManager::scavengeStaticRoots(Closure *cl) {
+void MemoryManager::scavengeStaticRoots(GCWorker *w,
+                                        std::vector<Closure *> &cafs) {
   dout << "MM: Scavenging static roots" << endl;
-  while (cl) {
-    evacuate((Closure **)&cl->payload_[0]);
-    cl = (Closure *)cl->payload_[1];
+  for (size_t i = 0; i < cafs.size(); ++i) {
+    evacuate(w, (Closure **)&cafs[i]->payload_[0]);
   }
 }
 
-void MemoryManager::scavengeBlock(Block *block) {
-  dout << "MM: Scavenging block: " << (void *)block->start()
-       << '-' << (void *)block->end() << endl;
+// Static objects found during a major GC are collected per worker
+// and then traversed sequentially by scavengeStatics.
 
-  char *p = block->start();
+void MemoryManager::recordStatic(GCWorker *w, Closure *cl) {
+  if (w->staticSeen_.insert(cl).second)
+    w->statics_.push_back(cl);
+}
 
-  // We might be evacuating into the same block that we're scavenging.
-  // That is `bd->free` might change during the loop, so recheck here.
-  while ((char *)p < block->free()) {
-    Closure *cl = (Closure *)p;
-    InfoTable *info = cl->info();
-    LC_ASSERT(!isForwardingPointer(info));
-    switch (info->type()) {
-    case CONSTR:
-    case THUNK:
-    case FUN: {
-      u4 bitmap = info->layout().bitmap;
-      u4 size = info->size();
-      dout << "MM: * Scav " << (void *)cl
-           << ' ' << info->name() << ' ';
-      IFDBG(InfoTable::printPayload(dout, bitmap, size));
-      dout << endl;
+void MemoryManager::recordSrt(GCWorker *w, InfoTable *info) {
+  if (w->staticSeen_.insert(info).second)
+    w->srts_.push_back(info);
+}
 
-      LC_ASSERT(bitmap < (1UL << size));
-      for (u4 i = 0; bitmap != 0 && i < size; ++i, bitmap >>= 1) {
-        if (bitmap & 1) {
-          evacuate((Closure **)&cl->payload_[i]);
+// Record all static closures referenced by the code of the given
+// info table, and the SRTs of the info tables of objects that the
+// code may allocate.
+void MemoryManager::scavengeSrt(GCWorker *w, InfoTable *info) {
+  u2 srt = info->srtBitmap();
+  const Code *code = static_cast<CodeInfoTable *>(info)->code();
+  for (u4 i = 0; i < code->sizelits; ++i) {
+    if (i < 15 ? !(srt & (1u << i)) : !(srt & InfoTable::kSrtOverflowBit))
+      continue;
+    if (code->littypes[i] == LIT_CLOSURE) {
+      recordStatic(w, untag(code->lits[i]));
+    } else if (code->littypes[i] == LIT_INFO) {
+      InfoTable *other = (InfoTable *)code->lits[i];
+      if ((other->type() == FUN || other->type() == THUNK) &&
+          other->srtBitmap() != 0)
+        recordSrt(w, other);
+    }
+  }
+}
+
+void MemoryManager::scavengeStaticClosure(GCWorker *w, Closure *cl) {
+  InfoTable *info = cl->info();
+  dout << "MM: * Scav static " << (void *)cl << ' ' << info->name() << endl;
+  switch (info->type()) {
+  case IND:
+    // An updated CAF.  Its value is alive.  The original code of the
+    // CAF will not be run again, so its SRT need not be traversed.
+    evacuate(w, (Closure **)&cl->payload_[0]);
+    break;
+  case CONSTR: {
+    u4 bitmap = info->layout().bitmap;
+    for (u4 i = 0; bitmap != 0; ++i, bitmap >>= 1) {
+      if (bitmap & 1)
+        evacuate(w, (Closure **)&cl->payload_[i]);
+    }
+    break;
+  }
+  case FUN:
+  case THUNK:
+  case BLACKHOLE:
+  case CAF:
+    if (info->srtBitmap() != 0)
+      scavengeSrt(w, info);
+    break;
+  default:
+    break;
+  }
+}
+
+// Traverse all static closures and SRTs that have been recorded by
+// any worker since the last call.  Returns true if there were any
+// new ones.
+bool MemoryManager::scavengeStatics(GCWorker *w) {
+  bool progress = false;
+  bool more = true;
+  while (more) {
+    more = false;
+    for (u4 i = 0; i < gcThreads_; ++i) {
+      GCWorker *v = workers_[i];
+      while (!v->srts_.empty()) {
+        InfoTable *info = v->srts_.back();
+        v->srts_.pop_back();
+        if (liveStatics_.insert(info).second) {
+          scavengeSrt(w, info);
+          more = true;
+        }
+      }
+      while (!v->statics_.empty()) {
+        Closure *cl = v->statics_.back();
+        v->statics_.pop_back();
+        if (liveStatics_.insert(cl).second) {
+          scavengeStaticClosure(w, cl);
+          more = true;
         }
       }
-      p += (wordsof(ClosureHeader) + size) * sizeof(Word);
     }
-    break;
+    progress = progress || more;
+  }
+  return progress;
+}
 
-    case PAP: {
-      PapClosure *pap = (PapClosure *)cl;
-      // In principle we could get the bitmap from the function
-      // argument itself.  That would require following a few more
-      // pointers, though, so let's not do that if we can avoid it.
-      u4 bitmap = pap->info_.pointerMask_;
-      u4 size = pap->info_.nargs_;
-      dout << "MM: * Scav " << (void *)cl << " PAP";
-      IFDBG(InfoTable::printPayload(dout, bitmap, size));
-      dout << endl;
+// Revert all updated CAFs that were not reached during a major GC.
+// They will be re-evaluated if they are ever needed again.
+void MemoryManager::revertCAFs(std::vector<Closure *> &cafs) {
+  size_t live = 0;
+  for (size_t i = 0; i < cafs.size(); ++i) {
+    Closure *cl = cafs[i];
+    if (liveStatics_.count(cl)) {
+      cafs[live++] = cl;
+    } else {
+      dout << "MM: Reverting CAF " << (void *)cl << endl;
+      cl->setInfo((InfoTable *)cl->payload(1));
+      cl->setPayload(0, 0);
+      cl->setPayload(1, 0);
+      ++reverted_cafs_;
+    }
+  }
+  cafs.resize(live);
+}
 
-      evacuate(&pap->fun_);
+void MemoryManager::scavengeRememberedSet(GCWorker *w) {
+  dout << "MM: Scavenging remembered set ("
+       << remembered_.size() << ")" << endl;
+  std::vector<Closure *> remembered;
+  remembered.swap(remembered_);
+  for (size_t i = 0; i < remembered.size(); ++i) {
+    Closure *cl = remembered[i];
+    scavengeClosure(w, cl);
+    // The object may still point to an object in the aging area.
+    if (pointsIntoYoungGeneration(cl))
+      remember(w, cl);
+  }
+}
 
-      LC_ASSERT(bitmap < (1UL << size));
-      for (u4 i = 0; bitmap != 0 && i < size; ++i, bitmap >>= 1) {
-        if (bitmap & 1) {
-          evacuate((Closure **)&pap->payload_[i]);
-        }
+bool MemoryManager::pointsIntoYoungGeneration(Closure *cl) {
+  InfoTable *info = cl->info();
+  switch (info->type()) {
+  case IND:
+    return isYoungGeneration((Closure *)cl->payload(0));
+  case PAP: {
+    PapClosure *pap = (PapClosure *)cl;
+    if (isYoungGeneration(pap->fun_))
+      return true;
+    u4 bitmap = pap->info_.pointerMask_;
+    for (u4 i = 0; bitmap != 0; ++i, bitmap >>= 1) {
+      if ((bitmap & 1) && isYoungGeneration((Closure *)pap->payload_[i]))
+        return true;
+    }
+    return false;
+  }
+  default: {
+    u4 bitmap = info->layout().bitmap;
+    for (u4 i = 0; bitmap != 0; ++i, bitmap >>= 1) {
+      if ((bitmap & 1) && isYoungGeneration((Closure *)cl->payload_[i]))
+        return true;
+    }
+    return false;
+  }
+  }
+}
+
+// The size of a heap object in words.
+static inline u4 closureWords(Closure *cl) {
+  InfoTable *info = cl->info();
+  switch (info->type()) {
+  case PAP:
+    return wordsof(PapClosure) + ((PapClosure *)cl)->info_.nargs_;
+  case IND:
+    return wordsof(ClosureHeader) + 1;
+  default:
+    return wordsof(ClosureHeader) + info->size();
+  }
+}
+
+// Scavenge the fields of a single object.
+void MemoryManager::scavengeClosure(GCWorker *w, Closure *cl) {
+  InfoTable *info = cl->info();
+  LC_ASSERT(!isForwardingPointer(info));
+  switch (info->type()) {
+  case CONSTR:
+  case THUNK:
+  case BLACKHOLE:
+  case FUN:
+  case MVAR: {
+    u4 bitmap = info->layout().bitmap;
+    u4 size = info->size();
+    dout << "MM: * Scav " << (void *)cl
+         << ' ' << info->name() << ' ';
+    IFDBG(InfoTable::printPayload(dout, bitmap, size));
+    dout << endl;
+
+    LC_ASSERT(bitmap < (1UL << size));
+    for (u4 i = 0; bitmap != 0 && i < size; ++i, bitmap >>= 1) {
+      if (bitmap & 1) {
+        evacuate(w, (Closure **)&cl->payload_[i]);
       }
-      p += (wordsof(PapClosure) + size) * sizeof(Word);
     }
+    // The code may refer to CAFs.
+    if (majorGC_ && info->type() != CONSTR && info->srtBitmap() != 0)
+      recordSrt(w, info);
     break;
+  }
 
-    default:
-      cerr << "Can't scavenge object type, yet: " << info->type()
-           << " at " << cl << " " << info->name()
-           << endl;
-      exit(43);
+  case PAP: {
+    PapClosure *pap = (PapClosure *)cl;
+    // In principle we could get the bitmap from the function
+    // argument itself.  That would require following a few more
+    // pointers, though, so let's not do that if we can avoid it.
+    u4 bitmap = pap->info_.pointerMask_;
+    u4 size = pap->info_.nargs_;
+    dout << "MM: * Scav " << (void *)cl << " PAP";
+    IFDBG(InfoTable::printPayload(dout, bitmap, size));
+    dout << endl;
+
+    evacuate(w, &pap->fun_);
+
+    LC_ASSERT(bitmap < (1UL << size));
+    for (u4 i = 0; bitmap != 0 && i < size; ++i, bitmap >>= 1) {
+      if (bitmap & 1) {
+        evacuate(w, (Closure **)&pap->payload_[i]);
+      }
     }
+    break;
+  }
+
+  case IND:
+    // Only reachable via the remembered set.  Evacuated objects are
+    // never indirections.
+    evacuate(w, (Closure **)&cl->payload_[0]);
+    break;
+
+  default:
+    cerr << "Can't scavenge object type, yet: " << info->type()
+         << " at " << cl << " " << info->name()
+         << endl;
+    exit(43);
+  }
+}
+
+void MemoryManager::scavengeBlock(GCWorker *w, Block *block) {
+  dout << "MM: Scavenging block: " << (void *)block->start()
+       << '-' << (void *)block->end() << endl;
+
+  // Promoted objects may still point into the aging area.
+  bool checkYoung = block->getFlag(Block::kOld) && !majorGC_;
+
+  // We might be evacuating into the same block that we're scavenging.
+  // That is `bd->free` might change during the loop, so recheck here.
+  // During a census every object that gets scavenged is live.
+  bool census = census_;
+
+  w->scanning_ = block;
+  while (w->scanning_ == block && block->scan_ < block->free()) {
+    Closure *cl = (Closure *)block->scan_;
+    // Advance the scan pointer first.  If the block gets full while
+    // scavenging this object, another worker may take over the rest.
+    u4 words = closureWords(cl);
+    block->scan_ += words * sizeof(Word);
+    if (LC_UNLIKELY(census))
+      addToCensus(w->census_, cl->info(), words);
+    scavengeClosure(w, cl);
+    if (checkYoung && pointsIntoYoungGeneration(cl))
+      remember(w, cl);
   }
-  block->setFlag(Block::kScavenged);
+  w->scanning_ = NULL;
   dout << "MM: DONE Scavenging block: " << (void *)block->start()
        << '-' << (void *)block->end() << endl;
 }
 
+// Scavenge one block of the worker's own work.  Returns false if the
+// worker has no work left.
+//
+// Evacuation only allocates into the first block of each to-space.
+// These are always scavenged by the owning worker.  Other blocks got
+// pushed onto the worker's deque when they became full.
+bool MemoryManager::scavengeLocal(GCWorker *w) {
+  Block *block;
+  if (w->aging_ != NULL && w->aging_->scan_ < w->aging_->free()) {
+    scavengeBlock(w, w->aging_);
+    return true;
+  }
+  if (w->old_ != NULL && w->old_->scan_ < w->old_->free()) {
+    scavengeBlock(w, w->old_);
+    return true;
+  }
+  if (w->pending_.pop(&block)) {
+    scavengeBlock(w, block);
+    return true;
+  }
+  if (!w->overflow_.empty()) {
+    block = w->overflow_.back();
+    w->overflow_.pop_back();
+    scavengeBlock(w, block);
+    return true;
+  }
+  return false;
+}
+
+bool MemoryManager::stealWork(GCWorker *w) {
+  Block *block;
+  for (u4 i = 1; i < gcThreads_; ++i) {
+    GCWorker *victim = workers_[(w->id_ + i) % gcThreads_];
+    if (victim->pending_.steal(&block)) {
+      dout << "MM: Worker " << w->id_ << " stole block from "
+           << victim->id_ << endl;
+      scavengeBlock(w, block);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MemoryManager::workAvailable() {
+  for (u4 i = 0; i < gcThreads_; ++i) {
+    if (!workers_[i]->pending_.looksEmpty())
+      return true;
+  }
+  return false;
+}
+
+// Scavenge until there is no work left.  In a parallel GC, a worker
+// that runs out of work tries to steal from the other workers.  The
+// GC is finished once all workers are idle at the same time.  A
+// worker's to-space head blocks cannot be stolen, so a worker with
+// work left is never idle.
+void MemoryManager::scavengeLoop(GCWorker *w) {
+  for (;;) {
+    while (scavengeLocal(w)) {
+    }
+    if (!parallelGC_)
+      return;
+    if (stealWork(w))
+      continue;
+
+    __atomic_add_fetch(&gcIdle_, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (workAvailable()) {
+        __atomic_sub_fetch(&gcIdle_, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      if (__atomic_load_n(&gcIdle_, __ATOMIC_SEQ_CST) == gcThreads_)
+        return;
+      sched_yield();
+    }
+  }
+}
+
 // --- Sanity Checking ----------------------------------------
 //
 // This checks the heap for basic properties.  It should help us
@@ -931,6 +2256,16 @@ void MemoryManager::scavengeBlock(Block *block) {
 
 bool MemoryManager::sanityCheckClosure(SEEN_SET_TYPE &seen, Closure *cl) {
   void *p = (void *)cl;
+  if (ptrTag((Word)cl) != 0) {
+    if (!looksLikeClosure(untag(cl)) ||
+        ptrTag((Word)cl) != untag(cl)->info()->pointerTag()) {
+      cerr << "Wrong pointer tag: " << p << endl;
+      return false;
+    }
+    cl = untag(cl);
+    p = (void *)cl;
+  }
+
   if (seen.count(p) > 0)
     return true;
 
@@ -951,8 +2286,10 @@ bool MemoryManager::sanityCheckClosure(SEEN_SET_TYPE &seen, Closure *cl) {
   switch (info->type()) {
     case CONSTR:
     case THUNK:
+    case BLACKHOLE:
     case CAF:
-    case FUN: {
+    case FUN:
+    case MVAR: {
       u4 bitmap = info->layout().bitmap;
       u4 size = info->size();
 
@@ -982,8 +2319,20 @@ bool MemoryManager::sanityCheckClosure(SEEN_SET_TYPE &seen, Closure *cl) {
 
   case UPDATE_FRAME:
   case AP_CONT:
+  case LARGE:
     break;
 
+  case ARRAY: {
+    ArrayClosure *arr = (ArrayClosure *)cl;
+    for (Word i = 0; i < arr->ptrs_; ++i) {
+      if (!sanityCheckClosure(seen, arr->payload_[i])) {
+        cerr << ".. " << p << '[' << i << "] " << info->name() << endl;
+        return false;
+      }
+    }
+    break;
+  }
+
     case PAP: {
       PapClosure *pap = (PapClosure *)cl;
       // In principle we could get the bitmap from the function
@@ -1081,14 +2430,14 @@ bool MemoryManager::sanityCheckStack(SEEN_SET_TYPE &seen, Word *base, Word *top,
   if (!sanityCheckFrame(seen, base, top, bitmask))
     return false;
 
-  top = base - 3;
+  top = callerFrameTop(base);
   pc = (BcIns *)base[-2];
   base = (Word *)base[-3];
 
   while (base) {
     if (!sanityCheckFrame(seen, base, top, BcIns::offsetToBitmask(pc - 1)))
       return false;
-    top = base - 3;
+    top = callerFrameTop(base);
     pc = (BcIns *)base[-2];
     base = (Word *)base[-3];
   }
@@ -1096,28 +2445,37 @@ bool MemoryManager::sanityCheckStack(SEEN_SET_TYPE &seen, Word *base, Word *top,
   return true;
 }
 
-bool MemoryManager::sanityCheckStaticRoots(SEEN_SET_TYPE &seen, Closure *cl) {
-  while (cl) {
+bool MemoryManager::sanityCheckStaticRoots(SEEN_SET_TYPE &seen,
+                                           std::vector<Closure *> &cafs) {
+  for (size_t i = 0; i < cafs.size(); ++i) {
+    Closure *cl = cafs[i];
     if (!sanityCheckClosure(seen, (Closure *)cl->payload_[0])) {
       cerr << ".. static root " << (void *)cl;
       return false;
     }
-    cl = (Closure *)cl->payload_[1];
   }
   return true;
 }
 
-void MemoryManager::sanityCheckHeap(Capability *cap) {
+void MemoryManager::sanityCheckHeap() {
   SEEN_SET_TYPE seen;
 
-  Thread *T = cap->currentThread();
-  BcIns *pc = T->pc();
-  Word *base = T->base();
-  Word *top = T->top();
-
-  if (!(sanityCheckStack(seen, base, top, pc) &&
-        sanityCheckStaticRoots(seen, cap->staticRoots())))
-    exit(42);
+  for (size_t c = 0; c < capabilities_.size(); ++c) {
+    Capability *cap = capabilities_[c];
+    if (!sanityCheckStaticRoots(seen, cap->staticRoots()))
+      exit(42);
+    const std::vector<Thread *> &threads = cap->threads();
+    for (size_t i = 0; i < threads.size(); ++i) {
+      Thread *T = threads[i];
+      topOfStackMask_ =
+        T == cap->currentThread() ? cap->topOfStackMask_ : kNoMask;
+      if (!sanityCheckStack(seen, T->base(), T->top(), T->pc())) {
+        cerr << ".. thread " << T->id() << endl;
+        exit(42);
+      }
+    }
+  }
+  topOfStackMask_ = kNoMask;
 }
 
 bool
@@ -4,8 +4,13 @@
 #include "common.hh"
 #include "utils.hh"
 #include "objects.hh"
+#include "wsdeque.hh"
+#include "time.hh"
+#include "heapprofile.hh"
 #include <iostream>
 #include <string.h>
+#include <vector>
+#include <pthread.h>
 
 #include HASH_SET_H
 
@@ -13,6 +18,7 @@ _START_LAMBDACHINE_NAMESPACE
 
 class MemoryManager;
 class Capability;
+class GCWorker;
 
 // Only one OS thread should allocate to each block.
 
@@ -64,6 +70,11 @@ public:
     kContentsMask = 0xff,
     kScavenged = 0x100,
     kFull = 0x200,
+    // Generation flags, only used for kClosures blocks.  Blocks
+    // without either flag belong to the nursery.
+    kAged = 0x400,      // Objects that survived one minor GC.
+    kOld = 0x800,       // Promoted objects (the old generation).
+    kFromSpace = 0x1000, // Being collected by the current GC.
   } Flags;
 
   inline Flags flags() const {
@@ -81,6 +92,7 @@ public:
 private:
   friend class Region;
   friend class MemoryManager;
+  friend class Image;
   Block() {}; // Hidden
   ~Block() {};
 
@@ -89,6 +101,7 @@ private:
   inline void markAsFree() {
     flags_ = (uint32_t)Block::kUninitialized;
     free_ = start_;
+    scan_ = start_;
 #if !defined(NDEBUG)
     memset(free_, 0, end_ - free_);
 #endif
@@ -98,6 +111,7 @@ private:
   char *start_;
   char *end_;
   char *free_;
+  char *scan_;  // Scavenging progress (only used during GC).
   Block *link_;
   uint32_t flags_;
 #if LC_ARCH_BITS == 64
@@ -164,6 +178,14 @@ public:
     return kRegionSize - sizeof(LargeObjectRegionData) - sizeof(LargeObject);
   }
 
+  // Offset of the flags of the first block descriptor relative to
+  // the start of the region.  The JIT uses this to inline the
+  // generation check of the write barrier.
+  static inline Word blockFlagsOffset() {
+    return offsetof(SmallObjectRegionData, blocks_) +
+      offsetof(Block, flags_);
+  }
+
 private:
   Region() {}  // Hidden
 
@@ -220,6 +242,42 @@ private:
 
 class AllocInfoTableHandle; // forward decl
 
+// The state of one garbage collector thread.  Each worker evacuates
+// objects into its own to-space blocks, so copying needs no locks.
+// Full blocks that still need to be scavenged are pushed onto the
+// worker's deque from where idle workers may steal them.
+//
+// Worker 0 is run by the thread that triggered the GC.  If there is
+// only one worker, no additional threads are created and the GC is
+// the same sequential Cheney-style copying GC as before.
+class GCWorker {
+private:
+  GCWorker(MemoryManager *mm, u4 id);
+  ~GCWorker();
+
+  // Reset the per-GC state.
+  void reset();
+
+  MemoryManager *mm_;
+  u4 id_;
+  Block *aging_;    // To-space for objects from the nursery.
+  Block *old_;      // To-space for promoted objects.
+  Block *scanning_; // The block currently being scavenged, if any.
+  WSDeque<Block *> pending_;  // Full blocks that need scavenging.
+  std::vector<Block *> overflow_;  // Used if pending_ is full.
+  std::vector<Closure *> remembered_;
+  // Static closures and SRTs reached during a major GC.  The set
+  // avoids recording the same object repeatedly.
+  HASH_NAMESPACE::HASH_SET_CLASS<void *> staticSeen_;
+  std::vector<Closure *> statics_;
+  std::vector<InfoTable *> srts_;
+  CensusTable census_;  // Only used if a census is being taken.
+  uint64_t copied_;  // Bytes copied during the current GC.
+  pthread_t thread_;
+
+  friend class MemoryManager;
+};
+
 class MemoryManager
 {
   //  void *allocInfoTable(Word nwords);
@@ -229,6 +287,13 @@ public:
 
   InfoTable *allocInfoTable(AllocInfoTableHandle&, Word nwords);
 
+  // Info tables are read-only once allocated.  Use these to update an
+  // info table later, e.g., when its code is loaded lazily.  The
+  // block that is currently being filled by an AllocInfoTableHandle
+  // stays writable.
+  void unprotectInfoTable(const InfoTable *info);
+  void protectInfoTable(const InfoTable *info);
+
   inline char *allocString(size_t length) {
     return reinterpret_cast<char*>(allocInto(&strings_, length + 1));
   }
@@ -244,14 +309,44 @@ public:
                      sizeof(BcIns) * instrs + sizeof(u2) * bitmaps);
   }
 
+  // Allocate the literals of a piece of bytecode and their types.
+  // The literals are word-aligned, which allocCode does not
+  // guarantee.
+  void allocLiterals(size_t n, Word **lits, u1 **littypes);
+
   inline Closure *allocClosure(InfoTable *info, size_t payloadWords) {
+    return allocClosureInto(&closures_, info, payloadWords);
+  }
+
+  inline Closure *allocClosureInto(Block **block, InfoTable *info,
+                                   size_t payloadWords) {
     Closure *cl = reinterpret_cast<Closure*>
-      (allocInto(&closures_,
+      (allocInto(block,
                  (wordsof(ClosureHeader) + payloadWords) * sizeof(Word)));
     Closure::initHeader(cl, info);
     return cl;
   }
 
+  // Allocate an object that is never moved by the GC.  Never
+  // triggers a GC, so it may be called from traces (see integer.hh),
+  // but the size counts towards the next GC.  Large objects die in
+  // major GCs and their space gets reused.
+  Closure *allocLarge(Word nbytes);
+
+  // Allocate a mutable boxed array with all elements set to `init'.
+  // Like allocLarge, never triggers a GC.
+  ArrayClosure *allocArray(Word ptrs, Closure *init);
+
+  // Allocate an uninitialised byte array.  Never triggers a GC.
+  ByteArrayClosure *allocByteArray(Word bytes);
+
+  // Map the file `path' read-only and wrap it as a byte array.  The
+  // array is a large object whose payload is the mapping, so the GC
+  // never copies it; the file is unmapped when the array becomes
+  // unreachable.  The array must not be written to.  Returns NULL if
+  // the file cannot be mapped.  Never triggers a GC.
+  ByteArrayClosure *mapFile(const char *path);
+
   bool looksLikeInfoTable(void *p);
   bool looksLikeClosure(void *p);
 
@@ -261,13 +356,54 @@ public:
   void debugPrint();
 
   inline uint64_t allocated() const { return allocated_; }
+  inline uint64_t copied() const { return copied_; }
+  inline uint64_t mapped() const { return mapped_; }
   inline uint32_t numGCs() const { return num_gcs_; };
+  inline uint32_t numMinorGCs() const { return num_gcs_ - num_major_gcs_; }
+  inline uint32_t numMajorGCs() const { return num_major_gcs_; }
+  inline uint64_t numRevertedCAFs() const { return reverted_cafs_; }
+
+  // Returns true if the object has been promoted to the old
+  // generation.  Static and large objects are never "old" in this
+  // sense, since they do not get copied.
+  inline bool isOldGeneration(void *p) const {
+    Region *r = Region::regionFromPointer(p);
+    if (!r->isSmallObjectRegion())
+      return false;
+    return Region::blockFromPointer(p)->getFlag(Block::kOld);
+  }
 
-  static const u4 kNoMask = ~0;
+  // Returns true if the object lives in the nursery or the aging area.
+  inline bool isYoungGeneration(void *p) const {
+    Region *r = Region::regionFromPointer(p);
+    if (!r->isSmallObjectRegion())
+      return false;
+    Block *block = Region::blockFromPointer(p);
+    return block->contents() == Block::kClosures &&
+      !block->getFlag(Block::kOld);
+  }
 
-  inline void setTopOfStackMask(u4 mask) {
-    topOfStackMask_ = mask;
-  };
+  // The write barrier.  Must be called whenever an existing heap
+  // object is mutated to point to another heap object: on UPDATE
+  // (also on traces), PUTMVAR, and when unwindStack updates thunks.
+  // Old objects get recorded in the remembered set which is used as
+  // an additional root set by minor GCs.
+  inline void writeBarrier(Closure *cl) {
+    if (LC_UNLIKELY(isOldGeneration(cl)))
+      remember(cl);
+  }
+
+  // The write barrier for boxed arrays.  Must be called whenever
+  // element `i' of an array is overwritten.  Arrays never move, so
+  // they are not put into the remembered set.  Instead, the minor GC
+  // scans the dirty cards of all arrays.
+  static inline void arrayWriteBarrier(ArrayClosure *arr, Word i) {
+    arr->markCard(i);
+  }
+
+  inline size_t rememberedSetSize() const { return remembered_.size(); }
+
+  static const u4 kNoMask = ~0;
 
   static const u4 kDefaultGCTrigger = 2;  // blocks
 
@@ -279,11 +415,112 @@ public:
     nextGC_ = blocks;
   }
 
-  inline void setMinHeapSize(size_t bytes) {
-    minHeapSize_ = idivCeil(bytes, Block::kBlockSize);
-    if (minHeapSize_ < 2) minHeapSize_ = 2;
+  // Heap sizing policy.  All sizes are in bytes.
+  //
+  // The mutator may allocate the nursery size before a GC is
+  // triggered.  If the heap is smaller than the suggested heap size,
+  // the nursery gets all the remaining space.  The heap (nursery,
+  // aging area and old generation) may never grow beyond the maximum
+  // heap size; the program is aborted if the live data does not fit.
+  // Finally, if the fraction of time spent in the GC exceeds the GC
+  // time target, the nursery is grown; if it is well below the
+  // target, it is shrunk back towards the configured size.
+
+  // A nursery size of 0 selects a size based on the CPU caches.
+  void setNurserySize(size_t bytes);
+  inline void setSuggestedHeapSize(size_t bytes) {
+    suggestedHeapBlocks_ = idivCeil(bytes, Block::kBlockSize);
+  }
+  // A maximum heap size of 0 means unlimited.
+  inline void setMaxHeapSize(size_t bytes) {
+    maxHeapBlocks_ = idivCeil(bytes, Block::kBlockSize);
+  }
+  // A target of 0 disables adaptive nursery sizing.
+  inline void setGCTimeTarget(double fraction) {
+    gcTimeTarget_ = fraction;
+  }
+
+  inline size_t nurserySize() const {
+    return (size_t)nurseryBlocks_ * Block::kBlockSize;
+  }
+
+  // Size of the largest L2 or L3 cache, or 0 if unknown.
+  static size_t cacheSize();
+
+  static const size_t kMinNurserySize = 1UL << 20;  // 1MB
+  static const size_t kMaxDefaultNurserySize = 16UL << 20;
+  // Adaptive sizing never grows the nursery beyond this factor.
+  static const u4 kMaxNurseryGrowth = 16;
+
+  // The old generation may grow by this factor (relative to the
+  // amount of data that survived the last major GC) before another
+  // major GC is triggered.
+  static const u4 kOldGenGrowthFactor = 2;
+
+  // Set the number of threads used by the garbage collector.  Must
+  // not be called during GC.
+  void setGCThreads(u4 threads);
+  inline u4 gcThreads() const { return gcThreads_; }
+
+  static const u4 kMaxGCThreads = 64;
+
+  // Take a heap census every gcInterval GCs or every timeInterval,
+  // whichever comes first, and write it to the given file.  Returns
+  // false if the file cannot be opened.
+  bool startHeapProfile(const char *filename, u4 gcInterval,
+                        Time timeInterval);
+  inline const HeapProfiler *heapProfiler() const { return heapProfiler_; }
+
+  // --- Capabilities ---
+  //
+  // Any number of capabilities may share the heap, each running on
+  // its own OS thread.  Every capability allocates into its own
+  // nursery block, so allocation needs no locks.  Only when a block
+  // is full does a capability take the heap lock to get a new one.
+  //
+  // A capability is "attached" while it runs Haskell code (see
+  // Capability::attach).  The GC may only run while all attached
+  // capabilities are stopped.  The capability whose block triggers
+  // the GC stops the world: it waits until every other attached
+  // capability has reached a safepoint, collects garbage using the
+  // threads of all capabilities as roots, gives each capability a
+  // fresh nursery block, and then resumes the world.  Safepoints are
+  // the points where the nursery block is full, calls in the
+  // interpreter, and the jumps back to the start of a trace, so that
+  // a loop that doesn't allocate cannot delay the GC for long.
+
+  inline u4 numCapabilities() const { return (u4)capabilities_.size(); }
+  // True once a second capability has been registered.  From then on
+  // thunks are blackholed (see objects.hh).
+  inline bool isShared() const { return shared_; }
+
+  // Take a spark from the pool of any capability other than `thief'.
+  // The thief must be attached.
+  bool stealSpark(Capability *thief, Closure **spark);
+
+  // True while some capability waits for all others to stop.  Cheap
+  // enough to poll on every call; traces read the flag directly.
+  static inline bool safepointRequested() {
+    return __atomic_load_n(&safepointRequests_, __ATOMIC_RELAXED) != 0;
+  }
+  static inline const u4 *safepointRequestFlag() {
+    return &safepointRequests_;
   }
 
+  // Stop all other attached capabilities without collecting garbage,
+  // e.g., to modify code that they may be running.  The caller must
+  // be attached.  Returns false if another capability is already
+  // stopping the world; the caller cannot wait for it, since it is
+  // not at a safepoint, and has to try again later.
+  bool stopOtherCapabilities();
+  void resumeOtherCapabilities();
+
+  // Wait while another capability has stopped the world.  Like
+  // bumpAllocatorFull, the caller must have synced its thread and set
+  // the pointer mask of the top frame unless it is at an instruction
+  // that the GC understands.
+  void safepoint(Capability *cap, char **heap, char **heaplim);
+
 private:
   inline void *allocInto(Block **block, size_t bytes) {
     char *ptr = (*block)->alloc(bytes);
@@ -291,54 +528,119 @@ private:
       blockFull(block);
       ptr = (*block)->alloc(bytes);
     }
-    allocated_ += bytes;
+    countAllocated(bytes);
     return ptr;
   }
 
+  inline void countAllocated(uint64_t bytes) {
+    __atomic_fetch_add(&allocated_, bytes, __ATOMIC_RELAXED);
+  }
+
   inline bool isGCd(Block *block) const {
     return block->contents() == Block::kClosures;
   }
 
   friend class Capability;
-
-  // There must not be any other allocation occurring to this block.
-  inline void getBumpAllocatorBounds(char **heap, char **heaplim) {
-    *heap = closures_->free();
-    *heaplim = closures_->end();
+  friend class Image;
+
+  // The bounds of a capability's nursery block.  Only the owning
+  // capability allocates into it.
+  inline void getBumpAllocatorBounds(Block *nursery,
+                                     char **heap, char **heaplim) {
+    *heap = nursery->free();
+    *heaplim = nursery->end();
     LC_ASSERT(isWordAligned(*heap));
     LC_ASSERT(isWordAligned(*heaplim));
   }
 
-  inline void sync(char *heap, char *heaplim) {
+  inline void sync(Block *nursery, char *heap, char *heaplim) {
     // heaplim == NULL can happen if we want to force a thread to
     // yield.
-    LC_ASSERT(heaplim == NULL || heaplim == closures_->end());
-    LC_ASSERT(closures_->free() <= heap && heap <= closures_->end());
-    allocated_ += static_cast<uint64_t>(heap - closures_->free());
-    closures_->free_ = heap;
+    LC_ASSERT(heaplim == NULL || heaplim == nursery->end());
+    LC_ASSERT(nursery->free() <= heap && heap <= nursery->end());
+    countAllocated(static_cast<uint64_t>(heap - nursery->free()));
+    nursery->free_ = heap;
   }
 
+  // Give the capability a new nursery block.  This is a safepoint:
+  // may stop the world and collect garbage, or wait for another
+  // capability to do so.
   void bumpAllocatorFull(char **heap, char **heaplim, Capability *cap);
 
   // Returns non-zero if GC is necessary.  If result is 0, then *heap
-  // and *heaplim point to a new block.
-  int bumpAllocatorFullNoGC(char **heap, char **heaplim);
+  // and *heaplim point to a new block.  Never blocks, so it may be
+  // called from a trace.
+  int bumpAllocatorFullNoGC(Capability *cap, char **heap, char **heaplim);
+
+  void registerCapability(Capability *cap);
+  void unregisterCapability(Capability *cap);
+  void attachCapability();
+  void detachCapability();
+  // These require heapLock_.
+  void retireNursery(Capability *cap);
+  void stopTheWorld();
+  void resumeTheWorld();
+  void waitForGC();
+
+  void remember(Closure *cl);
+  inline void remember(GCWorker *w, Closure *cl) {
+    w->remembered_.push_back(cl);
+  }
 
   bool markBlockReadOnly(const Block *block);
   bool markBlockReadWrite(const Block *block);
 
   Block *grabFreeBlock(Block::Flags);
+  Block *grabStaticBlock(Block::Flags contents);
   void blockFull(Block **);
   void performGC(Capability *cap);
-  void scavengeStack(Word *base, Word *top, const BcIns *pc);
-  void scavengeFrame(Word *base, Word *top, const u2 *bitmask);
-  void scavengeBlock(Block *);
-  void scavengeStaticRoots(Closure *);
-  void scavengeLarge();
+  void resizeHeap(u4 liveBlocks, Time gcStart, Time gcEnd);
+  void heapOverflow(u4 liveBlocks);
+  void addToFromSpace(Block **blocks);
+  void scavengeStack(GCWorker *, Word *base, Word *top, const BcIns *pc);
+  void scavengeThreads(GCWorker *, Capability *);
+  void scavengeSparks(GCWorker *, Capability *);
+  static bool keepSpark(Closure **spark, void *env);
+  void scavengeFrame(GCWorker *, Word *base, Word *top, const u2 *bitmask);
+  void scavengeClosure(GCWorker *, Closure *);
+  void scavengeBlock(GCWorker *, Block *);
+  void scavengeStaticRoots(GCWorker *, std::vector<Closure *> &cafs);
+  void recordStatic(GCWorker *, Closure *);
+  void recordSrt(GCWorker *, InfoTable *);
+  void scavengeSrt(GCWorker *, InfoTable *);
+  void scavengeStaticClosure(GCWorker *, Closure *);
+  bool scavengeStatics(GCWorker *);
+  void revertCAFs(std::vector<Closure *> &cafs);
+  void scavengeRememberedSet(GCWorker *);
+  bool pointsIntoYoungGeneration(Closure *);
+  bool scavengeLarge(GCWorker *);
+  void scavengeArray(GCWorker *, ArrayClosure *);
+  void scavengeArrayCards(GCWorker *);
+  void pruneArrays();
   void sweepLargeObjects();
-
-  Closure *allocLarge(Word nbytes);
-  void evacuate(Closure **);
+  LargeObject *reuseLargeObject(Word nbytes);
+  inline u4 largeBlocks() const {
+    return (u4)(largeBytes_ >> Block::kBlockSizeLog2);
+  }
+  void unmapFile(LargeObject *);
+
+  // Parallel GC support.
+  static void *gcWorkerMain(void *);
+  void startGCWorkers();
+  void stopGCWorkers();
+  void scavengeToSpace(GCWorker *);
+  void scavengeLoop(GCWorker *);
+  bool scavengeLocal(GCWorker *);
+  bool stealWork(GCWorker *);
+  bool workAvailable();
+  char *allocToSpace(GCWorker *, Block **dest, Block::Flags gen,
+                     size_t bytes);
+  void pushWork(GCWorker *, Block *);
+  void mergeToSpace(Block **list, Block *blocks);
+
+  void evacuate(GCWorker *, Closure **);
+  void copy(GCWorker *, Block **dest, Block::Flags gen, Closure **p,
+            InfoTable *info, u4 payloadSize);
   void evacuateLarge(Closure *);
 
 # define SEEN_SET_TYPE HASH_NAMESPACE::HASH_SET_CLASS<void*>
@@ -348,8 +650,9 @@ private:
                         const u2 *bitmask);
   bool sanityCheckStack(SEEN_SET_TYPE &seen, Word *base, Word *top,
                         const BcIns *pc);
-  bool sanityCheckStaticRoots(SEEN_SET_TYPE &seen, Closure *cl);
-  void sanityCheckHeap(Capability *cap);
+  bool sanityCheckStaticRoots(SEEN_SET_TYPE &seen,
+                              std::vector<Closure *> &cafs);
+  void sanityCheckHeap();
   bool inRegions(void *p);
 
   void beginAllocInfoTable();
@@ -360,25 +663,91 @@ private:
   Block *free_;
   Block *info_tables_;
   Block *static_closures_;
-  Block *closures_;
+  Block *closures_;  // The nursery, except the capabilities' current blocks.
+  Block *aging_;     // Objects that survived one minor GC.
+  Block *old_gen_;   // Promoted objects.  Head receives promotions.
   Block *strings_;
   Block *bytecode_;
   Block *old_heap_; // Only non-NULL during GC
-  u4 topOfStackMask_;
+  u4 topOfStackMask_;  // of the stack that is being scavenged
   int beginAllocInfoTableLevel_;
   LargeObject *largeObjects_;
   LargeObject *evacuatedLargeObjects_;
   LargeObject *scavengedLargeObjects_;
-  LargeObject *freeLargeRegions_;
-
-  uint64_t minHeapSize_;  // in blocks
+  LargeObject *freeLargeRegions_;  // Dead large objects, can be reused.
+  Word largeBytes_;    // All large objects except mapped files.
+  Word largeSinceGC_;  // Not yet counted against nextGC_.
+
+  // Heap sizing.  All sizes in blocks.
+  u4 baseNurseryBlocks_;  // configured nursery size
+  u4 nurseryBlocks_;      // current (adaptive) nursery size
+  u4 suggestedHeapBlocks_;
+  u4 maxHeapBlocks_;      // 0 = unlimited
+  double gcTimeTarget_;
+  double gcTimeFraction_;  // moving average
+  Time lastGCEnd_;
   u4 nextGC_;  // if zero, a GC gets triggered.
+  u4 oldGenBlocks_;
+  u4 nextMajorGC_;  // major GC when old and large blocks reach this value
+  bool majorGC_;  // only valid during GC
+
+  // Old objects which may point into the young generation.
+  std::vector<Closure *> remembered_;
+
+  // All boxed arrays that survived the last major GC or were
+  // allocated since.  A minor GC scans their dirty cards.
+  std::vector<ArrayClosure *> arrays_;
+
+  // Static closures reachable from live code (major GC only).
+  SEEN_SET_TYPE liveStatics_;
 
   // Assuming an allocation rate of 16GB/s (pretty high), this counter
   // will overflow in 2^30 seconds, or about 34 years.  That appears
   // to be fine for now (it's for statistical purposes only).
   uint64_t allocated_;
+  uint64_t copied_;  // Total bytes copied by the GC.
+  uint64_t mapped_;  // Bytes of files currently mapped by mapFile.
   uint64_t num_gcs_;
+  uint64_t num_major_gcs_;
+  uint64_t reverted_cafs_;
+
+  HeapProfiler *heapProfiler_;  // NULL unless heap profiling
+  bool census_;  // only valid during GC
+
+  // GC workers.  workers_[0] always exists.  The others only have
+  // threads once the first parallel GC has run.
+  u4 gcThreads_;
+  GCWorker **workers_;
+  bool parallelGC_;  // true during a GC with more than one worker
+  bool workersStarted_;
+  bool shutdownWorkers_;
+  u4 gcIdle_;  // number of workers looking for work
+  u4 gcRunning_;  // number of helper threads still running
+  u4 gcGeneration_;  // incremented to start the helper threads
+  pthread_mutex_t gcLock_;  // protects the above thread coordination
+  pthread_cond_t gcStart_;
+  pthread_cond_t gcDone_;
+  // Protects the free block list, and the large objects during a
+  // parallel GC.
+  pthread_mutex_t blockLock_;
+
+  // Capabilities.  heapLock_ protects the nursery (closures_),
+  // nextGC_, the remembered set, the large objects and the fields
+  // below.  A capability that stops the world holds it during the
+  // whole GC.
+  std::vector<Capability *> capabilities_;
+  u4 attachedCaps_;  // capabilities running Haskell code
+  bool shared_;
+  u4 nextVictim_;    // where stealSpark starts looking
+  u4 stoppedCaps_;   // attached capabilities waiting for the GC
+  bool stopTheWorld_;  // a capability is waiting to collect garbage
+  u4 gcEpoch_;  // incremented after each GC; wakes up stopped capabilities
+  pthread_mutex_t heapLock_;
+  pthread_cond_t worldStopped_;
+  pthread_cond_t worldResumed_;
+  // Number of memory managers whose world is being stopped.  Shared
+  // by all of them, because traces are shared.
+  static u4 safepointRequests_;
 
   friend class AllocInfoTableHandle;
 };
@@ -411,6 +780,18 @@ private:
   MemoryManager &mm_;
 };
 
+// Array helpers that are called from traces (see IRCALLDEF).
+Closure *newArray(MemoryManager *mm, Word ptrs, Closure *init);
+Closure *newByteArray(MemoryManager *mm, Word bytes);
+// Copy elements [srcOffset, srcOffset + n) of `src' to `dst'.  The
+// arrays may overlap.
+void copyArray(Closure *src, Word srcOffset, Closure *dst, Word dstOffset,
+               Word n);
+
+// Called from traces (see Assembler::writeBarrier) after they found
+// that `cl' lives in the old generation.
+void rememberFromTrace(MemoryManager *mm, Closure *cl);
+
 _END_LAMBDACHINE_NAMESPACE
 
 #endif /* _MEMORYMANAGER_H_ */
@@ -0,0 +1,253 @@
+// Micro-benchmarks.  They print timings and are too slow for the
+// unit tests, so they live in their own binary:
+//
+//     make microbench && ./microbench
+
+#include "gtest/gtest.h"
+#include "thread.hh"
+#include "memorymanager.hh"
+#include "loader.hh"
+#include "capability.hh"
+#include "objects.hh"
+#include "bytearray.hh"
+#include "miscclosures.hh"
+#include "time.hh"
+
+#include <iostream>
+#include <string.h>
+
+using namespace std;
+_USE_LAMBDACHINE_NAMESPACE
+
+class BenchCodeTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    for (size_t i = 0; i < countof(code_); ++i) {
+      code_[i] = stop();
+    }
+    T = Thread::createTestingThread(&code_[0], framesize_);
+    cap_->disableBytecodeTracing();
+  }
+
+  virtual void TearDown() {
+    if (T != NULL) {
+      T->destroy();
+      delete T;
+    }
+    T = NULL;
+  }
+
+  BenchCodeTest() : T(NULL), framesize_(8) {
+    cap_ = new Capability(&mm);
+    l_ = new Loader(&mm, NULL);
+  }
+
+  virtual ~BenchCodeTest() {
+    delete cap_;
+    delete l_;
+  }
+
+  BcIns stop() { return BcIns::ad(BcIns::kSTOP, 0, 0); }
+
+  MemoryManager mm;
+  Loader *l_;
+  Capability *cap_;
+  Thread *T;
+  BcIns code_[32];
+  u4 framesize_;
+};
+
+class ByteArrayBench : public BenchCodeTest {
+};
+
+// Compares the bulk bytecodes with the equivalent GETA1/SETA1 loops in
+// the interpreter.  Prints the timings, only checks the results.
+TEST_F(ByteArrayBench, BulkVersusLoop) {
+  static const Word kBytes = 1 << 19;
+  static const int kRounds = 4;
+  ByteArrayClosure *src = mm.allocByteArray(kBytes);
+  ByteArrayClosure *dst = mm.allocByteArray(kBytes);
+  memset(src->payload_, 'a', kBytes);
+  ((u1 *)src->payload_)[kBytes - 1] = '\n';
+
+  // r0 = src, r1 = i, r2 = n, r3 = byte, r4 = 1, r5 = tmp, r6 = dst,
+  // r7 = 0
+  for (int i = 0; i < 2; ++i) {
+    const char *what = i == 0 ? "find" : "copy";
+    Time loop = 0, bulk = 0;
+    for (int round = 0; round < kRounds; ++round) {
+      T->setSlot(0, (Word)src);
+      T->setSlot(1, 0);
+      T->setSlot(2, kBytes);
+      T->setSlot(3, '\n');
+      T->setSlot(4, 1);
+      T->setSlot(6, (Word)dst);
+      T->setSlot(7, 0);
+      T->setPC(&code_[0]);
+      if (i == 0) {
+        code_[0] = BcIns::abc(BcIns::kGETA1, 5, 0, 1);
+        code_[1] = BcIns::ad(BcIns::kISEQ, 5, 3);
+        code_[2] = BcIns::aj(BcIns::kJMP, 0, +3);
+        code_[3] = BcIns::abc(BcIns::kADDRR, 1, 1, 4);
+        code_[4] = BcIns::ad(BcIns::kISLT, 1, 2);
+        code_[5] = BcIns::aj(BcIns::kJMP, 0, -6);
+        code_[6] = stop();
+      } else {
+        code_[0] = BcIns::abc(BcIns::kGETA1, 5, 0, 1);
+        code_[1] = BcIns::abc(BcIns::kSETA1, 5, 6, 1);
+        code_[2] = BcIns::abc(BcIns::kADDRR, 1, 1, 4);
+        code_[3] = BcIns::ad(BcIns::kISLT, 1, 2);
+        code_[4] = BcIns::aj(BcIns::kJMP, 0, -5);
+        code_[5] = stop();
+      }
+      Time start = getProcessElapsedTime();
+      ASSERT_TRUE(cap_->run(T));
+      loop += getProcessElapsedTime() - start;
+      if (i == 0) {
+        ASSERT_EQ(kBytes - 1, T->slot(1));
+      }
+
+      T->setPC(&code_[0]);
+      if (i == 0) {
+        code_[0] = BcIns::abc(BcIns::kFINDBYTEA, 1, 0, 7);
+        code_[1] = BcIns::args(2, 3, 0, 0);
+      } else {
+        code_[0] = BcIns::abc(BcIns::kCOPYBYTEA, 0, 7, 6);
+        code_[1] = BcIns::args(7, 2, 0, 0);
+      }
+      code_[2] = stop();
+      start = getProcessElapsedTime();
+      ASSERT_TRUE(cap_->run(T));
+      bulk += getProcessElapsedTime() - start;
+      if (i == 0) {
+        ASSERT_EQ(kBytes - 1, T->slot(1));
+      }
+    }
+    if (i == 1) {
+      ASSERT_EQ(0, memcmp(src->payload_, dst->payload_, kBytes));
+    }
+    cerr << what << " " << kBytes << " bytes: loop "
+         << TimeToUS(loop / kRounds) << "us, bulk "
+         << TimeToUS(bulk / kRounds) << "us\n";
+  }
+}
+
+// Collects a long chain of thunks with 1, 2 and 4 GC threads (see
+// utils/rungcbenchmarks.sh for the same on real programs).  Each
+// thunk holds the previous one, so the whole chain stays live.
+TEST(GCBench, Chain) {
+  static const Word kLength = 400000;
+  static const u4 kThreads[] = { 1, 2, 4 };
+  for (size_t t = 0; t < countof(kThreads); ++t) {
+    MemoryManager mm;
+    mm.setNurserySize(8 * Block::kBlockSize);
+    mm.setGCThreads(kThreads[t]);
+    Loader l(&mm, NULL);
+    Capability cap(&mm);
+
+    // r0 = chain, r1 = i, r2 = n, r3 = 1, r4 = info,
+    // r5 = any static closure
+    BcIns code[8];
+    u2 *bitmaps = (u2 *)&code[7];  // the bitmap follows the code
+    bitmaps[0] = 1 | 32;           // r0, r5
+    code[0] = BcIns::abc(BcIns::kALLOC, 0, 4, 2);
+    code[1] = BcIns::args(0, 5, 0, 0);
+    code[2] = BcIns::bitmapOffset(byteOffset32(&code[2], &bitmaps[0]));
+    code[3] = BcIns::abc(BcIns::kADDRR, 1, 1, 3);
+    code[4] = BcIns::ad(BcIns::kISLT, 1, 2);
+    code[5] = BcIns::aj(BcIns::kJMP, 0, -6);
+    code[6] = BcIns::ad(BcIns::kSTOP, 0, 0);
+    Thread *T = Thread::createThread(&cap, 1U << 10);
+    T->top_ = T->base() + 6;
+    T->setPC(&code[0]);
+    T->setSlot(0, (Word)MiscClosures::stg_STOP_closure_addr);
+    T->setSlot(1, 0);
+    T->setSlot(2, kLength);
+    T->setSlot(3, 1);
+    T->setSlot(4, (Word)MiscClosures::getApInfo(1, 1));
+    T->setSlot(5, (Word)MiscClosures::stg_STOP_closure_addr);
+
+    Time gcBefore = gc_time;
+    Time start = getProcessElapsedTime();
+    ASSERT_TRUE(cap.run(T));
+    Time total = getProcessElapsedTime() - start;
+    cerr << "--gc-threads=" << kThreads[t] << ": "
+         << mm.numGCs() << " GCs, GC "
+         << TimeToUS(gc_time - gcBefore) / 1000 << "ms, total "
+         << TimeToUS(total) / 1000 << "ms\n";
+    delete T;
+  }
+}
+
+// A complete binary tree of the given depth.  The nodes are AP thunks
+// with two pointer fields, which the GC copies like any other object.
+static Closure *
+buildTree(MemoryManager *mm, InfoTable *node, u4 depth)
+{
+  if (depth == 0)
+    return MiscClosures::stg_STOP_closure_addr;
+  Closure *cl = mm->allocClosure(node, 2);
+  cl->setPayload(0, (Word)buildTree(mm, node, depth - 1));
+  cl->setPayload(1, (Word)buildTree(mm, node, depth - 1));
+  return cl;
+}
+
+// Unlike Chain, the live data is a wide tree, so the GC workers
+// always find unscanned objects to steal.  Each round puts a fresh
+// tree into the nursery and then allocates garbage until the tree has
+// been copied into the old generation.  Only the GC time of those
+// collections depends on the number of GC threads.
+TEST(GCBench, BinaryTree) {
+  static const u4 kDepth = 17;  // 128K nodes, 3MB
+  static const u4 kRounds = 10;
+  static const Word kGarbage = 100000;  // thunks per round
+  static const u4 kThreads[] = { 1, 2, 4, 8 };
+  for (size_t t = 0; t < countof(kThreads); ++t) {
+    MemoryManager mm;
+    mm.setNurserySize(8 * Block::kBlockSize);
+    mm.setGCThreads(kThreads[t]);
+    Loader l(&mm, NULL);
+    Capability cap(&mm);
+    InfoTable *node = MiscClosures::getApInfo(1, 1);
+
+    // r0 = tree, r1 = i, r2 = n, r3 = 1, r4 = info, r5 = garbage,
+    // r6 = any static closure
+    BcIns code[8];
+    u2 *bitmaps = (u2 *)&code[7];  // the bitmap follows the code
+    bitmaps[0] = 1;                // r0
+    code[0] = BcIns::abc(BcIns::kALLOC, 5, 4, 2);
+    code[1] = BcIns::args(6, 6, 0, 0);
+    code[2] = BcIns::bitmapOffset(byteOffset32(&code[2], &bitmaps[0]));
+    code[3] = BcIns::abc(BcIns::kADDRR, 1, 1, 3);
+    code[4] = BcIns::ad(BcIns::kISLT, 1, 2);
+    code[5] = BcIns::aj(BcIns::kJMP, 0, -6);
+    code[6] = BcIns::ad(BcIns::kSTOP, 0, 0);
+    Thread *T = Thread::createThread(&cap, 1U << 10);
+
+    Time gcBefore = gc_time;
+    Time start = getProcessElapsedTime();
+    for (u4 round = 0; round < kRounds; ++round) {
+      T->top_ = T->base() + 7;
+      T->setPC(&code[0]);
+      T->setSlot(0, (Word)buildTree(&mm, node, kDepth));
+      T->setSlot(1, 0);
+      T->setSlot(2, kGarbage);
+      T->setSlot(3, 1);
+      T->setSlot(4, (Word)node);
+      T->setSlot(6, (Word)MiscClosures::stg_STOP_closure_addr);
+      ASSERT_TRUE(cap.run(T));
+    }
+    Time total = getProcessElapsedTime() - start;
+    Time gc = gc_time - gcBefore;
+    cerr << "--gc-threads=" << kThreads[t] << ": "
+         << mm.numGCs() << " GCs (" << mm.numMajorGCs() << " major), GC "
+         << TimeToUS(gc) / 1000 << "ms (" << TimeToUS(gc / kRounds)
+         << "us per tree), total " << TimeToUS(total) / 1000 << "ms\n";
+    delete T;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
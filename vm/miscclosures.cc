@@ -2,6 +2,7 @@
 
 #include <string.h>
 #include <iostream>
+#include <pthread.h>
 
 _START_LAMBDACHINE_NAMESPACE
 
@@ -11,7 +12,17 @@ using namespace HASH_NAMESPACE;
 Closure *MiscClosures::stg_UPD_closure_addr = NULL;
 BcIns *MiscClosures::stg_UPD_return_pc = NULL;
 Closure *MiscClosures::stg_STOP_closure_addr = NULL;
+Closure *MiscClosures::stg_UNDERFLOW_closure_addr = NULL;
+BcIns *MiscClosures::stg_UNDERFLOW_return_pc = NULL;
 InfoTable *MiscClosures::stg_IND_info = NULL;
+Closure *MiscClosures::stg_FORK_closure_addr = NULL;
+Closure *MiscClosures::stg_EVAL_closure_addr = NULL;
+Closure *MiscClosures::stg_CATCH_closure_addr = NULL;
+BcIns *MiscClosures::stg_CATCH_handler_pc = NULL;
+InfoTable *MiscClosures::stg_RAISE_info = NULL;
+InfoTable *MiscClosures::stg_MVAR_info = NULL;
+Closure *MiscClosures::stg_NO_VALUE_closure_addr = NULL;
+InfoTable *MiscClosures::stg_THREADID_info = NULL;
 MiscClosures::ApContInfo *MiscClosures::smallApConts = NULL;
 HASH_MAP_CLASS<u4, MiscClosures::ApContInfo> *MiscClosures::otherApConts = NULL;
 MemoryManager *MiscClosures::allocMM = NULL;
@@ -20,6 +31,11 @@ InfoTable **MiscClosures::smallApInfos = NULL;
 APMAP *MiscClosures::otherApInfos = NULL;
 Closure *MiscClosures::stg_BLACKHOLE_closure_addr = NULL;
 InfoTable *MiscClosures::stg_BYTEARR_info = NULL;
+InfoTable *MiscClosures::stg_MUT_ARR_info = NULL;
+InfoTable *MiscClosures::stg_ARR_info = NULL;
+InfoTable *MiscClosures::stg_SMALLINT_info = NULL;
+InfoTable *MiscClosures::stg_BIGPOS_info = NULL;
+InfoTable *MiscClosures::stg_BIGNEG_info = NULL;
 
 void MiscClosures::initStopClosure(MemoryManager &mm) {
   AllocInfoTableHandle hdl(mm);
@@ -79,6 +95,7 @@ void MiscClosures::initBlackholeClosure(MemoryManager &mm) {
   BcIns *code = info->code_.code;
   //  u2 *bitmasks = cast(u2 *, code + info->code_.sizecode);
   code[0] = BcIns::ad(BcIns::kSTOP, 1, 0);
+  info->blackholeInfo_ = NULL;
 
   Closure *stg_BLACKHOLE_closure = mm.allocStaticClosure(0);
   stg_BLACKHOLE_closure->setInfo((InfoTable *)info);
@@ -129,6 +146,229 @@ void MiscClosures::initUpdateClosure(MemoryManager &mm) {
   MiscClosures::stg_UPD_closure_addr = stg_UPD_closure;
 }
 
+void MiscClosures::initUnderflowClosure(MemoryManager &mm) {
+  AllocInfoTableHandle hdl(mm);
+  CodeInfoTable *info = static_cast<FuncInfoTable *>
+    (mm.allocInfoTable(hdl, wordsof(FuncInfoTable)));
+  info->type_ = FUN;
+  info->size_ = 1;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_UNDERFLOW";
+  info->code_.framesize = 1;
+  info->code_.arity = 0;
+  info->code_.sizecode = 3;
+  info->code_.sizelits = 0;
+  info->code_.sizebitmaps = 2;
+  info->code_.lits = NULL;
+  info->code_.littypes = NULL;
+  info->code_.code = static_cast<BcIns *>
+                     (mm.allocCode(info->code_.sizecode, info->code_.sizebitmaps));
+  BcIns *code = info->code_.code;
+  u2 *bitmasks = cast(u2 *, code + info->code_.sizecode);
+
+  // never executed, only for the bitmasks
+  code[0] = BcIns::ad(BcIns::kEVAL, 0, 0);
+  code[1] = BcIns::bitmapOffset(byteOffset32(&code[1], bitmasks));
+  code[2] = BcIns::ad(BcIns::kUNDERFLOW, 0, 0);
+  // r0 holds the top of the caller's frame; it is not a pointer.
+  bitmasks[0] = 0;
+  bitmasks[1] = 0;
+
+  MiscClosures::stg_UNDERFLOW_return_pc = &code[2];
+
+  Closure *stg_UNDERFLOW_closure = mm.allocStaticClosure(0);
+  stg_UNDERFLOW_closure->setInfo((InfoTable *)info);
+  MiscClosures::stg_UNDERFLOW_closure_addr = stg_UNDERFLOW_closure;
+}
+
+void MiscClosures::initForkClosure(MemoryManager &mm) {
+  AllocInfoTableHandle hdl(mm);
+  CodeInfoTable *info = static_cast<FuncInfoTable *>
+    (mm.allocInfoTable(hdl, wordsof(FuncInfoTable)));
+  info->type_ = FUN;
+  info->size_ = 1;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_FORK";
+  info->code_.framesize = 2;
+  info->code_.arity = 1;
+  info->code_.sizecode = 7;
+  info->code_.sizelits = 0;
+  info->code_.sizebitmaps = 4;
+  info->code_.lits = NULL;
+  info->code_.littypes = NULL;
+  info->code_.code = static_cast<BcIns *>
+                     (mm.allocCode(info->code_.sizecode, info->code_.sizebitmaps));
+  BcIns *code = info->code_.code;
+  u2 *bitmasks = cast(u2 *, code + info->code_.sizecode);
+
+  // A new thread starts at the YIELD, which the scheduler skips.
+  // r0 = the IO action, r1 = the State# token.
+  code[0] = BcIns::ad(BcIns::kYIELD, 0, 0);
+  code[1] = BcIns::bitmapOffset(byteOffset32(&code[1], &bitmasks[0]));
+  code[2] = BcIns::abc(BcIns::kCALL, 0, 0, 1);
+  code[3] = BcIns::pointerInfo(0);
+  code[4] = BcIns::args(1, 0, 0, 0);
+  code[5] = BcIns::bitmapOffset(byteOffset32(&code[5], &bitmasks[2]));
+  code[6] = BcIns::ad(BcIns::kSTOP, 0, 0);
+  bitmasks[0] = 1;  // r0 is live and a pointer
+  bitmasks[1] = 1;
+  bitmasks[2] = 0;
+  bitmasks[3] = 0;
+
+  Closure *stg_FORK_closure = mm.allocStaticClosure(0);
+  stg_FORK_closure->setInfo((InfoTable *)info);
+  MiscClosures::stg_FORK_closure_addr = stg_FORK_closure;
+}
+
+void MiscClosures::initEvalClosure(MemoryManager &mm) {
+  AllocInfoTableHandle hdl(mm);
+  CodeInfoTable *info = static_cast<FuncInfoTable *>
+    (mm.allocInfoTable(hdl, wordsof(FuncInfoTable)));
+  info->type_ = FUN;
+  info->size_ = 1;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_EVAL";
+  info->code_.framesize = 1;
+  info->code_.arity = 1;
+  info->code_.sizecode = 4;
+  info->code_.sizelits = 0;
+  info->code_.sizebitmaps = 0;
+  info->code_.lits = NULL;
+  info->code_.littypes = NULL;
+  info->code_.code = static_cast<BcIns *>
+                     (mm.allocCode(info->code_.sizecode, info->code_.sizebitmaps));
+  BcIns *code = info->code_.code;
+
+  code[0] = BcIns::ad(BcIns::kEVAL, 0, 0);
+  code[1] = BcIns::bitmapOffset(0);  // no live-outs
+  code[2] = BcIns::ad(BcIns::kMOV_RES, 0, 0);
+  code[3] = BcIns::ad(BcIns::kRET1, 0, 0);
+
+  Closure *stg_EVAL_closure = mm.allocStaticClosure(0);
+  stg_EVAL_closure->setInfo((InfoTable *)info);
+  MiscClosures::stg_EVAL_closure_addr = stg_EVAL_closure;
+}
+
+void MiscClosures::initCatchClosure(MemoryManager &mm) {
+  AllocInfoTableHandle hdl(mm);
+  CodeInfoTable *info = static_cast<FuncInfoTable *>
+    (mm.allocInfoTable(hdl, wordsof(FuncInfoTable)));
+  info->type_ = FUN;
+  info->size_ = 1;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_CATCH";
+  info->code_.framesize = CATCH_frame_size;
+  info->code_.arity = 3;
+  info->code_.sizecode = 8;
+  info->code_.sizelits = 0;
+  info->code_.sizebitmaps = 2;
+  info->code_.lits = NULL;
+  info->code_.littypes = NULL;
+  info->code_.code = static_cast<BcIns *>
+                     (mm.allocCode(info->code_.sizecode, info->code_.sizebitmaps));
+  BcIns *code = info->code_.code;
+  u2 *bitmasks = cast(u2 *, code + info->code_.sizecode);
+
+  // r0 = the handler, r1 = the IO action, r2 = the State# token.
+  // CATCH pushes the frame and starts at the CALL.  If the action
+  // returns, so does the frame.
+  code[0] = BcIns::abc(BcIns::kCALL, 1, 0, 1);
+  code[1] = BcIns::pointerInfo(0);
+  code[2] = BcIns::args(2, 0, 0, 0);
+  code[3] = BcIns::bitmapOffset(byteOffset32(&code[3], &bitmasks[0]));
+  code[4] = BcIns::ad(BcIns::kMOV_RES, 1, 0);
+  code[5] = BcIns::ad(BcIns::kRET1, 1, 0);
+  // RAISE continues here with r0 = the exception, r1 = a State#
+  // token and r2 = the handler.  The handler replaces the frame.
+  code[6] = BcIns::abc(BcIns::kCALLT, 2, 0xff, 2);
+  code[7] = BcIns::pointerInfo(1);
+  bitmasks[0] = 1;  // r0 is live and a pointer
+  bitmasks[1] = 1;
+
+  MiscClosures::stg_CATCH_handler_pc = &code[6];
+
+  Closure *stg_CATCH_closure = mm.allocStaticClosure(0);
+  stg_CATCH_closure->setInfo((InfoTable *)info);
+  MiscClosures::stg_CATCH_closure_addr = stg_CATCH_closure;
+}
+
+void MiscClosures::initRaiseItbl(MemoryManager &mm) {
+  AllocInfoTableHandle hdl(mm);
+  CodeInfoTable *info = static_cast<CodeInfoTable *>
+    (mm.allocInfoTable(hdl, wordsof(CodeInfoTable)));
+  info->type_ = THUNK;
+  info->size_ = 1;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 1;
+  info->name_ = "stg_RAISE";
+  info->code_.framesize = 1;
+  info->code_.arity = 0;
+  info->code_.sizecode = 3;
+  info->code_.sizelits = 0;
+  info->code_.sizebitmaps = 0;
+  info->code_.lits = NULL;
+  info->code_.littypes = NULL;
+  info->code_.code = static_cast<BcIns *>
+                     (mm.allocCode(info->code_.sizecode, info->code_.sizebitmaps));
+  BcIns *code = info->code_.code;
+  code[0] = BcIns::ad(BcIns::kIFUNC, 1, 0);
+  code[1] = BcIns::ad(BcIns::kLOADFV, 0, 1);
+  code[2] = BcIns::ad(BcIns::kRAISE, 0, 0);
+
+  buildBlackholeInfo(&mm, info);
+  MiscClosures::stg_RAISE_info = info;
+}
+
+InfoTable *MiscClosures::buildBlackholeInfo(MemoryManager *mm,
+                                            CodeInfoTable *thunk) {
+  LC_ASSERT(thunk->type() == THUNK);
+  AllocInfoTableHandle hdl(*mm);
+  CodeInfoTable *info = static_cast<CodeInfoTable *>
+    (mm->allocInfoTable(hdl, wordsof(CodeInfoTable)));
+  *info = *thunk;
+  info->type_ = BLACKHOLE;
+  info->blackholeInfo_ = thunk;
+  thunk->blackholeInfo_ = info;
+  return info;
+}
+
+void MiscClosures::initThreadInfos(MemoryManager &mm) {
+  AllocInfoTableHandle hdl(mm);
+  InfoTable *info = static_cast<InfoTable *>
+    (mm.allocInfoTable(hdl, wordsof(InfoTable)));
+  info->type_ = MVAR;
+  info->size_ = wordsof(MVarClosure) - wordsof(ClosureHeader);
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 1;  // only the value, the queue is not on the heap
+  info->name_ = "stg_MVAR";
+  MiscClosures::stg_MVAR_info = info;
+
+  info = static_cast<InfoTable *>
+    (mm.allocInfoTable(hdl, wordsof(InfoTable)));
+  info->type_ = CONSTR;
+  info->size_ = 1;
+  info->tagOrBitmap_ = 1;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_ThreadId";
+  MiscClosures::stg_THREADID_info = info;
+
+  // Pointers to it are never tagged.
+  info = static_cast<InfoTable *>
+    (mm.allocInfoTable(hdl, wordsof(InfoTable)));
+  info->type_ = CONSTR;
+  info->size_ = 0;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_NO_VALUE";
+  Closure *stg_NO_VALUE_closure = mm.allocStaticClosure(0);
+  stg_NO_VALUE_closure->setInfo(info);
+  MiscClosures::stg_NO_VALUE_closure_addr = stg_NO_VALUE_closure;
+}
+
 void MiscClosures::initByteArrInfo(MemoryManager &mm)
 {
   AllocInfoTableHandle hdl(mm);
@@ -143,6 +383,61 @@ void MiscClosures::initByteArrInfo(MemoryManager &mm)
   MiscClosures::stg_BYTEARR_info = info;
 }
 
+void MiscClosures::initArrayInfos(MemoryManager &mm)
+{
+  AllocInfoTableHandle hdl(mm);
+  InfoTable *info = static_cast<InfoTable*>
+    (mm.allocInfoTable(hdl, wordsof(InfoTable)));
+  info->type_ = ARRAY;
+  info->size_ = 0;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_MUT_ARR";
+  MiscClosures::stg_MUT_ARR_info = info;
+
+  info = static_cast<InfoTable*>
+    (mm.allocInfoTable(hdl, wordsof(InfoTable)));
+  info->type_ = ARRAY;
+  info->size_ = 0;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_ARR";
+  MiscClosures::stg_ARR_info = info;
+}
+
+void MiscClosures::initIntegerInfos(MemoryManager &mm)
+{
+  AllocInfoTableHandle hdl(mm);
+  InfoTable *info = static_cast<InfoTable*>
+    (mm.allocInfoTable(hdl, wordsof(InfoTable)));
+  info->type_ = CONSTR;
+  info->size_ = 1;
+  info->tagOrBitmap_ = 1;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_SMALLINT";
+  MiscClosures::stg_SMALLINT_info = info;
+
+  // Big integers are byte arrays of limbs.  The sign is in the info
+  // table.
+  info = static_cast<InfoTable*>
+    (mm.allocInfoTable(hdl, wordsof(InfoTable)));
+  info->type_ = LARGE;
+  info->size_ = 0;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_BIGPOS";
+  MiscClosures::stg_BIGPOS_info = info;
+
+  info = static_cast<InfoTable*>
+    (mm.allocInfoTable(hdl, wordsof(InfoTable)));
+  info->type_ = LARGE;
+  info->size_ = 0;
+  info->tagOrBitmap_ = 0;
+  info->layout_.bitmap = 0;
+  info->name_ = "stg_BIGNEG";
+  MiscClosures::stg_BIGNEG_info = info;
+}
+
 void MiscClosures::initIndirectionItbl(MemoryManager &mm) {
   AllocInfoTableHandle hdl(mm);
   InfoTable *info = static_cast<InfoTable *>
@@ -274,6 +569,10 @@ void MiscClosures::initApConts(MemoryManager *mm) {
   otherApConts = new HASH_NAMESPACE::HASH_MAP_CLASS<u4, ApContInfo>(20);
 }
 
+// Protects the tables of application continuations and info tables
+// for larger arities, which are built on demand by any capability.
+static pthread_mutex_t apLock = PTHREAD_MUTEX_INITIALIZER;
+
 void MiscClosures::getApCont(Closure **closure, BcIns **returnAddr,
                              u4 nargs, u4 pointerMask) {
   LC_ASSERT(nargs > 0);
@@ -282,6 +581,7 @@ void MiscClosures::getApCont(Closure **closure, BcIns **returnAddr,
     *closure = inf->closure;
     *returnAddr = inf->returnAddr;
   } else {
+    pthread_mutex_lock(&apLock);
     u4 index = apContIndex(nargs, pointerMask);
     APKMAP::iterator i = otherApConts->find(index);
     if (i != otherApConts->end()) {
@@ -296,6 +596,7 @@ void MiscClosures::getApCont(Closure **closure, BcIns **returnAddr,
       *returnAddr = inf.returnAddr;
       (*otherApConts)[index] = inf;
     }
+    pthread_mutex_unlock(&apLock);
   }
 }
 
@@ -333,7 +634,7 @@ InfoTable *MiscClosures::buildApInfo(MemoryManager *mm, u4 nargs, u4 pointerMask
     (mm->allocInfoTable(hdl, wordsof(CodeInfoTable)));
   info->type_ = THUNK;
   info->size_ = 1 + nargs;
-  info->tagOrBitmap_ = (pointerMask << 1) | 1u;
+  info->tagOrBitmap_ = 0;  // No SRT.
   info->layout_.bitmap = (pointerMask << 1) | 1u;
 
   char buf[50];
@@ -369,6 +670,7 @@ InfoTable *MiscClosures::buildApInfo(MemoryManager *mm, u4 nargs, u4 pointerMask
   code[2 + nargs] = BcIns::abc(BcIns::kCALLT, nargs, 0xff, nargs);
   code[3 + nargs] = BcIns::pointerInfo(pointerMask);
 
+  buildBlackholeInfo(mm, info);
   return info;
 }
 
@@ -387,16 +689,16 @@ InfoTable *MiscClosures::getApInfo(u4 nargs, u4 pointerMask) {
   if (LC_LIKELY(nargs <= kMaxSmallArity)) {
     return smallApInfos[apContIndex(nargs, pointerMask)];
   } else {
+    pthread_mutex_lock(&apLock);
     u4 index = apContIndex(nargs, pointerMask);
     InfoTable *itbl = (*otherApInfos)[index];
-    if (LC_LIKELY(itbl != NULL)) {
-      return itbl;
-    } else {
+    if (LC_UNLIKELY(itbl == NULL)) {
       itbl = buildApInfo(allocMM, nargs, pointerMask);
       LC_ASSERT(itbl != NULL);
       (*otherApInfos)[index] = itbl;
-      return itbl;
     }
+    pthread_mutex_unlock(&apLock);
+    return itbl;
   }
 }
 
@@ -405,7 +707,15 @@ void MiscClosures::init(MemoryManager *mm) {
   MiscClosures::initStopClosure(*mm);
   MiscClosures::initBlackholeClosure(*mm);
   MiscClosures::initByteArrInfo(*mm);
+  MiscClosures::initArrayInfos(*mm);
+  MiscClosures::initIntegerInfos(*mm);
   MiscClosures::initUpdateClosure(*mm);
+  MiscClosures::initUnderflowClosure(*mm);
+  MiscClosures::initForkClosure(*mm);
+  MiscClosures::initEvalClosure(*mm);
+  MiscClosures::initCatchClosure(*mm);
+  MiscClosures::initRaiseItbl(*mm);
+  MiscClosures::initThreadInfos(*mm);
   MiscClosures::initIndirectionItbl(*mm);
   MiscClosures::initApConts(mm);
   MiscClosures::initPapItbl(mm);
@@ -417,7 +727,22 @@ void MiscClosures::reset() {
   MiscClosures::stg_BLACKHOLE_closure_addr = NULL;
   MiscClosures::stg_UPD_return_pc = NULL;
   MiscClosures::stg_UPD_closure_addr = NULL;
+  MiscClosures::stg_UNDERFLOW_return_pc = NULL;
+  MiscClosures::stg_UNDERFLOW_closure_addr = NULL;
   MiscClosures::stg_IND_info = NULL;
+  MiscClosures::stg_FORK_closure_addr = NULL;
+  MiscClosures::stg_EVAL_closure_addr = NULL;
+  MiscClosures::stg_CATCH_closure_addr = NULL;
+  MiscClosures::stg_CATCH_handler_pc = NULL;
+  MiscClosures::stg_RAISE_info = NULL;
+  MiscClosures::stg_MVAR_info = NULL;
+  MiscClosures::stg_NO_VALUE_closure_addr = NULL;
+  MiscClosures::stg_THREADID_info = NULL;
+  MiscClosures::stg_MUT_ARR_info = NULL;
+  MiscClosures::stg_ARR_info = NULL;
+  MiscClosures::stg_SMALLINT_info = NULL;
+  MiscClosures::stg_BIGPOS_info = NULL;
+  MiscClosures::stg_BIGNEG_info = NULL;
   delete[] MiscClosures::smallApConts;
   MiscClosures::smallApConts = NULL;
   delete MiscClosures::otherApConts;
@@ -28,18 +28,63 @@ public:
   }
   static InfoTable *getApInfo(u4 nargs, u4 pointerMask);
 
+  /// Create the blackhole info table of a thunk info table.  See
+  /// "Blackholing" in objects.hh.
+  static InfoTable *buildBlackholeInfo(MemoryManager *mm,
+                                       CodeInfoTable *thunk);
+
   static Closure *stg_UPD_closure_addr;
   static BcIns *stg_UPD_return_pc;
   static const uint32_t UPD_frame_size = 2;
 
   static Closure *stg_BLACKHOLE_closure_addr;
 
+  /// The node and return address of the frame at the bottom of each
+  /// stack chunk except the first.  See "Stack Chunks" in thread.hh.
+  static Closure *stg_UNDERFLOW_closure_addr;
+  static BcIns *stg_UNDERFLOW_return_pc;
+
   static Closure *stg_STOP_closure_addr;
+
+  /// The node of the bottom frame of a forked thread.  It calls the
+  /// thread's IO action and stops the thread when it returns.
+  static Closure *stg_FORK_closure_addr;
+
+  /// The node of a frame that evaluates its only slot and returns
+  /// the result.  Used to evaluate a thunk that is applied to
+  /// arguments once thunks are blackholed.
+  static Closure *stg_EVAL_closure_addr;
+
+  /// The node of a catch frame.  See "Exceptions" in capability.hh.
+  static Closure *stg_CATCH_closure_addr;
+  static const uint32_t CATCH_frame_size = 3;
+  /// Where a catch frame continues when it catches an exception.
+  static BcIns *stg_CATCH_handler_pc;
+  /// A thunk that raises the exception in its only payload word.
+  /// Thunks whose evaluation was aborted by an exception are
+  /// overwritten with it.
+  static InfoTable *stg_RAISE_info;
+
+  static InfoTable *stg_MVAR_info;
+  /// The contents of an empty MVar.
+  static Closure *stg_NO_VALUE_closure_addr;
+  /// Result of FORK.  The only payload word is the thread ID.
+  static InfoTable *stg_THREADID_info;
   static InfoTable *stg_IND_info;
   static InfoTable *stg_PAP_info;
 
   static InfoTable *stg_BYTEARR_info;
 
+  /// Boxed arrays, see ArrayClosure.  Freezing and thawing an array
+  /// only changes its info table.
+  static InfoTable *stg_MUT_ARR_info;
+  static InfoTable *stg_ARR_info;
+
+  /// Integers.  See integer.hh.
+  static InfoTable *stg_SMALLINT_info;
+  static InfoTable *stg_BIGPOS_info;
+  static InfoTable *stg_BIGNEG_info;
+
 private:
   typedef struct {
     Closure *closure;
@@ -63,8 +108,16 @@ private:
   static void initStopClosure(MemoryManager &mm);
   static void initBlackholeClosure(MemoryManager &mm);
   static void initUpdateClosure(MemoryManager &mm);
+  static void initUnderflowClosure(MemoryManager &mm);
+  static void initForkClosure(MemoryManager &mm);
+  static void initEvalClosure(MemoryManager &mm);
+  static void initCatchClosure(MemoryManager &mm);
+  static void initRaiseItbl(MemoryManager &mm);
+  static void initThreadInfos(MemoryManager &mm);
   static void initIndirectionItbl(MemoryManager &mm);
   static void initByteArrInfo(MemoryManager &mm);
+  static void initArrayInfos(MemoryManager &mm);
+  static void initIntegerInfos(MemoryManager &mm);
   static void initPapItbl(MemoryManager *mm);
   static void initApConts(MemoryManager *mm);
   static void initApInfos(MemoryManager *mm);
@@ -72,6 +125,8 @@ private:
                           u4 nargs, u4 pointerMask);
   static InfoTable* buildApInfo(MemoryManager *mm, u4 nargs,
                                 u4 pointerMask);
+
+  friend class Image;
 };
 
 _END_LAMBDACHINE_NAMESPACE
@@ -10,7 +10,13 @@ const u2 closureFlags[] = {
   CTDEF(DEFFLAG)
 };
 
+const char *const closureTypeNames[] = {
+# define DEFNAME(name, _) #name,
+  CTDEF(DEFNAME)
+};
+
 void printClosure(ostream &out, Closure *cl, bool oneline) {
+  cl = untag(cl);
   const InfoTable *info = cl->info();
 
   if (!info) {
@@ -20,7 +26,7 @@ void printClosure(ostream &out, Closure *cl, bool oneline) {
   }
 
   while (info->type() == IND) {
-    cl = (Closure *)cl->payload(0);
+    cl = untag(cl->payload(0));
     info = cl->info();
     out << "IND -> ";
   }
@@ -41,6 +47,7 @@ void printClosure(ostream &out, Closure *cl, bool oneline) {
 void
 printClosureShort(ostream &out, Closure *cl)
 {
+  cl = untag(cl);
   const InfoTable *info = cl->info();
 
   if (!info) {
@@ -51,7 +58,7 @@ printClosureShort(ostream &out, Closure *cl)
   out << '[' << COL_BLUE;
   while (info->type() == IND) {
     out << (void *)cl << "->";
-    cl = (Closure *)cl->payload(0);
+    cl = untag(cl->payload(0));
     info = cl->info();
   }
   out << (void *)cl << COL_RESET << '=';
@@ -131,7 +138,10 @@ void Code::printLiteral(std::ostream &out, u4 litid) const {
     out << (Word)lit << " (w)";
     break;
   case LIT_FLOAT:
-    out << (float)lit << " (w)";
+    out << lc_w2f(lit) << " (f)";
+    break;
+  case LIT_DOUBLE:
+    out << lc_w2d(lit) << " (d)";
     break;
   case LIT_CHAR:
     if (lit < 256)
@@ -152,7 +162,7 @@ void Code::printLiteral(std::ostream &out, u4 litid) const {
     break;
   }
   case LIT_CLOSURE: {
-    const Closure *cl = (const Closure *)lit;
+    const Closure *cl = untag(lit);
     if (cl != NULL && cl->info() != NULL) {
       out << "clos " << cl << " (" << cl->info()->name() << ")";
     } else {
@@ -160,6 +170,9 @@ void Code::printLiteral(std::ostream &out, u4 litid) const {
     }
     break;
   }
+  case LIT_CFUNC:
+    out << "cfunc " << (const void *)lit;
+    break;
   default:
     out << "???";
   }
@@ -189,8 +202,9 @@ static void printArgPointers(ostream &out, const u2 *bitmap, u4 arity) {
 bool
 isConstructor(Closure *cl)
 {
+  cl = untag(cl);
   while (cl->isIndirection()) {
-    cl = (Closure *)cl->payload(0);
+    cl = untag(cl->payload(0));
   }
   return cl->info()->type() == CONSTR;
 }
@@ -2,9 +2,11 @@
 #define _OBJECTS_H_
 
 #include "common.hh"
+#include "vm.hh"
 #include "bytecode.hh"
 
 #include <iostream>
+#include <string.h>
 
 _START_LAMBDACHINE_NAMESPACE
 
@@ -30,10 +32,11 @@ typedef enum {
   LIT_WORD,   /* Word-sized unsigned integer */
   //  LIT_WORD64, /* Unsigned integer of at least 64 bits */
   LIT_FLOAT,  /* 32 bit floating point number */
-  //  LIT_DOUBLE, /* 64 bit floating point number */
+  LIT_DOUBLE, /* 64 bit floating point number */
   LIT_CLOSURE, /* Reference to a (static) closure. */
   LIT_INFO,     /* Reference to an info table. */
-  LIT_PC        /* Not actually used by bytecode, only by trace recorder. */
+  LIT_PC,       /* Not actually used by bytecode, only by trace recorder. */
+  LIT_CFUNC     /* Address of a C function, see ffi.hh. */
 } LitType;
 
 typedef union {
@@ -63,7 +66,9 @@ typedef union {
   _(AP_CONT,        HNF) \
   _(STATIC_IND,     IND) \
   _(UPDATE_FRAME,   ___) \
-  _(BLACKHOLE,      ___)
+  _(BLACKHOLE,      ___) \
+  _(MVAR,           HNF) \
+  _(ARRAY,          HNF)
 
 #define DEF_CLOS_TY(name, flags) name,
 typedef enum _ClosureType {
@@ -73,6 +78,11 @@ typedef enum _ClosureType {
 #undef DEF_CLOS_TY
 
 extern const u2 closureFlags[];
+extern const char *const closureTypeNames[];
+
+inline const char *closureTypeName(ClosureType type) {
+  return type < N_CLOSURE_TYPES ? closureTypeNames[type] : "?";
+}
 
 class InfoTable {
 public:
@@ -81,6 +91,16 @@ public:
   inline bool hasCode() const { return (kHasCodeBitmap & (1 << type())) != 0; }
   inline const ClosureInfo layout() const { return layout_; }
   inline u4 size() const { return size_; }
+  // For FUN/THUNK/CAF: bit i is set if literal i of the code refers to
+  // a static closure or an info table (whose code may in turn refer to
+  // static closures).  Bit 15 is set if any literal with index >= 15
+  // does.  This is our SRT: the GC uses it to find the CAFs that are
+  // still reachable from code.
+  inline u2 srtBitmap() const { return tagOrBitmap_; }
+  static const u2 kSrtOverflowBit = 1u << 15;
+  // The tag to put into the low bits of pointers to objects with
+  // this info table.  See "Pointer Tagging" below.
+  inline Word pointerTag() const;
   void debugPrint(std::ostream&) const;
   static void printPayload(std::ostream&, u4 bitmap, u4 size);
 private:
@@ -96,6 +116,7 @@ private:
   const char *name_;
   friend class Loader;
   friend class MiscClosures;
+  friend class Image;
   friend struct _Closure;
 };
 
@@ -105,12 +126,18 @@ class ConInfoTable : public InfoTable {
 class CodeInfoTable : public InfoTable {
 public:
   inline const Code *code() const { return &code_; }
+  // THUNK: the info table of the same thunk while it is being
+  // evaluated (see "Blackholing" below), or NULL if it cannot be
+  // blackholed.  BLACKHOLE: the original info table.
+  inline InfoTable *blackholeInfo() const { return blackholeInfo_; }
   void printCode(std::ostream&) const;
   void printLiteral(std::ostream&, u4 litid) const;
 private:
   Code code_;
+  InfoTable *blackholeInfo_;
   friend class Loader;
   friend class MiscClosures;
+  friend class Image;
 };
 
 typedef CodeInfoTable FuncInfoTable;
@@ -158,8 +185,77 @@ public:
   inline bool isHNF() const {
     return closureFlags[info()->type()] & CF_HNF;
   }
+  // Replace the thunk's info table by its blackhole info table.
+  // Fails if another thread has changed the info table first, i.e.,
+  // blackholed or updated the thunk.
+  inline bool tryClaim(InfoTable *info, InfoTable *blackholeInfo) {
+    return __atomic_compare_exchange_n(&header_.info_, &info, blackholeInfo,
+                                       false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE);
+  }
 };
 
+// --- Blackholing -----------------------------------------------------
+//
+// Once more than one capability shares the heap (see "Capabilities"
+// in capability.hh), a thunk is blackholed when a thread starts to
+// evaluate it: EVAL atomically replaces its info table by a copy of
+// type BLACKHOLE (CodeInfoTable::blackholeInfo).  The copy has the
+// same layout and code, so the thunk's frame and the GC work as
+// before.  A thread that finds a blackhole waits until the owner has
+// updated it.  Without blackholing two threads could evaluate the
+// same thunk, and the update by one of them would overwrite the free
+// variables the other one is still reading.
+//
+// CAFs are never blackholed.  They have no free variables, so
+// evaluating them twice is only a waste of time.
+
+// --- Pointer Tagging -------------------------------------------------
+//
+// Closures are word-aligned, so the low three bits of a pointer to a
+// closure are free.  A pointer to an evaluated constructor may carry
+// its constructor tag in these bits, so that EVAL and CASE need not
+// look at the object (and its info table) at all:
+//
+//   0      Nothing known.  The object may be a thunk or indirection.
+//   1..6   The object is a constructor with that tag.
+//   7      The object is a constructor with a tag >= 7.  The tag must
+//          be read from the info table.
+//
+// Only constructors are tagged.  Pointers are tagged when EVAL
+// returns a constructor, by the GC when it copies or visits one, and
+// by the loader for references to static constructors.  Every other
+// pointer may be untagged, so any code that dereferences a closure
+// pointer that may have come from a register or from the heap must
+// untag it first.  Pointers to the node of a frame (base[-1]) are
+// never tagged.
+
+static const Word kTagBits = 3;
+static const Word kTagMask = (1 << kTagBits) - 1;
+
+inline Word ptrTag(Word p) { return p & kTagMask; }
+inline Closure *untag(Word p) { return (Closure *)(p & ~kTagMask); }
+inline Closure *untag(Closure *p) { return untag((Word)p); }
+
+inline Word InfoTable::pointerTag() const {
+  if (type() != CONSTR)
+    return 0;
+  return tagOrBitmap_ < kTagMask ? tagOrBitmap_ : kTagMask;
+}
+
+// Tag a pointer to an untagged closure in HNF.
+inline Word tagPointer(Closure *cl) {
+  return (Word)cl | cl->info()->pointerTag();
+}
+
+// The constructor tag of a possibly tagged pointer to a constructor.
+inline u2 constructorTag(Word p) {
+  Word t = ptrTag(p);
+  if (t != 0 && t != kTagMask)
+    return (u2)t;
+  return untag(p)->tag();
+}
+
 typedef union {
   uint64_t combined;
   struct {
@@ -191,6 +287,67 @@ typedef struct {
   Word payload_[];
 } ByteArrayClosure;
 
+#define BYTEARRAY_PAYLOAD_OFFSET (offsetof(ByteArrayClosure, payload_))
+
+// A boxed array (Array# or MutableArray#).  The payload holds ptrs_
+// pointers and is followed by the card table, which has one byte for
+// each group of 2^kArrayCardBits elements.  A card is non-zero if one
+// of its elements may point into the young generation.  A minor GC
+// only scans the elements of dirty cards.
+//
+// Arrays are always allocated as large objects (see
+// MemoryManager::allocArray), so they never move.
+static const Word kArrayCardBits = 7;
+
+typedef struct _ArrayClosure {
+public:
+  ClosureHeader header_;
+  Word ptrs_;
+  Closure *payload_[];
+
+  static inline Word numCards(Word ptrs) {
+    return (ptrs + (1 << kArrayCardBits) - 1) >> kArrayCardBits;
+  }
+  // Size of an array with the given number of elements.
+  static inline Word allocBytes(Word ptrs) {
+    return sizeof(struct _ArrayClosure) + ptrs * sizeof(Word) +
+      roundUpBytesToWords(numCards(ptrs)) * sizeof(Word);
+  }
+  inline InfoTable *info() const { return header_.info(); }
+  inline u1 *cards() { return (u1 *)&payload_[ptrs_]; }
+  inline void markCard(Word i) { cards()[i >> kArrayCardBits] = 1; }
+  // Mark the cards of elements [i, i + n).
+  inline void markCards(Word i, Word n) {
+    if (n == 0) return;
+    Word first = i >> kArrayCardBits;
+    Word last = (i + n - 1) >> kArrayCardBits;
+    memset(cards() + first, 1, last - first + 1);
+  }
+} ArrayClosure;
+
+#define ARRAY_PTRS_OFFSET     (offsetof(ArrayClosure, ptrs_))
+#define ARRAY_PAYLOAD_OFFSET  (offsetof(ArrayClosure, payload_))
+LC_STATIC_ASSERT(is_word_aligned(ARRAY_PAYLOAD_OFFSET));
+
+// An MVar is either full or empty.  Threads blocked on an MVar are
+// kept in a FIFO queue linked through Thread::link_.  An empty MVar
+// points to a static sentinel (MiscClosures::stg_NO_VALUE_closure_addr),
+// so that the GC can treat value_ like any other pointer field.
+typedef struct _MVarClosure {
+public:
+  ClosureHeader header_;
+  Closure *value_;
+  Thread *head_;
+  Thread *tail_;
+  inline void init(InfoTable *info, Closure *empty) {
+    header_.info_ = info;
+    value_ = empty;
+    head_ = NULL;
+    tail_ = NULL;
+  }
+  inline InfoTable *info() const { return header_.info(); }
+} MVarClosure;
+
 #define PAP_PAYLOAD_OFFSET   (offsetof(PapClosure, payload_))
 #define PAP_FUNCTION_OFFSET  (offsetof(PapClosure, fun_))
 #define PAP_INFO_OFFSET      (offsetof(PapClosure, info_))
@@ -202,14 +359,19 @@ typedef struct _LargeObject {
 public:
   struct _LargeObject *prev_;
   struct _LargeObject *next_;
-  Word flags_;  // TODO: Currently this is only the mark bitmap.
-                // Better move that out of the object.
+  Word flags_;  // Bit 0 is the mark bit.  TODO: Better move that
+                // out of the object.
   Word payloadSize_;   // How many bytes follow this object?
   ClosureHeader header_;
 
   inline bool getMark() const { return flags_ & 1; }
   inline void setMark() { flags_ |= 1L; }
   inline void clearMark() { flags_ &= ~1L; }
+
+  // The object is a byte array whose payload is a mapped file (see
+  // MemoryManager::mapFile).
+  inline bool isMappedFile() const { return flags_ & 2; }
+  inline void setMappedFile() { flags_ |= 2L; }
 } LargeObject;
 
 inline Closure *
@@ -3,18 +3,38 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 
 _START_LAMBDACHINE_NAMESPACE
 
 typedef enum {
   OPT_PRINT_LOADER_STATE = 0x1000,
   OPT_TRACE_INTERPRETER,
-  OPT_PRINT_STATS
+  OPT_PRINT_STATS,
+  OPT_GC_THREADS,
+  OPT_GC_TARGET,
+  OPT_HEAP_PROFILE,
+  OPT_HEAP_PROFILE_INTERVAL,
+  OPT_ALLOC_PROFILE,
+  OPT_MAX_STACK,
+  OPT_CAPS,
+  OPT_SPARK_WORKERS,
+  OPT_SAVE_IMAGE,
+  OPT_LOAD_IMAGE
 } OptionFlags;
 
 #define MAX_CLOSURE_NAME_LEN 512
 #define MAX_STACK_SIZE (1024*1024)
 #define MIN_STACK_SIZE (1024*sizeof(Word))
+#define DEFAULT_STACK_CHUNK_SIZE (32*1024*sizeof(Word))
+#define DEFAULT_MAX_STACK_SIZE (1024L*1024*1024)
+#define MAX_GC_THREADS 64
+#define MAX_CAPS 64
+#define MAX_SPARK_WORKERS 64
+#define DEFAULT_GC_TARGET 20  /* percent */
+#define DEFAULT_HEAP_PROFILE_FILE "lcvm.hp"
+#define DEFAULT_HEAP_PROFILE_GCS 10
 
 long parseMemorySize(const char *str);
 
@@ -24,7 +44,18 @@ Options::Options()
     traceInterpreter_(false),
     printStats_(false),
     enableAsm_(1),
-    stackSize_(MIN_STACK_SIZE)
+    stackSize_(DEFAULT_STACK_CHUNK_SIZE),
+    maxStackSize_(DEFAULT_MAX_STACK_SIZE),
+    gcThreads_(1),
+    caps_(1),
+    sparkWorkers_(0),
+    nurserySize_(0),
+    suggestedHeapSize_(0),
+    maxHeapSize_(0),
+    gcTimeTarget_(DEFAULT_GC_TARGET / 100.0),
+    heapProfileGCs_(DEFAULT_HEAP_PROFILE_GCS),
+    heapProfileSeconds_(0),
+    allocProfile_(false)
 {
 }
 
@@ -48,14 +79,29 @@ Options *OptionParser::parse(int argc, char *argv[]) {
     {"help",               no_argument, 0, 'h'},
     {"step",               required_argument, 0, 'S'},
     {"stack",              required_argument, 0, 's'},
+    {"max-stack",          required_argument, NULL, OPT_MAX_STACK},
     {"trace",              no_argument, NULL, OPT_TRACE_INTERPRETER},
     {"print-stats",        no_argument, NULL, OPT_PRINT_STATS},
+    {"gc-threads",         required_argument, NULL, OPT_GC_THREADS},
+    {"caps",               required_argument, NULL, OPT_CAPS},
+    {"spark-workers",      required_argument, NULL, OPT_SPARK_WORKERS},
+    {"nursery",            required_argument, 0, 'A'},
+    {"heap-size",          required_argument, 0, 'H'},
+    {"max-heap",           required_argument, 0, 'M'},
+    {"gc-target",          required_argument, NULL, OPT_GC_TARGET},
+    {"heap-profile",       optional_argument, NULL, OPT_HEAP_PROFILE},
+    {"heap-profile-interval", required_argument, NULL,
+     OPT_HEAP_PROFILE_INTERVAL},
+    {"alloc-profile",      no_argument, NULL, OPT_ALLOC_PROFILE},
+    {"save-image",         required_argument, NULL, OPT_SAVE_IMAGE},
+    {"load-image",         required_argument, NULL, OPT_LOAD_IMAGE},
     {0, 0, 0, 0}
   };
 
   while (1) {
     int option_index = 0;
-    c = getopt_long(argc, argv, "he:B:O:", long_options, &option_index);
+    c = getopt_long(argc, argv, "he:B:O:A:H:M:", long_options,
+                    &option_index);
 
     if (c == -1)
       break;
@@ -78,6 +124,112 @@ Options *OptionParser::parse(int argc, char *argv[]) {
     case OPT_TRACE_INTERPRETER:
       opts()->traceInterpreter_ = true;
       break;
+    case OPT_GC_THREADS: {
+      char *end = NULL;
+      long n = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || n < 1 || n > MAX_GC_THREADS) {
+        fprintf(stderr, "Invalid number of GC threads: %s.  "
+                "Must be between 1 and %d.\n", optarg, MAX_GC_THREADS);
+        res = NULL;
+        goto ret;
+      }
+      opts()->gcThreads_ = (int)n;
+      break;
+    }
+    case OPT_CAPS: {
+      char *end = NULL;
+      long n = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || n < 1 || n > MAX_CAPS) {
+        fprintf(stderr, "Invalid number of capabilities: %s.  "
+                "Must be between 1 and %d.\n", optarg, MAX_CAPS);
+        res = NULL;
+        goto ret;
+      }
+      opts()->caps_ = (int)n;
+      break;
+    }
+    case OPT_SPARK_WORKERS: {
+      char *end = NULL;
+      long n = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || n < 0 || n > MAX_SPARK_WORKERS) {
+        fprintf(stderr, "Invalid number of spark workers: %s.  "
+                "Must be between 0 and %d.\n", optarg, MAX_SPARK_WORKERS);
+        res = NULL;
+        goto ret;
+      }
+      opts()->sparkWorkers_ = (int)n;
+      break;
+    }
+    case OPT_GC_TARGET: {
+      char *end = NULL;
+      long n = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || n < 0 || n > 99) {
+        fprintf(stderr, "Invalid GC time target: %s.  "
+                "Must be a percentage between 0 and 99.\n", optarg);
+        res = NULL;
+        goto ret;
+      }
+      opts()->gcTimeTarget_ = n / 100.0;
+      break;
+    }
+    case OPT_HEAP_PROFILE:
+      opts()->heapProfileFile_ =
+        optarg != NULL ? optarg : DEFAULT_HEAP_PROFILE_FILE;
+      break;
+    case OPT_ALLOC_PROFILE:
+      opts()->allocProfile_ = true;
+      break;
+    case OPT_SAVE_IMAGE:
+      opts()->saveImageFile_ = optarg;
+      break;
+    case OPT_LOAD_IMAGE:
+      opts()->loadImageFile_ = optarg;
+      break;
+    case OPT_MAX_STACK: {
+      long size = parseMemorySize(optarg);
+      if (size < 0) {
+        fprintf(stderr, "Could not parse memory size: %s\n", optarg);
+        res = NULL;
+        goto ret;
+      }
+      opts()->maxStackSize_ = size;
+      break;
+    }
+    case OPT_HEAP_PROFILE_INTERVAL: {
+      // Either a number of GCs ("10") or a time ("0.5s", "100ms").
+      char *end = NULL;
+      double n = strtod(optarg, &end);
+      if (end != optarg && n > 0 && *end == '\0' && n == (int)n) {
+        opts()->heapProfileGCs_ = (int)n;
+        opts()->heapProfileSeconds_ = 0;
+      } else if (end != optarg && n > 0 &&
+                 (!strcmp(end, "s") || !strcmp(end, "ms"))) {
+        opts()->heapProfileGCs_ = 0;
+        opts()->heapProfileSeconds_ = end[0] == 'm' ? n / 1000 : n;
+      } else {
+        fprintf(stderr, "Invalid heap profile interval: %s\n", optarg);
+        res = NULL;
+        goto ret;
+      }
+      break;
+    }
+    case 'A':
+    case 'H':
+    case 'M': {
+      long size = parseMemorySize(optarg);
+      if (size < 0) {
+        fprintf(stderr, "Could not parse memory size: %s\n", optarg);
+        res = NULL;
+        goto ret;
+      }
+      if (c == 'A')
+        opts()->nurserySize_ = size;
+      else if (c == 'H')
+        opts()->suggestedHeapSize_ = size;
+      else
+        opts()->maxHeapSize_ = size;
+      break;
+    }
     case 'e':
       fprintf(stderr, "entry = %s\n", optarg);
       opts()->entry_ = optarg;
@@ -90,6 +242,8 @@ Options *OptionParser::parse(int argc, char *argv[]) {
       opts()->stackSize_ = parseMemorySize(optarg);
       if (opts()->stackSize_ < 0) {
         fprintf(stderr, "Could not parse stack size.  Using default.\n");
+        opts()->stackSize_ = DEFAULT_STACK_CHUNK_SIZE;
+      } else if (opts()->stackSize_ < (long)MIN_STACK_SIZE) {
         opts()->stackSize_ = MIN_STACK_SIZE;
       }
       break;
@@ -119,7 +273,39 @@ Options *OptionParser::parse(int argc, char *argv[]) {
              "     --asm        Generate native code.\n"
              "  -B --base       Set loader base dir (default: cwd).\n"
              "                  Separate multiple paths with \":\""
-             "     --stack=SIZE Specify the stack size in bytes, valid units are K,M,b,G.\n"
+             "     --stack=SIZE Size of a stack chunk in bytes, valid units are K,M,b,G.\n"
+             "                  The stack grows by adding chunks (default: 256K).\n"
+             "     --max-stack=SIZE\n"
+             "                  Maximum stack size (default: 1G, 0 = unlimited).\n"
+             "     --gc-threads=N\n"
+             "                  Use N threads for garbage collection (default: 1).\n"
+             "     --caps=N     Evaluate the entry point N times in parallel, each on its\n"
+             "                  own capability and OS thread (default: 1).\n"
+             "     --spark-workers=N\n"
+             "                  Evaluate sparks (par#) on N additional OS threads (default: 0).\n"
+             "  -A --nursery=SIZE\n"
+             "                  Nursery size (default: based on the L2/L3 cache size).\n"
+             "  -H --heap-size=SIZE\n"
+             "                  Suggested heap size.  Unused heap is added to the nursery.\n"
+             "  -M --max-heap=SIZE\n"
+             "                  Maximum heap size (default: unlimited).\n"
+             "     --gc-target=PERCENT\n"
+             "                  Grow the nursery if more than PERCENT of the runtime is\n"
+             "                  spent in the GC (default: 20, 0 = never resize).\n"
+             "     --heap-profile[=FILE]\n"
+             "                  Write a heap census by info table to FILE (default: lcvm.hp).\n"
+             "                  View it with hpview.\n"
+             "     --heap-profile-interval=N|Ts\n"
+             "                  Take a census every N GCs or every T seconds (default: 10 GCs).\n"
+             "     --alloc-profile\n"
+             "                  Count allocations per allocation site (interpreter and\n"
+             "                  traces).  Printed with the stats at exit.\n"
+             "     --save-image=FILE\n"
+             "                  Save the loaded modules to an image file and exit\n"
+             "                  without running the entry point.\n"
+             "     --load-image=FILE\n"
+             "                  Load an image before loading any modules.  Modules in\n"
+             "                  the image are not loaded again.\n"
              "\n",
              argv[0]);
       res = NULL;
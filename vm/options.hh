@@ -15,9 +15,24 @@ public:
   inline const std::string entry() const { return entry_; }
   inline const std::string basePath() const { return basePath_; }
   inline long stackSize() const { return stackSize_; }
+  inline long maxStackSize() const { return maxStackSize_; }
   inline bool printLoaderState() const { return printLoaderState_; }
   inline bool printStats() const { return printStats_; }
   inline bool traceInterpreter() const { return traceInterpreter_; }
+  inline int gcThreads() const { return gcThreads_; }
+  inline int capabilities() const { return caps_; }
+  inline int sparkWorkers() const { return sparkWorkers_; }
+  inline long nurserySize() const { return nurserySize_; }
+  inline long suggestedHeapSize() const { return suggestedHeapSize_; }
+  inline long maxHeapSize() const { return maxHeapSize_; }
+  inline double gcTimeTarget() const { return gcTimeTarget_; }
+  inline bool heapProfile() const { return !heapProfileFile_.empty(); }
+  inline const std::string heapProfileFile() const { return heapProfileFile_; }
+  inline int heapProfileGCs() const { return heapProfileGCs_; }
+  inline double heapProfileSeconds() const { return heapProfileSeconds_; }
+  inline bool allocProfile() const { return allocProfile_; }
+  inline const std::string saveImageFile() const { return saveImageFile_; }
+  inline const std::string loadImageFile() const { return loadImageFile_; }
   virtual ~Options();
 
 protected:
@@ -32,7 +47,21 @@ private:
   bool printStats_;
   std::string printLoaderStateFile_;
   int enableAsm_;
-  long stackSize_;
+  long stackSize_;          // size of a stack chunk
+  long maxStackSize_;       // 0 = unlimited
+  int gcThreads_;
+  int caps_;                // capabilities (OS threads) running the entry
+  int sparkWorkers_;        // OS threads evaluating sparks
+  long nurserySize_;        // 0 = derive from cache size
+  long suggestedHeapSize_;
+  long maxHeapSize_;        // 0 = unlimited
+  double gcTimeTarget_;     // 0 = fixed nursery size
+  std::string heapProfileFile_;  // empty = no heap profiling
+  int heapProfileGCs_;           // census every N GCs ...
+  double heapProfileSeconds_;    // ... or every N seconds
+  bool allocProfile_;
+  std::string saveImageFile_;  // empty = don't save an image
+  std::string loadImageFile_;  // empty = load bytecode files only
 
   friend class OptionParser;
 };
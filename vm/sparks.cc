@@ -0,0 +1,108 @@
+#include "sparks.hh"
+#include "capability.hh"
+#include "thread.hh"
+#include "miscclosures.hh"
+
+#include <sched.h>
+#include <time.h>
+
+_START_LAMBDACHINE_NAMESPACE
+
+// Idle workers back off exponentially up to this many nanoseconds.
+static const long kMaxIdleSleep = 1000000;
+
+SparkWorkers::SparkWorkers(MemoryManager *mm, u4 numWorkers,
+                           Word stackWords, bool profileAlloc)
+  : mm_(mm), stackWords_(stackWords), stop_(false) {
+  for (u4 i = 0; i < numWorkers; ++i) {
+    Worker *w = new Worker;
+    w->pool = this;
+    w->cap = new Capability(mm);
+    w->cap->jit()->setOption(Jit::kOptFastHeapCheckFail, true);
+    if (profileAlloc)
+      w->cap->enableAllocProfiling();
+    workers_.push_back(w);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i)
+    pthread_create(&workers_[i]->thread, NULL, workerMain, workers_[i]);
+}
+
+SparkWorkers::~SparkWorkers() {
+  __atomic_store_n(&stop_, true, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < workers_.size(); ++i)
+    pthread_join(workers_[i]->thread, NULL);
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    delete workers_[i]->cap;
+    delete workers_[i];
+  }
+}
+
+void *SparkWorkers::workerMain(void *arg) {
+  Worker *w = (Worker *)arg;
+  SparkWorkers *pool = w->pool;
+  long idle = 0;
+  while (!__atomic_load_n(&pool->stop_, __ATOMIC_ACQUIRE)) {
+    if (pool->runSpark(w)) {
+      idle = 0;
+    } else if (idle < 1000) {
+      sched_yield();
+      idle += 100;
+    } else {
+      struct timespec ts = { 0, idle };
+      nanosleep(&ts, NULL);
+      if (idle < kMaxIdleSleep)
+        idle *= 2;
+    }
+  }
+  return NULL;
+}
+
+// Undo the blackholing of all thunks that the thread was evaluating.
+// Otherwise whoever needs them next would wait forever.
+static void unclaimThunks(Thread *T) {
+  Word *base = T->base();
+  while (base != NULL) {
+    if ((Closure *)base[-1] == MiscClosures::stg_UPD_closure_addr) {
+      Closure *cl = untag((Closure *)base[0]);
+      InfoTable *info = cl->info();
+      if (info->type() == BLACKHOLE) {
+        InfoTable *orig = static_cast<CodeInfoTable *>(info)->blackholeInfo();
+        __atomic_store_n(&cl->header_.info_, orig, __ATOMIC_RELEASE);
+      }
+    }
+    base = (Word *)base[-3];
+  }
+}
+
+// Evaluate one spark, if there is any.  Returns false if there was no
+// spark to evaluate.
+bool SparkWorkers::runSpark(Worker *w) {
+  Capability *cap = w->cap;
+  Closure *spark;
+  cap->attach();
+  if (!cap->popSpark(&spark) && !mm_->stealSpark(cap, &spark)) {
+    cap->detach();
+    return false;
+  }
+  while (spark->isIndirection())
+    spark = untag((Closure *)spark->payload(0));
+  if (spark->info()->type() != THUNK) {
+    // Already evaluated, or being evaluated by someone else.
+    ++cap->sparkStats().fizzled;
+    cap->detach();
+    return true;
+  }
+  Thread *T = Thread::createThread(cap, stackWords_);
+  if (cap->eval(T, spark)) {
+    ++cap->sparkStats().converted;
+  } else {
+    fprintf(stderr, "Evaluation of a spark failed.\n");
+    unclaimThunks(T);
+  }
+  T->destroy();
+  delete T;
+  cap->detach();
+  return true;
+}
+
+_END_LAMBDACHINE_NAMESPACE
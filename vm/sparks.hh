@@ -0,0 +1,54 @@
+#ifndef _SPARKS_H_
+#define _SPARKS_H_
+
+#include "common.hh"
+#include "vm.hh"
+#include "memorymanager.hh"
+
+#include <pthread.h>
+#include <vector>
+
+_START_LAMBDACHINE_NAMESPACE
+
+// A pool of OS threads that evaluate sparks (see "Sparks" in
+// capability.hh).  Each worker has its own capability.  It first
+// looks at its own spark pool (sparks created while it evaluates a
+// spark end up there), then tries to steal from the other
+// capabilities.  The result of a spark is the updated thunk; workers
+// don't report anything else.
+//
+// Workers only attach to the heap while they evaluate a spark, so an
+// idle worker never holds up a GC.
+class SparkWorkers {
+public:
+  // If `profileAlloc' is set, the workers count allocations (see
+  // Capability::enableAllocProfiling).
+  SparkWorkers(MemoryManager *mm, u4 numWorkers, Word stackWords,
+               bool profileAlloc = false);
+  // Stops and joins all workers.  A worker finishes the spark it is
+  // currently evaluating first.
+  ~SparkWorkers();
+
+  inline u4 numWorkers() const { return (u4)workers_.size(); }
+  // The capability of the given worker, e.g., for its statistics.
+  inline Capability *capability(u4 i) const { return workers_[i]->cap; }
+
+private:
+  typedef struct {
+    SparkWorkers *pool;
+    Capability *cap;
+    pthread_t thread;
+  } Worker;
+
+  static void *workerMain(void *arg);
+  bool runSpark(Worker *w);
+
+  MemoryManager *mm_;
+  Word stackWords_;
+  bool stop_;
+  std::vector<Worker *> workers_;
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _SPARKS_H_ */
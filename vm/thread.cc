@@ -4,37 +4,69 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 _START_LAMBDACHINE_NAMESPACE
 
 void Thread::destroy() {
-  if (stack_ != NULL) {
-    delete[] stack_;
+  while (chunk_ != NULL) {
+    StackChunk *prev = chunk_->prev_;
+    freeChunk(chunk_);
+    chunk_ = prev;
   }
+  shrinkStack();
   stack_ = NULL;
   base_ = NULL;
   top_ = NULL;
 }
 
+StackChunk *Thread::allocChunk(Word words) {
+  size_t bytes = sizeof(StackChunk) + (words + kStackSlopWords) * sizeof(Word);
+  StackChunk *chunk = (StackChunk *)malloc(bytes);
+  if (chunk == NULL) {
+    fprintf(stderr, "FATAL: Could not allocate stack chunk.\n");
+    exit(1);
+  }
+#ifndef NDEBUG
+  // This is mainly to shut up Valgrind
+  memset(chunk->words_, 0xf0, (words + kStackSlopWords) * sizeof(Word));
+#endif
+  chunk->prev_ = NULL;
+  chunk->size_ = words;
+  return chunk;
+}
+
+void Thread::freeChunk(StackChunk *chunk) {
+  free(chunk);
+}
+
 // Used to initialize a new thread.
 BcIns Thread::stopCode_[] = { BcIns::ad(BcIns::kSTOP, 0, 0) };
 
+// Threads are created concurrently on several capabilities.
+static Word nextThreadId = 1;
+
 void Thread::initialize(Word stackSizeInWords) {
   header_ = 0;
+  id_ = __atomic_fetch_add(&nextThreadId, 1, __ATOMIC_RELAXED);
+  link_ = NULL;
+  blackhole_ = NULL;
   base_ = NULL;
   top_ = NULL;
   owner_ = NULL;
   stack_ = NULL;
+  spare_ = NULL;
   if (stackSizeInWords < kMinStackWords) {
     stackSizeInWords = kMinStackWords;
   }
   pc_ = &stopCode_[0];
-  stackSize_ = stackSizeInWords;
-  stack_ = new Word[stackSize_];
-#ifndef NDEBUG
-  // This is mainly to shut up Valgrind
-  memset(stack_, 0xf0, stackSize_ * sizeof(Word));
-#endif
+  chunkWords_ = stackSizeInWords;
+  maxStackWords_ = ~(Word)0;
+  chunk_ = allocChunk(chunkWords_);
+  numChunks_ = 1;
+  stackWords_ = chunk_->size_;
+  stackSize_ = chunk_->size_;
+  stack_ = chunk_->words_;
   stack_[0] = (Word)NULL;   // previous base
   stack_[1] = (Word)NULL;   // previous PC
   stack_[2] = (Word)MiscClosures::stg_STOP_closure_addr;
@@ -51,6 +83,67 @@ void Thread::initialize(Word stackSizeInWords) {
   pc_ = &info->code()->code[0];
 }
 
+bool Thread::growStack(Word **base, Word **top, Word needed) {
+  Word *frame = *base - 3;
+  Word frameWords = *top - frame;
+  Word words = kUnderflowFrameWords + frameWords + needed;
+  StackChunk *chunk;
+
+  if (spare_ != NULL && spare_->size_ >= words) {
+    chunk = spare_;
+    spare_ = NULL;
+  } else {
+    if (words < chunkWords_)
+      words = chunkWords_;
+    if (stackWords_ + words > maxStackWords_)
+      return false;
+    chunk = allocChunk(words);
+  }
+  stackWords_ += chunk->size_;
+  ++numChunks_;
+  chunk->prev_ = chunk_;
+  chunk_ = chunk;
+  stack_ = chunk->words_;
+  stackSize_ = chunk->size_;
+
+  // The underflow frame.
+  Word *s = stack_;
+  s[0] = frame[0];        // previous base
+  s[1] = frame[1];        // return PC
+  s[2] = (Word)MiscClosures::stg_UNDERFLOW_closure_addr;
+  s[3] = (Word)frame;     // top of the caller's frame
+
+  // The moved frame returns to the underflow frame.
+  Word *t = &s[kUnderflowFrameWords];
+  memcpy(t, frame, frameWords * sizeof(Word));
+  t[0] = (Word)&s[3];
+  t[1] = (Word)MiscClosures::stg_UNDERFLOW_return_pc;
+  *base = &t[3];
+  *top = t + frameWords;
+  return true;
+}
+
+void Thread::popStackChunk() {
+  StackChunk *chunk = chunk_;
+  LC_ASSERT(chunk->prev_ != NULL);
+  chunk_ = chunk->prev_;
+  stack_ = chunk_->words_;
+  stackSize_ = chunk_->size_;
+  stackWords_ -= chunk->size_;
+  --numChunks_;
+  // Keep the popped chunk around in case the stack grows again soon.
+  if (spare_ != NULL)
+    freeChunk(spare_);
+  spare_ = chunk;
+}
+
+void Thread::shrinkStack() {
+  if (spare_ != NULL) {
+    freeChunk(spare_);
+    spare_ = NULL;
+  }
+}
+
 Thread *Thread::createThread(Capability *cap, Word stackSizeInWords) {
   Thread *T = new Thread;
   T->initialize(stackSizeInWords);
@@ -58,6 +151,21 @@ Thread *Thread::createThread(Capability *cap, Word stackSizeInWords) {
   return T;
 }
 
+Thread *Thread::createForkedThread(Capability *cap, Word stackSizeInWords,
+                                   Closure *action) {
+  Thread *T = createThread(cap, stackSizeInWords);
+  // The bottom frame runs the action and then stops the thread.  The
+  // action is passed the (unused) State# token as its only argument.
+  T->stack_[2] = (Word)MiscClosures::stg_FORK_closure_addr;
+  T->base_[0] = (Word)action;
+  T->base_[1] = 0;
+  T->top_ = T->base_ + 2;
+  CodeInfoTable *info = static_cast<CodeInfoTable *>
+                        (MiscClosures::stg_FORK_closure_addr->info());
+  T->pc_ = &info->code()->code[0];
+  return T;
+}
+
 Thread *Thread::createTestingThread(BcIns *pc, u4 framesize) {
   Thread *T = new Thread;
   T->initialize(framesize);
@@ -75,6 +183,7 @@ bool Thread::isValid() const {
 #ifndef NDEBUG
   CHECK_VALID(stackSize_ >= kMinStackWords);
   if (stack_ != NULL) {
+    CHECK_VALID(chunk_ != NULL && stack_ == chunk_->words_);
     CHECK_VALID(within(stack_, stack_ + stackSize_, base_));
     CHECK_VALID(within(stack_, stack_ + stackSize_, top_));
     CHECK_VALID(top_ >= base_);
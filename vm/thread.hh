@@ -4,19 +4,71 @@
 #include "common.hh"
 #include "vm.hh"
 #include "bytecode.hh"
+#include "objects.hh"
 
 _START_LAMBDACHINE_NAMESPACE
 
+// --- Stack Chunks ----------------------------------------------------
+//
+// A Haskell stack is a linked list of chunks.  A thread starts out
+// with a single chunk.  If a frame does not fit into the current
+// chunk, the frame is moved into a fresh chunk, below an underflow
+// frame:
+//
+//        old chunk                   new chunk
+//   +------------------+      +---------------------+
+//   |       ...        |      | prev base           |  stg_UNDERFLOW
+//   |   caller frame   |<-----| return pc           |  frame
+//   |  top of caller   |      | stg_UNDERFLOW       |
+//   +------------------+      | caller's top        |
+//                             | &underflow frame    |  moved frame
+//                             | UNDERFLOW return pc |
+//                             | node, slots ...     |
+//                             +---------------------+
+//
+// The underflow frame takes over the return address and previous
+// base of the moved frame.  When the moved frame returns, the
+// UNDERFLOW instruction copies the return results back to the old
+// chunk and pops the new chunk.  The most recently popped chunk is
+// kept as a spare, so that a recursion that oscillates around a
+// chunk boundary does not allocate on every call.  The spare is
+// released after each GC.
+//
+// Every chunk has kStackSlopWords words beyond stackLimit().  A frame
+// that returns into the previous chunk writes up to 255 results past
+// the top of its caller's frame, which always fit into the slop.
+
+typedef struct _StackChunk {
+  struct _StackChunk *prev_;
+  Word size_;                   // usable words, excluding the slop
+  Word words_[];
+} StackChunk;
+
 struct _Thread {
 public:
   static const Word kMinStackWords = 64;
+  static const Word kStackSlopWords = 3 + 256;
+  // Traces are only entered if there are at least this many words
+  // left in the current chunk.  Must be larger than the number of
+  // slots a trace may write above its base (see AbstractStack).
+  static const Word kTraceStackReserve = 512;
+  // Words used by an underflow frame (including its only slot).
+  static const Word kUnderflowFrameWords = 4;
 
   static Thread *createThread(Capability *, Word stackSizeInWords);
+  // Create a thread that runs the IO action `action'.  The thread
+  // starts out at a YIELD instruction, see Capability::forkThread.
+  static Thread *createForkedThread(Capability *, Word stackSizeInWords,
+                                    Closure *action);
   static Thread *createTestingThread(BcIns *pc, u4 framesize);
 
   inline BcIns *pc() const { return pc_; }
+  inline Word id() const { return id_; }
   inline Word *stackStart() const { return stack_; }
   inline Word *stackLimit() const { return stack_ + stackSize_; }
+  inline Word *traceStackLimit() const {
+    return stackLimit() - kTraceStackReserve;
+  }
   inline Word *top() const { return top_; }
   inline Word *base() const { return base_; }
 
@@ -32,6 +84,24 @@ public:
 
   inline void setPC(BcIns *pc) { pc_ = pc; }
 
+  // The maximum total size of all stack chunks.
+  inline void setMaxStackSize(Word words) { maxStackWords_ = words; }
+  inline Word maxStackSize() const { return maxStackWords_; }
+  // Total size of all stack chunks currently in use.
+  inline Word stackSize() const { return stackWords_; }
+  inline Word stackChunks() const { return numChunks_; }
+
+  // Move the frame at [*base - 3, *top) to a new stack chunk which
+  // has room for at least `needed' words above the frame.  Updates
+  // `*base' and `*top'.  Returns false if that would exceed the
+  // maximum stack size.
+  bool growStack(Word **base, Word **top, Word needed);
+  // Pop the current stack chunk.  Called by the UNDERFLOW
+  // instruction.
+  void popStackChunk();
+  // Release the spare stack chunk, if any.
+  void shrinkStack();
+
   //  Thread() {}
   void initialize(Word stackSizeInWords);
   void destroy();
@@ -53,6 +123,19 @@ public:
   Word *top_;
   Word *stack_;
   Capability *owner_;
+  StackChunk *chunk_;      // current chunk, stack_ == chunk_->words_
+  StackChunk *spare_;
+  Word chunkWords_;        // default size of a new chunk
+  Word stackWords_;
+  Word maxStackWords_;
+  Word numChunks_;
+  Word id_;
+  Thread *link_;           // next thread in an MVar queue
+  Closure *blackhole_;     // the blackhole the thread waits for, if any
+
+private:
+  StackChunk *allocChunk(Word words);
+  void freeChunk(StackChunk *chunk);
 };
 
 _END_LAMBDACHINE_NAMESPACE
@@ -6,12 +6,25 @@
 #include "capability.hh"
 #include "objects.hh"
 #include "miscclosures.hh"
+#include "integer.hh"
+#include "bytearray.hh"
+#include "ffi.hh"
+#include "io.hh"
+#include "image.hh"
+#include "utils.hh"
 #include "jit.hh"
 #include "time.hh"
 
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 using namespace std;
 _USE_LAMBDACHINE_NAMESPACE
@@ -25,6 +38,47 @@ TEST(ThreadTest, StartStop) {
   delete T;
 }
 
+TEST(ThreadTest, GrowStack) {
+  MemoryManager m;
+  Loader l(&m, NULL);
+  Capability cap(&m);
+  Thread *T = Thread::createThread(&cap, Thread::kMinStackWords);
+  Closure *stop = MiscClosures::stg_STOP_closure_addr;
+  BcIns *stopReturnPc =
+    &((CodeInfoTable *)stop->info())->code()->code[2];
+
+  // Push a frame that returns to the STOP frame.
+  Word *frame = T->top();
+  frame[0] = (Word)T->base();
+  frame[1] = (Word)stopReturnPc;
+  frame[2] = (Word)stop;
+  Word *base = &frame[3];
+  Word *top = base + 2;
+  base[0] = 0;
+  base[1] = 42;
+
+  T->setMaxStackSize(T->stackSize());
+  ASSERT_FALSE(T->growStack(&base, &top, 100));
+  T->setMaxStackSize(~(Word)0);
+  ASSERT_TRUE(T->growStack(&base, &top, 100));
+  ASSERT_EQ((Word)2, T->stackChunks());
+  ASSERT_TRUE(top + 100 <= T->stackLimit());
+  ASSERT_EQ((Word)stop, base[-1]);
+  ASSERT_EQ((Word)MiscClosures::stg_UNDERFLOW_return_pc, base[-2]);
+  ASSERT_EQ((Word)42, base[1]);
+
+  // Returning from the moved frame pops the chunk.
+  BcIns code[] = { BcIns::ad(BcIns::kRET1, 1, 0) };
+  T->sync(&code[0], base);
+  T->top_ = top;
+  ASSERT_TRUE(cap.run(T));
+  ASSERT_EQ((Word)1, T->stackChunks());
+  ASSERT_EQ(frame, T->top());
+  ASSERT_EQ((Word)42, T->top()[FRAME_SIZE]);
+  T->destroy();
+  delete T;
+}
+
 TEST(MMTest, AllocRegion) {
   Region *region = Region::newRegion(Region::kSmallObjectRegion);
   ASSERT_TRUE(region != NULL);
@@ -51,6 +105,77 @@ TEST(MMTest, AllocBasic2) {
   ASSERT_GT(m.infoTables(), sizeof(Word));
 }
 
+TEST(MMTest, WriteBarrierNursery) {
+  MemoryManager m;
+  Closure *cl = m.allocClosure(NULL, 2);
+  ASSERT_TRUE(m.isYoungGeneration(cl));
+  ASSERT_FALSE(m.isOldGeneration(cl));
+  // Nursery objects never need to be remembered.
+  m.writeBarrier(cl);
+  ASSERT_EQ((size_t)0, m.rememberedSetSize());
+  Closure *st = m.allocStaticClosure(2);
+  ASSERT_FALSE(m.isYoungGeneration(st));
+  ASSERT_FALSE(m.isOldGeneration(st));
+}
+
+TEST(MMTest, GCThreads) {
+  MemoryManager m;
+  ASSERT_EQ((u4)1, m.gcThreads());
+  m.setGCThreads(4);
+  ASSERT_EQ((u4)4, m.gcThreads());
+  m.setGCThreads(0);
+  ASSERT_EQ((u4)1, m.gcThreads());
+  m.setGCThreads(MemoryManager::kMaxGCThreads + 1);
+  ASSERT_EQ((u4)MemoryManager::kMaxGCThreads, m.gcThreads());
+}
+
+TEST(MMTest, NurserySize) {
+  MemoryManager m;
+  // Default is derived from the cache size, but within bounds.
+  ASSERT_GE(m.nurserySize(), (size_t)MemoryManager::kMinNurserySize);
+  ASSERT_LE(m.nurserySize(), (size_t)MemoryManager::kMaxDefaultNurserySize);
+  m.setNurserySize(4UL << 20);
+  ASSERT_EQ((size_t)4UL << 20, m.nurserySize());
+  // Rounded up to whole blocks.
+  m.setNurserySize(Block::kBlockSize * 3 + 1);
+  ASSERT_EQ((size_t)Block::kBlockSize * 4, m.nurserySize());
+}
+
+TEST(HeapProfilerTest, CensusDue) {
+  HeapProfiler p;
+  ASSERT_TRUE(p.open("/dev/null", 3, 0));
+  Time now = getProcessElapsedTime();
+  ASSERT_FALSE(p.censusDue(2, now));
+  ASSERT_TRUE(p.censusDue(3, now));
+  CensusTable census;
+  p.writeSample(3, now, census);
+  ASSERT_EQ((u4)1, p.samples());
+  ASSERT_FALSE(p.censusDue(5, now));
+  ASSERT_TRUE(p.censusDue(6, now));
+}
+
+TEST(WSDequeTest, PushPopSteal) {
+  WSDeque<int> q(2);
+  ASSERT_TRUE(q.looksEmpty());
+  ASSERT_TRUE(q.push(1));
+  ASSERT_TRUE(q.push(2));
+  ASSERT_TRUE(q.push(3));
+  ASSERT_TRUE(q.push(4));
+  ASSERT_FALSE(q.push(5));  // full
+  int x = 0;
+  ASSERT_TRUE(q.steal(&x));
+  ASSERT_EQ(1, x);
+  ASSERT_TRUE(q.pop(&x));
+  ASSERT_EQ(4, x);
+  ASSERT_TRUE(q.pop(&x));
+  ASSERT_EQ(3, x);
+  ASSERT_TRUE(q.steal(&x));
+  ASSERT_EQ(2, x);
+  ASSERT_FALSE(q.pop(&x));
+  ASSERT_FALSE(q.steal(&x));
+  ASSERT_TRUE(q.looksEmpty());
+}
+
 TEST(LoaderTest, Simple) {
   MemoryManager mm;
   Loader l(&mm, "/usr/bin");
@@ -635,6 +760,63 @@ TEST_F(IRTestFold, FoldSub) {
   buf->debugPrint(cerr, 1);
 }
 
+TEST_F(IRTestFold, FoldBitOps) {
+  TRef zero = buf->literal(IRT_I64, 0);
+  TRef k = buf->literal(IRT_I64, 0xf0);
+  TRef opaque = buf->slot(0);
+
+  TRef tr1 = buf->emit(IR::kPOPCNT, IRT_I64, k, TRef());
+  ASSERT_TRUE(tr1.isLiteral());
+  EXPECT_EQ((Word)4, buf->literalValue(tr1.ref()));
+  TRef tr2 = buf->emit(IR::kCLZ, IRT_I64, zero, TRef());
+  ASSERT_TRUE(tr2.isLiteral());
+  EXPECT_EQ((Word)64, buf->literalValue(tr2.ref()));
+  TRef tr3 = buf->emit(IR::kCTZ, IRT_I64, k, TRef());
+  ASSERT_TRUE(tr3.isLiteral());
+  EXPECT_EQ((Word)4, buf->literalValue(tr3.ref()));
+  TRef tr4 = buf->emit(IR::kPEXT, IRT_I64, k, buf->literal(IRT_I64, 0x3c));
+  ASSERT_TRUE(tr4.isLiteral());
+  EXPECT_EQ((Word)0xc, buf->literalValue(tr4.ref()));
+
+  TRef tr5 = buf->emit(IR::kBSWAP, IRT_I64, opaque, TRef());
+  EXPECT_EQ(opaque, buf->emit(IR::kBSWAP, IRT_I64, tr5, TRef()));
+  EXPECT_EQ(zero, buf->emit(IR::kPDEP, IRT_I64, opaque, zero));
+
+  buf->debugPrint(cerr, 1);
+}
+
+TEST_F(IRTestFold, FoldOverflow) {
+  const IR::Type ty = IRT_I64 | IRT_GUARD;
+  TRef zero = buf->literal(IRT_I64, 0);
+  TRef one = buf->literal(IRT_I64, 1);
+  TRef minus1 = buf->literal(IRT_I64, -1);
+  TRef kmax = buf->literal(IRT_I64, ~(Word)0 >> 1);
+  TRef opaque = buf->slot(0);
+
+  TRef tr1 = buf->emit(IR::kADDOV, ty, kmax, minus1);
+  ASSERT_TRUE(tr1.isLiteral());
+  EXPECT_EQ((~(Word)0 >> 1) - 1, buf->literalValue(tr1.ref()));
+  EXPECT_EQ(opaque, buf->emit(IR::kADDOV, ty, zero, opaque));
+  EXPECT_EQ(opaque, buf->emit(IR::kSUBOV, ty, opaque, zero));
+  EXPECT_EQ(zero, buf->emit(IR::kSUBOV, ty, opaque, opaque));
+  EXPECT_EQ(opaque, buf->emit(IR::kMULOV, ty, one, opaque));
+  EXPECT_EQ(zero, buf->emit(IR::kMULOV, ty, opaque, zero));
+
+  TRef tr2 = buf->emit(IR::kADDCU, IRT_I64, minus1, one);
+  ASSERT_TRUE(tr2.isLiteral());
+  EXPECT_EQ((Word)1, buf->literalValue(tr2.ref()));
+  TRef tr3 = buf->emit(IR::kMULHU, IRT_I64, minus1, minus1);
+  ASSERT_TRUE(tr3.isLiteral());
+  EXPECT_EQ(~(Word)0 - 1, buf->literalValue(tr3.ref()));
+  EXPECT_EQ(zero, buf->emit(IR::kMULHU, IRT_I64, opaque, one));
+
+  // A checked operation that always overflows is a failing guard.
+  EXPECT_THROW(buf->emit(IR::kADDOV, ty, kmax, one), int);
+  EXPECT_THROW(buf->emit(IR::kMULOV, ty, kmax, kmax), int);
+
+  buf->debugPrint(cerr, 1);
+}
+
 class CodeTest : public ::testing::Test {
 protected:
   virtual void SetUp() {
@@ -782,6 +964,42 @@ TEST_F(ArithTest, Rem) {
   ASSERT_EQ(0, arithABC(BcIns::abc(BcIns::kREMRR, 0, 1, 2), 0, 3));
 }
 
+TEST_F(ArithTest, Overflow) {
+  const Word kMax = ~(Word)0 >> 1;
+  ASSERT_EQ(0, arithABC(BcIns::abc(BcIns::kADDOV, 0, 1, 2), kMax - 1, 1));
+  ASSERT_EQ(1, arithABC(BcIns::abc(BcIns::kADDOV, 0, 1, 2), kMax, 1));
+  ASSERT_EQ(1, arithABC(BcIns::abc(BcIns::kADDOV, 0, 1, 2), kMax + 1, -1));
+  ASSERT_EQ(0, arithABC(BcIns::abc(BcIns::kSUBOV, 0, 1, 2), kMax + 1, 0));
+  ASSERT_EQ(1, arithABC(BcIns::abc(BcIns::kSUBOV, 0, 1, 2), kMax + 1, 1));
+  ASSERT_EQ(1, arithABC(BcIns::abc(BcIns::kSUBOV, 0, 1, 2), 0, kMax + 1));
+  ASSERT_EQ(0, arithABC(BcIns::abc(BcIns::kMULOV, 0, 1, 2), -1, kMax));
+  ASSERT_EQ(1, arithABC(BcIns::abc(BcIns::kMULOV, 0, 1, 2), -1, kMax + 1));
+  ASSERT_EQ(1, arithABC(BcIns::abc(BcIns::kMULOV, 0, 1, 2),
+                        0x100000000, 0x80000000));
+
+  ASSERT_EQ(0, arithABC(BcIns::abc(BcIns::kADDCU, 0, 1, 2), kMax, kMax));
+  ASSERT_EQ(1, arithABC(BcIns::abc(BcIns::kADDCU, 0, 1, 2), -1, 1));
+  ASSERT_EQ(0, arithABC(BcIns::abc(BcIns::kMULHU, 0, 1, 2), 123, 456));
+  ASSERT_EQ(~(Word)0 - 1,
+            arithABC(BcIns::abc(BcIns::kMULHU, 0, 1, 2), -1, -1));
+}
+
+TEST_F(ArithTest, BitOps) {
+  ASSERT_EQ(0, arithAD(BcIns::ad(BcIns::kPOPCNT, 0, 1), 0));
+  ASSERT_EQ(64, arithAD(BcIns::ad(BcIns::kPOPCNT, 0, 1), -1));
+  ASSERT_EQ(3, arithAD(BcIns::ad(BcIns::kPOPCNT, 0, 1), 0x10300));
+  ASSERT_EQ(64, arithAD(BcIns::ad(BcIns::kCLZ, 0, 1), 0));
+  ASSERT_EQ(47, arithAD(BcIns::ad(BcIns::kCLZ, 0, 1), 0x10300));
+  ASSERT_EQ(64, arithAD(BcIns::ad(BcIns::kCTZ, 0, 1), 0));
+  ASSERT_EQ(8, arithAD(BcIns::ad(BcIns::kCTZ, 0, 1), 0x10300));
+  ASSERT_EQ((Word)0x0807060504030201ULL,
+            arithAD(BcIns::ad(BcIns::kBSWAP, 0, 1), 0x0102030405060708ULL));
+  ASSERT_EQ((Word)0x50b0, arithABC(BcIns::abc(BcIns::kPDEP, 0, 1, 2),
+                                   0x5b, 0xf0f0));
+  ASSERT_EQ((Word)0x5b, arithABC(BcIns::abc(BcIns::kPEXT, 0, 1, 2),
+                                 0x57b9, 0xf0f0));
+}
+
 TEST_F(ArithTest, Mov) {
   ASSERT_EQ(0x123456, arithAD(BcIns::ad(BcIns::kMOV, 0, 1), 0x123456));
 }
@@ -899,6 +1117,1841 @@ TEST_F(ArithTest, AllocN_5) {
   ASSERT_EQ((Word)2222, T->slot(1));
 }
 
+static void writeFile(const char *path, const string &contents) {
+  ofstream out(path, ios::out | ios::binary | ios::trunc);
+  out << contents;
+}
+
+static void putU2(string &s, u2 x) {
+  s += (char)(x >> 8);
+  s += (char)x;
+}
+
+static void putU4(string &s, u4 x) {
+  putU2(s, x >> 16);
+  putU2(s, x);
+}
+
+static void putVarUInt(string &s, Word x) {
+  while (x >= 0x80) {
+    s += (char)(0x80 | (x & 0x7f));
+    x >>= 7;
+  }
+  s += (char)x;
+}
+
+// An identifier "<module>.<string i>".  String 0 is the module name.
+static void putId(string &s, Word i) {
+  s += (char)2;
+  s += (char)0;
+  putVarUInt(s, i);
+}
+
+static void putCode(string &s, const BcIns *code, u2 n) {
+  for (u2 i = 0; i < n; ++i)
+    putU4(s, *(const u4 *)&code[i]);
+}
+
+// A module `Caf' with a CAF `c' that evaluates to the static
+// constructor `unit', a function `g' whose code refers to `c', a
+// thunk info table `t' whose code refers to `c', and a function `h'
+// that refers to `t' (a LIT_INFO literal) but not to `c'.
+static string cafTestModule() {
+  static const char *strings[] = {
+    "Caf", "Unit`con_info", "Unit", "unit`closure", "c`info", "c",
+    "c`closure", "g`info", "g", "g`closure", "t`info", "t", "h`info", "h",
+    "h`closure"
+  };
+  string s("KHCB");
+  putU2(s, 0);
+  putU2(s, 1);
+  putU4(s, 0);  // flags
+  putU4(s, countof(strings));
+  putU4(s, 5);  // info tables
+  putU4(s, 4);  // closures
+  putU4(s, 0);  // imports
+  s += "BCST";
+  for (size_t i = 0; i < countof(strings); ++i) {
+    putVarUInt(s, strlen(strings[i]));
+    s += strings[i];
+  }
+  s += (char)1;  // module name
+  s += (char)0;
+  s += "BCCL";
+
+  s += "ITBL";
+  putId(s, 1);
+  putVarUInt(s, CONSTR);
+  putVarUInt(s, 1);  // tag
+  putVarUInt(s, 0);  // size
+  putId(s, 2);
+
+  // c = unit
+  s += "ITBL";
+  putId(s, 4);
+  putVarUInt(s, CAF);
+  putVarUInt(s, 0);
+  putId(s, 5);
+  putVarUInt(s, 1);  // framesize
+  putVarUInt(s, 0);  // arity
+  putVarUInt(s, 1);  // literals
+  putU2(s, 3);  // instructions
+  putU2(s, 0);  // bitmaps
+  s += (char)LIT_CLOSURE;
+  putId(s, 3);
+  BcIns ccode[] = {
+    BcIns::ad(BcIns::kIFUNC, 1, 0), BcIns::ad(BcIns::kLOADK, 0, 0),
+    BcIns::ad(BcIns::kRET1, 0, 0)
+  };
+  putCode(s, ccode, countof(ccode));
+
+  // g x = c, and t = c
+  const Word uses[][3] = { { 7, FUN, 8 }, { 10, THUNK, 11 } };
+  for (size_t i = 0; i < countof(uses); ++i) {
+    s += "ITBL";
+    putId(s, uses[i][0]);
+    putVarUInt(s, uses[i][1]);
+    putVarUInt(s, 0);
+    putId(s, uses[i][2]);
+    putVarUInt(s, 1);
+    putVarUInt(s, uses[i][1] == FUN ? 1 : 0);
+    putVarUInt(s, 1);
+    putU2(s, 3);
+    putU2(s, 0);
+    s += (char)LIT_CLOSURE;
+    putId(s, 6);
+    BcIns code[] = {
+      BcIns::ad(uses[i][1] == FUN ? BcIns::kFUNC : BcIns::kIFUNC, 1, 0),
+      BcIns::ad(BcIns::kLOADK, 0, 0), BcIns::ad(BcIns::kRET1, 0, 0)
+    };
+    putCode(s, code, countof(code));
+  }
+
+  // h x = x, but its code mentions the info table of t.
+  s += "ITBL";
+  putId(s, 12);
+  putVarUInt(s, FUN);
+  putVarUInt(s, 0);
+  putId(s, 13);
+  putVarUInt(s, 1);
+  putVarUInt(s, 1);
+  putVarUInt(s, 1);
+  putU2(s, 2);
+  putU2(s, 0);
+  s += (char)LIT_INFO;
+  putId(s, 10);
+  BcIns hcode[] = {
+    BcIns::ad(BcIns::kFUNC, 1, 0), BcIns::ad(BcIns::kRET1, 0, 0)
+  };
+  putCode(s, hcode, countof(hcode));
+
+  const Word closures[][2] = { { 3, 1 }, { 9, 7 }, { 14, 12 } };
+  for (size_t i = 0; i < countof(closures); ++i) {
+    s += "CLOS";
+    putId(s, closures[i][0]);
+    putVarUInt(s, 0);
+    putId(s, closures[i][1]);
+  }
+  s += "CLOS";
+  putId(s, 6);
+  putVarUInt(s, 2);
+  putId(s, 4);
+  s += (char)LIT_INT;
+  putVarUInt(s, 0);
+  s += (char)LIT_INT;
+  putVarUInt(s, 0);
+  return s;
+}
+
+// Load the module `Caf' and evaluate its CAF `c'.  Returns the
+// updated CAF.
+// Load the module `Caf' and evaluate its CAF `c'.  Returns the
+// updated CAF.
+static Closure *evalTestCAF(Loader &l, const char *dir, Capability &cap) {
+  string module = string(dir) + "/Caf.lcbc";
+  writeFile(module.c_str(), cafTestModule());
+  bool loaded = l.loadModule("Caf");
+  unlink(module.c_str());
+  rmdir(dir);
+  if (!loaded)
+    return NULL;
+  Closure *c = l.closure("Caf.c`closure");
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  bool ok = c != NULL && cap.eval(T, c);
+  delete T;
+  return ok ? c : NULL;
+}
+
+// Enough live data for several major GCs with a 2-block nursery.
+static const Word kGCChainLength = 20000;
+
+// Allocate a chain of `length' AP thunks, each pointing to the
+// previous one, with `root' in r7, which is live throughout, so
+// everything reachable from `root' survives all the GCs that the
+// chain triggers.  Returns where `root' ended up.
+static Closure *runChainWithRoot(Capability &cap, Closure *root,
+                                 Word length) {
+  // r0 = chain, r1 = i, r2 = n, r3 = 1, r4 = info,
+  // r5 = any static closure, r7 = root
+  BcIns code[8];
+  u2 *bitmaps = (u2 *)&code[7];  // the bitmap follows the code
+  bitmaps[0] = 1 | 32 | 128;     // r0, r5, r7
+  code[0] = BcIns::abc(BcIns::kALLOC, 0, 4, 2);
+  code[1] = BcIns::args(0, 5, 0, 0);
+  code[2] = BcIns::bitmapOffset(byteOffset32(&code[2], &bitmaps[0]));
+  code[3] = BcIns::abc(BcIns::kADDRR, 1, 1, 3);
+  code[4] = BcIns::ad(BcIns::kISLT, 1, 2);
+  code[5] = BcIns::aj(BcIns::kJMP, 0, -6);
+  code[6] = BcIns::ad(BcIns::kSTOP, 0, 0);
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  T->top_ = T->base() + 8;
+  T->setPC(&code[0]);
+  T->setSlot(0, (Word)MiscClosures::stg_STOP_closure_addr);
+  T->setSlot(1, 0);
+  T->setSlot(2, length);
+  T->setSlot(3, 1);
+  T->setSlot(4, (Word)MiscClosures::getApInfo(1, 1));
+  T->setSlot(5, (Word)MiscClosures::stg_STOP_closure_addr);
+  T->setSlot(7, (Word)root);
+  EXPECT_TRUE(cap.run(T));
+  EXPECT_EQ(length, T->slot(1));
+  root = (Closure *)T->slot(7);
+  delete T;
+  return root;
+}
+
+// A CAF that nothing refers to any more is reverted by a major GC.
+TEST(MMTest, RevertUnreachableCAF) {
+  MemoryManager mm;
+  mm.setNurserySize(2 * Block::kBlockSize);
+  char dir[] = "/tmp/lcvm_cafXXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  Loader l(&mm, dir);
+  Capability cap(&mm);
+  Closure *c = evalTestCAF(l, dir, cap);
+  ASSERT_TRUE(c != NULL);
+  InfoTable *cafInfo = (InfoTable *)c->payload(1);
+  ASSERT_EQ(MiscClosures::stg_IND_info, c->info());
+  ASSERT_EQ(CAF, cafInfo->type());
+  ASSERT_EQ((size_t)1, cap.staticRoots().size());
+
+  runChainWithRoot(cap, MiscClosures::stg_STOP_closure_addr,
+                   kGCChainLength);
+  ASSERT_LT((uint32_t)0, mm.numMajorGCs());
+  EXPECT_EQ(cafInfo, c->info());
+  EXPECT_EQ((Word)0, c->payload(0));
+  EXPECT_EQ((uint64_t)1, mm.numRevertedCAFs());
+  EXPECT_TRUE(cap.staticRoots().empty());
+}
+
+// Minor GCs treat all updated CAFs as roots.
+TEST(MMTest, MinorGCKeepsCAF) {
+  MemoryManager mm;
+  mm.setNurserySize(2 * Block::kBlockSize);
+  char dir[] = "/tmp/lcvm_cafXXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  Loader l(&mm, dir);
+  Capability cap(&mm);
+  Closure *c = evalTestCAF(l, dir, cap);
+  ASSERT_TRUE(c != NULL);
+  Closure *value = (Closure *)c->payload(0);
+
+  runChainWithRoot(cap, MiscClosures::stg_STOP_closure_addr, 4000);
+  ASSERT_LT((uint32_t)0, mm.numMinorGCs());
+  ASSERT_EQ((uint32_t)0, mm.numMajorGCs());
+  EXPECT_EQ(MiscClosures::stg_IND_info, c->info());
+  EXPECT_EQ(value, (Closure *)c->payload(0));
+  EXPECT_EQ((uint64_t)0, mm.numRevertedCAFs());
+  EXPECT_EQ((size_t)1, cap.staticRoots().size());
+}
+
+// A CAF stays updated as long as a live function refers to it,
+// either directly or through the info table of a thunk that the
+// function may allocate.
+TEST(MMTest, KeepCAFReachableFromSRT) {
+  const char *roots[] = { "Caf.g`closure", "Caf.h`closure" };
+  for (size_t i = 0; i < countof(roots); ++i) {
+    MemoryManager mm;
+    mm.setNurserySize(2 * Block::kBlockSize);
+    char dir[] = "/tmp/lcvm_cafXXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    Loader l(&mm, dir);
+    Capability cap(&mm);
+    Closure *c = evalTestCAF(l, dir, cap);
+    ASSERT_TRUE(c != NULL);
+    // The SRTs are only known once the code has been loaded.
+    l.loadAllCode();
+    Closure *fun = l.closure(roots[i]);
+    ASSERT_TRUE(fun != NULL);
+    ASSERT_NE(0, fun->info()->srtBitmap()) << roots[i];
+
+    runChainWithRoot(cap, fun, kGCChainLength);
+    ASSERT_LT((uint32_t)0, mm.numMajorGCs());
+    EXPECT_EQ(MiscClosures::stg_IND_info, c->info()) << roots[i];
+    EXPECT_EQ((uint64_t)0, mm.numRevertedCAFs()) << roots[i];
+    EXPECT_EQ((size_t)1, cap.staticRoots().size()) << roots[i];
+  }
+}
+
+TEST(MMTest, LargeObjectReuse) {
+  MemoryManager mm;
+  mm.setNurserySize(2 * Block::kBlockSize);
+  Loader l(&mm, NULL);
+  Capability cap(&mm);
+  const Word kObjects = 8;
+  const Word kBytes = 16 * Block::kBlockSize / kObjects;
+  Closure *dead[kObjects];
+  for (Word i = 0; i < kObjects; ++i)
+    dead[i] = mm.allocLarge(kBytes);
+
+  runChainWithRoot(cap, MiscClosures::stg_STOP_closure_addr,
+                   kGCChainLength);
+  ASSERT_LT((uint32_t)0, mm.numMajorGCs());
+
+  // The dead objects have been merged and given back to the bump
+  // allocator of their region.
+  for (Word i = 0; i < kObjects; ++i)
+    EXPECT_EQ(dead[i], mm.allocLarge(kBytes));
+}
+
+static void ioTestFile(char *path) {
+  strcpy(path, "/tmp/lcvm_iotestXXXXXX");
+  int fd = mkstemp(path);
+  EXPECT_NE(-1, fd);
+  close(fd);
+}
+
+static string readFile(const char *path) {
+  ifstream in(path, ios::in | ios::binary);
+  stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+// A census counts live large objects under their info table.
+TEST(MMTest, CensusLargeObjects) {
+  MemoryManager mm;
+  mm.setNurserySize(2 * Block::kBlockSize);
+  Loader l(&mm, NULL);
+  Capability cap(&mm);
+  char path[32];
+  ioTestFile(path);
+  ASSERT_TRUE(mm.startHeapProfile(path, 1, 0));
+  ArrayClosure *arr =
+    mm.allocArray(2, MiscClosures::stg_NO_VALUE_closure_addr);
+  ByteArrayClosure *bytes = mm.allocByteArray(100);
+  arr->payload_[0] = (Closure *)bytes;
+  mm.allocByteArray(100);  // dead
+
+  runChainWithRoot(cap, (Closure *)arr, kGCChainLength);
+  ASSERT_LT((uint32_t)0, mm.numMajorGCs());
+  string profile = readFile(path);
+  unlink(path);
+  stringstream arrLine, bytesLine;
+  arrLine << ",ARRAY,\"stg_MUT_ARR\",1," << ArrayClosure::allocBytes(2)
+          << "\n";
+  bytesLine << ",LARGE,\"stg_BYTEARR\",1,"
+            << wordsof(ByteArrayClosure) * sizeof(Word) + 104 << "\n";
+  EXPECT_NE(string::npos, profile.find(arrLine.str())) << profile;
+  EXPECT_NE(string::npos, profile.find(bytesLine.str())) << profile;
+}
+
+// A tagged pointer is known to point to an evaluated constructor.
+// Neither EVAL nor GETTAG should need to look at the object.
+TEST_F(ArithTest, TaggedPointer) {
+  Word tagged = 0x123450 | 3;
+  ASSERT_EQ((Word)2, arithAD(BcIns::ad(BcIns::kGETTAG, 0, 1), tagged));
+
+  T->setPC(&code_[0]);
+  T->setSlot(0, 0);
+  T->setSlot(1, tagged);
+  code_[0] = BcIns::ad(BcIns::kEVAL, 1, 0);
+  code_[1] = BcIns::bitmapOffset(0);  // no live-outs
+  code_[2] = BcIns::ad(BcIns::kMOV_RES, 0, 0);
+  ASSERT_TRUE(cap_->run(T));
+  ASSERT_EQ(tagged, T->slot(0));
+
+  ASSERT_EQ((Word)3, ptrTag(tagged));
+  ASSERT_EQ((Closure *)0x123450, untag(tagged));
+  ASSERT_EQ((u2)3, constructorTag(tagged));
+}
+
+TEST_F(ArithTest, Double) {
+  ASSERT_EQ(lc_d2w(4.0), arithABC(BcIns::abc(BcIns::kADDD, 0, 1, 2),
+                                  lc_d2w(2.5), lc_d2w(1.5)));
+  ASSERT_EQ(lc_d2w(-1.25), arithABC(BcIns::abc(BcIns::kSUBD, 0, 1, 2),
+                                    lc_d2w(0.25), lc_d2w(1.5)));
+  ASSERT_EQ(lc_d2w(3.75), arithABC(BcIns::abc(BcIns::kMULD, 0, 1, 2),
+                                   lc_d2w(2.5), lc_d2w(1.5)));
+  ASSERT_EQ(lc_d2w(0.1), arithABC(BcIns::abc(BcIns::kDIVD, 0, 1, 2),
+                                  lc_d2w(1.0), lc_d2w(10.0)));
+  ASSERT_EQ(lc_d2w(-0.0), arithAD(BcIns::ad(BcIns::kNEGD, 0, 1),
+                                  lc_d2w(0.0)));
+}
+
+TEST_F(ArithTest, Float) {
+  ASSERT_EQ(lc_f2w(4.0f), arithABC(BcIns::abc(BcIns::kADDF, 0, 1, 2),
+                                   lc_f2w(2.5f), lc_f2w(1.5f)));
+  ASSERT_EQ(lc_f2w(0.1f), arithABC(BcIns::abc(BcIns::kDIVF, 0, 1, 2),
+                                   lc_f2w(1.0f), lc_f2w(10.0f)));
+  ASSERT_EQ(lc_f2w(-2.5f), arithAD(BcIns::ad(BcIns::kNEGF, 0, 1),
+                                   lc_f2w(2.5f)));
+}
+
+TEST_F(ArithTest, Conversions) {
+  ASSERT_EQ(lc_d2w(-7.0), arithAD(BcIns::ad(BcIns::kI2D, 0, 1), (Word)-7));
+  ASSERT_EQ((Word)-3, arithAD(BcIns::ad(BcIns::kD2I, 0, 1), lc_d2w(-3.9)));
+  ASSERT_EQ(lc_f2w(42.0f), arithAD(BcIns::ad(BcIns::kI2F, 0, 1), 42));
+  ASSERT_EQ((Word)3, arithAD(BcIns::ad(BcIns::kF2I, 0, 1), lc_f2w(3.9f)));
+  ASSERT_EQ(lc_d2w(0.5), arithAD(BcIns::ad(BcIns::kF2D, 0, 1),
+                                 lc_f2w(0.5f)));
+  ASSERT_EQ(lc_f2w(0.1f), arithAD(BcIns::ad(BcIns::kD2F, 0, 1),
+                                  lc_d2w(0.1)));
+}
+
+TEST_F(ArithTest, BranchDouble) {
+  Word nan = lc_d2w(0.0 / 0.0);
+  ASSERT_TRUE(branchTest(BcIns::kISLTD, lc_d2w(-1.5), lc_d2w(0.5)));
+  ASSERT_FALSE(branchTest(BcIns::kISLTD, lc_d2w(0.5), lc_d2w(0.5)));
+  ASSERT_TRUE(branchTest(BcIns::kISGED, lc_d2w(0.5), lc_d2w(0.5)));
+  ASSERT_TRUE(branchTest(BcIns::kISEQD, lc_d2w(0.0), lc_d2w(-0.0)));
+  ASSERT_FALSE(branchTest(BcIns::kISEQD, nan, nan));
+  ASSERT_TRUE(branchTest(BcIns::kISNED, nan, nan));
+  ASSERT_FALSE(branchTest(BcIns::kISLTD, nan, lc_d2w(1.0)));
+  ASSERT_FALSE(branchTest(BcIns::kISGED, nan, lc_d2w(1.0)));
+  ASSERT_TRUE(branchTest(BcIns::kISGTF, lc_f2w(2.0f), lc_f2w(1.0f)));
+  ASSERT_FALSE(branchTest(BcIns::kISLEF, lc_f2w(2.0f), lc_f2w(1.0f)));
+}
+
+class IntegerTest : public CodeTest {
+protected:
+  Closure *fromInt(WordInt n) {
+    T->setPC(&code_[0]);
+    T->setSlot(1, (Word)n);
+    code_[0] = BcIns::ad(BcIns::kI2Z, 0, 1);
+    code_[1] = BcIns::bitmapOffset(0);
+    code_[2] = stop();
+    EXPECT_TRUE(cap_->run(T));
+    return (Closure *)T->slot(0);
+  }
+
+  WordInt toInt(Closure *z) {
+    T->setPC(&code_[0]);
+    T->setSlot(1, (Word)z);
+    code_[0] = BcIns::ad(BcIns::kZ2I, 0, 1);
+    code_[1] = stop();
+    EXPECT_TRUE(cap_->run(T));
+    return (WordInt)T->slot(0);
+  }
+
+  WordInt compare(Closure *x, Closure *y) {
+    T->setPC(&code_[0]);
+    T->setSlot(1, (Word)x);
+    T->setSlot(2, (Word)y);
+    code_[0] = BcIns::abc(BcIns::kCMPZ, 0, 1, 2);
+    code_[1] = stop();
+    EXPECT_TRUE(cap_->run(T));
+    return (WordInt)T->slot(0);
+  }
+
+  // Runs one of ADDZ, ..., SHRZ.  For the shifts `y' is the shift
+  // amount, otherwise an Integer.
+  Closure *op(BcIns::Opcode opc, Closure *x, Word y) {
+    T->setPC(&code_[0]);
+    T->setSlot(1, (Word)x);
+    T->setSlot(2, y);
+    code_[0] = BcIns::abc(opc, 0, 1, 2);
+    code_[1] = BcIns::bitmapOffset(0);
+    code_[2] = stop();
+    EXPECT_TRUE(cap_->run(T));
+    return (Closure *)T->slot(0);
+  }
+
+  Closure *op(BcIns::Opcode opc, Closure *x, Closure *y) {
+    return op(opc, x, (Word)y);
+  }
+
+  static Word limbs(Closure *z) {
+    return ((ByteArrayClosure *)z)->bytes_ / sizeof(Word);
+  }
+};
+
+TEST_F(IntegerTest, Small) {
+  uint64_t alloc_before = mm.allocated();
+  Closure *z = op(BcIns::kADDZ, fromInt(-23), fromInt(18));
+  ASSERT_EQ((uint64_t)(6 * sizeof(Word)), mm.allocated() - alloc_before);
+  ASSERT_TRUE(isSmallInteger(z));
+  ASSERT_EQ(-5, toInt(z));
+  ASSERT_EQ(-41, toInt(op(BcIns::kSUBZ, fromInt(-23), fromInt(18))));
+  ASSERT_EQ(-356136, toInt(op(BcIns::kMULZ, fromInt(-456), fromInt(781))));
+  ASSERT_EQ(-2, toInt(op(BcIns::kQUOTZ, fromInt(-8), fromInt(3))));
+  ASSERT_EQ(-2, toInt(op(BcIns::kREMZ, fromInt(-8), fromInt(3))));
+  ASSERT_EQ(40, toInt(op(BcIns::kSHLZ, fromInt(5), 3)));
+  ASSERT_EQ(-3, toInt(op(BcIns::kSHRZ, fromInt(-5), 1)));
+  ASSERT_EQ(-1, compare(fromInt(-5), fromInt(3)));
+  ASSERT_EQ(0, compare(fromInt(3), fromInt(3)));
+  ASSERT_EQ(1, compare(fromInt(3), fromInt(-5)));
+}
+
+TEST_F(IntegerTest, Overflow) {
+  const WordInt kMax = (WordInt)(~(Word)0 >> 1);
+  const WordInt kMin = -kMax - 1;
+
+  Closure *z = op(BcIns::kADDZ, fromInt(kMax), fromInt(1));
+  ASSERT_EQ(MiscClosures::stg_BIGPOS_info, z->info());
+  ASSERT_EQ((Word)1, limbs(z));
+  ASSERT_EQ((Word)kMin, ((ByteArrayClosure *)z)->payload_[0]);
+  ASSERT_EQ(kMin, toInt(z));  // wraps around
+  ASSERT_EQ(1, compare(z, fromInt(kMax)));
+  z = op(BcIns::kSUBZ, z, fromInt(1));
+  ASSERT_TRUE(isSmallInteger(z));
+  ASSERT_EQ(kMax, toInt(z));
+
+  z = op(BcIns::kSUBZ, fromInt(kMin), fromInt(1));
+  ASSERT_EQ(MiscClosures::stg_BIGNEG_info, z->info());
+  ASSERT_EQ(-1, compare(z, fromInt(kMin)));
+  ASSERT_EQ(kMax, toInt(z));
+
+  z = op(BcIns::kQUOTZ, fromInt(kMin), fromInt(-1));
+  ASSERT_EQ(MiscClosures::stg_BIGPOS_info, z->info());
+  ASSERT_EQ(0, compare(z, op(BcIns::kMULZ, fromInt(kMin), fromInt(-1))));
+  ASSERT_EQ(0, toInt(op(BcIns::kREMZ, fromInt(kMin), fromInt(-1))));
+}
+
+TEST_F(IntegerTest, Big) {
+  // x = 2^62 * 2^62 + 5 = 2^124 + 5
+  Closure *p = op(BcIns::kSHLZ, fromInt(1), 62);
+  Closure *x = op(BcIns::kADDZ, op(BcIns::kMULZ, p, p), fromInt(5));
+  ASSERT_EQ(MiscClosures::stg_BIGPOS_info, x->info());
+  ASSERT_EQ((Word)2, limbs(x));
+  ASSERT_EQ(5, toInt(op(BcIns::kREMZ, x, p)));
+  Closure *q = op(BcIns::kQUOTZ, x, p);
+  ASSERT_TRUE(isSmallInteger(q));
+  ASSERT_EQ((WordInt)1 << 62, toInt(q));
+
+  // (x * -x) `quot` x == -x, with a multi-limb divisor.
+  Closure *nx = op(BcIns::kSUBZ, fromInt(0), x);
+  ASSERT_EQ(MiscClosures::stg_BIGNEG_info, nx->info());
+  Closure *y = op(BcIns::kMULZ, x, nx);
+  ASSERT_EQ((Word)4, limbs(y));
+  ASSERT_EQ(0, compare(op(BcIns::kQUOTZ, y, x), nx));
+  ASSERT_EQ(0, toInt(op(BcIns::kREMZ, y, nx)));
+  ASSERT_EQ(-1, compare(y, nx));
+  ASSERT_EQ(1, compare(x, nx));
+
+  // Shifts round towards negative infinity.
+  Closure *s = op(BcIns::kSHLZ, fromInt(-3), 100);
+  ASSERT_EQ(MiscClosures::stg_BIGNEG_info, s->info());
+  ASSERT_EQ(-3, toInt(op(BcIns::kSHRZ, s, 100)));
+  s = op(BcIns::kSUBZ, s, fromInt(1));
+  ASSERT_EQ(-4, toInt(op(BcIns::kSHRZ, s, 100)));
+  ASSERT_EQ(-1, toInt(op(BcIns::kSHRZ, s, 200)));
+}
+
+class ArrayTest : public CodeTest {
+};
+
+TEST_F(ArrayTest, ReadWrite) {
+  Closure *k = MiscClosures::stg_NO_VALUE_closure_addr;
+  Closure *x = MiscClosures::stg_STOP_closure_addr;
+  T->setPC(&code_[0]);
+  T->setSlot(1, 300);
+  T->setSlot(2, (Word)k);
+  T->setSlot(3, 200);
+  T->setSlot(4, (Word)x);
+  code_[0] = BcIns::abc(BcIns::kNEWARR, 0, 1, 2);
+  code_[1] = BcIns::abc(BcIns::kWRITEARR, 4, 0, 3);
+  code_[2] = BcIns::abc(BcIns::kREADARR, 5, 0, 3);
+  code_[3] = BcIns::ad(BcIns::kSIZEARR, 6, 0);
+  code_[4] = BcIns::ad(BcIns::kFREEZEARR, 7, 0);
+  code_[5] = stop();
+  ASSERT_TRUE(cap_->run(T));
+
+  ArrayClosure *arr = (ArrayClosure *)T->slot(0);
+  ASSERT_EQ((Word)arr, T->slot(7));
+  ASSERT_EQ(MiscClosures::stg_ARR_info, arr->info());
+  ASSERT_EQ((Word)300, T->slot(6));
+  ASSERT_EQ((Word)x, T->slot(5));
+  ASSERT_EQ(k, arr->payload_[199]);
+  ASSERT_EQ(k, arr->payload_[299]);
+  // A static initial value does not dirty any cards.  The write only
+  // dirties the card of element 200.
+  ASSERT_EQ((Word)3, ArrayClosure::numCards(300));
+  EXPECT_EQ(0, arr->cards()[0]);
+  EXPECT_EQ(1, arr->cards()[1]);
+  EXPECT_EQ(0, arr->cards()[2]);
+
+  T->setPC(&code_[0]);
+  code_[0] = BcIns::ad(BcIns::kTHAWARR, 1, 0);
+  code_[1] = stop();
+  ASSERT_TRUE(cap_->run(T));
+  ASSERT_EQ(MiscClosures::stg_MUT_ARR_info, arr->info());
+}
+
+TEST_F(ArrayTest, Copy) {
+  Closure *k = MiscClosures::stg_NO_VALUE_closure_addr;
+  Closure *x = MiscClosures::stg_STOP_closure_addr;
+  T->setPC(&code_[0]);
+  T->setSlot(1, 300);
+  T->setSlot(2, (Word)k);
+  T->setSlot(3, 1);
+  T->setSlot(4, (Word)x);
+  T->setSlot(5, 3);
+  T->setSlot(6, 280);
+  code_[0] = BcIns::abc(BcIns::kNEWARR, 0, 1, 2);
+  code_[1] = BcIns::abc(BcIns::kNEWARR, 7, 1, 2);
+  code_[2] = BcIns::abc(BcIns::kWRITEARR, 4, 0, 3);    // r0[1] = x
+  // r7[280..282] = r0[1..3]
+  code_[3] = BcIns::abc(BcIns::kCOPYARR, 0, 3, 7);
+  code_[4] = BcIns::args(6, 5, 0, 0);
+  // r0[3] = r0[1], overlapping
+  code_[5] = BcIns::abc(BcIns::kCOPYARR, 0, 3, 0);
+  code_[6] = BcIns::args(5, 3, 0, 0);
+  code_[7] = stop();
+  ASSERT_TRUE(cap_->run(T));
+
+  ArrayClosure *src = (ArrayClosure *)T->slot(0);
+  ArrayClosure *dst = (ArrayClosure *)T->slot(7);
+  EXPECT_EQ(x, dst->payload_[280]);
+  EXPECT_EQ(k, dst->payload_[281]);
+  EXPECT_EQ(k, dst->payload_[279]);
+  EXPECT_EQ(x, src->payload_[1]);
+  EXPECT_EQ(k, src->payload_[2]);
+  EXPECT_EQ(x, src->payload_[3]);
+  EXPECT_EQ(0, dst->cards()[0]);
+  EXPECT_EQ(0, dst->cards()[1]);
+  EXPECT_EQ(1, dst->cards()[2]);
+}
+
+class ByteArrayTest : public CodeTest {
+};
+
+TEST_F(ByteArrayTest, Bulk) {
+  T->setPC(&code_[0]);
+  T->setSlot(1, 100);
+  T->setSlot(2, 10);
+  T->setSlot(3, 20);
+  T->setSlot(4, 0x4142);
+  T->setSlot(7, 0);
+  code_[0] = BcIns::abc(BcIns::kNEWBYTEA, 0, 1, 0);
+  code_[1] = BcIns::abc(BcIns::kNEWBYTEA, 5, 1, 0);
+  code_[2] = BcIns::abc(BcIns::kSETBYTEA, 0, 7, 1);  // r0[0..99] = 0
+  code_[3] = BcIns::args(7, 0, 0, 0);
+  code_[4] = BcIns::abc(BcIns::kSETBYTEA, 5, 7, 1);  // r5[0..99] = 0
+  code_[5] = BcIns::args(7, 0, 0, 0);
+  code_[6] = BcIns::abc(BcIns::kSETBYTEA, 0, 2, 3);  // r0[10..29] = 0x42
+  code_[7] = BcIns::args(4, 0, 0, 0);
+  // r5[20..39] = r0[10..29]
+  code_[8] = BcIns::abc(BcIns::kCOPYBYTEA, 0, 2, 5);
+  code_[9] = BcIns::args(3, 3, 0, 0);
+  // r6 = compare r0[10..29] r5[20..39]
+  code_[10] = BcIns::abc(BcIns::kCMPBYTEA, 6, 0, 2);
+  code_[11] = BcIns::args(5, 3, 3, 0);
+  // r7 = find 0x42 in r5[10..19]
+  code_[12] = BcIns::abc(BcIns::kFINDBYTEA, 7, 5, 2);
+  code_[13] = BcIns::args(2, 4, 0, 0);
+  code_[14] = stop();
+  ASSERT_TRUE(cap_->run(T));
+
+  ByteArrayClosure *a = (ByteArrayClosure *)T->slot(0);
+  ByteArrayClosure *b = (ByteArrayClosure *)T->slot(5);
+  u1 *p = (u1 *)a->payload_;
+  u1 *q = (u1 *)b->payload_;
+  EXPECT_EQ(0, p[9]);
+  EXPECT_EQ(0x42, p[10]);
+  EXPECT_EQ(0x42, p[29]);
+  EXPECT_EQ(0, p[30]);
+  EXPECT_EQ(0, q[19]);
+  EXPECT_EQ(0x42, q[20]);
+  EXPECT_EQ(0x42, q[39]);
+  EXPECT_EQ(0, q[40]);
+  EXPECT_EQ((Word)0, T->slot(6));
+  EXPECT_EQ((Word)-1, T->slot(7));
+
+  // r7 = find 0x42 in r5[10..29]
+  T->setPC(&code_[12]);
+  code_[13] = BcIns::args(3, 4, 0, 0);
+  ASSERT_TRUE(cap_->run(T));
+  EXPECT_EQ((Word)20, T->slot(7));
+
+  q[25] = 0x43;
+  T->setPC(&code_[10]);
+  ASSERT_TRUE(cap_->run(T));
+  EXPECT_EQ((Word)-1, T->slot(6));
+}
+
+TEST(ByteArrayKernelTest, CompareFind) {
+  MemoryManager mm;
+  ByteArrayClosure *a = mm.allocByteArray(300);
+  ByteArrayClosure *b = mm.allocByteArray(300);
+  u1 *p = (u1 *)a->payload_;
+  u1 *q = (u1 *)b->payload_;
+  for (int i = 0; i < 300; ++i)
+    p[i] = q[i] = (u1)(i * 7);
+  int best = detectByteArrayKernels();
+  for (int k = BYTEARRAY_KERNELS_SCALAR; k <= best; ++k) {
+    setByteArrayKernels(k);
+    ASSERT_EQ(k, byteArrayKernels());
+    // Every offset and length around the vector sizes.
+    for (Word ofs = 0; ofs < 40; ++ofs) {
+      for (Word n = 0; n < 100; ++n) {
+        ASSERT_EQ(0, compareByteArrays((Closure *)a, ofs, (Closure *)b,
+                                       ofs, n));
+        for (Word d = 0; d < n; d += 13) {
+          q[ofs + d] ^= 0x80;
+          WordInt expected = p[ofs + d] < q[ofs + d] ? -1 : 1;
+          EXPECT_EQ(expected, compareByteArrays((Closure *)a, ofs,
+                                                (Closure *)b, ofs, n));
+          q[ofs + d] ^= 0x80;
+        }
+        const u1 *r = (const u1 *)memchr(p + ofs, 0xff, n);
+        WordInt expected = r ? (WordInt)(r - p) : -1;
+        EXPECT_EQ(expected, findByteArray((Closure *)a, ofs, n, 0xff));
+        if (n > 0) {
+          EXPECT_EQ((WordInt)ofs,
+                    findByteArray((Closure *)a, ofs, n, p[ofs]));
+        }
+      }
+    }
+  }
+  setByteArrayKernels(best);
+}
+
+class ConcTest : public CodeTest {
+};
+
+TEST_F(ConcTest, MVarTakePut) {
+  T->setPC(&code_[0]);
+  T->setSlot(1, 0x1230);
+  T->setSlot(2, 0);
+  code_[0] = BcIns::ad(BcIns::kNEWMVAR, 0, 0);
+  code_[1] = BcIns::bitmapOffset(0);
+  code_[2] = BcIns::ad(BcIns::kPUTMVAR, 0, 1);
+  code_[3] = BcIns::bitmapOffset(0);
+  code_[4] = BcIns::ad(BcIns::kTAKEMVAR, 2, 0);
+  code_[5] = BcIns::bitmapOffset(0);
+  ASSERT_TRUE(cap_->run(T));
+  MVarClosure *mvar = (MVarClosure *)T->slot(0);
+  ASSERT_EQ(MiscClosures::stg_MVAR_info, mvar->info());
+  ASSERT_EQ((Word)0x1230, T->slot(2));
+  ASSERT_EQ(MiscClosures::stg_NO_VALUE_closure_addr, mvar->value_);
+
+  // Taking from an empty MVar with no other thread to run.
+  T->setPC(&code_[4]);
+  ASSERT_FALSE(cap_->run(T));
+  ASSERT_EQ(&code_[4], T->pc());
+  ASSERT_EQ(T, mvar->head_);
+}
+
+TEST_F(ConcTest, Fork) {
+  T->setPC(&code_[0]);
+  T->setSlot(1, 0x1230);  // never run
+  code_[0] = BcIns::ad(BcIns::kFORK, 0, 1);
+  code_[1] = BcIns::bitmapOffset(0);
+  ASSERT_TRUE(cap_->run(T));
+  ASSERT_EQ((size_t)1, cap_->threads().size());
+  ASSERT_EQ((size_t)1, cap_->runQueueLength());
+  Thread *child = cap_->threads()[0];
+  Closure *tid = (Closure *)T->slot(0);
+  ASSERT_EQ(MiscClosures::stg_THREADID_info, tid->info());
+  ASSERT_EQ(child->id(), tid->payload(0));
+  ASSERT_EQ((Word)0x1230, child->slot(0));
+  ASSERT_EQ(BcIns::kYIELD, child->pc()->opcode());
+}
+
+// Builds a chain of N+1 MVars (each full MVar points to the previous
+// one) and then counts its length.  The chain must survive the GCs
+// triggered by either capability.
+static const Word kSMPChainLength = 20000;
+
+static void
+initChainCode(BcIns *code)
+{
+  u2 *bitmaps = (u2 *)&code[17];  // bitmaps follow the code
+  bitmaps[0] = 1; bitmaps[1] = 1 | 2 | 4 | 8;            // r0
+  bitmaps[2] = 1 | 32; bitmaps[3] = 1 | 2 | 4 | 8 | 32;  // r0, r5
+  code[0] = BcIns::ad(BcIns::kNEWMVAR, 0, 0);
+  code[1] = BcIns::bitmapOffset(0);
+  code[2] = BcIns::ad(BcIns::kNEWMVAR, 5, 0);
+  code[3] = BcIns::bitmapOffset(byteOffset32(&code[3], &bitmaps[0]));
+  code[4] = BcIns::ad(BcIns::kPUTMVAR, 5, 0);
+  code[5] = BcIns::bitmapOffset(byteOffset32(&code[5], &bitmaps[2]));
+  code[6] = BcIns::ad(BcIns::kMOV, 0, 5);
+  code[7] = BcIns::abc(BcIns::kADDRR, 1, 1, 3);
+  code[8] = BcIns::ad(BcIns::kISLT, 1, 2);
+  code[9] = BcIns::aj(BcIns::kJMP, 0, -8);
+  code[10] = BcIns::ad(BcIns::kISEQ, 0, 6);
+  code[11] = BcIns::aj(BcIns::kJMP, 0, 4);
+  code[12] = BcIns::abc(BcIns::kLOADF, 0, 0, 1);
+  code[13] = BcIns::abc(BcIns::kADDRR, 4, 4, 3);
+  code[14] = BcIns::ad(BcIns::kISNE, 0, 6);
+  code[15] = BcIns::aj(BcIns::kJMP, 0, -4);
+  code[16] = BcIns::ad(BcIns::kSTOP, 0, 0);
+}
+
+typedef struct {
+  Capability *cap;
+  Thread *T;
+  bool ok;
+} SMPWorker;
+
+static void *
+runSMPWorker(void *arg)
+{
+  SMPWorker *w = (SMPWorker *)arg;
+  w->ok = w->cap->run(w->T);
+  return NULL;
+}
+
+TEST(SMPTest, SharedHeap) {
+  MemoryManager mm;
+  mm.setNurserySize(2 * Block::kBlockSize);
+  Loader l(&mm, NULL);
+  BcIns code[19];
+  initChainCode(code);
+
+  const int kCaps = 2;
+  Capability *caps[kCaps];
+  SMPWorker workers[kCaps];
+  pthread_t tids[kCaps];
+  for (int i = 0; i < kCaps; ++i) {
+    caps[i] = new Capability(&mm);
+    Thread *T = Thread::createThread(caps[i], 1U << 10);
+    T->top_ = T->base() + 7;
+    T->setPC(&code[0]);
+    T->setSlot(1, 0);
+    T->setSlot(2, kSMPChainLength);
+    T->setSlot(3, 1);
+    T->setSlot(4, 0);
+    T->setSlot(6, (Word)MiscClosures::stg_NO_VALUE_closure_addr);
+    workers[i].cap = caps[i];
+    workers[i].T = T;
+    workers[i].ok = false;
+  }
+  ASSERT_EQ((u4)kCaps, mm.numCapabilities());
+  for (int i = 0; i < kCaps; ++i)
+    pthread_create(&tids[i], NULL, runSMPWorker, &workers[i]);
+  for (int i = 0; i < kCaps; ++i)
+    pthread_join(tids[i], NULL);
+
+  EXPECT_LT((uint32_t)0, mm.numGCs());
+  for (int i = 0; i < kCaps; ++i) {
+    EXPECT_TRUE(workers[i].ok);
+    EXPECT_EQ(kSMPChainLength + 1, workers[i].T->slot(4));
+    EXPECT_FALSE(caps[i]->isAttached());
+    delete workers[i].T;
+    delete caps[i];
+  }
+}
+
+// An info table that runs the given code.  It is a copy of the info
+// table `tmpl', which determines its type and layout.
+static CodeInfoTable *
+codeInfoTable(MemoryManager &mm, InfoTable *tmpl, BcIns *code, u2 sizecode,
+              u1 framesize, u1 arity, Word *lits = NULL, u2 sizelits = 0,
+              u1 *littypes = NULL)
+{
+  static u1 closureLittypes[] = { LIT_CLOSURE, LIT_CLOSURE, LIT_CLOSURE };
+  if (littypes == NULL)
+    littypes = closureLittypes;
+  AllocInfoTableHandle h(mm);
+  CodeInfoTable *info = static_cast<CodeInfoTable *>
+    (mm.allocInfoTable(h, wordsof(CodeInfoTable)));
+  *info = *static_cast<CodeInfoTable *>(tmpl);
+  Code *c = const_cast<Code *>(info->code());
+  c->code = code;
+  c->sizecode = sizecode;
+  c->framesize = framesize;
+  c->arity = arity;
+  c->lits = lits;
+  c->littypes = littypes;
+  c->sizelits = sizelits;
+  c->sizebitmaps = 0;
+  return info;
+}
+
+// The protection of the mapping that contains `p', as shown in
+// /proc/self/maps, e.g., "r-xp".
+static std::string
+mappingProtection(void *p)
+{
+  std::ifstream maps("/proc/self/maps");
+  std::string line;
+  uintptr_t addr = (uintptr_t)p;
+  while (std::getline(maps, line)) {
+    unsigned long from, to;
+    char prot[5];
+    if (sscanf(line.c_str(), "%lx-%lx %4s", &from, &to, prot) == 3 &&
+        from <= addr && addr < to)
+      return prot;
+  }
+  return "";
+}
+
+// A capability that runs a loop which neither allocates nor returns
+// must still stop when another capability stops the world, also once
+// the loop has been compiled to a trace.
+TEST(SMPTest, SafepointInLoop) {
+  MemoryManager mm;
+  Loader l(&mm, NULL);
+  InfoTable *funInfo = MiscClosures::stg_STOP_closure_addr->info();
+
+  // loop flag zero self =
+  //   if flag.1 /= zero then stop else loop flag zero self
+  BcIns code[7];
+  code[0] = BcIns::ad(BcIns::kFUNC, 4, 0);
+  code[1] = BcIns::abc(BcIns::kLOADF, 3, 0, 1);
+  code[2] = BcIns::ad(BcIns::kISNE, 3, 1);
+  code[3] = BcIns::aj(BcIns::kJMP, 0, 2);
+  code[4] = BcIns::abc(BcIns::kCALLT, 2, 0, 3);
+  code[5] = BcIns::bitmapOffset(1 | 4);  // pointer mask: r0, r2
+  code[6] = BcIns::ad(BcIns::kSTOP, 0, 0);
+  Closure *fun = mm.allocStaticClosure(0);
+  fun->setInfo(codeInfoTable(mm, funInfo, code, 7, 4, 3));
+  Closure *flag = mm.allocStaticClosure(1);
+  flag->setInfo(MiscClosures::stg_NO_VALUE_closure_addr->info());
+  flag->setPayload(0, 0);
+
+  Capability *cap = new Capability(&mm);
+  Capability *stopper = new Capability(&mm);
+  Thread *T = Thread::createThread(cap, 1U << 10);
+  T->top_ = T->base() + 4;
+  T->setPC(&code[1]);
+  T->setSlot(0, (Word)flag);
+  T->setSlot(1, 0);
+  T->setSlot(2, (Word)fun);
+  SMPWorker worker = { cap, T, false };
+  uint32_t fragments = Jit::numFragments();
+  pthread_t tid;
+  pthread_create(&tid, NULL, runSMPWorker, &worker);
+
+  // Wait until the loop runs as a trace.
+  while (Jit::numFragments() == fragments)
+    sched_yield();
+
+  // The loop can only end after the world has been stopped.  The
+  // stop fails while the other capability compiles a trace.
+  stopper->attach();
+  while (!mm.stopOtherCapabilities())
+    sched_yield();
+  // The machine code area is only writable during compilation.
+  EXPECT_EQ("r-xp", mappingProtection(cap->jit()->mcode()->start()));
+  flag->setPayload(0, 1);
+  mm.resumeOtherCapabilities();
+  stopper->detach();
+  pthread_join(tid, NULL);
+
+  EXPECT_TRUE(worker.ok);
+  EXPECT_EQ(BcIns::kJFUNC, code[0].opcode());
+  delete T;
+  delete stopper;
+  delete cap;
+}
+
+TEST_F(ConcTest, Spark) {
+  Closure *thunk = mm.allocStaticClosure(2);
+  thunk->setInfo(MiscClosures::getApInfo(1, 0));
+  T->setPC(&code_[0]);
+  T->setSlot(1, (Word)thunk);
+  T->setSlot(2, 0x1230 | 1);  // an evaluated constructor
+  code_[0] = BcIns::ad(BcIns::kSPARK, 1, 0);
+  code_[1] = BcIns::ad(BcIns::kSPARK, 2, 0);
+  ASSERT_TRUE(cap_->run(T));
+  ASSERT_EQ(1, cap_->sparkPoolSize());
+  ASSERT_EQ((uint64_t)1, cap_->sparkStats().created);
+  ASSERT_EQ((uint64_t)1, cap_->sparkStats().dud);
+  Closure *spark = NULL;
+  ASSERT_TRUE(cap_->popSpark(&spark));
+  ASSERT_EQ(thunk, spark);
+  ASSERT_FALSE(cap_->popSpark(&spark));
+}
+
+// Byte arrays allocated by helper calls on a trace are counted per
+// call site of the trace.
+TEST(AllocProfileTest, HelperCallsOnTraces) {
+  MemoryManager mm;
+  Loader l(&mm, NULL);
+  InfoTable *funInfo = MiscClosures::stg_EVAL_closure_addr->info();
+
+  // loop i limit self one =
+  //   if i == limit then stop
+  //   else newByteArray one; loop (i + one) limit self one
+  BcIns loop[8];
+  loop[0] = BcIns::ad(BcIns::kFUNC, 5, 0);
+  loop[1] = BcIns::ad(BcIns::kISEQ, 0, 1);
+  loop[2] = BcIns::aj(BcIns::kJMP, 0, 4);
+  loop[3] = BcIns::abc(BcIns::kNEWBYTEA, 4, 3, 0);
+  loop[4] = BcIns::abc(BcIns::kADDRR, 0, 0, 3);
+  loop[5] = BcIns::abc(BcIns::kCALLT, 2, 0, 4);
+  loop[6] = BcIns::bitmapOffset(4);  // pointer mask: r2
+  loop[7] = BcIns::ad(BcIns::kSTOP, 0, 0);
+  Closure *fun = mm.allocStaticClosure(0);
+  fun->setInfo(codeInfoTable(mm, funInfo, loop, 8, 5, 4));
+
+  const Word kIterations = 10000;
+  Capability cap(&mm);
+  cap.enableAllocProfiling();
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  T->top_ = T->base() + 5;
+  T->setPC(&loop[1]);
+  T->setSlot(0, 0);
+  T->setSlot(1, kIterations);
+  T->setSlot(2, (Word)fun);
+  T->setSlot(3, 1);
+  uint32_t fragments = Jit::numFragments();
+  ASSERT_TRUE(cap.run(T));
+  ASSERT_EQ(kIterations, T->slot(0));
+
+  uint64_t allocs = 0, bytes = 0;
+  for (uint32_t t = fragments; t < Jit::numFragments(); ++t) {
+    Fragment *F = Jit::traceById(t);
+    for (uint32_t c = 0; c < F->numAllocCalls(); ++c) {
+      EXPECT_EQ(&loop[3], F->allocCall(c).pc);
+      EXPECT_EQ(fun->info(), F->allocCall(c).fun);
+      allocs += F->allocCall(c).allocs;
+      bytes += F->allocCall(c).bytes;
+    }
+  }
+  EXPECT_LT((uint64_t)kIterations / 2, allocs);
+  EXPECT_GT((uint64_t)kIterations, allocs);
+  EXPECT_EQ(allocs * (sizeof(ByteArrayClosure) + sizeof(Word)), bytes);
+  // The interpreter counted the rest.
+  EXPECT_EQ((size_t)1, cap.allocProfile().numSites());
+  delete T;
+}
+
+class ExceptionTest : public CodeTest {
+protected:
+  virtual void SetUp() {
+    CodeTest::SetUp();
+    InfoTable *funInfo = MiscClosures::stg_EVAL_closure_addr->info();
+    exc_ = MiscClosures::stg_NO_VALUE_closure_addr;
+
+    raiseCode_[0] = BcIns::ad(BcIns::kFUNC, 1, 0);
+    raiseCode_[1] = BcIns::ad(BcIns::kRAISE, 0, 0);
+    raiseFun_ = mm.allocStaticClosure(1);
+    raiseFun_->setInfo(codeInfoTable(mm, funInfo, raiseCode_, 2, 1, 1));
+
+    // An AP thunk that raises exc_ when evaluated.
+    thunk_ = mm.allocStaticClosure(2);
+    thunk_->setInfo(MiscClosures::getApInfo(1, 1));
+    thunk_->setPayload(0, (Word)raiseFun_);
+    thunk_->setPayload(1, (Word)exc_);
+
+    // \s -> thunk_ `seq` ...
+    actionCode_[0] = BcIns::ad(BcIns::kFUNC, 1, 0);
+    actionCode_[1] = BcIns::ad(BcIns::kLOADFV, 0, 1);
+    actionCode_[2] = BcIns::ad(BcIns::kEVAL, 0, 0);
+    actionCode_[3] = BcIns::bitmapOffset(0);
+    actionCode_[4] = BcIns::ad(BcIns::kMOV_RES, 0, 0);
+    actionCode_[5] = BcIns::ad(BcIns::kRET1, 0, 0);
+    action_ = mm.allocStaticClosure(1);
+    action_->setInfo(codeInfoTable(mm, funInfo, actionCode_, 6, 1, 1));
+    action_->setPayload(0, (Word)thunk_);
+
+    // \e s -> e
+    handlerCode_[0] = BcIns::ad(BcIns::kFUNC, 2, 0);
+    handlerCode_[1] = BcIns::ad(BcIns::kRET1, 0, 0);
+    handler_ = mm.allocStaticClosure(1);
+    handler_->setInfo(codeInfoTable(mm, funInfo, handlerCode_, 2, 2, 2));
+
+    // catch# action_ handler_
+    mainLits_[0] = (Word)action_;
+    mainLits_[1] = (Word)handler_;
+    mainCode_[0] = BcIns::ad(BcIns::kIFUNC, 3, 0);
+    mainCode_[1] = BcIns::ad(BcIns::kLOADK, 1, 0);
+    mainCode_[2] = BcIns::ad(BcIns::kLOADK, 2, 1);
+    mainCode_[3] = BcIns::ad(BcIns::kCATCH, 1, 2);
+    mainCode_[4] = BcIns::bitmapOffset(0);
+    mainCode_[5] = BcIns::ad(BcIns::kMOV_RES, 0, 0);
+    mainCode_[6] = BcIns::ad(BcIns::kRET1, 0, 0);
+    main_ = mm.allocStaticClosure(1);
+    main_->setInfo(codeInfoTable(mm, MiscClosures::stg_RAISE_info,
+                                 mainCode_, 7, 3, 0, mainLits_, 2));
+    main_->setPayload(0, (Word)exc_);
+  }
+
+  Closure *exc_, *raiseFun_, *thunk_, *action_, *handler_, *main_;
+  BcIns raiseCode_[2], actionCode_[6], handlerCode_[2], mainCode_[7];
+  Word mainLits_[2];
+};
+
+TEST_F(ExceptionTest, Catch) {
+  Thread *T1 = Thread::createThread(cap_, 1U << 10);
+  ASSERT_TRUE(cap_->eval(T1, main_));
+  // main_ has been updated with the result of the handler.
+  ASSERT_EQ(MiscClosures::stg_IND_info, main_->info());
+  ASSERT_EQ((Word)exc_, (Word)untag((Closure *)main_->payload(0)));
+  // The thunk raises the exception again if it is evaluated again.
+  ASSERT_EQ(MiscClosures::stg_RAISE_info, thunk_->info());
+  ASSERT_EQ((Word)exc_, thunk_->payload(0));
+  delete T1;
+}
+
+TEST_F(ExceptionTest, Uncaught) {
+  Thread *T1 = Thread::createThread(cap_, 1U << 10);
+  ASSERT_FALSE(cap_->eval(T1, thunk_));
+  ASSERT_EQ(MiscClosures::stg_RAISE_info, thunk_->info());
+  // Evaluating the updated thunk raises the exception again.
+  Thread *T2 = Thread::createThread(cap_, 1U << 10);
+  ASSERT_FALSE(cap_->eval(T2, thunk_));
+  delete T1;
+  delete T2;
+}
+
+static double ffiTestMix(Word a, double x, Word b, float y) {
+  return a * x + b + y;
+}
+
+static double ffiTestSeen = 0;
+
+static void ffiTestSetSeen(double d) {
+  ffiTestSeen = d;
+}
+
+static Word ffiTestSum6(Word a, Word b, Word c, Word d, Word e, Word f) {
+  return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f;
+}
+
+static float ffiTestScale(float x, Word n) {
+  return x * n;
+}
+
+TEST(FfiTest, Call) {
+  FfiType words[] = { FFI_WORD, FFI_WORD, FFI_WORD, FFI_WORD, FFI_WORD,
+                      FFI_WORD };
+  Word args[] = { 1, 2, 3, 4, 5, 6 };
+  EXPECT_EQ((Word)91, ffiCall((const void *)&ffiTestSum6,
+                              ffiSignature(FFI_WORD, 6, words), 6, args));
+
+  FfiType mixed[] = { FFI_WORD, FFI_DOUBLE, FFI_WORD, FFI_FLOAT };
+  Word margs[] = { 3, lc_d2w(0.5), 2, lc_f2w(0.25f) };
+  u2 sig = ffiSignature(FFI_DOUBLE, 4, mixed);
+  EXPECT_EQ(FFI_DOUBLE, ffiResultType(sig));
+  EXPECT_EQ(FFI_FLOAT, ffiArgType(sig, 3));
+  EXPECT_EQ(3.75, lc_w2d(ffiCall((const void *)&ffiTestMix, sig, 4, margs)));
+
+  FfiType fw[] = { FFI_FLOAT, FFI_WORD };
+  Word fargs[] = { lc_f2w(1.5f), 4 };
+  EXPECT_EQ(6.0f, lc_w2f(ffiCall((const void *)&ffiTestScale,
+                                 ffiSignature(FFI_FLOAT, 2, fw), 2, fargs)));
+
+  // Varargs functions need %al to be set.
+  char out[32];
+  FfiType pf[] = { FFI_WORD, FFI_WORD, FFI_WORD, FFI_WORD, FFI_DOUBLE };
+  Word pargs[] = { (Word)out, sizeof(out), (Word)"%d %.1f", 42, lc_d2w(2.5) };
+  EXPECT_EQ((Word)6, ffiCall((const void *)&snprintf,
+                             ffiSignature(FFI_WORD, 5, pf), 5, pargs));
+  EXPECT_STREQ("42 2.5", out);
+}
+
+TEST(FfiTest, Lookup) {
+  registerForeignFunction("ffiTestMix", (const void *)&ffiTestMix);
+  EXPECT_EQ((const void *)&ffiTestMix, lookupForeignFunction("ffiTestMix"));
+  EXPECT_TRUE(lookupForeignFunction("strlen") != NULL);
+  EXPECT_TRUE(lookupForeignFunction("no_such_foreign_function") == NULL);
+}
+
+class ForeignCallTest : public CodeTest {
+};
+
+// A thunk that calls ffiTestMix and passes the result to
+// ffiTestSetSeen in a safe call.
+TEST_F(ForeignCallTest, Interp) {
+  FfiType mixed[] = { FFI_WORD, FFI_DOUBLE, FFI_WORD, FFI_FLOAT };
+  FfiType dbl[] = { FFI_DOUBLE };
+  Closure *result = MiscClosures::stg_NO_VALUE_closure_addr;
+  Word lits[] = { (Word)&ffiTestMix, 7, lc_d2w(1.5), lc_f2w(0.25f),
+                  (Word)&ffiTestSetSeen, (Word)result };
+  u1 littypes[] = { LIT_CFUNC, LIT_INT, LIT_DOUBLE, LIT_FLOAT, LIT_CFUNC,
+                    LIT_CLOSURE };
+  BcIns code[13];
+  code[0] = BcIns::ad(BcIns::kIFUNC, 4, 0);
+  code[1] = BcIns::ad(BcIns::kLOADK, 1, 1);
+  code[2] = BcIns::ad(BcIns::kLOADK, 2, 2);
+  code[3] = BcIns::ad(BcIns::kLOADK, 3, 3);
+  code[4] = BcIns::abc(BcIns::kCCALL, 0, 0, 4);
+  code[5] = BcIns::foreignCallInfo(0, ffiSignature(FFI_DOUBLE, 4, mixed));
+  code[6] = BcIns::args(1, 2, 1, 3);
+  code[7] = BcIns::abc(BcIns::kCCALLS, 1, 0, 1);
+  code[8] = BcIns::foreignCallInfo(4, ffiSignature(FFI_VOID, 1, dbl));
+  code[9] = BcIns::args(0, 0, 0, 0);
+  code[10] = BcIns::bitmapOffset(0);
+  code[11] = BcIns::ad(BcIns::kLOADK, 0, 5);
+  code[12] = BcIns::ad(BcIns::kRET1, 0, 0);
+  Closure *thunk = mm.allocStaticClosure(1);
+  thunk->setInfo(codeInfoTable(mm, MiscClosures::stg_RAISE_info, code, 13,
+                               4, 0, lits, 6, littypes));
+  thunk->setPayload(0, (Word)result);
+
+  ffiTestSeen = 0;
+  Thread *T1 = Thread::createThread(cap_, 1U << 10);
+  ASSERT_TRUE(cap_->eval(T1, thunk));
+  EXPECT_EQ(7 * 1.5 + 7 + 0.25, ffiTestSeen);
+  ASSERT_EQ(MiscClosures::stg_IND_info, thunk->info());
+  delete T1;
+}
+
+TEST(HandleTest, Write) {
+  char path[32];
+  ioTestFile(path);
+  int fd = open(path, O_WRONLY | O_TRUNC);
+  ASSERT_NE(-1, fd);
+  {
+    Handle h(fd, true);
+    EXPECT_TRUE(h.write("abc", 3));
+    EXPECT_TRUE(h.putChar('d'));
+    EXPECT_TRUE(h.putChar(0xe9));
+    EXPECT_TRUE(h.putChar(0x20ac));
+    EXPECT_TRUE(h.putChar(0x1f600));
+    EXPECT_EQ((size_t)(4 + 2 + 3 + 4), h.buffered());
+    EXPECT_EQ("", readFile(path));
+    // Too large for the buffer; written out directly.
+    string big(Handle::kBufferSize + 10, 'x');
+    EXPECT_TRUE(h.write(big.data(), big.size()));
+    EXPECT_EQ((size_t)0, h.buffered());
+    EXPECT_TRUE(h.putChar('y'));
+  }
+  string expected("abcd\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+  expected += string(Handle::kBufferSize + 10, 'x');
+  expected += "y";
+  EXPECT_EQ(expected, readFile(path));
+  unlink(path);
+}
+
+TEST(HandleTest, Unbuffered) {
+  char path[32];
+  ioTestFile(path);
+  int fd = open(path, O_WRONLY | O_TRUNC);
+  ASSERT_NE(-1, fd);
+  Handle h(fd, true, false);
+  EXPECT_TRUE(h.write("abc", 3));
+  EXPECT_TRUE(h.putChar(0xe9));
+  EXPECT_EQ((size_t)0, h.buffered());
+  EXPECT_EQ("abc\xc3\xa9", readFile(path));
+  unlink(path);
+}
+
+TEST(HandleTest, Close) {
+  char path[32];
+  ioTestFile(path);
+  int fd = open(path, O_WRONLY | O_TRUNC);
+  ASSERT_NE(-1, fd);
+  Handle h(fd, true);
+  EXPECT_TRUE(h.write("abc", 3));
+  EXPECT_TRUE(h.close());
+  EXPECT_EQ("abc", readFile(path));
+  EXPECT_FALSE(h.putChar('d'));
+  EXPECT_FALSE(h.write("d", 1));
+  EXPECT_FALSE(h.flush());
+  EXPECT_FALSE(h.close());
+  unlink(path);
+}
+
+struct HandleWriter {
+  Handle *handle;
+  int writes;
+};
+
+static void *writeUntilClosed(void *arg) {
+  HandleWriter *w = (HandleWriter *)arg;
+  while (w->handle->putChar('x'))
+    __atomic_add_fetch(&w->writes, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+TEST(HandleTest, CloseWhileWriting) {
+  char path[32];
+  ioTestFile(path);
+  WordInt h = HandleTable::open(path, HANDLE_WRITE);
+  ASSERT_NE(-1, h);
+  HandleWriter w = { HandleTable::get(h), 0 };
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, writeUntilClosed, &w));
+  while (__atomic_load_n(&w.writes, __ATOMIC_RELAXED) < 1000)
+    sched_yield();
+  EXPECT_TRUE(HandleTable::close(h));
+  pthread_join(thread, NULL);
+  // Everything written before the close reached the file.
+  EXPECT_EQ(string(w.writes, 'x'), readFile(path));
+  EXPECT_EQ(NULL, HandleTable::get(h));
+  EXPECT_EQ(-1, handlePutChar(h, 'y'));
+  unlink(path);
+}
+
+class IOTest : public CodeTest {
+};
+
+TEST_F(IOTest, Interp) {
+  char path[32];
+  ioTestFile(path);
+  T->setPC(&code_[0]);
+  T->setSlot(1, (Word)path);
+  T->setSlot(2, HANDLE_WRITE);
+  T->setSlot(4, 'h');
+  T->setSlot(5, (Word)"ello ");
+  T->setSlot(7, 5);
+  code_[0] = BcIns::abc(BcIns::kHOPEN, 0, 1, 2);
+  code_[1] = BcIns::abc(BcIns::kHPUTC, 3, 0, 4);
+  code_[2] = BcIns::abc(BcIns::kHPUTS, 3, 0, 5);
+  code_[3] = BcIns::abc(BcIns::kNEWBYTEA, 6, 7, 0);
+  code_[4] = BcIns::abc(BcIns::kSETBYTEA, 6, 2, 7);  // r6[0..4] = 'h'
+  code_[5] = BcIns::args(4, 0, 0, 0);
+  code_[6] = BcIns::abc(BcIns::kHWRITEBA, 3, 0, 6);
+  code_[7] = BcIns::args(2, 7, 0, 0);
+  code_[8] = stop();
+  ASSERT_TRUE(cap_->run(T));
+  EXPECT_EQ((Word)3, T->slot(0));
+  EXPECT_EQ((Word)0, T->slot(3));
+  // STOP flushes all handles.
+  EXPECT_EQ("hello hhhhh", readFile(path));
+
+  T->setPC(&code_[0]);
+  T->setSlot(1, 3);
+  T->setSlot(2, 42);
+  code_[0] = BcIns::ad(BcIns::kHCLOSE, 0, 1);
+  code_[1] = BcIns::abc(BcIns::kHPUTC, 3, 1, 4);
+  code_[2] = BcIns::ad(BcIns::kHFLUSH, 5, 2);
+  code_[3] = stop();
+  ASSERT_TRUE(cap_->run(T));
+  EXPECT_EQ((Word)0, T->slot(0));
+  EXPECT_EQ((Word)-1, T->slot(3));
+  EXPECT_EQ((Word)-1, T->slot(5));
+  EXPECT_EQ("hello hhhhh", readFile(path));
+
+  // Closed handles are reused.
+  EXPECT_EQ(3, HandleTable::open(path, HANDLE_APPEND));
+  EXPECT_TRUE(HandleTable::close(3));
+  EXPECT_EQ(-1, HandleTable::open("/nonexistent/lcvm_iotest", HANDLE_WRITE));
+  unlink(path);
+}
+
+TEST(MMTest, MapFile) {
+  MemoryManager mm;
+  char path[32];
+  ioTestFile(path);
+  string contents;
+  for (int i = 0; i < 10000; ++i)
+    contents += (char)('a' + i % 26);
+  writeFile(path, contents);
+
+  ByteArrayClosure *arr = mm.mapFile(path);
+  ASSERT_TRUE(arr != NULL);
+  EXPECT_EQ(MiscClosures::stg_BYTEARR_info, arr->header_.info());
+  EXPECT_EQ((Word)contents.size(), arr->bytes_);
+  EXPECT_EQ(contents, string((const char *)arr->payload_, arr->bytes_));
+  EXPECT_TRUE(mm.looksLikeClosure(arr));
+  EXPECT_EQ((uint64_t)contents.size(), mm.mapped());
+
+  writeFile(path, "");
+  ByteArrayClosure *empty = mm.mapFile(path);
+  ASSERT_TRUE(empty != NULL);
+  EXPECT_EQ((Word)0, empty->bytes_);
+
+  EXPECT_TRUE(mm.mapFile("/nonexistent/lcvm_mapfile") == NULL);
+  EXPECT_TRUE(mm.mapFile("/tmp") == NULL);
+  unlink(path);
+}
+
+TEST(LoaderTest, BytecodeFile) {
+  char path[32];
+  ioTestFile(path);
+  const char bytes[] = "KHCB\x01\x02\x80\x01\x02\x03\xac\x02\x03" "abc";
+  writeFile(path, string(bytes, sizeof(bytes) - 1));
+  BytecodeFile f(path);
+  ASSERT_TRUE(f.open());
+  EXPECT_TRUE(f.magic("KHCB"));
+  EXPECT_EQ(0x0102, f.get_u2());
+  EXPECT_EQ(0x80010203U, f.get_u4());
+  EXPECT_EQ((Word)300, f.get_varuint());
+  EXPECT_EQ((WordInt)-2, f.get_varsint());
+  EXPECT_EQ(0, memcmp("abc", f.get_string(3), 3));
+  EXPECT_EQ((long)sizeof(bytes) - 1, f.offset());
+  f.close();
+
+  BytecodeFile missing("/nonexistent/lcvm_bytecode");
+  EXPECT_FALSE(missing.open());
+  unlink(path);
+}
+
+TEST_F(IOTest, MapFile) {
+  char path[32];
+  ioTestFile(path);
+  writeFile(path, "lambdachine");
+  T->setPC(&code_[0]);
+  T->setSlot(1, (Word)path);
+  T->setSlot(2, 6);
+  T->setSlot(4, (Word)"/nonexistent/lcvm_mapfile");
+  T->setSlot(5, BYTEARRAY_PAYLOAD_OFFSET + 10);
+  code_[0] = BcIns::abc(BcIns::kMAPFILE, 3, 0, 1);
+  code_[1] = BcIns::abc(BcIns::kGETA1, 6, 0, 2);
+  code_[2] = BcIns::abc(BcIns::kPTROFSC, 7, 0, 5);
+  code_[3] = BcIns::abc(BcIns::kMAPFILE, 4, 1, 4);
+  code_[4] = stop();
+  ASSERT_TRUE(cap_->run(T));
+  EXPECT_EQ((Word)0, T->slot(3));
+  EXPECT_EQ((Word)11, ((ByteArrayClosure *)T->slot(0))->bytes_);
+  EXPECT_EQ((Word)'c', T->slot(6));
+  EXPECT_EQ((Word)'e', T->slot(7));
+  EXPECT_EQ((Word)-1, T->slot(4));
+  EXPECT_EQ((Word)0, ((ByteArrayClosure *)T->slot(1))->bytes_);
+  unlink(path);
+}
+
+TEST(SparkTest, ClaimThunk) {
+  MemoryManager mm;
+  Loader l(&mm, NULL);
+  InfoTable *info = MiscClosures::getApInfo(1, 0);
+  InfoTable *bh = static_cast<CodeInfoTable *>(info)->blackholeInfo();
+  ASSERT_TRUE(bh != NULL);
+  ASSERT_EQ(BLACKHOLE, bh->type());
+  ASSERT_EQ(info->size(), bh->size());
+  ASSERT_EQ(info, static_cast<CodeInfoTable *>(bh)->blackholeInfo());
+
+  Closure *thunk = mm.allocStaticClosure(2);
+  thunk->setInfo(info);
+  ASSERT_TRUE(thunk->tryClaim(info, bh));
+  ASSERT_EQ(bh, thunk->info());
+  ASSERT_FALSE(thunk->tryClaim(info, bh));
+}
+
+// The number of guards in the recorded IR that check the result of
+// a call to claimThunkFromTrace.
+static int countClaimGuards(IRBuffer *buf) {
+  int guards = 0;
+  for (SnapNo i = 0; i < buf->numSnapshots(); ++i) {
+    IR *guard = buf->ir(buf->snap(i).ref());
+    if (guard->opcode() != IR::kNE || irref_islit(guard->op1()))
+      continue;
+    IR *call = buf->ir(guard->op1());
+    if (call->opcode() == IR::kCALLN &&
+        call->op2() == IRCALL_claimThunkFromTrace)
+      ++guards;
+  }
+  return guards;
+}
+
+// A trace only claims the thunks it evaluates once a second
+// capability shares the heap, like the interpreter.
+TEST(SparkTest, RecordClaimThunk) {
+  MemoryManager mm;
+  Loader l(&mm, NULL);
+  Capability cap(&mm);
+  Closure *thunk = mm.allocStaticClosure(2);
+  thunk->setInfo(MiscClosures::getApInfo(1, 0));
+  thunk->setPayload(0, 0);
+  thunk->setPayload(1, 0);
+
+  BcIns code[3];
+  code[0] = BcIns::ad(BcIns::kEVAL, 0, 0);
+  code[1] = BcIns::bitmapOffset(0);
+  code[2] = BcIns::ad(BcIns::kSTOP, 0, 0);
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  T->top_ = T->base() + 1;
+  T->setPC(&code[2]);
+  ASSERT_TRUE(cap.run(T));  // Makes T the current thread.
+  T->setSlot(0, (Word)thunk);
+
+  Capability *other = NULL;
+  for (int blackholing = 0; blackholing < 2; ++blackholing) {
+    if (blackholing)
+      other = new Capability(&mm);
+    ASSERT_EQ((bool)blackholing, cap.isBlackholing());
+    Jit jit;
+    jit.beginRecording(&cap, &code[0], T->base(), false);
+    ASSERT_FALSE(jit.recordIns(&code[0], T->base(), NULL));
+    EXPECT_EQ(blackholing, countClaimGuards(jit.buffer()));
+    // Only the compiled trace claims the thunk, not the recorder.
+    EXPECT_EQ(MiscClosures::getApInfo(1, 0), thunk->info());
+    jit.requestAbort();
+    ASSERT_TRUE(jit.recordIns(&code[0], T->base(), NULL));
+  }
+  delete other;
+  delete T;
+}
+
+// Sparks whose thunk has been evaluated are dropped by the GC.
+TEST(SparkTest, GCPrunesFizzled) {
+  MemoryManager mm;
+  mm.setNurserySize(2 * Block::kBlockSize);
+  Loader l(&mm, NULL);
+  Capability cap(&mm);
+  Closure *thunks[2];
+  for (int i = 0; i < 2; ++i) {
+    thunks[i] = mm.allocStaticClosure(2);
+    thunks[i]->setInfo(MiscClosures::getApInfo(1, 0));
+  }
+
+  BcIns code[19];
+  code[0] = BcIns::ad(BcIns::kSPARK, 1, 0);
+  code[1] = BcIns::ad(BcIns::kSPARK, 2, 0);
+  code[2] = BcIns::ad(BcIns::kSTOP, 0, 0);
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  T->top_ = T->base() + 7;
+  T->setPC(&code[0]);
+  T->setSlot(1, (Word)thunks[0]);
+  T->setSlot(2, (Word)thunks[1]);
+  ASSERT_TRUE(cap.run(T));
+  ASSERT_EQ(2, cap.sparkPoolSize());
+
+  // Update the second thunk, then allocate until the GC runs.
+  thunks[1]->setInfo(MiscClosures::stg_IND_info);
+  thunks[1]->payload_[0] = (Word)MiscClosures::stg_NO_VALUE_closure_addr;
+  initChainCode(code);
+  T->setPC(&code[0]);
+  T->setSlot(1, 0);
+  T->setSlot(2, kSMPChainLength);
+  T->setSlot(3, 1);
+  T->setSlot(4, 0);
+  T->setSlot(6, (Word)MiscClosures::stg_NO_VALUE_closure_addr);
+  ASSERT_TRUE(cap.run(T));
+  ASSERT_LT((uint32_t)0, mm.numGCs());
+
+  ASSERT_EQ(1, cap.sparkPoolSize());
+  ASSERT_EQ((uint64_t)1, cap.sparkStats().fizzled);
+  Closure *spark = NULL;
+  ASSERT_TRUE(cap.popSpark(&spark));
+  ASSERT_EQ(thunks[0], spark);
+  delete T;
+}
+
+// Minor GCs only scan the dirty cards of an array.  Fill an array with
+// freshly allocated MVars while the GC runs.  All of them must
+// survive and a clean card never points into the young generation.
+TEST(MMTest, ArrayCards) {
+  MemoryManager mm;
+  mm.setNurserySize(2 * Block::kBlockSize);
+  Loader l(&mm, NULL);
+  Capability cap(&mm);
+  const Word kLength = 20000;
+  Closure *empty = MiscClosures::stg_NO_VALUE_closure_addr;
+
+  BcIns code[10];
+  u2 *bitmaps = (u2 *)&code[8];  // bitmaps follow the code
+  bitmaps[0] = 1 | 64; bitmaps[1] = 1 | 2 | 4 | 8 | 64;  // r0, r6
+  code[0] = BcIns::abc(BcIns::kNEWARR, 0, 2, 6);
+  code[1] = BcIns::ad(BcIns::kNEWMVAR, 5, 0);
+  code[2] = BcIns::bitmapOffset(byteOffset32(&code[2], &bitmaps[0]));
+  code[3] = BcIns::abc(BcIns::kWRITEARR, 5, 0, 1);
+  code[4] = BcIns::abc(BcIns::kADDRR, 1, 1, 3);
+  code[5] = BcIns::ad(BcIns::kISLT, 1, 2);
+  code[6] = BcIns::aj(BcIns::kJMP, 0, -6);
+  code[7] = BcIns::ad(BcIns::kSTOP, 0, 0);
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  T->top_ = T->base() + 7;
+  T->setPC(&code[0]);
+  T->setSlot(1, 0);
+  T->setSlot(2, kLength);
+  T->setSlot(3, 1);
+  T->setSlot(6, (Word)empty);
+  ASSERT_TRUE(cap.run(T));
+  ASSERT_LT((uint32_t)0, mm.numMinorGCs());
+
+  ArrayClosure *arr = (ArrayClosure *)T->slot(0);
+  ASSERT_EQ(kLength, arr->ptrs_);
+  std::vector<Closure *> elems(arr->payload_, arr->payload_ + kLength);
+  for (Word i = 0; i < kLength; ++i) {
+    MVarClosure *mvar = (MVarClosure *)elems[i];
+    ASSERT_EQ(MiscClosures::stg_MVAR_info, mvar->info()) << i;
+    ASSERT_EQ(empty, mvar->value_) << i;
+    if (!arr->cards()[i >> kArrayCardBits]) {
+      ASSERT_FALSE(mm.isYoungGeneration(mvar)) << i;
+    }
+  }
+  std::sort(elems.begin(), elems.end());
+  ASSERT_TRUE(std::unique(elems.begin(), elems.end()) == elems.end());
+  delete T;
+}
+
+// A mapped file is unmapped once a major GC finds it unreachable.
+TEST(MMTest, MapFileGC) {
+  MemoryManager mm;
+  mm.setNurserySize(2 * Block::kBlockSize);
+  Loader l(&mm, NULL);
+  Capability cap(&mm);
+  char path[32];
+  ioTestFile(path);
+  writeFile(path, string(3 * Region::kRegionSize, 'x'));
+  ASSERT_TRUE(mm.mapFile(path) != NULL);
+  unlink(path);
+  EXPECT_EQ((uint64_t)3 * Region::kRegionSize, mm.mapped());
+
+  BcIns code[19];
+  initChainCode(code);
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  T->top_ = T->base() + 7;
+  T->setPC(&code[0]);
+  T->setSlot(1, 0);
+  T->setSlot(2, kSMPChainLength);
+  T->setSlot(3, 1);
+  T->setSlot(4, 0);
+  T->setSlot(6, (Word)MiscClosures::stg_NO_VALUE_closure_addr);
+  ASSERT_TRUE(cap.run(T));
+  ASSERT_LT((uint32_t)0, mm.numMajorGCs());
+  EXPECT_EQ((uint64_t)0, mm.mapped());
+  delete T;
+}
+
+// A module `Img' with a constructor `pair', a function `f' that
+// refers to it, a string and a C function, and a CAF `c' that
+// evaluates to `pair'.  See Loader::loadModuleHeader.
+static string imageTestModule() {
+  static const char *strings[] = {
+    "Img", "Pair`con_info", "Pair", "pair`closure", "f`info", "f",
+    "f`closure", "hello", "lcvm_imageTest", "c`info", "c", "c`closure"
+  };
+  string s("KHCB");
+  putU2(s, 0);
+  putU2(s, 1);
+  putU4(s, 0);  // flags
+  putU4(s, countof(strings));
+  putU4(s, 3);  // info tables
+  putU4(s, 3);  // closures
+  putU4(s, 0);  // imports
+  s += "BCST";
+  for (size_t i = 0; i < countof(strings); ++i) {
+    putVarUInt(s, strlen(strings[i]));
+    s += strings[i];
+  }
+  s += (char)1;  // module name
+  s += (char)0;
+  s += "BCCL";
+
+  s += "ITBL";
+  putId(s, 1);
+  putVarUInt(s, CONSTR);
+  putVarUInt(s, 1);  // tag
+  putVarUInt(s, 2);  // size
+  putU4(s, 1);  // bitmap: pointer, non-pointer
+  putId(s, 2);
+
+  s += "ITBL";
+  putId(s, 4);
+  putVarUInt(s, FUN);
+  putVarUInt(s, 0);
+  putId(s, 5);
+  putVarUInt(s, 1);  // framesize
+  putVarUInt(s, 1);  // arity
+  putVarUInt(s, 3);  // literals
+  putU2(s, 2);  // instructions
+  putU2(s, 0);  // bitmaps
+  s += (char)LIT_CLOSURE;
+  putId(s, 3);
+  s += (char)LIT_STRING;
+  putVarUInt(s, 7);
+  s += (char)LIT_CFUNC;
+  putVarUInt(s, 8);
+  BcIns fcode[] = {
+    BcIns::ad(BcIns::kFUNC, 1, 0), BcIns::ad(BcIns::kRET1, 0, 0)
+  };
+  putCode(s, fcode, countof(fcode));
+
+  s += "ITBL";
+  putId(s, 9);
+  putVarUInt(s, CAF);
+  putVarUInt(s, 0);
+  putId(s, 10);
+  putVarUInt(s, 1);
+  putVarUInt(s, 0);
+  putVarUInt(s, 1);
+  putU2(s, 3);
+  putU2(s, 0);
+  s += (char)LIT_CLOSURE;
+  putId(s, 3);
+  BcIns ccode[] = {
+    BcIns::ad(BcIns::kIFUNC, 1, 0), BcIns::ad(BcIns::kLOADK, 0, 0),
+    BcIns::ad(BcIns::kRET1, 0, 0)
+  };
+  putCode(s, ccode, countof(ccode));
+
+  s += "CLOS";
+  putId(s, 3);
+  putVarUInt(s, 2);
+  putId(s, 1);
+  s += (char)LIT_CLOSURE;
+  putId(s, 6);
+  s += (char)LIT_INT;
+  putVarUInt(s, 84);  // 42, zig-zag encoded
+
+  s += "CLOS";
+  putId(s, 6);
+  putVarUInt(s, 0);
+  putId(s, 4);
+
+  s += "CLOS";
+  putId(s, 11);
+  putVarUInt(s, 2);
+  putId(s, 9);
+  s += (char)LIT_INT;
+  putVarUInt(s, 0);
+  s += (char)LIT_INT;
+  putVarUInt(s, 0);
+  return s;
+}
+
+static Word imageTestFunction(Word x) {
+  return x + 1;
+}
+
+TEST(ImageTest, SaveLoad) {
+  char dir[] = "/tmp/lcvm_imageXXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  string module = string(dir) + "/Img.lcbc";
+  string image = string(dir) + "/Img.img";
+  writeFile(module.c_str(), imageTestModule());
+  registerForeignFunction("lcvm_imageTest", (const void *)&imageTestFunction);
+
+  MemoryManager mm1;
+  Loader l1(&mm1, dir);
+  ASSERT_TRUE(l1.loadModule("Img"));
+  ASSERT_TRUE(Image::save(image.c_str(), &mm1, &l1));
+  unlink(module.c_str());
+  Closure *pair1 = l1.closure("Img.pair`closure");
+  const Code *fcode1 =
+    ((CodeInfoTable *)l1.closure("Img.f`closure")->info())->code();
+
+  // The first heap is still alive, so the image gets loaded at
+  // different addresses.
+  MemoryManager mm2;
+  Loader l2(&mm2, dir);
+  ASSERT_TRUE(Image::load(image.c_str(), &mm2, &l2));
+  unlink(image.c_str());
+  rmdir(dir);
+  ASSERT_TRUE(l2.loadModule("Img"));  // Already loaded.
+  ASSERT_TRUE(l2.module("Img") != NULL);
+  EXPECT_STREQ("Img", l2.module("Img")->name());
+
+  Closure *pair = l2.closure("Img.pair`closure");
+  Closure *f = l2.closure("Img.f`closure");
+  ASSERT_TRUE(pair != NULL && f != NULL);
+  EXPECT_NE(pair1, pair);
+  EXPECT_TRUE(mm2.looksLikeClosure(pair));
+  EXPECT_TRUE(mm2.looksLikeInfoTable(pair->info()));
+  EXPECT_STREQ("Img.Pair", pair->info()->name());
+  EXPECT_EQ(f, untag(pair->payload(0)));
+  EXPECT_EQ(ptrTag(pair1->payload(0)), ptrTag(pair->payload(0)));
+  EXPECT_EQ((Word)42, pair->payload(1));
+
+  const Code *fcode = ((CodeInfoTable *)f->info())->code();
+  ASSERT_EQ(3, fcode->sizelits);
+  EXPECT_EQ(pair, untag(fcode->lits[0]));
+  EXPECT_EQ(ptrTag(fcode1->lits[0]), ptrTag(fcode->lits[0]));
+  EXPECT_STREQ("hello", (const char *)fcode->lits[1]);
+  EXPECT_NE(fcode1->lits[1], fcode->lits[1]);
+  EXPECT_EQ((Word)&imageTestFunction, fcode->lits[2]);
+  EXPECT_EQ(LIT_CFUNC, fcode->littypes[2]);
+  EXPECT_NE(fcode1->code, fcode->code);
+  EXPECT_EQ(0, memcmp(fcode1->code, fcode->code, 2 * sizeof(BcIns)));
+
+  EXPECT_TRUE(mm2.looksLikeClosure(MiscClosures::stg_STOP_closure_addr));
+  EXPECT_STREQ("stg_STOP", MiscClosures::stg_STOP_closure_addr->info()->name());
+  EXPECT_TRUE(mm2.looksLikeInfoTable(MiscClosures::getApInfo(2, 1)));
+  Closure *apk;
+  BcIns *apkReturn;
+  MiscClosures::getApCont(&apk, &apkReturn, 3, 5);
+  EXPECT_TRUE(mm2.looksLikeClosure(apk));
+
+  // Evaluating the CAF uses the relocated code, literals and
+  // MiscClosures.
+  Capability cap(&mm2);
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  Closure *c = l2.closure("Img.c`closure");
+  ASSERT_TRUE(cap.eval(T, c));
+  EXPECT_EQ(MiscClosures::stg_IND_info, c->info());
+  EXPECT_EQ(pair, untag((Closure *)c->payload(0)));
+  delete T;
+}
+
+TEST(LoaderTest, LazyCode) {
+  char dir[] = "/tmp/lcvm_lazyXXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  string module = string(dir) + "/Img.lcbc";
+  writeFile(module.c_str(), imageTestModule());
+  registerForeignFunction("lcvm_imageTest", (const void *)&imageTestFunction);
+
+  MemoryManager mm;
+  Loader l(&mm, dir);
+  ASSERT_TRUE(l.loadModule("Img"));
+  EXPECT_EQ((size_t)2, l.pendingCode());
+
+  // Looking up closures doesn't load any code.
+  Closure *pair = l.closure("Img.pair`closure");
+  Closure *c = l.closure("Img.c`closure");
+  ASSERT_TRUE(pair != NULL && c != NULL);
+  EXPECT_EQ((size_t)2, l.pendingCode());
+  Closure *f = untag(pair->payload(0));
+  const Code *fcode = ((CodeInfoTable *)f->info())->code();
+  EXPECT_EQ(1, fcode->arity);
+  EXPECT_EQ(1, fcode->framesize);
+  EXPECT_TRUE(fcode->code == NULL);
+  EXPECT_EQ(0, f->info()->srtBitmap());
+
+  // Evaluating the CAF loads its code, but not the code of f.
+  Capability cap(&mm);
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  ASSERT_TRUE(cap.eval(T, c));
+  EXPECT_EQ(pair, untag((Closure *)c->payload(0)));
+  EXPECT_EQ((size_t)1, l.pendingCode());
+  EXPECT_TRUE(fcode->code == NULL);
+  delete T;
+
+  // Applying f loads its code.  All code has been loaded then, so the
+  // file is no longer needed.
+  Closure *ap = mm.allocStaticClosure(2);
+  ap->setInfo(MiscClosures::getApInfo(1, 1));
+  ap->setPayload(0, (Word)f);
+  ap->setPayload(1, (Word)pair);
+  T = Thread::createThread(&cap, 1U << 10);
+  ASSERT_TRUE(cap.eval(T, ap));
+  EXPECT_EQ(pair, untag((Closure *)ap->payload(0)));
+  EXPECT_EQ((size_t)0, l.pendingCode());
+  unlink(module.c_str());
+  rmdir(dir);
+  ASSERT_EQ(3, fcode->sizelits);
+  EXPECT_EQ(pair, untag(fcode->lits[0]));
+  EXPECT_NE((Word)0, ptrTag(fcode->lits[0]));
+  EXPECT_STREQ("hello", (const char *)fcode->lits[1]);
+  EXPECT_EQ((Word)&imageTestFunction, fcode->lits[2]);
+  EXPECT_EQ(1, f->info()->srtBitmap());
+  ASSERT_EQ(2, fcode->sizecode);
+  EXPECT_EQ(BcIns::kFUNC, fcode->code[0].opcode());
+  delete T;
+}
+
+TEST(LoaderTest, LazyCodeReadOnlyInfoTables) {
+  char dir[] = "/tmp/lcvm_lazyXXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  string module = string(dir) + "/Img.lcbc";
+  writeFile(module.c_str(), imageTestModule());
+  registerForeignFunction("lcvm_imageTest", (const void *)&imageTestFunction);
+
+  MemoryManager mm;
+  Loader l(&mm, dir);
+  ASSERT_TRUE(l.loadModule("Img"));
+  unlink(module.c_str());
+  rmdir(dir);
+
+  // Fill the info table block of the module, so it becomes read-only,
+  // as happens when loading any real program.
+  {
+    AllocInfoTableHandle h(mm);
+    for (size_t i = 0; i < 2 * Block::kBlockSize / (8 * sizeof(Word)); ++i)
+      mm.allocInfoTable(h, 8);
+  }
+
+  Closure *c = l.closure("Img.c`closure");
+  ASSERT_TRUE(c != NULL);
+  InfoTable *cinfo = c->info();
+  Capability cap(&mm);
+  Thread *T = Thread::createThread(&cap, 1U << 10);
+  ASSERT_TRUE(cap.eval(T, c));
+  delete T;
+  EXPECT_EQ((size_t)1, l.pendingCode());
+  const Code *ccode = ((CodeInfoTable *)cinfo)->code();
+  ASSERT_EQ(3, ccode->sizecode);
+  EXPECT_EQ(1, cinfo->srtBitmap());
+}
+
 testing::AssertionResult
 isTrueResultOutput(string output)
 {
@@ -2191,6 +4244,424 @@ TEST_F(TestFragment, DivMod) {
   EXPECT_EQ((WordInt)-57, (WordInt)base[3]);
 }
 
+TEST_F(TestFragment, CallHelper) {
+  // Values live across the call must survive in callee-saved
+  // registers or spill slots.
+  TRef x = buf->slot(0);
+  TRef y = buf->slot(1);
+  TRef sum = buf->emit(IR::kADD, IRT_I64, buf->slot(2), buf->slot(3));
+  TRef args[2] = { x, y };
+  TRef cmp = buf->emitCall(IRCALL_integerCompare, IRT_I64, 2, args);
+  TRef low = buf->emitCall(IRCALL_integerToInt, IRT_I64, 1, args);
+  buf->setSlot(0, cmp);
+  buf->setSlot(1, low);
+  buf->setSlot(2, buf->emit(IR::kADD, IRT_I64, sum, cmp));
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Word small1[2], small2[2];
+  Closure *a = setSmallInteger((Closure *)small1, 5);
+  Closure *b = setSmallInteger((Closure *)small2, 7);
+  Closure *big = integerShl(&mm, a, 70, (Closure *)small2);
+  ASSERT_EQ(MiscClosures::stg_BIGPOS_info, big->info());
+
+  Word *base = T->base();
+  base[0] = (Word)a;
+  base[1] = (Word)b;
+  base[2] = 100;
+  base[3] = 20;
+  Run();
+  EXPECT_EQ((WordInt)-1, (WordInt)base[0]);
+  EXPECT_EQ((Word)5, base[1]);
+  EXPECT_EQ((Word)119, base[2]);
+
+  base[0] = (Word)big;
+  base[1] = (Word)a;
+  base[2] = 100;
+  base[3] = 20;
+  Run();
+  EXPECT_EQ((Word)1, base[0]);
+  EXPECT_EQ((Word)0, base[1]);  // 5 * 2^70 mod 2^64
+  EXPECT_EQ((Word)121, base[2]);
+}
+
+TEST_F(TestFragment, Arrays) {
+  TRef arr = buf->slot(0);
+  TRef idx = buf->slot(1);
+  TRef val = buf->slot(2);
+  TRef k = buf->literal(IRT_I64, 299);
+  TRef elem = buf->emit(IR::kALOAD, IRT_CLOS,
+                        buf->emit(IR::kAREF, IRT_PTR, arr, idx), 0);
+  buf->emit(IR::kASTORE, IRT_CLOS,
+            buf->emit(IR::kAREF, IRT_PTR, arr, idx), val);
+  buf->emit(IR::kASTORE, IRT_CLOS,
+            buf->emit(IR::kAREF, IRT_PTR, arr, k), elem);
+  buf->setSlot(3, elem);
+  TRef sref = buf->emit(IR::kFREF, IRT_PTR, arr, 1);
+  buf->setSlot(4, buf->emit(IR::kFLOAD, IRT_I64, sref, 0));
+
+  // Allocating calls are not CSEd.
+  TRef args[5];
+  args[0] = buf->literal(IRT_PTR, (Word)&mm);
+  args[1] = buf->literal(IRT_I64, 2);
+  args[2] = val;
+  TRef arr2 = buf->emitCall(IRCALL_newArray, IRT_CLOS, 3, args);
+  TRef arr3 = buf->emitCall(IRCALL_newArray, IRT_CLOS, 3, args);
+  ASSERT_NE(arr2.ref(), arr3.ref());
+  buf->setSlot(5, arr2);
+  buf->setSlot(6, arr3);
+  args[0] = arr;
+  args[1] = k;
+  args[2] = arr2;
+  args[3] = buf->literal(IRT_I64, 1);
+  args[4] = buf->literal(IRT_I64, 1);
+  buf->emitCall(IRCALL_copyArray, IRT_VOID, 5, args);
+
+  TRef iref = buf->emit(IR::kFREF, IRT_PTR, arr, 0);
+  buf->emit(IR::kFSTORE, IRT_VOID, iref,
+            buf->literal(IRT_INFO, (Word)MiscClosures::stg_ARR_info));
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Closure *x = MiscClosures::stg_NO_VALUE_closure_addr;
+  Closure *y = MiscClosures::stg_STOP_closure_addr;
+  Closure *z = MiscClosures::stg_BLACKHOLE_closure_addr;
+  ArrayClosure *a = mm.allocArray(300, x);
+  a->payload_[5] = z;
+  Word *base = T->base();
+  base[0] = (Word)a;
+  base[1] = 5;
+  base[2] = (Word)y;
+  Run();
+  EXPECT_EQ((Word)z, base[3]);
+  EXPECT_EQ((Word)300, base[4]);
+  EXPECT_EQ(y, a->payload_[5]);
+  EXPECT_EQ(z, a->payload_[299]);
+  EXPECT_EQ(x, a->payload_[298]);
+  EXPECT_EQ(1, a->cards()[0]);
+  EXPECT_EQ(0, a->cards()[1]);
+  EXPECT_EQ(1, a->cards()[2]);
+  EXPECT_EQ(MiscClosures::stg_ARR_info, a->info());
+
+  ArrayClosure *a2 = (ArrayClosure *)base[5];
+  ArrayClosure *a3 = (ArrayClosure *)base[6];
+  ASSERT_NE(a2, a3);
+  ASSERT_EQ((Word)2, a2->ptrs_);
+  EXPECT_EQ(y, a2->payload_[0]);
+  EXPECT_EQ(z, a2->payload_[1]);
+  EXPECT_EQ(1, a2->cards()[0]);
+  EXPECT_EQ(y, a3->payload_[1]);
+  EXPECT_EQ(0, a3->cards()[0]);
+}
+
+TEST_F(TestFragment, ByteArrays) {
+  TRef arr = buf->slot(0);
+  TRef idx = buf->slot(1);
+  TRef val = buf->slot(2);
+  TRef one = buf->literal(IRT_I64, 1);
+  TRef two = buf->literal(IRT_I64, 2);
+  TRef aref = buf->emit(IR::kAREF, IRT_PTR, arr, idx);
+  TRef b = buf->emit(IR::kALOAD, IRT_U8, aref, 0);
+  EXPECT_EQ(b.ref(), buf->emit(IR::kALOAD, IRT_U8, aref, 0).ref());
+  buf->setSlot(3, b);
+  buf->setSlot(4, buf->emit(IR::kALOAD, IRT_U16, aref, 0));
+  TRef idx1 = buf->emit(IR::kADD, IRT_I64, idx, one);
+  buf->setSlot(5, buf->emit(IR::kALOAD, IRT_U32,
+                            buf->emit(IR::kAREF, IRT_PTR, arr, idx1), 0));
+
+  // Stores to other elements do not kill the first load.
+  TRef idx2 = buf->emit(IR::kADD, IRT_I64, idx, two);
+  buf->emit(IR::kASTORE, IRT_U8,
+            buf->emit(IR::kAREF, IRT_PTR, arr, idx2), val);
+  EXPECT_EQ(b.ref(), buf->emit(IR::kALOAD, IRT_U8, aref, 0).ref());
+  buf->emit(IR::kASTORE, IRT_U16,
+            buf->emit(IR::kAREF, IRT_PTR, arr, buf->literal(IRT_I64, 0)),
+            val);
+  TRef b2 = buf->emit(IR::kALOAD, IRT_U8, aref, 0);
+  EXPECT_NE(b.ref(), b2.ref());
+  buf->setSlot(6, b2);
+
+  // Full-word stores are forwarded to loads.
+  TRef wref = buf->emit(IR::kAREF, IRT_PTR, arr, two);
+  buf->emit(IR::kASTORE, IRT_U64, wref, val);
+  EXPECT_EQ(val.ref(), buf->emit(IR::kALOAD, IRT_U64, wref, 0).ref());
+
+  // Implied guards are dropped.
+  buf->emit(IR::kLT, IRT_VOID|IRT_GUARD, idx, buf->literal(IRT_I64, 10));
+  EXPECT_TRUE(buf->emit(IR::kLT, IRT_VOID|IRT_GUARD, idx,
+                        buf->literal(IRT_I64, 20)).isNone());
+  EXPECT_TRUE(buf->emit(IR::kLE, IRT_VOID|IRT_GUARD, idx,
+                        buf->literal(IRT_I64, 9)).isNone());
+  EXPECT_FALSE(buf->emit(IR::kLT, IRT_VOID|IRT_GUARD, idx,
+                         buf->literal(IRT_I64, 9)).isNone());
+  buf->emit(IR::kGE, IRT_VOID|IRT_GUARD, idx, buf->literal(IRT_I64, 0));
+  EXPECT_TRUE(buf->emit(IR::kGT, IRT_VOID|IRT_GUARD, idx,
+                        buf->literal(IRT_I64, -1)).isNone());
+
+  // The size of an array is only loaded once.
+  TRef sref = buf->emit(IR::kFREF, IRT_PTR, arr, 1);
+  TRef size = buf->emit(IR::kFLOAD, IRT_I64, sref, 0);
+  EXPECT_EQ(size.ref(), buf->emit(IR::kFLOAD, IRT_I64, sref, 0).ref());
+  buf->emit(IR::kLTU, IRT_VOID|IRT_GUARD, idx, size);
+
+  TRef args[2];
+  args[0] = buf->literal(IRT_PTR, (Word)&mm);
+  args[1] = buf->literal(IRT_I64, 16);
+  TRef arr2 = buf->emitCall(IRCALL_newByteArray, IRT_CLOS, 2, args);
+  buf->emit(IR::kASTORE, IRT_U8,
+            buf->emit(IR::kAREF, IRT_PTR, arr2, one), val);
+  buf->setSlot(7, arr2);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  ByteArrayClosure *a = mm.allocByteArray(32);
+  u1 *bytes = (u1 *)a->payload_;
+  for (int i = 0; i < 32; ++i)
+    bytes[i] = i + 1;
+  Word *base = T->base();
+  base[0] = (Word)a;
+  base[1] = 5;
+  base[2] = 0x1122334455667788ULL;
+  Run();
+  EXPECT_EQ((Word)6, base[3]);
+  EXPECT_EQ((Word)0x0c0b, base[4]);
+  EXPECT_EQ((Word)0x1c1b1a19, base[5]);
+  EXPECT_EQ((Word)6, base[6]);
+  EXPECT_EQ(0x88, bytes[7]);
+  EXPECT_EQ(0x88, bytes[0]);
+  EXPECT_EQ(0x77, bytes[1]);
+  EXPECT_EQ((Word)0x1122334455667788ULL, a->payload_[2]);
+  ByteArrayClosure *a2 = (ByteArrayClosure *)base[7];
+  EXPECT_EQ(MiscClosures::stg_BYTEARR_info, a2->header_.info());
+  EXPECT_EQ((Word)16, a2->bytes_);
+  EXPECT_EQ(0x88, ((u1 *)a2->payload_)[1]);
+}
+
+TEST_F(TestFragment, BulkByteArrays) {
+  TRef arr = buf->slot(0);
+  TRef ofs = buf->slot(1);
+  TRef n = buf->slot(2);
+  TRef val = buf->slot(3);
+  TRef aref = buf->emit(IR::kAREF, IRT_PTR, arr, ofs);
+  TRef b = buf->emit(IR::kALOAD, IRT_U8, aref, 0);
+  TRef args[5];
+  args[0] = arr;
+  args[1] = ofs;
+  args[2] = n;
+  args[3] = val;
+  buf->setSlot(4, buf->emitCall(IRCALL_findByteArray, IRT_I64, 4, args));
+  // Calls that only read do not invalidate loads.
+  EXPECT_EQ(b.ref(), buf->emit(IR::kALOAD, IRT_U8, aref, 0).ref());
+  buf->emitCall(IRCALL_setByteArray, IRT_VOID, 4, args);
+  TRef b2 = buf->emit(IR::kALOAD, IRT_U8, aref, 0);
+  EXPECT_NE(b.ref(), b2.ref());
+  buf->setSlot(5, b2);
+  args[0] = arr;
+  args[1] = ofs;
+  args[2] = arr;
+  args[3] = buf->literal(IRT_I64, 0);
+  args[4] = n;
+  buf->emitCall(IRCALL_copyByteArray, IRT_VOID, 5, args);
+  buf->setSlot(6, buf->emitCall(IRCALL_compareByteArrays, IRT_I64, 5,
+                                args));
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  ByteArrayClosure *a = mm.allocByteArray(64);
+  u1 *bytes = (u1 *)a->payload_;
+  for (int i = 0; i < 64; ++i)
+    bytes[i] = i;
+  Word *base = T->base();
+  base[0] = (Word)a;
+  base[1] = 40;
+  base[2] = 20;
+  base[3] = 50;
+  Run();
+  EXPECT_EQ((Word)50, base[4]);
+  EXPECT_EQ((Word)50, base[5]);
+  EXPECT_EQ(50, bytes[59]);
+  EXPECT_EQ(60, bytes[60]);
+  EXPECT_EQ(50, bytes[0]);
+  EXPECT_EQ(50, bytes[19]);
+  EXPECT_EQ(20, bytes[20]);
+  EXPECT_EQ((Word)0, base[6]);
+}
+
+TEST_F(TestFragment, ForeignCall) {
+  FfiType mixed[] = { FFI_WORD, FFI_DOUBLE, FFI_WORD, FFI_FLOAT };
+  FfiType dbl[] = { FFI_DOUBLE };
+  FfiType words[] = { FFI_WORD, FFI_WORD, FFI_WORD, FFI_WORD, FFI_WORD,
+                      FFI_WORD };
+  TRef x = buf->floatOperand(buf->slot(0), IRT_F64);
+  TRef n = buf->slot(1);
+  TRef f = buf->floatOperand(buf->slot(2), IRT_F32);
+  // Live across the calls.
+  TRef n2 = buf->emit(IR::kADD, IRT_I64, n, n);
+  TRef args[7];
+  args[0] = buf->literal(IRT_PTR, (Word)&ffiTestMix);
+  args[1] = n;
+  args[2] = x;
+  args[3] = n;
+  args[4] = f;
+  TRef r = buf->emitCCall(ffiSignature(FFI_DOUBLE, 4, mixed), 4, args);
+  buf->setSlot(3, r);
+  args[0] = buf->literal(IRT_PTR, (Word)&ffiTestSetSeen);
+  args[1] = r;
+  buf->emitCCall(ffiSignature(FFI_VOID, 1, dbl), 1, args);
+  args[0] = buf->literal(IRT_PTR, (Word)&ffiTestSum6);
+  for (int i = 1; i <= 6; ++i)
+    args[i] = i == 4 ? n2 : buf->literal(IRT_I64, i);
+  TRef sum = buf->emitCCall(ffiSignature(FFI_WORD, 6, words), 6, args);
+  buf->setSlot(4, buf->emit(IR::kADD, IRT_I64, sum, n2));
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  ffiTestSeen = 0;
+  Word *base = T->base();
+  base[0] = lc_d2w(1.5);
+  base[1] = 7;
+  base[2] = lc_f2w(0.25f);
+  Run();
+  EXPECT_EQ(7 * 1.5 + 7 + 0.25, lc_w2d(base[3]));
+  EXPECT_EQ(7 * 1.5 + 7 + 0.25, ffiTestSeen);
+  EXPECT_EQ((Word)(1 + 4 + 9 + 4 * 14 + 25 + 36 + 14), base[4]);
+}
+
+TEST_F(TestFragment, Output) {
+  char path[32];
+  ioTestFile(path);
+  cap.attach();
+  WordInt h = HandleTable::open(path, HANDLE_WRITE);
+  ASSERT_NE(-1, h);
+  TRef args[2];
+  args[0] = buf->slot(0);
+  args[1] = buf->slot(1);
+  TRef r1 = buf->emitCall(IRCALL_handlePutChar, IRT_I64, 2, args);
+  args[1] = buf->slot(2);
+  TRef r2 = buf->emitCall(IRCALL_handlePutStr, IRT_I64, 2, args);
+  TRef r3 = buf->emitCall(IRCALL_handleFlush, IRT_I64, 1, args);
+  buf->setSlot(3, buf->emit(IR::kADD, IRT_I64,
+                            buf->emit(IR::kADD, IRT_I64, r1, r2), r3));
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Word *base = T->base();
+  base[0] = h;
+  base[1] = 0x3bb;  // lambda
+  base[2] = (Word)"chine";
+  Run();
+  EXPECT_EQ((Word)0, base[3]);
+  EXPECT_EQ("\xce\xbb" "chine", readFile(path));
+  EXPECT_TRUE(HandleTable::close(h));
+  cap.detach();
+  unlink(path);
+}
+
+TEST_F(TestFragment, CheckedArith) {
+  TRef x = buf->slot(0);
+  TRef y = buf->slot(1);
+  TRef z = buf->slot(2);
+  TRef sum = buf->emit(IR::kADDOV, IRT_I64|IRT_GUARD, x, y);
+  buf->setSlot(3, sum);
+  buf->setSlot(4, buf->emit(IR::kADDCU, IRT_I64, x, y));
+  buf->setSlot(5, buf->emit(IR::kMULHU, IRT_I64, x, z));
+  TRef prod = buf->emit(IR::kMULOV, IRT_I64|IRT_GUARD, y, z);
+  buf->setSlot(6, prod);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  const Word kMax = ~(Word)0 >> 1;
+  Word *base = T->base();
+  base[0] = 5;
+  base[1] = -3;
+  base[2] = 7;
+  base[3] = base[4] = base[5] = base[6] = 0;
+  Run();
+  EXPECT_EQ((Word)2, base[3]);
+  EXPECT_EQ((Word)1, base[4]);
+  EXPECT_EQ((Word)0, base[5]);
+  EXPECT_EQ((Word)-21, base[6]);
+
+  // Exits at the first guard.
+  base[0] = kMax;
+  base[1] = 1;
+  base[3] = base[4] = base[5] = base[6] = 0;
+  Run();
+  EXPECT_EQ((Word)0, base[3]);
+  EXPECT_EQ((Word)0, base[6]);
+
+  // Exits at the second guard.
+  base[0] = -1;
+  base[1] = kMax;
+  base[2] = 2;
+  base[3] = base[4] = base[5] = base[6] = 0;
+  Run();
+  EXPECT_EQ(kMax - 1, base[3]);
+  EXPECT_EQ((Word)1, base[4]);
+  EXPECT_EQ((Word)1, base[5]);
+  EXPECT_EQ((Word)0, base[6]);
+}
+
+class BitOpsFragment : public TestFragment {
+protected:
+  void AssembleBitOps() {
+    TRef x = buf->slot(0);
+    TRef mask = buf->slot(1);
+    buf->setSlot(2, buf->emit(IR::kPOPCNT, IRT_I64, x, TRef()));
+    buf->setSlot(3, buf->emit(IR::kCLZ, IRT_I64, x, TRef()));
+    buf->setSlot(4, buf->emit(IR::kCTZ, IRT_I64, x, TRef()));
+    buf->setSlot(5, buf->emit(IR::kBSWAP, IRT_I64, x, TRef()));
+    buf->setSlot(6, buf->emit(IR::kPDEP, IRT_I64, x, mask));
+    buf->setSlot(7, buf->emit(IR::kPEXT, IRT_I64, x, mask));
+    buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+    Assemble();
+  }
+
+  void RunBitOps(Word x, Word mask) {
+    Word *base = T->base();
+    base[0] = x;
+    base[1] = mask;
+    Run();
+    EXPECT_EQ(wordPopCount(x), base[2]);
+    EXPECT_EQ(wordClz(x), base[3]);
+    EXPECT_EQ(wordCtz(x), base[4]);
+    EXPECT_EQ(wordByteSwap(x), base[5]);
+    EXPECT_EQ(wordPdep(x, mask), base[6]);
+    EXPECT_EQ(wordPext(x, mask), base[7]);
+    EXPECT_EQ(x, base[0]);
+    EXPECT_EQ(mask, base[1]);
+  }
+};
+
+TEST_F(BitOpsFragment, Native) {
+  uint32_t features = Assembler::detectCpuFeatures();
+  jit.assembler()->setCpuFeatures(features);
+  AssembleBitOps();
+  if (features != (CPU_POPCNT | CPU_LZCNT | CPU_BMI1 | CPU_BMI2))
+    cerr << "NOTE: Some bit instructions not supported by this CPU.\n";
+  RunBitOps(0x0102030405060708ULL, 0xff00ff00ff00ff00ULL);
+  RunBitOps(0, ~(Word)0);
+  RunBitOps(~(Word)0, 0x8000000000000001ULL);
+  RunBitOps(1, 0);
+}
+
+TEST_F(BitOpsFragment, Fallback) {
+  jit.assembler()->setCpuFeatures(0);
+  AssembleBitOps();
+  RunBitOps(0x0102030405060708ULL, 0xff00ff00ff00ff00ULL);
+  RunBitOps(0, ~(Word)0);
+  RunBitOps(~(Word)0, 0x8000000000000001ULL);
+  RunBitOps(1, 0);
+  jit.assembler()->setCpuFeatures(Assembler::detectCpuFeatures());
+}
+
 TEST_F(TestFragment, Mul) {
   TRef inp1 = buf->slot(0);
   TRef inp2 = buf->slot(1);
@@ -2239,6 +4710,94 @@ TEST_F(TestFragment, Mul) {
   EXPECT_EQ(0, base[5]);
 }
 
+TEST_F(TestFragment, FloatArith) {
+  TRef x = buf->floatOperand(buf->slot(0), IRT_F64);
+  TRef y = buf->floatOperand(buf->slot(1), IRT_F64);
+  TRef n = buf->slot(2);
+  TRef f1 = buf->floatOperand(buf->slot(3), IRT_F32);
+  TRef f2 = buf->floatOperand(buf->slot(4), IRT_F32);
+  TRef k = buf->literal(IRT_F64, lc_d2w(1.5));
+  TRef sum = buf->emit(IR::kADD, IRT_F64, x, y);
+  TRef prod = buf->emit(IR::kMUL, IRT_F64, sum, k);
+  TRef quot = buf->emit(IR::kDIV, IRT_F64, x, y);
+  TRef neg = buf->emit(IR::kNEG, IRT_F64, prod, TRef());
+  TRef nd = buf->emit(IR::kCONV, IRT_F64, n, IRT_I64);
+  TRef diff = buf->emit(IR::kSUB, IRT_F64, nd, x);
+  TRef trunc = buf->emit(IR::kCONV, IRT_I64, quot, IRT_F64);
+  TRef fsum = buf->emit(IR::kADD, IRT_F32, f1, f2);
+  TRef fneg = buf->emit(IR::kNEG, IRT_F32, fsum, TRef());
+  TRef fd = buf->emit(IR::kCONV, IRT_F64, fsum, IRT_F32);
+  buf->setSlot(0, neg);
+  buf->setSlot(1, quot);
+  buf->setSlot(2, diff);
+  buf->setSlot(3, trunc);
+  buf->setSlot(4, fneg);
+  buf->setSlot(5, fd);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Word *base = T->base();
+  base[0] = lc_d2w(2.0);
+  base[1] = lc_d2w(0.5);
+  base[2] = 7;
+  base[3] = lc_f2w(1.25f);
+  base[4] = lc_f2w(2.0f);
+  Run();
+  EXPECT_EQ(-3.75, lc_w2d(base[0]));
+  EXPECT_EQ(4.0, lc_w2d(base[1]));
+  EXPECT_EQ(5.0, lc_w2d(base[2]));
+  EXPECT_EQ(4, base[3]);
+  EXPECT_EQ(lc_f2w(-3.25f), base[4]);
+  EXPECT_EQ(3.25, lc_w2d(base[5]));
+}
+
+TEST_F(TestFragment, FloatGuard) {
+  TRef x = buf->floatOperand(buf->slot(0), IRT_F64);
+  TRef y = buf->floatOperand(buf->slot(1), IRT_F64);
+  TRef sum = buf->emit(IR::kADD, IRT_F64, x, y);
+  buf->setSlot(2, sum);
+  buf->emit(IR::kLT, IRT_F64|IRT_GUARD, x, y);
+  buf->emit(IR::kNE, IRT_F64|IRT_GUARD, x, sum);
+  TRef sq = buf->emit(IR::kMUL, IRT_F64, sum, sum);
+  buf->setSlot(3, sq);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Word *base = T->base();
+  base[0] = lc_d2w(1.0);
+  base[1] = lc_d2w(2.0);
+  base[3] = 0;
+  Run();
+  EXPECT_EQ(3.0, lc_w2d(base[2]));
+  EXPECT_EQ(9.0, lc_w2d(base[3]));
+
+  // Exits at the first guard.  The sum is restored from an XMM
+  // register.
+  base[0] = lc_d2w(3.0);
+  base[1] = lc_d2w(2.0);
+  base[3] = 0;
+  Run();
+  EXPECT_EQ(5.0, lc_w2d(base[2]));
+  EXPECT_EQ(0, base[3]);
+
+  // Comparisons with NaN are false.
+  base[0] = lc_d2w(0.0 / 0.0);
+  base[1] = lc_d2w(2.0);
+  base[3] = 0;
+  Run();
+  EXPECT_EQ(0, base[3]);
+
+  // Exits at the second guard.
+  base[0] = lc_d2w(-1.0);
+  base[1] = lc_d2w(0.0);
+  base[3] = 0;
+  Run();
+  EXPECT_EQ(-1.0, lc_w2d(base[2]));
+  EXPECT_EQ(0, base[3]);
+}
+
 TEST_F(TestFragment, Alloc1) {
   TRef itbl = buf->literal(IRT_INFO, 0x123456783);
   TRef lit1 = buf->literal(IRT_I64, 5);
@@ -2292,6 +4851,34 @@ TEST_F(TestFragment, Alloc1) {
   EXPECT_EQ(&heap[3], cap.traceExitHpLim());
 }
 
+TEST_F(TestFragment, AllocProfile) {
+  jit.setOption(Jit::kOptAllocProfile, true);
+  TRef itbl = buf->literal(IRT_INFO, 0x123456783);
+  TRef lit1 = buf->literal(IRT_I64, 5);
+  buf->emitHeapCheck(2);
+  IRBuffer::HeapEntry he = 0;
+  TRef alloc = buf->emitNEW(itbl, 1, &he);
+  buf->setField(he, 0, lit1);
+  buf->setSlot(0, alloc);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+  ASSERT_EQ((uint32_t)1, F->numAllocSites());
+  EXPECT_EQ((uint32_t)2, F->allocSiteWords(0));
+
+  Word heap[10];
+  for (int i = 0; i < 3; ++i) {
+    T->base()[0] = 0;
+    RunWithHeap(&heap[0], &heap[10]);
+  }
+  EXPECT_EQ((uint64_t)3, F->allocSite(0).allocs);
+
+  // Heap check fails, no allocation.
+  T->base()[0] = 0;
+  RunWithHeap(&heap[0], &heap[1]);
+  EXPECT_EQ((uint64_t)3, F->allocSite(0).allocs);
+}
+
 TEST_F(TestFragment, Alloc2) {
   TRef itbl = buf->literal(IRT_INFO, 0x123456783);
   TRef lit1 = buf->literal(IRT_I64, 5);
@@ -2383,6 +4970,49 @@ TEST_F(TestFragment, Alloc3) {
   EXPECT_EQ(37 + 7, heap[5]);
 }
 
+// A thunk that only refers to static closures.
+static Closure *newApThunk(MemoryManager &mm) {
+  Closure *thunk = mm.allocClosure(MiscClosures::getApInfo(1, 0), 2);
+  thunk->setPayload(0, (Word)MiscClosures::stg_NO_VALUE_closure_addr);
+  thunk->setPayload(1, (Word)MiscClosures::stg_NO_VALUE_closure_addr);
+  return thunk;
+}
+
+// The write barrier adds old objects to the remembered set without
+// leaving the trace.  Registers that are live across it survive.
+TEST_F(TestFragment, WriteBarrier) {
+  mm.setNurserySize(2 * Block::kBlockSize);
+  Closure *old = newApThunk(mm);
+  old = runChainWithRoot(cap, old, kGCChainLength);
+  ASSERT_TRUE(mm.isOldGeneration(old));
+  size_t remembered = mm.rememberedSetSize();
+  Closure *young = newApThunk(mm);
+  ASSERT_FALSE(mm.isOldGeneration(young));
+
+  TRef obj = buf->slot(0);
+  TRef x = buf->slot(1);
+  TRef x1 = buf->emit(IR::kADD, IRT_I64, x, buf->literal(IRT_I64, 5));
+  buf->emit(IR::kWBAR, IRT_VOID, obj, buf->literal(IRT_PTR, (Word)&mm));
+  TRef x2 = buf->emit(IR::kADD, IRT_I64, x1, x);
+  buf->setSlot(1, x2);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Word *base = T->base();
+  base[0] = (Word)young;
+  base[1] = 10;
+  Run();
+  EXPECT_EQ(25, base[1]);
+  EXPECT_EQ(remembered, mm.rememberedSetSize());
+
+  base[0] = (Word)old;
+  base[1] = 10;
+  Run();
+  EXPECT_EQ(25, base[1]);
+  EXPECT_EQ(remembered + 1, mm.rememberedSetSize());
+}
+
 TEST(CallStackTest, Simple1) {
   CallStack cs;
   cs.reset();
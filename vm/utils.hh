@@ -43,6 +43,54 @@ inline bool isWordAligned(char *ptr) {
   return isAlignedAtPowerOf2(LC_ARCH_BYTES_LOG2, ptr);
 }
 
+// Bit operations on words with the semantics of the POPCNT, CLZ, etc.
+// bytecodes.  Counting the leading or trailing zeros of 0 returns the
+// number of bits in a word.
+
+inline Word wordPopCount(Word x) {
+  return __builtin_popcountl(x);
+}
+
+inline Word wordClz(Word x) {
+  return x == 0 ? LC_ARCH_BITS : __builtin_clzl(x);
+}
+
+inline Word wordCtz(Word x) {
+  return x == 0 ? LC_ARCH_BITS : __builtin_ctzl(x);
+}
+
+inline Word wordByteSwap(Word x) {
+#if LC_ARCH_BITS == 64
+  return __builtin_bswap64(x);
+#else
+  return __builtin_bswap32(x);
+#endif
+}
+
+// Scatter the low bits of `x' to the positions of the set bits of
+// `mask' (like x86's PDEP).
+inline Word wordPdep(Word x, Word mask) {
+  Word result = 0;
+  for (Word bit = 1; mask != 0; bit <<= 1) {
+    if (x & bit)
+      result |= mask & -mask;
+    mask &= mask - 1;
+  }
+  return result;
+}
+
+// Gather the bits of `x' at the positions of the set bits of `mask'
+// into the low bits of the result (like x86's PEXT).
+inline Word wordPext(Word x, Word mask) {
+  Word result = 0;
+  for (Word bit = 1; mask != 0; bit <<= 1) {
+    if (x & mask & -mask)
+      result |= bit;
+    mask &= mask - 1;
+  }
+  return result;
+}
+
 _END_LAMBDACHINE_NAMESPACE
 
 #endif /* _UTILS_H_ */
@@ -0,0 +1,120 @@
+#ifndef _WSDEQUE_H_
+#define _WSDEQUE_H_
+
+#include "common.hh"
+
+#include <stdlib.h>
+
+_START_LAMBDACHINE_NAMESPACE
+
+/**
+ * A fixed-capacity work-stealing deque.
+ *
+ * This is the algorithm from Chase and Lev, "Dynamic Circular
+ * Work-Stealing Deque" (SPAA'05), minus the resizing.  The owning
+ * thread pushes and pops at the bottom end, any other thread may
+ * steal from the top end.  Only the owner may call push() and pop().
+ *
+ * The element type must be copyable with a plain store (e.g., a
+ * pointer).
+ */
+template <typename T>
+class WSDeque {
+public:
+  explicit WSDeque(u4 capacityLog2 = 10)
+    : top_(0), bottom_(0), mask_((1L << capacityLog2) - 1) {
+    buffer_ = static_cast<T *>(malloc(sizeof(T) * (mask_ + 1)));
+  }
+  ~WSDeque() { free(buffer_); }
+
+  /// Push an element at the bottom.  Returns false if the deque is
+  /// full.  Owner only.
+  bool push(T x) {
+    long b = __atomic_load_n(&bottom_, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&top_, __ATOMIC_ACQUIRE);
+    if (b - t > mask_)
+      return false;
+    buffer_[b & mask_] = x;
+    __atomic_store_n(&bottom_, b + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  /// Take an element from the bottom.  Owner only.
+  bool pop(T *out) {
+    long b = __atomic_load_n(&bottom_, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&bottom_, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&top_, __ATOMIC_RELAXED);
+    if (t > b) {
+      // Empty.
+      __atomic_store_n(&bottom_, b + 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    *out = buffer_[b & mask_];
+    if (t == b) {
+      // Last element.  Race against thieves for it.
+      bool won = __atomic_compare_exchange_n(&top_, &t, t + 1, false,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED);
+      __atomic_store_n(&bottom_, b + 1, __ATOMIC_RELAXED);
+      return won;
+    }
+    return true;
+  }
+
+  /// Take an element from the top.  May be called by any thread.
+  /// May fail spuriously if another thread wins the race for the
+  /// same element.
+  bool steal(T *out) {
+    long t = __atomic_load_n(&top_, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&bottom_, __ATOMIC_ACQUIRE);
+    if (t >= b)
+      return false;
+    T x = buffer_[t & mask_];
+    if (!__atomic_compare_exchange_n(&top_, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return false;
+    *out = x;
+    return true;
+  }
+
+  /// Approximate test for emptiness; only exact if no other thread
+  /// is concurrently accessing the deque.
+  inline bool looksEmpty() const {
+    return __atomic_load_n(&top_, __ATOMIC_RELAXED) >=
+      __atomic_load_n(&bottom_, __ATOMIC_RELAXED);
+  }
+
+  /// Approximate number of elements; only exact if no other thread
+  /// is concurrently accessing the deque.
+  inline long size() const {
+    long n = __atomic_load_n(&bottom_, __ATOMIC_RELAXED) -
+      __atomic_load_n(&top_, __ATOMIC_RELAXED);
+    return n > 0 ? n : 0;
+  }
+
+  /// Remove all elements for which `keep' returns false.  `keep' may
+  /// modify the element.  The order of the remaining elements is
+  /// preserved.  Only safe if no other thread accesses the deque.
+  void filter(bool (*keep)(T *x, void *env), void *env) {
+    long t = top_;
+    long j = t;
+    for (long i = t; i < bottom_; ++i) {
+      T x = buffer_[i & mask_];
+      if (keep(&x, env))
+        buffer_[j++ & mask_] = x;
+    }
+    bottom_ = j;
+  }
+
+private:
+  long top_;
+  long bottom_;
+  long mask_;
+  T *buffer_;
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _WSDEQUE_H_ */